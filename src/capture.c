@@ -0,0 +1,360 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+#include <sys/resource.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+/* Local includes */
+#include "capture.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Webcam capture: webcams usually deliver 640x480 or 720p frames, as YUYV
+ * or MJPEG, and capturing with "v4l2src ! videoconvert ! videoscale" means
+ * v4l2src picks the largest mode, and we then convert and downscale each
+ * frame on the CPU. Instead, we ask the device for the modes it supports,
+ * and pick the one that needs the least work: the frame rate we want comes
+ * first (YUYV often can't do 30fps at higher resolutions, MJPEG can), then
+ * the resolution (no scaling at all, or else downscaling from the closest
+ * larger mode), and then the format (I420 needs nothing, other raw formats
+ * a conversion, MJPEG a decode). When scaling is needed, we do it before
+ * converting, so that there are fewer pixels to convert. All this means
+ * opening the device and running test pipelines, so we do it once at startup,
+ * before the WebRTC loop exists, and building pipelines later only looks the
+ * result up. If asked to, we also report what we saved, by running both the
+ * chain we picked and the old one on a few test frames of the same size and
+ * format, and comparing the CPU time they took: as that's the CPU time of the
+ * whole process, it's only meaningful before JACK and other pipelines start */
+#define JAMRTC_CAPTURE_FPS			30
+#define JAMRTC_CAPTURE_BENCH_FRAMES	30
+typedef struct jamrtc_capture_mode {
+	/* Whether this is MJPEG, and the format otherwise */
+	gboolean jpeg;
+	char format[16];
+	gint width, height, fps_n, fps_d;
+} jamrtc_capture_mode;
+
+/* How we get frames from the device */
+static const char *io_mode = "auto";
+
+/* Pipeline descriptions we came up with, indexed by device and resolution */
+static GHashTable *descriptions = NULL;
+static jamrtc_mutex capture_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+
+/* Set how v4l2src should get frames from the webcam */
+int jamrtc_capture_set_io_mode(const char *mode) {
+	if(mode == NULL)
+		mode = "auto";
+	if(strcasecmp(mode, "auto") && strcasecmp(mode, "dmabuf") &&
+			strcasecmp(mode, "mmap") && strcasecmp(mode, "rw")) {
+		JAMRTC_LOG(LOG_FATAL, "Unsupported video I/O mode '%s' (should be auto, dmabuf, mmap or rw)\n", mode);
+		return -1;
+	}
+	io_mode = mode;
+	return 0;
+}
+
+/* Helpers to compare modes */
+static guint jamrtc_capture_format_cost(const jamrtc_capture_mode *mode) {
+	if(mode->jpeg)
+		return 3;
+	if(!strcmp(mode->format, "I420"))
+		return 0;
+	if(!strcmp(mode->format, "YV12") || !strcmp(mode->format, "NV12") || !strcmp(mode->format, "NV21"))
+		return 1;
+	if(!strcmp(mode->format, "YUY2") || !strcmp(mode->format, "UYVY") || !strcmp(mode->format, "YVYU"))
+		return 2;
+	return 4;
+}
+static gint jamrtc_capture_fps(const jamrtc_capture_mode *mode) {
+	/* Anything above what we need is as good as what we need */
+	if(mode->fps_d <= 0)
+		return 0;
+	return MIN(mode->fps_n * 100 / mode->fps_d, JAMRTC_CAPTURE_FPS * 100);
+}
+static gboolean jamrtc_capture_better(const jamrtc_capture_mode *a, const jamrtc_capture_mode *b, gint width, gint height) {
+	gint fa = jamrtc_capture_fps(a), fb = jamrtc_capture_fps(b);
+	if(fa != fb)
+		return fa > fb;
+	gboolean sa = (a->width != width || a->height != height), sb = (b->width != width || b->height != height);
+	if(sa != sb)
+		return !sa;
+	if(sa) {
+		/* Both need scaling: downscaling from the closest larger mode is better */
+		gboolean la = (a->width >= width && a->height >= height), lb = (b->width >= width && b->height >= height);
+		if(la != lb)
+			return la;
+		gint64 aa = (gint64)a->width * a->height, ab = (gint64)b->width * b->height;
+		if(aa != ab)
+			return la ? (aa < ab) : (aa > ab);
+	}
+	return jamrtc_capture_format_cost(a) < jamrtc_capture_format_cost(b);
+}
+
+/* Helper to ask the device which modes it supports */
+static GList *jamrtc_capture_modes(const char *device, gint width, gint height) {
+	GstElement *src = gst_element_factory_make("v4l2src", NULL);
+	if(src == NULL)
+		return NULL;
+	g_object_set(src, "device", device, NULL);
+	GList *modes = NULL;
+	if(gst_element_set_state(src, GST_STATE_READY) != GST_STATE_CHANGE_FAILURE) {
+		/* We only take MJPEG into account if we can decode it */
+		GstElementFactory *factory = gst_element_factory_find("jpegdec");
+		gboolean can_decode = (factory != NULL);
+		if(factory != NULL)
+			gst_object_unref(factory);
+		GstPad *pad = gst_element_get_static_pad(src, "src");
+		GstCaps *caps = gst_pad_query_caps(pad, NULL);
+		guint i = 0, n = caps ? gst_caps_get_size(caps) : 0;
+		for(i=0; i<n; i++) {
+			GstStructure *s = gst_structure_copy(gst_caps_get_structure(caps, i));
+			gboolean jpeg = gst_structure_has_name(s, "image/jpeg");
+			if((!jpeg && !gst_structure_has_name(s, "video/x-raw")) || (jpeg && !can_decode)) {
+				gst_structure_free(s);
+				continue;
+			}
+			/* Devices may advertise ranges and lists: get as close as we can to what we need */
+			gst_structure_fixate_field_nearest_int(s, "width", width);
+			gst_structure_fixate_field_nearest_int(s, "height", height);
+			gst_structure_fixate_field_nearest_fraction(s, "framerate", JAMRTC_CAPTURE_FPS, 1);
+			if(!jpeg)
+				gst_structure_fixate_field_string(s, "format", "I420");
+			jamrtc_capture_mode mode = { 0 };
+			mode.jpeg = jpeg;
+			const char *format = jpeg ? "MJPEG" : gst_structure_get_string(s, "format");
+			if(format != NULL && gst_structure_get_int(s, "width", &mode.width) &&
+					gst_structure_get_int(s, "height", &mode.height) &&
+					gst_structure_get_fraction(s, "framerate", &mode.fps_n, &mode.fps_d) &&
+					mode.width > 0 && mode.height > 0 && mode.fps_d > 0) {
+				g_strlcpy(mode.format, format, sizeof(mode.format));
+				jamrtc_capture_mode *copy = g_malloc(sizeof(jamrtc_capture_mode));
+				*copy = mode;
+				modes = g_list_prepend(modes, copy);
+			}
+			gst_structure_free(s);
+		}
+		if(caps != NULL)
+			gst_caps_unref(caps);
+		gst_object_unref(pad);
+	}
+	gst_element_set_state(src, GST_STATE_NULL);
+	gst_object_unref(src);
+	return g_list_reverse(modes);
+}
+
+/* Helper to write the chain that turns frames in a specific mode to what we
+ * need: it starts from the caps of the mode, and ends with our own caps */
+static void jamrtc_capture_chain(const jamrtc_capture_mode *mode, gint width, gint height,
+		char *buffer, size_t buflen, const char **work) {
+	if(mode->jpeg) {
+		g_snprintf(buffer, buflen, "image/jpeg,width=%d,height=%d,framerate=%d/%d ! jpegdec ! ",
+			mode->width, mode->height, mode->fps_n, mode->fps_d);
+	} else {
+		g_snprintf(buffer, buflen, "video/x-raw,format=%s,width=%d,height=%d,framerate=%d/%d ! ",
+			mode->format, mode->width, mode->height, mode->fps_n, mode->fps_d);
+	}
+	gboolean scale = (mode->width != width || mode->height != height);
+	/* What jpegdec gives us depends on the device, so we always let videoconvert
+	 * see it, which is just a passthrough if it's I420 already */
+	gboolean convert = mode->jpeg || strcmp(mode->format, "I420");
+	char scaled[64];
+	g_snprintf(scaled, sizeof(scaled), "videoscale ! video/x-raw,width=%d,height=%d ! ", width, height);
+	if(scale && convert && (gint64)mode->width * mode->height >= (gint64)width * height) {
+		/* Downscale first, so that we convert fewer pixels */
+		g_strlcat(buffer, scaled, buflen);
+		g_strlcat(buffer, "videoconvert ! ", buflen);
+	} else {
+		if(convert)
+			g_strlcat(buffer, "videoconvert ! ", buflen);
+		if(scale)
+			g_strlcat(buffer, scaled, buflen);
+	}
+	char caps[64];
+	g_snprintf(caps, sizeof(caps), "video/x-raw,format=I420,width=%d,height=%d", width, height);
+	g_strlcat(buffer, caps, buflen);
+	if(work != NULL) {
+		if(mode->jpeg)
+			*work = scale ? "decode and scale" : "decode only";
+		else if(scale)
+			*work = convert ? "scale and convert" : "scale only";
+		else
+			*work = convert ? "convert only" : "native, nothing to do";
+	}
+}
+
+/* Helper to run a pipeline to completion, returning how much CPU time it took (-1 on error) */
+static gint64 jamrtc_capture_run(const char *description, gint64 timeout) {
+	GError *error = NULL;
+	GstElement *pipeline = gst_parse_launch(description, &error);
+	if(error != NULL) {
+		JAMRTC_LOG(LOG_HUGE, "Error creating capture test pipeline: %s\n", error->message ? error->message : "??");
+		g_error_free(error);
+		if(pipeline != NULL)
+			gst_object_unref(pipeline);
+		return -1;
+	}
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	gint64 res = -1;
+	if(gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE) {
+		GstBus *bus = gst_element_get_bus(pipeline);
+		GstMessage *msg = gst_bus_timed_pop_filtered(bus, timeout * GST_MSECOND,
+			GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+		getrusage(RUSAGE_SELF, &after);
+		if(msg != NULL && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS) {
+			res = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) * G_USEC_PER_SEC +
+				(after.ru_utime.tv_usec - before.ru_utime.tv_usec) +
+				(after.ru_stime.tv_sec - before.ru_stime.tv_sec) * G_USEC_PER_SEC +
+				(after.ru_stime.tv_usec - before.ru_stime.tv_usec);
+		}
+		if(msg != NULL)
+			gst_message_unref(msg);
+		gst_object_unref(bus);
+	}
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(pipeline);
+	return res;
+}
+
+/* Helper to measure how much CPU a chain needs per frame (us, -1 on error),
+ * by feeding it test frames in the format and resolution of a mode */
+static gdouble jamrtc_capture_bench(const jamrtc_capture_mode *mode, const char *chain) {
+	char source[256], pipeline[1024];
+	if(mode->jpeg) {
+		/* We need MJPEG frames: what it takes to encode them is in the baseline too */
+		g_snprintf(source, sizeof(source), "videotestsrc num-buffers=%d ! "
+			"video/x-raw,format=I420,width=%d,height=%d,framerate=%d/%d ! jpegenc",
+			JAMRTC_CAPTURE_BENCH_FRAMES, mode->width, mode->height, mode->fps_n, mode->fps_d);
+	} else {
+		g_snprintf(source, sizeof(source), "videotestsrc num-buffers=%d ! "
+			"video/x-raw,format=%s,width=%d,height=%d,framerate=%d/%d",
+			JAMRTC_CAPTURE_BENCH_FRAMES, mode->format, mode->width, mode->height, mode->fps_n, mode->fps_d);
+	}
+	g_snprintf(pipeline, sizeof(pipeline), "%s ! fakesink", source);
+	gint64 baseline = jamrtc_capture_run(pipeline, 10000);
+	g_snprintf(pipeline, sizeof(pipeline), "%s ! %s ! fakesink", source, chain);
+	gint64 total = jamrtc_capture_run(pipeline, 10000);
+	if(baseline < 0 || total < 0)
+		return -1;
+	return (gdouble)MAX(0, total - baseline) / JAMRTC_CAPTURE_BENCH_FRAMES;
+}
+
+/* Helper to let v4l2src and the converters figure it out, when we can't do better */
+static char *jamrtc_capture_fallback(const char *device, gint width, gint height) {
+	return g_strdup_printf("v4l2src device=%s%s%s ! videoconvert ! videoscale ! video/x-raw,width=%d,height=%d",
+		device, strcasecmp(io_mode, "auto") ? " io-mode=" : "", strcasecmp(io_mode, "auto") ? io_mode : "",
+		width, height);
+}
+
+/* Helper to negotiate the capture mode with a device */
+static char *jamrtc_capture_negotiate(const char *device, gint width, gint height, gboolean bench) {
+	GList *modes = jamrtc_capture_modes(device, width, height);
+	if(modes == NULL) {
+		/* We couldn't ask the device, so let v4l2src and the converters figure it out */
+		JAMRTC_LOG(LOG_WARN, "Couldn't get the capture modes of %s, converting and scaling whatever it gives us\n", device);
+		return jamrtc_capture_fallback(device, width, height);
+	}
+	/* Find the best mode, and the one v4l2src would have picked (the largest raw one) */
+	jamrtc_capture_mode *best = NULL, *largest = NULL;
+	GList *temp = modes;
+	while(temp) {
+		jamrtc_capture_mode *mode = (jamrtc_capture_mode *)temp->data;
+		JAMRTC_LOG(LOG_VERB, "  -- %s: %dx%d %s @ %d/%d fps\n", device,
+			mode->width, mode->height, mode->format, mode->fps_n, mode->fps_d);
+		if(best == NULL || jamrtc_capture_better(mode, best, width, height))
+			best = mode;
+		if(!mode->jpeg && (largest == NULL ||
+				(gint64)mode->width * mode->height > (gint64)largest->width * largest->height))
+			largest = mode;
+		temp = temp->next;
+	}
+	char chain[512];
+	const char *work = NULL;
+	jamrtc_capture_chain(best, width, height, chain, sizeof(chain), &work);
+	/* Check if we can have the device export frames as dmabuf, if needed */
+	const char *io = io_mode;
+	if(!strcasecmp(io, "auto")) {
+		char test[768];
+		g_snprintf(test, sizeof(test), "v4l2src device=%s io-mode=dmabuf num-buffers=2 ! %s ! fakesink", device, chain);
+		io = (jamrtc_capture_run(test, 3000) >= 0) ? "dmabuf" : "mmap";
+	}
+	char *description = g_strdup_printf("v4l2src device=%s io-mode=%s ! %s", device, io, chain);
+	JAMRTC_LOG(LOG_INFO, "Webcam capture: %dx%d %s @ %.1f fps from %s (%s), %s\n",
+		best->width, best->height, best->format, (gdouble)best->fps_n / best->fps_d, device, io, work);
+	/* Compare the CPU time it takes to what we used to do, if asked to */
+	if(bench && largest != NULL && largest != best) {
+		char old[512];
+		g_snprintf(old, sizeof(old), "video/x-raw,format=%s,width=%d,height=%d,framerate=%d/%d ! "
+			"videoconvert ! videoscale ! video/x-raw,format=I420,width=%d,height=%d",
+			largest->format, largest->width, largest->height, largest->fps_n, largest->fps_d, width, height);
+		gdouble before = jamrtc_capture_bench(largest, old), after = jamrtc_capture_bench(best, chain);
+		if(before >= 0 && after >= 0) {
+			JAMRTC_LOG(LOG_INFO, "  -- ~%.2fms of CPU per frame (%.2fms instead of %.2fms to convert and scale %dx%d %s)\n",
+				(before - after) / 1000, after / 1000, before / 1000,
+				largest->width, largest->height, largest->format);
+		}
+	}
+	g_list_free_full(modes, (GDestroyNotify)g_free);
+	return description;
+}
+
+/* Negotiate the capture mode with a webcam, at startup */
+void jamrtc_capture_prepare(const char *device, guint width, guint height, gboolean bench) {
+	char key[256];
+	g_snprintf(key, sizeof(key), "%s %ux%u", device, width, height);
+	jamrtc_mutex_lock(&capture_mutex);
+	gboolean done = (descriptions != NULL && g_hash_table_lookup(descriptions, key) != NULL);
+	jamrtc_mutex_unlock(&capture_mutex);
+	if(done)
+		return;
+	/* This blocks for a while, so we don't hold the lock in the meanwhile */
+	char *description = jamrtc_capture_negotiate(device, width, height, bench);
+	jamrtc_mutex_lock(&capture_mutex);
+	if(descriptions == NULL)
+		descriptions = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	g_hash_table_insert(descriptions, g_strdup(key), description);
+	jamrtc_mutex_unlock(&capture_mutex);
+}
+
+/* Write the pipeline description to capture frames from a webcam */
+void jamrtc_capture_describe(const char *device, guint width, guint height, char *buffer, size_t buflen) {
+	char key[256];
+	g_snprintf(key, sizeof(key), "%s %ux%u", device, width, height);
+	jamrtc_mutex_lock(&capture_mutex);
+	char *description = descriptions ? g_hash_table_lookup(descriptions, key) : NULL;
+	if(description != NULL) {
+		g_strlcpy(buffer, description, buflen);
+		jamrtc_mutex_unlock(&capture_mutex);
+		return;
+	}
+	jamrtc_mutex_unlock(&capture_mutex);
+	/* We never negotiate here, as we may be on the WebRTC loop: fall back to converting and scaling */
+	JAMRTC_LOG(LOG_WARN, "No capture mode negotiated for %s at %ux%u, converting and scaling whatever it gives us\n",
+		device, width, height);
+	description = jamrtc_capture_fallback(device, width, height);
+	g_strlcpy(buffer, description, buflen);
+	g_free(description);
+}
+
+/* Get rid of the cached capture modes */
+void jamrtc_capture_cleanup(void) {
+	jamrtc_mutex_lock(&capture_mutex);
+	if(descriptions != NULL)
+		g_hash_table_destroy(descriptions);
+	descriptions = NULL;
+	jamrtc_mutex_unlock(&capture_mutex);
+}
@@ -0,0 +1,40 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_CAPTURE_H
+#define JAMRTC_CAPTURE_H
+
+/* GLib */
+#include <glib.h>
+
+
+/* Set how v4l2src should get frames from the webcam: "auto" (dmabuf, if
+ * the device can export frames that way, mmap otherwise), "dmabuf", "mmap"
+ * or "rw". Must be called before the webcam is used: returns 0 if valid */
+int jamrtc_capture_set_io_mode(const char *mode);
+
+/* Negotiate how to capture I420 frames of the provided resolution from a
+ * webcam: the device is asked for the modes it supports, and we pick the one
+ * that needs the least work to get there, so that videoconvert and videoscale
+ * are only added when there's no way around them. This opens the device and
+ * runs test pipelines, so it blocks: call it at startup, before joining. If
+ * bench is TRUE, we also measure the CPU time we save, which only makes sense
+ * before JACK and any other pipeline are running. The result is cached */
+void jamrtc_capture_prepare(const char *device, guint width, guint height, gboolean bench);
+/* Write the pipeline description to capture I420 frames of the provided
+ * resolution from a webcam (from v4l2src up to the caps filter), as
+ * negotiated at startup: this never blocks, and if nothing was negotiated
+ * for that device and resolution, we convert and scale whatever it gives us */
+void jamrtc_capture_describe(const char *device, guint width, guint height, char *buffer, size_t buflen);
+/* Get rid of the cached capture modes */
+void jamrtc_capture_cleanup(void);
+
+
+#endif
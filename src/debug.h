@@ -16,6 +16,8 @@
 #include <glib.h>
 #include <glib/gprintf.h>
 
+#include "log.h"
+
 extern int jamrtc_log_level;
 extern gboolean jamrtc_log_timestamps;
 extern gboolean jamrtc_log_colors;
@@ -66,10 +68,16 @@ static const char *jamrtc_log_prefix[] = {
 #define JAMRTC_PRINT g_print
 /* Logger based on different levels, which can either be displayed
  * or not according to the configuration of the gateway.
- * The format must be a string literal. */
+ * The format must be a string literal. When the asynchronous logger
+ * is running, everything but the message itself is done there. */
 #define JAMRTC_LOG(level, format, ...) \
 do { \
 	if (level > LOG_NONE && level <= LOG_MAX && level <= jamrtc_log_level) { \
+		if (g_atomic_int_get(&jamrtc_log_async)) { \
+			jamrtc_log_write(level, __FILE__, __FUNCTION__, __LINE__, \
+			                 format, ##__VA_ARGS__); \
+			break; \
+		} \
 		char jamrtc_log_ts[64] = ""; \
 		char jamrtc_log_src[128] = ""; \
 		if (jamrtc_log_timestamps) { \
@@ -0,0 +1,153 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <sys/resource.h>
+
+/* Local includes */
+#include "degrade.h"
+#include "debug.h"
+
+
+/* Degradation controller: when the machine gets loaded, encoding and
+ * decoding video competes with the audio we play and send, and of the two
+ * audio is what matters in a jam. We periodically check how much CPU we're
+ * using (user and system time of the whole process, compared to all the
+ * cores), and how many QoS messages our pipelines posted (which sinks and
+ * aggregators do when frames arrive too late, and are dropped). When we're
+ * over budget, or frames are late, for a couple of seconds in a row, we go
+ * one level down; when we've been well under budget with no late frames for
+ * a while, we go one level up again. The thresholds are far apart, and if
+ * we have to degrade again soon after a recovery, we wait twice as long
+ * before the next one (up to a few minutes), so that we don't flap */
+#define JAMRTC_DEGRADE_RELAXED		60		/* Below this percentage of the budget we're relaxed */
+#define JAMRTC_DEGRADE_QOS			5		/* QoS messages per second we consider a problem */
+#define JAMRTC_DEGRADE_TRIGGER		2		/* Seconds over budget before degrading */
+#define JAMRTC_DEGRADE_RECOVERY		15		/* Seconds relaxed before recovering, at first */
+#define JAMRTC_DEGRADE_MAX_RECOVERY	240		/* Seconds relaxed before recovering, at most */
+static guint budget = 0;
+static guint cores = 1;
+static volatile gint qos = 0;
+
+/* State of the controller (only accessed by the thread calling the update) */
+static jamrtc_degrade_level level = JAMRTC_DEGRADE_NONE;
+static gint64 last_time = 0, last_cpu = 0, last_change = 0, last_recovery = 0;
+static guint overloaded = 0, relaxed = 0, recovery = JAMRTC_DEGRADE_RECOVERY;
+
+
+/* Helper to get the CPU time (user+system) consumed by the process so far, in microseconds */
+static gint64 jamrtc_degrade_cpu_time(void) {
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+	return (gint64)usage.ru_utime.tv_sec*G_USEC_PER_SEC + usage.ru_utime.tv_usec +
+		(gint64)usage.ru_stime.tv_sec*G_USEC_PER_SEC + usage.ru_stime.tv_usec;
+}
+
+/* Degradation controller initialization */
+void jamrtc_degrade_init(guint percent) {
+	budget = MIN(percent, 100);
+	cores = MAX(1, g_get_num_processors());
+	last_time = g_get_monotonic_time();
+	last_cpu = jamrtc_degrade_cpu_time();
+	if(budget > 0) {
+		JAMRTC_LOG(LOG_INFO, "Degrading video when using more than %u%% of the CPU (%u cores)\n",
+			budget, cores);
+	}
+}
+
+/* Whether the degradation controller is enabled */
+gboolean jamrtc_degrade_is_enabled(void) {
+	return budget > 0;
+}
+
+/* Bus sync handler to count QoS messages */
+GstBusSyncReply jamrtc_degrade_bus_handler(GstBus *bus, GstMessage *msg, gpointer user_data) {
+	if(GST_MESSAGE_TYPE(msg) != GST_MESSAGE_QOS)
+		return GST_BUS_PASS;
+	g_atomic_int_inc(&qos);
+	/* Nobody else is interested, so don't let them pile up on the bus */
+	return GST_BUS_DROP;
+}
+
+/* Check the CPU usage and the QoS messages, and figure out the level */
+jamrtc_degrade_level jamrtc_degrade_update(void) {
+	if(budget == 0)
+		return JAMRTC_DEGRADE_NONE;
+	gint64 now = g_get_monotonic_time(), cpu = jamrtc_degrade_cpu_time();
+	if(now - last_time < G_USEC_PER_SEC / 2)
+		return level;
+	gdouble usage = (gdouble)(cpu - last_cpu) * 100 / ((now - last_time) * cores);
+	gint count = g_atomic_int_get(&qos);
+	g_atomic_int_add(&qos, -count);
+	gdouble late = (gdouble)count * G_USEC_PER_SEC / (now - last_time);
+	gdouble elapsed = (gdouble)(now - last_time) / G_USEC_PER_SEC;
+	last_time = now;
+	last_cpu = cpu;
+	JAMRTC_LOG(LOG_DBG, "CPU usage %.1f%% (budget %u%%), %.1f late frames/s, level %s\n",
+		usage, budget, late, jamrtc_degrade_level_str(level));
+	/* Check how we're doing */
+	if(usage > budget || late >= JAMRTC_DEGRADE_QOS) {
+		overloaded++;
+		relaxed = 0;
+	} else if(usage < (gdouble)budget * JAMRTC_DEGRADE_RELAXED / 100 && late == 0) {
+		overloaded = 0;
+		relaxed++;
+	} else {
+		/* Somewhere in between: nothing to do */
+		overloaded = 0;
+		relaxed = 0;
+	}
+	if(overloaded >= JAMRTC_DEGRADE_TRIGGER && level < JAMRTC_DEGRADE_MAX &&
+			now - last_change >= JAMRTC_DEGRADE_TRIGGER * G_USEC_PER_SEC) {
+		/* Go one level down: if we recovered not long ago, wait longer next time */
+		if(last_recovery > 0 && now - last_recovery < (gint64)recovery * G_USEC_PER_SEC)
+			recovery = MIN(recovery * 2, JAMRTC_DEGRADE_MAX_RECOVERY);
+		level++;
+		last_change = now;
+		overloaded = 0;
+		JAMRTC_LOG(LOG_WARN, "Using %.1f%% of the CPU (budget %u%%), %.1f late frames/s: degrading video (%s)\n",
+			usage, budget, late, jamrtc_degrade_level_str(level));
+	} else if(relaxed * elapsed >= recovery && level > JAMRTC_DEGRADE_NONE &&
+			now - last_change >= (gint64)recovery * G_USEC_PER_SEC) {
+		/* We've been fine for a while, go one level up */
+		level--;
+		last_change = now;
+		last_recovery = now;
+		relaxed = 0;
+		JAMRTC_LOG(LOG_INFO, "Using %.1f%% of the CPU (budget %u%%): recovering video (%s)\n",
+			usage, budget, jamrtc_degrade_level_str(level));
+	} else if(level == JAMRTC_DEGRADE_NONE && last_recovery > 0 &&
+			now - last_recovery >= (gint64)JAMRTC_DEGRADE_MAX_RECOVERY * G_USEC_PER_SEC) {
+		/* We've been fine for long enough to forget about past troubles */
+		recovery = JAMRTC_DEGRADE_RECOVERY;
+		last_recovery = 0;
+	}
+	return level;
+}
+
+/* Get a string representation of a level */
+const char *jamrtc_degrade_level_str(jamrtc_degrade_level level) {
+	switch(level) {
+		case JAMRTC_DEGRADE_NONE:
+			return "full quality";
+		case JAMRTC_DEGRADE_FPS:
+			return "lower webcam frame rate";
+		case JAMRTC_DEGRADE_RESOLUTION:
+			return "lower webcam resolution";
+		case JAMRTC_DEGRADE_REMOTE_VIDEO:
+			return "remote video paused";
+		case JAMRTC_DEGRADE_PREVIEW:
+			return "remote video and preview paused";
+		default:
+			break;
+	}
+	return NULL;
+}
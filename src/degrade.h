@@ -0,0 +1,58 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_DEGRADE_H
+#define JAMRTC_DEGRADE_H
+
+/* GLib */
+#include <glib.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+
+/* Degradation levels: each level implies the previous ones */
+typedef enum jamrtc_degrade_level {
+	/* Everything as usual */
+	JAMRTC_DEGRADE_NONE = 0,
+	/* Capture (and encode) fewer webcam frames */
+	JAMRTC_DEGRADE_FPS,
+	/* Encode a smaller webcam video (or skip the highest simulcast layer),
+	 * and ask for the lowest substream of who's simulcasting */
+	JAMRTC_DEGRADE_RESOLUTION,
+	/* Stop receiving (and decoding) the video of the other participants */
+	JAMRTC_DEGRADE_REMOTE_VIDEO,
+	/* Stop rendering our own webcam preview too */
+	JAMRTC_DEGRADE_PREVIEW
+} jamrtc_degrade_level;
+#define JAMRTC_DEGRADE_MAX	JAMRTC_DEGRADE_PREVIEW
+/* Frame rate we capture at, normally and when degraded */
+#define JAMRTC_DEGRADE_FULL_FPS		30
+#define JAMRTC_DEGRADE_LOW_FPS		15
+
+/* Degradation controller initialization: budget is the share of the whole
+ * machine (percent of all cores) we can use before degrading video, to
+ * keep audio safe (0 disables the controller) */
+void jamrtc_degrade_init(guint budget);
+/* Whether the degradation controller is enabled */
+gboolean jamrtc_degrade_is_enabled(void);
+/* Bus sync handler to install on pipelines, to count QoS messages (frames
+ * that were late or dropped somewhere): QoS messages are dropped after
+ * being counted, any other message is passed on as usual */
+GstBusSyncReply jamrtc_degrade_bus_handler(GstBus *bus, GstMessage *msg, gpointer user_data);
+/* Check the CPU usage and the QoS messages since last time, and figure out
+ * which level we should be at now: to call periodically (about once per
+ * second), always from the same thread */
+jamrtc_degrade_level jamrtc_degrade_update(void);
+/* Get a string representation of a level */
+const char *jamrtc_degrade_level_str(jamrtc_degrade_level level);
+
+
+#endif
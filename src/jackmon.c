@@ -0,0 +1,282 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* JACK includes */
+#include <jack/jack.h>
+
+/* Local includes */
+#include "jackmon.h"
+#include "stats.h"
+#include "recorder.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* JACK monitor: when a jam glitches, it can be the network, the jitter
+ * buffer, or JACK itself not making it in time (an xrun). We open a JACK
+ * client with no ports and no process callback, only to be notified about
+ * xruns and about buffer size and sample rate changes: the notifications
+ * come from a JACK thread that's not realtime, and are queued with their
+ * timestamps. Things happening in our own pipelines (participants joining,
+ * pipelines starting, videos starting, renegotiations) are queued as well,
+ * since creating and starting pipelines also means new JACK clients and a
+ * graph reorder, which is a common cause of xruns. Periodically, what's
+ * queued is reported, warning about xruns that happened shortly after (or
+ * right before) some activity of ours, and the DSP load is sampled */
+#define JAMRTC_JACKMON_BEFORE		2000000	/* How long an activity can precede an xrun to be related (us) */
+#define JAMRTC_JACKMON_AFTER		500000	/* How long an activity can follow an xrun to be related (us) */
+#define JAMRTC_JACKMON_MAX_QUEUED	1000	/* Events we keep at most, if nobody polls */
+typedef enum jamrtc_jackmon_type {
+	JAMRTC_JACKMON_XRUN = 0,
+	JAMRTC_JACKMON_BUFFER_SIZE,
+	JAMRTC_JACKMON_SAMPLE_RATE,
+	JAMRTC_JACKMON_SHUTDOWN,
+	JAMRTC_JACKMON_ACTIVITY
+} jamrtc_jackmon_type;
+typedef struct jamrtc_jackmon_event {
+	jamrtc_jackmon_type type;
+	/* Monotonic and wallclock time of the event */
+	gint64 when, real_time;
+	/* Xruns only: how late the cycle was (us), and the DSP load (%) */
+	gfloat delay, load;
+	/* New buffer size or sample rate */
+	guint value;
+	/* Activities only: what happened, and to whom */
+	char *what;
+} jamrtc_jackmon_event;
+static void jamrtc_jackmon_event_free(jamrtc_jackmon_event *event) {
+	if(event == NULL)
+		return;
+	g_free(event->what);
+	g_free(event);
+}
+
+/* JACK client, and what we know about the server */
+static jack_client_t *client = NULL;
+static volatile gint xruns = 0, coinciding = 0;
+static volatile gint buffer_size = 0, sample_rate = 0;
+static gfloat max_load = 0;
+static gint64 started = 0;
+
+/* Events waiting to be reported, and recent activities */
+static GQueue events = G_QUEUE_INIT, activities = G_QUEUE_INIT;
+static jamrtc_mutex events_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+
+/* Helper to queue an event */
+static void jamrtc_jackmon_queue(jamrtc_jackmon_event *event) {
+	event->when = g_get_monotonic_time();
+	event->real_time = g_get_real_time();
+	GQueue *queue = (event->type == JAMRTC_JACKMON_ACTIVITY ? &activities : &events);
+	jamrtc_mutex_lock(&events_mutex);
+	if(g_queue_get_length(queue) >= JAMRTC_JACKMON_MAX_QUEUED)
+		jamrtc_jackmon_event_free(g_queue_pop_head(queue));
+	g_queue_push_tail(queue, event);
+	jamrtc_mutex_unlock(&events_mutex);
+}
+
+/* JACK callbacks: none of these are called on the process thread */
+static int jamrtc_jackmon_xrun(void *arg) {
+	jamrtc_jackmon_event *event = g_malloc0(sizeof(jamrtc_jackmon_event));
+	event->type = JAMRTC_JACKMON_XRUN;
+	event->delay = jack_get_xrun_delayed_usecs(client);
+	event->load = jack_cpu_load(client);
+	g_atomic_int_inc(&xruns);
+	jamrtc_jackmon_queue(event);
+	return 0;
+}
+static int jamrtc_jackmon_buffer_size(jack_nframes_t nframes, void *arg) {
+	if(g_atomic_int_get(&buffer_size) == (gint)nframes)
+		return 0;
+	g_atomic_int_set(&buffer_size, nframes);
+	jamrtc_jackmon_event *event = g_malloc0(sizeof(jamrtc_jackmon_event));
+	event->type = JAMRTC_JACKMON_BUFFER_SIZE;
+	event->value = nframes;
+	jamrtc_jackmon_queue(event);
+	return 0;
+}
+static int jamrtc_jackmon_sample_rate(jack_nframes_t nframes, void *arg) {
+	if(g_atomic_int_get(&sample_rate) == (gint)nframes)
+		return 0;
+	g_atomic_int_set(&sample_rate, nframes);
+	jamrtc_jackmon_event *event = g_malloc0(sizeof(jamrtc_jackmon_event));
+	event->type = JAMRTC_JACKMON_SAMPLE_RATE;
+	event->value = nframes;
+	jamrtc_jackmon_queue(event);
+	return 0;
+}
+static void jamrtc_jackmon_shutdown(jack_status_t code, const char *reason, void *arg) {
+	jamrtc_jackmon_event *event = g_malloc0(sizeof(jamrtc_jackmon_event));
+	event->type = JAMRTC_JACKMON_SHUTDOWN;
+	event->what = g_strdup(reason ? reason : "??");
+	jamrtc_jackmon_queue(event);
+}
+
+/* JACK monitor initialization */
+int jamrtc_jackmon_init(void) {
+	jack_status_t status = 0;
+	client = jack_client_open("JamRTC monitor", JackNoStartServer, &status);
+	if(client == NULL) {
+		JAMRTC_LOG(LOG_ERR, "Couldn't open the JACK monitor client (0x%x), is JACK running?\n", status);
+		return -1;
+	}
+	jack_set_xrun_callback(client, jamrtc_jackmon_xrun, NULL);
+	jack_set_buffer_size_callback(client, jamrtc_jackmon_buffer_size, NULL);
+	jack_set_sample_rate_callback(client, jamrtc_jackmon_sample_rate, NULL);
+	jack_on_info_shutdown(client, jamrtc_jackmon_shutdown, NULL);
+	/* Take note of the current settings, so that we only report actual changes */
+	g_atomic_int_set(&buffer_size, jack_get_buffer_size(client));
+	g_atomic_int_set(&sample_rate, jack_get_sample_rate(client));
+	if(jack_activate(client) != 0) {
+		JAMRTC_LOG(LOG_ERR, "Couldn't activate the JACK monitor client\n");
+		jamrtc_jackmon_cleanup();
+		return -1;
+	}
+	started = g_get_monotonic_time();
+	JAMRTC_LOG(LOG_INFO, "JACK monitor ready (%d Hz, %d frames per cycle, %.1fms)\n",
+		g_atomic_int_get(&sample_rate), g_atomic_int_get(&buffer_size),
+		(gdouble)g_atomic_int_get(&buffer_size) * 1000 / MAX(1, g_atomic_int_get(&sample_rate)));
+	return 0;
+}
+
+/* JACK monitor cleanup */
+void jamrtc_jackmon_cleanup(void) {
+	if(client != NULL) {
+		jack_deactivate(client);
+		jack_client_close(client);
+		client = NULL;
+		/* Report what's left, if anything */
+		jamrtc_jackmon_poll();
+		JAMRTC_LOG(LOG_INFO, "JACK xruns: %d (%d while our pipelines were busy), max DSP load %.1f%%\n",
+			g_atomic_int_get(&xruns), g_atomic_int_get(&coinciding), max_load);
+	}
+	jamrtc_mutex_lock(&events_mutex);
+	g_queue_clear_full(&events, (GDestroyNotify)jamrtc_jackmon_event_free);
+	g_queue_clear_full(&activities, (GDestroyNotify)jamrtc_jackmon_event_free);
+	jamrtc_mutex_unlock(&events_mutex);
+}
+
+/* Whether the JACK monitor is running */
+gboolean jamrtc_jackmon_is_enabled(void) {
+	return client != NULL;
+}
+
+/* Take note of something that happened in our pipelines */
+void jamrtc_jackmon_activity(const char *participant, const char *stream, const char *what) {
+	if(client == NULL || what == NULL)
+		return;
+	jamrtc_jackmon_event *event = g_malloc0(sizeof(jamrtc_jackmon_event));
+	event->type = JAMRTC_JACKMON_ACTIVITY;
+	if(stream != NULL)
+		event->what = g_strdup_printf("%s/%s %s", participant ? participant : "??", stream, what);
+	else
+		event->what = g_strdup_printf("%s %s", participant ? participant : "??", what);
+	jamrtc_jackmon_queue(event);
+}
+
+/* Helper to list the activities around an xrun: must be called with the mutex locked */
+static char *jamrtc_jackmon_related(jamrtc_jackmon_event *xrun) {
+	GString *related = NULL;
+	GList *temp = activities.head;
+	while(temp) {
+		jamrtc_jackmon_event *activity = (jamrtc_jackmon_event *)temp->data;
+		gint64 diff = activity->when - xrun->when;
+		if(diff >= -JAMRTC_JACKMON_BEFORE && diff <= JAMRTC_JACKMON_AFTER) {
+			if(related == NULL)
+				related = g_string_new(NULL);
+			else
+				g_string_append(related, ", ");
+			g_string_append_printf(related, "%s (%+.0fms)", activity->what, (gdouble)diff / 1000);
+		}
+		temp = temp->next;
+	}
+	return related ? g_string_free(related, FALSE) : NULL;
+}
+
+/* Report the xruns and changes that happened since the last time */
+void jamrtc_jackmon_poll(void) {
+	gint64 now = g_get_monotonic_time();
+	gfloat load = client ? jack_cpu_load(client) : 0;
+	if(load > max_load)
+		max_load = load;
+	/* Only report what's old enough that we know the activities that followed */
+	GList *ready = NULL;
+	jamrtc_mutex_lock(&events_mutex);
+	jamrtc_jackmon_event *event = NULL;
+	while((event = g_queue_peek_head(&events)) != NULL) {
+		if(client != NULL && now - event->when < JAMRTC_JACKMON_AFTER)
+			break;
+		event = g_queue_pop_head(&events);
+		if(event->type == JAMRTC_JACKMON_XRUN) {
+			/* We reuse this to keep track of the related activities */
+			g_free(event->what);
+			event->what = jamrtc_jackmon_related(event);
+		}
+		ready = g_list_append(ready, event);
+	}
+	/* Get rid of activities that can't be related to anything anymore */
+	event = g_queue_peek_head(&events);
+	gint64 oldest = (event ? event->when : now) - JAMRTC_JACKMON_BEFORE;
+	while((event = g_queue_peek_head(&activities)) != NULL && event->when < oldest)
+		jamrtc_jackmon_event_free(g_queue_pop_head(&activities));
+	jamrtc_mutex_unlock(&events_mutex);
+	/* Report them */
+	GList *temp = ready;
+	while(temp) {
+		event = (jamrtc_jackmon_event *)temp->data;
+		gdouble at = (gdouble)(event->when - started) / G_USEC_PER_SEC;
+		switch(event->type) {
+			case JAMRTC_JACKMON_XRUN:
+				if(event->load > max_load)
+					max_load = event->load;
+				if(event->what != NULL) {
+					g_atomic_int_inc(&coinciding);
+					JAMRTC_LOG(LOG_WARN, "JACK xrun at %.3fs (%.1fms late, DSP load %.1f%%), right when: %s\n",
+						at, event->delay / 1000, event->load, event->what);
+				} else {
+					JAMRTC_LOG(LOG_WARN, "JACK xrun at %.3fs (%.1fms late, DSP load %.1f%%)\n",
+						at, event->delay / 1000, event->load);
+				}
+				/* If we're recording, take note of where in the tracks this happened */
+				jamrtc_recorder_mark(event->real_time, "xrun");
+				break;
+			case JAMRTC_JACKMON_BUFFER_SIZE:
+				JAMRTC_LOG(LOG_WARN, "JACK buffer size changed at %.3fs: %u frames per cycle\n", at, event->value);
+				jamrtc_recorder_mark(event->real_time, "buffer-size");
+				break;
+			case JAMRTC_JACKMON_SAMPLE_RATE:
+				JAMRTC_LOG(LOG_WARN, "JACK sample rate changed at %.3fs: %u Hz\n", at, event->value);
+				jamrtc_recorder_mark(event->real_time, "sample-rate");
+				break;
+			case JAMRTC_JACKMON_SHUTDOWN:
+				JAMRTC_LOG(LOG_ERR, "JACK shut down at %.3fs: %s\n", at, event->what);
+				break;
+			default:
+				break;
+		}
+		temp = temp->next;
+	}
+	g_list_free_full(ready, (GDestroyNotify)jamrtc_jackmon_event_free);
+	/* Update the statistics */
+	if(client != NULL) {
+		jamrtc_stats_jack stats = { 0 };
+		stats.xruns = g_atomic_int_get(&xruns);
+		stats.coinciding = g_atomic_int_get(&coinciding);
+		stats.dsp_load = load;
+		stats.buffer_size = g_atomic_int_get(&buffer_size);
+		stats.sample_rate = g_atomic_int_get(&sample_rate);
+		jamrtc_stats_update_jack(&stats);
+	}
+}
+
+/* How many xruns we've seen so far */
+guint jamrtc_jackmon_xruns(void) {
+	return g_atomic_int_get(&xruns);
+}
@@ -0,0 +1,38 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_JACKMON_H
+#define JAMRTC_JACKMON_H
+
+/* GLib */
+#include <glib.h>
+
+
+/* JACK monitor initialization: opens a JACK client with no ports, only
+ * to be notified about xruns, buffer size and sample rate changes */
+int jamrtc_jackmon_init(void);
+/* JACK monitor cleanup (prints a summary of what happened) */
+void jamrtc_jackmon_cleanup(void);
+/* Whether the JACK monitor is running */
+gboolean jamrtc_jackmon_is_enabled(void);
+
+/* Take note of something that happened in our pipelines (e.g., someone
+ * joined, a video started, a renegotiation), so that we can tell if it
+ * may have caused an xrun: the stream can be NULL, for participants */
+void jamrtc_jackmon_activity(const char *participant, const char *stream, const char *what);
+/* Report the xruns and changes that happened since the last time, checking
+ * if they coincide with any activity, and update the JACK statistics: to
+ * be called periodically (and not from the JACK or streaming threads) */
+void jamrtc_jackmon_poll(void);
+/* How many xruns we've seen so far */
+guint jamrtc_jackmon_xruns(void);
+
+
+#endif
@@ -18,12 +18,25 @@
 
 /* GTK includes */
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 
 /* GStreamer includes */
 #include <gst/gst.h>
 
 /* Local includes */
 #include "webrtc.h"
+#include "renderer.h"
+#include "stats.h"
+#include "tracing.h"
+#include "recorder.h"
+#include "playout.h"
+#include "midi.h"
+#include "jackmon.h"
+#include "capture.h"
+#include "degrade.h"
+#include "protect.h"
+#include "memory.h"
+#include "mutex.h"
 #include "debug.h"
 
 
@@ -32,6 +45,7 @@ int jamrtc_log_level = LOG_INFO;
 gboolean jamrtc_log_timestamps = FALSE;
 gboolean jamrtc_log_colors = TRUE;
 int lock_debug = 0;
+int lock_profile = 0;
 
 /* Reference counters */
 
@@ -43,9 +57,15 @@ janus_mutex counters_mutex;
 int refcount_debug = 0;
 #endif
 
-/* Signal handler */
+/* SIGUSR1 handler (on the main loop, so we can log safely), to dump the mutex contention profile */
+static gboolean jamrtc_lock_profile_signal(gpointer user_data) {
+	jamrtc_mutex_profile_report(20);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helper to stop JamRTC (the third time we're asked, we just exit) */
 static volatile gint stop = 0;
-static void jamrtc_handle_signal(int signum) {
+static void jamrtc_stop(void) {
 	JAMRTC_LOG(LOG_INFO, "Stopping JamRTC...\n");
 	if(g_atomic_int_compare_and_exchange(&stop, 0, 1)) {
 		jamrtc_webrtc_cleanup();
@@ -55,6 +75,11 @@ static void jamrtc_handle_signal(int signum) {
 			exit(1);
 	}
 }
+/* SIGINT/SIGTERM handler (on the main loop too, for the same reason) */
+static gboolean jamrtc_handle_signal(gpointer user_data) {
+	jamrtc_stop();
+	return G_SOURCE_CONTINUE;
+}
 
 /* Signalling/WebRTC callbacks */
 static void jamrtc_server_connected(void);
@@ -81,9 +106,16 @@ static const char *server_url = NULL;
 static guint64 room_id = 0;
 static const char *display = NULL, *instrument = NULL;
 static gboolean no_mic = FALSE, no_webcam = FALSE, no_instrument = FALSE,
-	stereo = FALSE, no_jack = FALSE;
-static const char *video_device = NULL, *src_opts = NULL;
+	stereo = FALSE, no_jack = FALSE, compositor = FALSE, simulcast = FALSE, trace_latency = FALSE,
+	headless = FALSE, p2p = FALSE, midi = FALSE, sync_log = FALSE, bench_locked = FALSE, bundle = FALSE,
+	no_dtx = FALSE, no_drift = FALSE, no_stretch = FALSE, no_protection = FALSE, soak = FALSE,
+	capture_bench = FALSE;
+static const char *video_device = NULL, *video_io = NULL, *src_opts = NULL, *simulcast_ladder = NULL;
+static const char *record_folder = NULL, *record_format = NULL;
+static const char *jitter_traces = NULL, *playout_bench = NULL;
 static guint latency = 0;
+static guint metrics_port = 0, stats_interval = 0, bench_readers = 0;
+static gint cpu_budget = -1;
 static const char *stun_server = NULL, *turn_server = NULL;
 
 static GOptionEntry opt_entries[] = {
@@ -92,21 +124,48 @@ static GOptionEntry opt_entries[] = {
 	{ "display", 'd', 0, G_OPTION_ARG_STRING, &display, "Display name to use in the room (e.g., Lorenzo; required)", NULL },
 	{ "no-mic", 'M', 0, G_OPTION_ARG_NONE, &no_mic, "Don't add an audio source for the local microphone (default: enable audio chat)", NULL },
 	{ "no-webcam", 'W', 0, G_OPTION_ARG_NONE, &no_webcam, "Don't add a video source for the local webcam (default: enable video chat)", NULL },
+	{ "simulcast", 'x', 0, G_OPTION_ARG_NONE, &simulcast, "Simulcast the webcam, so that subscribers can pick the resolution they need (default: single encoding)", NULL },
+	{ "simulcast-ladder", 'X', 0, G_OPTION_ARG_STRING, &simulcast_ladder, "Simulcast layers, from the lowest to the highest (default: 160x90@64,320x180@128,640x360@384)", NULL },
 	{ "video-device", 'v', 0, G_OPTION_ARG_STRING, &video_device, "Video device to use for the video chat (default: /dev/video0)", NULL },
+	{ "video-io", 'V', 0, G_OPTION_ARG_STRING, &video_io, "How to get frames from the webcam: auto, dmabuf, mmap or rw (default: auto, dmabuf if the device supports it)", NULL },
+	{ "capture-bench", 'G', 0, G_OPTION_ARG_NONE, &capture_bench, "At startup, measure how much CPU the webcam capture mode we picked saves per frame, compared to converting and scaling what the webcam gives us by default (default: disabled)", NULL },
 	{ "instrument", 'i', 0, G_OPTION_ARG_STRING, &instrument, "Description of the instrument (e.g., Guitar; default: unknown)", NULL },
 	{ "stereo", 's', 0, G_OPTION_ARG_NONE, &stereo, "Whether the instrument will be stereo or mono (default: mono)", NULL },
+	{ "midi", 'k', 0, G_OPTION_ARG_NONE, &midi, "The instrument is a MIDI one (e.g., keyboard or e-drums): send JACK MIDI events on a data channel, rather than audio (default: audio)", NULL },
 	{ "no-instrument", 'I', 0, G_OPTION_ARG_NONE, &no_instrument, "Don't add a source for the local instrument (default: enable instrument)", NULL },
+	{ "no-dtx", 'D', 0, G_OPTION_ARG_NONE, &no_dtx, "Don't use Opus DTX when sending audio, nor skip decoding streams that are silent (default: DTX and silence detection enabled)", NULL },
+	{ "no-drift", 'O', 0, G_OPTION_ARG_NONE, &no_drift, "Don't compensate the clock drift between who we receive audio from and our JACK clock, only estimate it (default: resample to compensate the drift)", NULL },
+	{ "no-stretch", 'N', 0, G_OPTION_ARG_NONE, &no_stretch, "Don't time-stretch instruments we receive to keep their playout latency low, only measure it (default: accelerate/decelerate playout when needed)", NULL },
+	{ "jitter-traces", 'E', 0, G_OPTION_ARG_STRING, &jitter_traces, "Save the arrival times of the instrument packets we receive in this folder, to replay them with --playout-bench (default: disabled)", NULL },
+	{ "playout-bench", 'e', 0, G_OPTION_ARG_STRING, &playout_bench, "Don't join any room: replay these jitter traces (comma separated) and compare playout latency and quality with and without time-stretching", NULL },
+	{ "cpu-budget", 'u', 0, G_OPTION_ARG_INT, &cpu_budget, "Share of the CPU (percent of all cores) we can use before degrading video, to keep audio safe: webcam frame rate first, then resolution, then remote videos and preview (default: 50, 0 to disable)", NULL },
+	{ "no-protection", 'A', 0, G_OPTION_ARG_NONE, &no_protection, "Don't throttle or pause video when the instruments suffer loss, jitter or growing round-trip times on the network (default: protect instruments)", NULL },
 	{ "jitter-buffer", 'b', 0, G_OPTION_ARG_INT, &latency, "Jitter buffer to use in RTP, in milliseconds (default: 0, no buffering)", NULL },
 	{ "src-opts", 'c', 0, G_OPTION_ARG_STRING, &src_opts, "Custom properties to add to jackaudiosrc (local instrument only)", NULL },
 	{ "stun-server", 'S', 0, G_OPTION_ARG_STRING, &stun_server, "STUN server to use, if any (hostname:port)", NULL },
 	{ "turn-server", 'T', 0, G_OPTION_ARG_STRING, &turn_server, "TURN server to use, if any (username:password@host:port)", NULL },
 	{ "log-level", 'l', 0, G_OPTION_ARG_INT, &jamrtc_log_level, "Logging level (0=disable logging, 7=maximum log level; default: 4)", NULL },
+	{ "lock-profile", 'p', 0, G_OPTION_ARG_NONE, &lock_profile, "Profile how long mutexes are waited for and held, per call site: the worst offenders are logged on SIGUSR1 and at exit (default: disabled)", NULL },
+	{ "bench-readers", 'B', 0, G_OPTION_ARG_INT, &bench_readers, "Benchmark the participant registry with this many threads looking up PeerConnections, and log lookup rates and latencies at exit (default: 0, disabled)", NULL },
+	{ "bench-locked", 'g', 0, G_OPTION_ARG_NONE, &bench_locked, "Have the registry benchmark threads hold the participants mutex for their lookups, for comparison (default: lock-free)", NULL },
+	{ "soak", 'K', 0, G_OPTION_ARG_NONE, &soak, "Soak test: sample memory every time a participant leaves, and at exit fail (exit code 1) unless memory use stayed flat, e.g., against JamRTC-mockjanus in bench mode (default: disabled)", NULL },
+	{ "sync-log", 'a', 0, G_OPTION_ARG_NONE, &sync_log, "Write log lines synchronously on the thread that logs them, e.g., to debug crashes (default: asynchronous logging)", NULL },
 	{ "no-jack", 'J', 0, G_OPTION_ARG_NONE, &no_jack, "For testing purposes, use autoaudiosrc/autoaudiosink instead (default: use JACK)", NULL },
+	{ "headless", 'H', 0, G_OPTION_ARG_NONE, &headless, "Run without any UI (no GTK/X11), only playing audio: video is neither rendered nor received (default: show the UI)", NULL },
+	{ "compositor", 'C', 0, G_OPTION_ARG_NONE, &compositor, "Render all video tiles in a single compositor-based sink (default: one sink per tile)", NULL },
+	{ "metrics-port", 'm', 0, G_OPTION_ARG_INT, &metrics_port, "Port to serve WebRTC statistics on in Prometheus format, on localhost (default: 0, disabled)", NULL },
+	{ "record", 'R', 0, G_OPTION_ARG_STRING, &record_folder, "Record all audio streams (and our instrument) as separate tracks in this folder, without transcoding (default: no recording)", NULL },
+	{ "record-format", 'F', 0, G_OPTION_ARG_STRING, &record_format, "Container to record tracks in, ogg or mkv (default: ogg)", NULL },
+	{ "trace-latency", 'L', 0, G_OPTION_ARG_NONE, &trace_latency, "Trace the latency of each stage of all pipelines, and log a breakdown periodically and at shutdown (default: disabled)", NULL },
+	{ "stats-interval", 't', 0, G_OPTION_ARG_INT, &stats_interval, "How often to sample WebRTC statistics, in seconds (default: 5)", NULL },
+	{ "bundle", 'U', 0, G_OPTION_ARG_NONE, &bundle, "Publish mic, webcam and instrument as separate m-lines of a single PeerConnection, which needs a multistream Janus (>= 1.0): the instrument can then be a comma separated list, e.g., Guitar,Vocals (default: a PeerConnection each)", NULL },
+	{ "p2p", 'P', 0, G_OPTION_ARG_NONE, &p2p, "Duo jams: exchange instruments directly with the other participant, using Janus for signalling only (default: instruments go through Janus)", NULL },
 	{ NULL },
 };
 
 
 /* Helper method to ensure GStreamer has the modules we need */
+static gboolean jamrtc_check_gstreamer_plugin_list(const char **needed);
 static gboolean jamrtc_check_gstreamer_plugins(void) {
 	/* Note: maybe some of these should be optional? And OS-aware... */
 	const char *needed[] = {
@@ -121,6 +180,32 @@ static gboolean jamrtc_check_gstreamer_plugins(void) {
 		"video4linux2",
 		NULL
 	};
+	if(!jamrtc_check_gstreamer_plugin_list(needed))
+		return FALSE;
+	if(compositor) {
+		/* We'll need these to render everything in a single sink */
+		const char *needed_compositor[] = {
+			"compositor",
+			"inter",
+			NULL
+		};
+		if(!jamrtc_check_gstreamer_plugin_list(needed_compositor))
+			return FALSE;
+	}
+	if(record_folder != NULL) {
+		/* We'll need these to record the tracks */
+		const char *needed_recorder[] = {
+			"rtp",
+			"opusparse",
+			(record_format && !strcasecmp(record_format, "mkv")) ? "matroska" : "ogg",
+			NULL
+		};
+		if(!jamrtc_check_gstreamer_plugin_list(needed_recorder))
+			return FALSE;
+	}
+	return TRUE;
+}
+static gboolean jamrtc_check_gstreamer_plugin_list(const char **needed) {
 	GstRegistry *registry = gst_registry_get();
 	if(registry == NULL) {
 		JAMRTC_LOG(LOG_FATAL, "No plugins registered in gstreamer\n");
@@ -141,13 +226,26 @@ static gboolean jamrtc_check_gstreamer_plugins(void) {
 	return ret;
 }
 
+/* Helper to quit GTK (or the main loop, when headless) from the loop thread */
+static GMainLoop *headless_loop = NULL;
+static gboolean jamrtc_gtk_quit(gpointer user_data) {
+	if(headless_loop != NULL)
+		g_main_loop_quit(headless_loop);
+	else
+		gtk_main_quit();
+	return G_SOURCE_REMOVE;
+}
+
 /* Thread responsible for the main loop */
 static gpointer jamrtc_loop_thread(gpointer user_data) {
 	GtkBuilder *builder = (GtkBuilder *)user_data;
-	/* Start the main Glib loop */
-	GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+	/* Start the WebRTC/signalling loop on its own context: the default
+	 * one is only iterated by gtk_main(), and only used for the UI */
+	GMainContext *context = g_main_context_new();
+	g_main_context_push_thread_default(context);
+	GMainLoop *loop = g_main_loop_new(context, FALSE);
 	/* Initialize the Janus stack: we'll continue in the 'server_connected' callback */
-	if(jamrtc_webrtc_init(&callbacks, builder, loop, server_url, stun_server, turn_server, src_opts, latency, no_jack) < 0) {
+	if(jamrtc_webrtc_init(&callbacks, builder, loop, server_url, stun_server, turn_server, src_opts, latency, no_jack, compositor) < 0) {
 		g_main_loop_unref(loop);
 		exit(1);
 	}
@@ -156,14 +254,77 @@ static gpointer jamrtc_loop_thread(gpointer user_data) {
 
 	/* When we leave the loop, we're done */
 	g_main_loop_unref(loop);
-	gtk_main_quit();
+	g_main_context_pop_thread_default(context);
+	g_main_context_unref(context);
+	g_idle_add(jamrtc_gtk_quit, NULL);
 	return NULL;
 }
 
+/* This function is called when the main window is minimised or restored */
+static gboolean jamrtc_window_state_changed(GtkWidget *widget, GdkEventWindowState *event, gpointer user_data) {
+	if(event->changed_mask & GDK_WINDOW_STATE_ICONIFIED)
+		jamrtc_webrtc_set_visible(!(event->new_window_state & GDK_WINDOW_STATE_ICONIFIED));
+	return FALSE;
+}
+
+/* This function is called when a video tile is double-clicked, to collapse or expand it */
+static gboolean jamrtc_video_clicked(GtkWidget *widget, GdkEventButton *event, gpointer user_data) {
+	if(event->type != GDK_2BUTTON_PRESS)
+		return FALSE;
+	guint slot = GPOINTER_TO_UINT(user_data);
+	if(slot == 0) {
+		/* This is the compositor, find out which video tile was clicked */
+		if(event->y >= JAMRTC_RENDERER_VIDEO_HEIGHT)
+			return FALSE;
+		slot = (guint)event->x / JAMRTC_RENDERER_TILE_WIDTH + 1;
+		jamrtc_webrtc_toggle_video(slot);
+		return TRUE;
+	}
+	gboolean visible = jamrtc_webrtc_toggle_video(slot);
+	/* Only resize the tile if there's something in it */
+	int width = 0, height = 0;
+	gtk_widget_get_size_request(widget, &width, &height);
+	if(width > 0)
+		gtk_widget_set_size_request(widget, width, visible ? 180 : JAMRTC_COLLAPSED_HEIGHT);
+	return TRUE;
+}
+
+/* This function is called when a video tile is resized, to pick the right simulcast substream */
+static void jamrtc_video_resized(GtkWidget *widget, GtkAllocation *allocation, gpointer user_data) {
+	jamrtc_webrtc_set_video_width(GPOINTER_TO_UINT(user_data), allocation->width);
+}
+
 /* This function is called when the main window is closed */
 static void jamrtc_window_closed(GtkWidget *widget, GdkEvent *event, gpointer user_data) {
-	/* Simulate a SIGINT */
-	jamrtc_handle_signal(SIGINT);
+	jamrtc_stop();
+}
+
+/* Helper to initialize GTK and the UI */
+static GtkBuilder *jamrtc_gtk_setup(void) {
+	gtk_init(NULL, NULL);
+	GtkBuilder *builder = gtk_builder_new();
+	gtk_builder_add_from_file(builder, "JamRTC.glade", NULL);
+	gtk_builder_connect_signals(builder, NULL);
+	GtkWidget *window = GTK_WIDGET(gtk_builder_get_object(builder, "main_window"));
+	g_signal_connect(G_OBJECT(window), "delete-event", G_CALLBACK(jamrtc_window_closed), NULL);
+	g_signal_connect(G_OBJECT(window), "window-state-event", G_CALLBACK(jamrtc_window_state_changed), NULL);
+	/* Video tiles can be collapsed (and their subscriptions paused) with a double click */
+	guint slot = 0;
+	for(slot=0; slot<=4; slot++) {
+		char draw[100];
+		if(slot == 0)
+			g_snprintf(draw, sizeof(draw), "compositor_draw");
+		else
+			g_snprintf(draw, sizeof(draw), "user%u_videodraw", slot);
+		GtkWidget *widget = GTK_WIDGET(gtk_builder_get_object(builder, draw));
+		gtk_widget_add_events(widget, GDK_BUTTON_PRESS_MASK);
+		g_signal_connect(G_OBJECT(widget), "button-press-event", G_CALLBACK(jamrtc_video_clicked), GUINT_TO_POINTER(slot));
+		/* When not using the compositor, tile sizes drive the simulcast substream we ask for */
+		if(slot > 0 && !compositor)
+			g_signal_connect(G_OBJECT(widget), "size-allocate", G_CALLBACK(jamrtc_video_resized), GUINT_TO_POINTER(slot));
+	}
+	gtk_widget_show(window);
+	return builder;
 }
 
 /* Main application */
@@ -178,8 +339,8 @@ int main(int argc, char *argv[]) {
 		g_error_free(error);
 		exit(1);
 	}
-	/* If some arguments are missing, fail */
-	if(server_url == NULL || room_id == 0 || display == NULL) {
+	/* If some arguments are missing, fail (unless we're only benchmarking the playout) */
+	if(playout_bench == NULL && (server_url == NULL || room_id == 0 || display == NULL)) {
 		char *help = g_option_context_get_help(opts, TRUE, NULL);
 		g_print("%s", help);
 		g_free(help);
@@ -193,8 +354,28 @@ int main(int argc, char *argv[]) {
 		instrument = "unknown";
 	if(src_opts == NULL)
 		src_opts = "";
+	if(stats_interval == 0)
+		stats_interval = 5;
+	if(cpu_budget < 0)
+		cpu_budget = 50;
+	if(simulcast_ladder == NULL)
+		simulcast_ladder = "160x90@64,320x180@128,640x360@384";
 	if(latency > 1000)
 		JAMRTC_LOG(LOG_WARN, "Very high jitter-buffer latency configured (%u)\n", latency);
+	if(midi && no_jack) {
+		JAMRTC_LOG(LOG_FATAL, "MIDI instruments need JACK\n");
+		g_option_context_free(opts);
+		exit(1);
+	}
+	if(bundle && (midi || p2p)) {
+		JAMRTC_LOG(LOG_FATAL, "The bundle mode doesn't support MIDI instruments or peer-to-peer jams\n");
+		g_option_context_free(opts);
+		exit(1);
+	}
+	if(headless && compositor) {
+		JAMRTC_LOG(LOG_WARN, "Running headless, ignoring the compositor option\n");
+		compositor = FALSE;
+	}
 
 	/* Logging level: default is info and no timestamps */
 	if(jamrtc_log_level == 0)
@@ -204,9 +385,16 @@ int main(int argc, char *argv[]) {
 	else if(jamrtc_log_level > LOG_MAX)
 		jamrtc_log_level = LOG_MAX;
 
+	/* If we're only benchmarking the playout stage, do that and leave */
+	if(playout_bench != NULL) {
+		int res = jamrtc_playout_bench(playout_bench);
+		g_option_context_free(opts);
+		exit(res < 0 ? 1 : 0);
+	}
+
 	/* Handle SIGINT (CTRL-C), SIGTERM (from service managers) */
-	signal(SIGINT, jamrtc_handle_signal);
-	signal(SIGTERM, jamrtc_handle_signal);
+	g_unix_signal_add(SIGINT, jamrtc_handle_signal, NULL);
+	g_unix_signal_add(SIGTERM, jamrtc_handle_signal, NULL);
 
 	/* Start JamRTC */
 	JAMRTC_LOG(LOG_INFO, "\n---------------------------------\n");
@@ -217,19 +405,91 @@ int main(int argc, char *argv[]) {
 	JAMRTC_LOG(LOG_INFO, "VideoRoom ID:   %"SCNu64"\n", room_id);
 	JAMRTC_LOG(LOG_INFO, "Display name:   %s\n", display);
 	JAMRTC_LOG(LOG_INFO, "Videochat:      mic %s, webcam %s\n", no_mic ? "disabled" : "enabled", no_webcam ? "disabled" : "enabled");
-	if(!no_webcam)
+	if(!no_webcam) {
 		JAMRTC_LOG(LOG_INFO, "Video device:   %s\n", video_device);
+		if(simulcast)
+			JAMRTC_LOG(LOG_INFO, "Simulcast:      %s\n", simulcast_ladder);
+	}
 	if(no_instrument)
 		JAMRTC_LOG(LOG_INFO, "Instrument:     disabled\n");
 	else
-		JAMRTC_LOG(LOG_INFO, "Instrument:     %s (%s JACK input)\n", instrument, stereo ? "stereo" : "mono");
+		JAMRTC_LOG(LOG_INFO, "Instrument:     %s (%s JACK input)\n", instrument, midi ? "MIDI" : (stereo ? "stereo" : "mono"));
 	if(strlen(src_opts) > 0)
 		JAMRTC_LOG(LOG_INFO, "JACK capture:   %s\n", src_opts);
 	JAMRTC_LOG(LOG_INFO, "STUN server:    %s\n", stun_server ? stun_server : "(none)");
 	JAMRTC_LOG(LOG_INFO, "TURN server:    %s\n\n", turn_server ? turn_server : "(none)");
+	if(headless)
+		JAMRTC_LOG(LOG_INFO, "Video rendering: none (headless)\n\n");
+	else if(compositor)
+		JAMRTC_LOG(LOG_INFO, "Video rendering: single compositor\n\n");
+	if(metrics_port > 0)
+		JAMRTC_LOG(LOG_INFO, "Metrics:        port %u, sampled every %us\n\n", metrics_port, stats_interval);
+	if(record_folder != NULL)
+		JAMRTC_LOG(LOG_INFO, "Recording:      %s (%s)\n\n", record_folder, record_format ? record_format : "ogg");
+	if(no_stretch)
+		JAMRTC_LOG(LOG_INFO, "Playout:        no time-stretching\n\n");
+	if(jitter_traces != NULL)
+		JAMRTC_LOG(LOG_INFO, "Jitter traces:  %s\n\n", jitter_traces);
+	if(p2p)
+		JAMRTC_LOG(LOG_INFO, "Instruments:    peer-to-peer (duo jam)\n\n");
+	if(bundle)
+		JAMRTC_LOG(LOG_INFO, "Publishing:     single bundled PeerConnection\n\n");
+	if(trace_latency) {
+		JAMRTC_LOG(LOG_WARN, "Latency tracing enabled: this adds some overhead to all pipelines\n\n");
+		jamrtc_tracing_enable();
+	}
 	if(no_jack)
 		JAMRTC_LOG(LOG_WARN, "For testing purposes, we'll use autoaudiosrc/autoaudiosink, instead of jackaudiosrc/jackaudiosink\n\n");
 
+	/* Validate the webcam I/O mode */
+	if(jamrtc_capture_set_io_mode(video_io) < 0) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+
+	/* Validate the simulcast layers, if needed */
+	if(simulcast && !no_webcam && jamrtc_webrtc_set_simulcast(simulcast_ladder) < 0) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+
+	/* Start the metrics endpoint, if needed */
+	if(metrics_port > 0) {
+		if(jamrtc_stats_init(metrics_port) < 0) {
+			g_option_context_free(opts);
+			exit(1);
+		}
+	}
+	jamrtc_webrtc_set_stats_interval(stats_interval);
+	jamrtc_webrtc_set_p2p(p2p);
+	jamrtc_webrtc_set_dtx(!no_dtx);
+	jamrtc_webrtc_set_drift_correction(!no_drift);
+	if(bundle && jamrtc_webrtc_set_bundle(no_instrument ? NULL : instrument, stereo) < 0) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+	jamrtc_webrtc_set_registry_bench(bench_readers, bench_locked);
+
+	/* Prepare the recorder, if needed */
+	if(record_folder != NULL && jamrtc_recorder_init(record_folder, record_format) < 0) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+
+	/* Prepare the playout stage of the instruments we'll receive */
+	if(jamrtc_playout_init(!no_stretch, jitter_traces) < 0) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+
+	/* Degrade video when the CPU gets too busy, before audio suffers */
+	jamrtc_degrade_init(cpu_budget);
+	/* Throttle video when the network gets congested, for the same reason */
+	jamrtc_protect_init(!no_protection);
+	/* Check whether participants joining and leaving make us grow, if needed */
+	if(soak)
+		jamrtc_memory_soak_enable();
+
 	/* Initialize GStreamer */
 	gst_init(NULL, NULL);
 	/* Make sure our gstreamer dependency has all we need */
@@ -238,14 +498,45 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
-	/* Initialize GTK */
-	gtk_init(NULL, NULL);
-	GtkBuilder *builder = gtk_builder_new();
-	gtk_builder_add_from_file(builder, "JamRTC.glade", NULL);
-	gtk_builder_connect_signals(builder, NULL);
-	GtkWidget *window = GTK_WIDGET(gtk_builder_get_object(builder, "main_window"));
-	g_signal_connect(G_OBJECT(window), "delete-event", G_CALLBACK(jamrtc_window_closed), NULL);
-	gtk_widget_show(window);
+	/* Negotiate the capture mode with the webcam now, as it blocks for a while: this
+	 * way it doesn't delay the WebRTC loop, and if we're asked to measure the CPU
+	 * it saves, neither JACK nor any other pipeline are running in the meanwhile */
+	if(!no_webcam) {
+		guint width = 0, height = 0;
+		jamrtc_webrtc_webcam_resolution(&width, &height);
+		jamrtc_capture_prepare(video_device, width, height, capture_bench);
+	}
+
+	/* Keep an eye on JACK xruns, and on what may cause them */
+	if(!no_jack && jamrtc_jackmon_init() < 0)
+		JAMRTC_LOG(LOG_WARN, "JACK xruns won't be monitored\n");
+
+	/* Open the JACK MIDI client, to play (and capture, if needed) MIDI instruments */
+	if(!no_jack && jamrtc_midi_init(midi && !no_instrument) < 0) {
+		if(midi && !no_instrument) {
+			g_option_context_free(opts);
+			exit(1);
+		}
+		JAMRTC_LOG(LOG_WARN, "MIDI instruments from other participants won't be played\n");
+	}
+
+	/* From now on, have a dedicated thread write log lines, unless told otherwise */
+	if(!sync_log)
+		jamrtc_log_init();
+
+	/* If we're profiling mutexes, dump the worst offenders on SIGUSR1 too */
+	if(lock_profile)
+		g_unix_signal_add(SIGUSR1, jamrtc_lock_profile_signal, NULL);
+
+	/* Initialize GTK, unless we're running headless */
+	GtkBuilder *builder = NULL;
+	if(headless) {
+		/* When the WebRTC loop ends it still quits us via the default
+		 * context, so we need a loop to iterate it in place of gtk_main() */
+		headless_loop = g_main_loop_new(NULL, FALSE);
+	} else {
+		builder = jamrtc_gtk_setup();
+	}
 
 	/* Spawn a thread to initialize the WebRTC code */
 	(void)g_thread_try_new("jamrtc loop", jamrtc_loop_thread, builder, &error);
@@ -254,11 +545,18 @@ int main(int argc, char *argv[]) {
 			error->code, error->message ? error->message : "??");
 		g_option_context_free(opts);
 		gst_deinit();
+		jamrtc_log_cleanup();
 		exit(1);
 	}
 
-	/* Show the application */
-	gtk_main();
+	/* Show the application (or just wait, if headless) */
+	if(headless_loop != NULL) {
+		g_main_loop_run(headless_loop);
+		g_main_loop_unref(headless_loop);
+		headless_loop = NULL;
+	} else {
+		gtk_main();
+	}
 
 #ifdef REFCOUNT_DEBUG
 	/* Any reference counters that are still up while we're leaving? (debug-mode only) */
@@ -277,10 +575,25 @@ int main(int argc, char *argv[]) {
 	jamrtc_mutex_unlock(&counters_mutex);
 #endif
 
+	jamrtc_jackmon_cleanup();
+	jamrtc_stats_cleanup();
+	jamrtc_recorder_cleanup();
+	jamrtc_playout_cleanup();
+	jamrtc_capture_cleanup();
+	jamrtc_protect_cleanup();
+	jamrtc_midi_cleanup();
+	/* If we were tracing latency, print a summary */
+	jamrtc_tracing_report(TRUE);
+	jamrtc_tracing_cleanup();
+	/* If we were profiling mutexes, print the worst offenders */
+	jamrtc_mutex_profile_report(20);
+	/* If we were soak testing, check how it went */
+	int res = jamrtc_memory_soak_report();
 	g_option_context_free(opts);
 	gst_deinit();
 	JAMRTC_LOG(LOG_INFO, "\nBye!\n");
-	exit(0);
+	jamrtc_log_cleanup();
+	exit(res < 0 ? 1 : 0);
 }
 
 /* We connected to the Janus instance */
@@ -291,18 +604,23 @@ static void jamrtc_server_connected(void) {
 
 /* We lost the connection to the Janus instance */
 static void jamrtc_server_disconnected(void) {
-	/* Simulate a SIGINT */
-	jamrtc_handle_signal(SIGINT);
+	jamrtc_stop();
 }
 
 /* We successfully joined the room */
 static void jamrtc_joined_room(void) {
+	if(bundle) {
+		/* Everything we have goes in the same PeerConnection */
+		if(!no_mic || !no_webcam || !no_instrument)
+			jamrtc_webrtc_publish_micwebcam(no_mic, no_webcam, video_device);
+		return;
+	}
 	/* Check if we need to publish our mic/webcam */
 	if(!no_mic || !no_webcam)
 		jamrtc_webrtc_publish_micwebcam(no_mic, no_webcam, video_device);
 	/* Check if we need to publish our local instrument now */
 	if(!no_instrument)
-		jamrtc_webrtc_publish_instrument(instrument, stereo);
+		jamrtc_webrtc_publish_instrument(instrument, stereo, midi);
 }
 
 /* A new participant just joined the session */
@@ -320,8 +638,8 @@ static void jamrtc_stream_started(const char *uuid, const char *display, const c
 
 /* An existing stream for a remote participant just went away */
 static void jamrtc_stream_stopped(const char *uuid, const char *display, const char *instrument) {
-	/* TODO Unsubscribe */
 	JAMRTC_LOG(LOG_INFO, "Stream stopped (%s, %s, %s)\n", uuid, display, instrument);
+	jamrtc_webrtc_unsubscribe(uuid, instrument != NULL);
 }
 
 /* An existing participant just left the session */
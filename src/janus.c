@@ -0,0 +1,601 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+
+/* WebSockets */
+#include <libwebsockets.h>
+
+/* Local includes */
+#include "janus.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Janus API client: each client has its own WebSocket connection and Janus
+ * session, and keeps track of the transactions it's waiting a response for.
+ * What the handles are used for is up to the owner, which gets all messages
+ * (and the opaque pointer the related request was sent with, if any) via
+ * callbacks. libwebsockets isn't thread safe, so all connections share the
+ * same context, served by a single thread that also takes care of creating
+ * them: outgoing messages are queued, and sent when the connection is
+ * writable (which we're told about when the service loop is woken up) */
+struct jamrtc_janus {
+	char *name;					/* Name of this client (only used for logging) */
+	const jamrtc_janus_callbacks *cb;	/* Callbacks to notify the owner on */
+	gpointer user_data;			/* Opaque pointer to pass to the callbacks */
+	guint64 session_id;			/* Janus session ID */
+	struct lws *wsi;			/* The libwebsockets client instance */
+	char *incoming;				/* Buffer containing incoming data until it's complete */
+	unsigned char *buffer;		/* Buffer containing the message to send */
+	int buflen;					/* Length of the buffer (may be resized after re-allocations) */
+	int bufpending;				/* Data an interrupted previous write couldn't send */
+	int bufoffset;				/* Offset from where the interrupted previous write should resume */
+	GAsyncQueue *messages;		/* Queue of outgoing messages to push */
+	jamrtc_mutex mutex;			/* Mutex to lock/unlock the connection */
+	GHashTable *transactions;	/* Transactions we're waiting a response for */
+	jamrtc_mutex transactions_mutex;	/* Mutex to lock/unlock the transactions */
+};
+
+/* WebSocket properties */
+static char *server_url = NULL, *uri = NULL;
+static const char *protocol = NULL, *address = NULL, *path = NULL;
+static int port = 0;
+static struct lws_context *context = NULL;
+static GThread *ws_thread = NULL;
+static volatile gint stopping = 0;
+/* Clients waiting for their WebSocket connection, and all clients */
+static GAsyncQueue *connects = NULL;
+static GList *clients = NULL;
+static jamrtc_mutex clients_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+static int jamrtc_janus_ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+static struct lws_protocols protocols[] = {
+	{ "janus-protocol", jamrtc_janus_ws_callback, 0, 0 },
+	{ NULL, NULL, 0, 0 }
+};
+static const struct lws_extension exts[] = {
+#ifndef LWS_WITHOUT_EXTENSIONS
+	{ "permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_max_window_bits" },
+	{ "deflate-frame", lws_extension_callback_pm_deflate, "deflate_frame" },
+#endif
+	{ NULL, NULL, NULL }
+};
+
+
+/* Helper method to generate a random transaction string */
+static char *jamrtc_janus_random_transaction(char *transaction, size_t trlen) {
+	g_snprintf(transaction, trlen, "%"SCNu32, g_random_int());
+	return transaction;
+}
+
+/* Helper method to serialize a JsonObject to a string */
+char *jamrtc_janus_json_to_string(JsonObject *object) {
+	/* Make it the root node */
+	JsonNode *root = json_node_init_object(json_node_alloc(), object);
+	JsonGenerator *generator = json_generator_new();
+	json_generator_set_root(generator, root);
+	char *text = json_generator_to_data(generator, NULL);
+
+	/* Release everything */
+	g_object_unref(generator);
+	json_node_free(root);
+	return text;
+}
+
+/* Helper to wake up the WebSockets thread, e.g., because there's something to send */
+static void jamrtc_janus_wakeup(jamrtc_janus *janus) {
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+	if(context != NULL)
+		lws_cancel_service(context);
+#else
+	/* On libwebsockets < 3.x we use lws_callback_on_writable */
+	if(janus == NULL)
+		return;
+	jamrtc_mutex_lock(&janus->mutex);
+	if(janus->wsi != NULL)
+		lws_callback_on_writable(janus->wsi);
+	jamrtc_mutex_unlock(&janus->mutex);
+#endif
+}
+
+/* Parse the Janus address, and start the WebSockets thread */
+static gpointer jamrtc_janus_thread(gpointer data);
+int jamrtc_janus_init(const char *url) {
+	/* Validate the input (parsing the address modifies it, so we use a copy) */
+	uri = g_strdup(url);
+	if(url == NULL || lws_parse_uri(uri, &protocol, &address, &port, &path)) {
+		JAMRTC_LOG(LOG_FATAL, "Invalid Janus WebSocket address\n");
+		g_clear_pointer(&uri, g_free);
+		return -1;
+	}
+	if((strcasecmp(protocol, "ws") && strcasecmp(protocol, "wss")) || !strlen(address)) {
+		JAMRTC_LOG(LOG_FATAL, "Invalid Janus WebSocket address (only ws:// and wss:// addresses are supported)\n");
+		JAMRTC_LOG(LOG_FATAL, "  -- Protocol: %s\n", protocol);
+		JAMRTC_LOG(LOG_FATAL, "  -- Address:  %s\n", address);
+		JAMRTC_LOG(LOG_FATAL, "  -- Path:     %s\n", path);
+		g_clear_pointer(&uri, g_free);
+		return -1;
+	}
+	server_url = g_strdup(url);
+
+	/* Create the libwebsockets context all clients will share */
+	struct lws_context_creation_info info = { 0 };
+	info.port = CONTEXT_PORT_NO_LISTEN;
+	info.protocols = protocols;
+	info.gid = -1;
+	info.uid = -1;
+	if(!strcasecmp(protocol, "wss"))
+		info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+	context = lws_create_context(&info);
+	if(context == NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Creating libwebsocket context failed\n");
+		jamrtc_janus_cleanup();
+		return -1;
+	}
+	connects = g_async_queue_new();
+
+	/* Start a thread to handle the WebSockets event loop */
+	g_atomic_int_set(&stopping, 0);
+	GError *error = NULL;
+	ws_thread = g_thread_try_new("jamrtc ws", jamrtc_janus_thread, NULL, &error);
+	if(error != NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the Janus WebSocket client thread...\n",
+			error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		jamrtc_janus_cleanup();
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop the WebSockets thread, and close all connections */
+void jamrtc_janus_cleanup(void) {
+	g_atomic_int_set(&stopping, 1);
+	if(ws_thread != NULL) {
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+		lws_cancel_service(context);
+#endif
+		g_thread_join(ws_thread);
+		ws_thread = NULL;
+	}
+	if(context != NULL) {
+		lws_context_destroy(context);
+		context = NULL;
+	}
+	if(connects != NULL) {
+		g_async_queue_unref(connects);
+		connects = NULL;
+	}
+	g_clear_pointer(&server_url, g_free);
+	g_clear_pointer(&uri, g_free);
+}
+
+/* Create a new client, and connect it */
+jamrtc_janus *jamrtc_janus_connect(const char *name, const jamrtc_janus_callbacks *callbacks,
+		gpointer user_data, GDestroyNotify opaque_unref) {
+	if(context == NULL || callbacks == NULL)
+		return NULL;
+	jamrtc_janus *janus = g_malloc0(sizeof(jamrtc_janus));
+	janus->name = g_strdup(name ? name : "janus");
+	janus->cb = callbacks;
+	janus->user_data = user_data;
+	janus->messages = g_async_queue_new_full(g_free);
+	jamrtc_mutex_init(&janus->mutex);
+	janus->transactions = g_hash_table_new_full(g_str_hash, g_str_equal,
+		(GDestroyNotify)g_free, opaque_unref);
+	jamrtc_mutex_init(&janus->transactions_mutex);
+	jamrtc_mutex_lock(&clients_mutex);
+	clients = g_list_append(clients, janus);
+	jamrtc_mutex_unlock(&clients_mutex);
+	/* The WebSockets thread will take care of the connection */
+	JAMRTC_LOG(LOG_INFO, "[%s] Connecting to Janus: %s\n", janus->name, server_url);
+	g_async_queue_push(connects, janus);
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+	lws_cancel_service(context);
+#endif
+	return janus;
+}
+
+/* Get rid of a client */
+void jamrtc_janus_free(jamrtc_janus *janus) {
+	if(janus == NULL)
+		return;
+	jamrtc_mutex_lock(&clients_mutex);
+	clients = g_list_remove(clients, janus);
+	jamrtc_mutex_unlock(&clients_mutex);
+	jamrtc_mutex_lock(&janus->transactions_mutex);
+	g_hash_table_destroy(janus->transactions);
+	janus->transactions = NULL;
+	jamrtc_mutex_unlock(&janus->transactions_mutex);
+	g_async_queue_unref(janus->messages);
+	g_free(janus->incoming);
+	g_free(janus->buffer);
+	g_free(janus->name);
+	g_free(janus);
+}
+
+/* Get the ID of the Janus session of a client */
+guint64 jamrtc_janus_session_id(jamrtc_janus *janus) {
+	return janus ? janus->session_id : 0;
+}
+
+/* Send a Janus API request */
+void jamrtc_janus_send(jamrtc_janus *janus, JsonObject *msg, gpointer opaque) {
+	if(janus == NULL || msg == NULL) {
+		if(msg != NULL)
+			json_object_unref(msg);
+		return;
+	}
+	char transaction[12];
+	json_object_set_string_member(msg, "transaction",
+		jamrtc_janus_random_transaction(transaction, sizeof(transaction)));
+	if(janus->session_id != 0)
+		json_object_set_int_member(msg, "session_id", janus->session_id);
+	if(opaque != NULL) {
+		/* Track the task */
+		jamrtc_mutex_lock(&janus->transactions_mutex);
+		if(janus->transactions != NULL)
+			g_hash_table_insert(janus->transactions, g_strdup(transaction), opaque);
+		jamrtc_mutex_unlock(&janus->transactions_mutex);
+	}
+	char *text = jamrtc_janus_json_to_string(msg);
+	json_object_unref(msg);
+	/* Queue the request, the WebSockets thread will send it */
+	JAMRTC_LOG(LOG_VERB, "[%s] Sending message: %s\n", janus->name, text);
+	g_async_queue_push(janus->messages, text);
+	jamrtc_janus_wakeup(janus);
+}
+
+/* Attach a new handle to a plugin */
+void jamrtc_janus_attach(jamrtc_janus *janus, const char *plugin, gpointer opaque) {
+	JsonObject *attach = json_object_new();
+	json_object_set_string_member(attach, "janus", "attach");
+	json_object_set_string_member(attach, "plugin", plugin);
+	jamrtc_janus_send(janus, attach, opaque);
+}
+
+/* Send a message to the plugin a handle is attached to */
+void jamrtc_janus_message(jamrtc_janus *janus, guint64 handle_id,
+		JsonObject *body, JsonObject *jsep, gpointer opaque) {
+	JsonObject *msg = json_object_new();
+	json_object_set_string_member(msg, "janus", "message");
+	json_object_set_int_member(msg, "handle_id", handle_id);
+	json_object_set_object_member(msg, "body", body);
+	if(jsep != NULL)
+		json_object_set_object_member(msg, "jsep", jsep);
+	jamrtc_janus_send(janus, msg, opaque);
+}
+
+/* Trickle a candidate on a handle */
+void jamrtc_janus_trickle(jamrtc_janus *janus, guint64 handle_id, guint mlineindex, const char *candidate) {
+	JsonObject *trickle = json_object_new();
+	json_object_set_string_member(trickle, "janus", "trickle");
+	json_object_set_int_member(trickle, "handle_id", handle_id);
+	JsonObject *ice = json_object_new();
+	json_object_set_string_member(ice, "candidate", candidate);
+	json_object_set_int_member(ice, "sdpMLineIndex", mlineindex);
+	json_object_set_object_member(trickle, "candidate", ice);
+	jamrtc_janus_send(janus, trickle, NULL);
+}
+
+/* Detach a handle: we don't need to track the response */
+void jamrtc_janus_detach(jamrtc_janus *janus, guint64 handle_id) {
+	JsonObject *detach = json_object_new();
+	json_object_set_string_member(detach, "janus", "detach");
+	json_object_set_int_member(detach, "handle_id", handle_id);
+	jamrtc_janus_send(janus, detach, NULL);
+}
+
+/* Keep the session alive */
+void jamrtc_janus_keepalive(jamrtc_janus *janus) {
+	if(janus == NULL || janus->session_id == 0)
+		return;
+	JsonObject *keepalive = json_object_new();
+	json_object_set_string_member(keepalive, "janus", "keepalive");
+	jamrtc_janus_send(janus, keepalive, NULL);
+}
+
+/* Destroy the session */
+void jamrtc_janus_destroy(jamrtc_janus *janus) {
+	if(janus == NULL || janus->session_id == 0)
+		return;
+	JsonObject *destroy = json_object_new();
+	json_object_set_string_member(destroy, "janus", "destroy");
+	jamrtc_janus_send(janus, destroy, NULL);
+}
+
+/* Stop tracking the transactions associated with an opaque pointer */
+static gboolean jamrtc_janus_forget_transaction(gpointer key, gpointer value, gpointer user_data) {
+	return value == user_data;
+}
+void jamrtc_janus_forget(jamrtc_janus *janus, gpointer opaque) {
+	if(janus == NULL || opaque == NULL)
+		return;
+	jamrtc_mutex_lock(&janus->transactions_mutex);
+	if(janus->transactions != NULL)
+		g_hash_table_foreach_remove(janus->transactions, jamrtc_janus_forget_transaction, opaque);
+	jamrtc_mutex_unlock(&janus->transactions_mutex);
+}
+
+/* Get how many transactions we're still waiting a response for */
+guint jamrtc_janus_pending(jamrtc_janus *janus) {
+	if(janus == NULL)
+		return 0;
+	jamrtc_mutex_lock(&janus->transactions_mutex);
+	guint pending = janus->transactions ? g_hash_table_size(janus->transactions) : 0;
+	jamrtc_mutex_unlock(&janus->transactions_mutex);
+	return pending;
+}
+
+/* Handler for messages coming from Janus */
+static void jamrtc_janus_server_message(jamrtc_janus *janus, char *text) {
+	JAMRTC_LOG(LOG_VERB, "[%s] Got message: '%s'\n", janus->name, text);
+
+	/* Make sure the text we just received is valid JSON */
+	JsonParser *parser = json_parser_new();
+	if(!json_parser_load_from_data(parser, text, -1, NULL)) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Not JSON, ignoring... '%s'\n", janus->name, text);
+		g_object_unref(parser);
+		return;
+	}
+	JsonNode *root = json_parser_get_root(parser);
+	if(!JSON_NODE_HOLDS_OBJECT(root)) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Invalid JSON message, ignoring... '%s'\n", janus->name, text);
+		g_object_unref(parser);
+		return;
+	}
+	JsonObject *object = json_node_get_object(root);
+	const char *response = json_object_has_member(object, "janus") ?
+		json_object_get_string_member(object, "janus") : NULL;
+	if(response == NULL) {
+		JAMRTC_LOG(LOG_ERR, "[%s] No 'janus' field in the received message, ignoring...\n", janus->name);
+		g_object_unref(parser);
+		return;
+	}
+	if(!strcasecmp(response, "ack")) {
+		/* The actual response will come later, if any */
+		g_object_unref(parser);
+		return;
+	}
+
+	if(janus->session_id == 0) {
+		/* We don't have a session ID yet, so this must be a response to our "create" */
+		JsonObject *data = json_object_has_member(object, "data") ?
+			json_object_get_object_member(object, "data") : NULL;
+		if(strcasecmp(response, "success") || data == NULL || !json_object_has_member(data, "id")) {
+			janus->cb->disconnected(janus, "ERROR: no session ID", janus->user_data);
+			g_object_unref(parser);
+			return;
+		}
+		janus->session_id = json_object_get_int_member(data, "id");
+		JAMRTC_LOG(LOG_INFO, "[%s]  -- Session created: %"SCNu64"\n", janus->name, janus->session_id);
+		janus->cb->session_created(janus, janus->session_id, janus->user_data);
+		g_object_unref(parser);
+		return;
+	}
+
+	/* Check if this is a response to a transaction we're tracking: if so,
+	 * we stop tracking it, and release the opaque pointer when we're done */
+	gpointer key = NULL, opaque = NULL;
+	GDestroyNotify opaque_unref = NULL;
+	if(json_object_has_member(object, "transaction")) {
+		const char *transaction = json_object_get_string_member(object, "transaction");
+		jamrtc_mutex_lock(&janus->transactions_mutex);
+		if(transaction != NULL && janus->transactions != NULL &&
+				g_hash_table_steal_extended(janus->transactions, transaction, &key, &opaque)) {
+			opaque_unref = g_hash_table_get_value_destroy_func(janus->transactions);
+		}
+		jamrtc_mutex_unlock(&janus->transactions_mutex);
+		g_free(key);
+	}
+	janus->cb->message(janus, object, response, opaque, janus->user_data);
+	if(opaque != NULL && opaque_unref != NULL)
+		opaque_unref(opaque);
+	g_object_unref(parser);
+}
+
+/* Helper method to connect a client: must be called by the WebSockets thread */
+static void jamrtc_janus_connect_internal(jamrtc_janus *janus) {
+	struct lws_client_connect_info i = { 0 };
+	i.host = address;
+	i.origin = address;
+	i.address = address;
+	i.port = port;
+	char wspath[256];
+	g_snprintf(wspath, sizeof(wspath), "/%s", path);
+	i.path = wspath;
+	i.context = context;
+	if(!strcasecmp(protocol, "wss"))
+		i.ssl_connection = 1;
+	i.ietf_version_or_minus_one = -1;
+	i.client_exts = exts;
+	i.protocol = protocols[0].name;
+	i.userdata = janus;
+	if(lws_client_connect_via_info(&i) == NULL) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Error initializing WebSocket connection\n", janus->name);
+		janus->cb->disconnected(janus, "Error initializing WebSocket connection", janus->user_data);
+	}
+}
+
+/* Thread to implement the WebSockets loop */
+static gpointer jamrtc_janus_thread(gpointer data) {
+	JAMRTC_LOG(LOG_VERB, "Joining Janus WebSocket client thread\n");
+	jamrtc_janus *janus = NULL;
+	while(!g_atomic_int_get(&stopping)) {
+		/* libwebsockets isn't thread safe, so we connect clients here */
+		while((janus = g_async_queue_try_pop(connects)) != NULL)
+			jamrtc_janus_connect_internal(janus);
+		/* Loop until we have to stop */
+		lws_service(context, 50);
+	}
+	JAMRTC_LOG(LOG_VERB, "Leaving Janus WebSocket client thread\n");
+	return NULL;
+}
+
+/* Handler for all libwebsockets events */
+static int jamrtc_janus_ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+	jamrtc_janus *janus = (jamrtc_janus *)user;
+	switch(reason) {
+		case LWS_CALLBACK_CLIENT_ESTABLISHED: {
+			jamrtc_mutex_lock(&janus->mutex);
+			janus->wsi = wsi;
+			jamrtc_mutex_unlock(&janus->mutex);
+			JAMRTC_LOG(LOG_INFO, "[%s]  -- Connected to Janus\n", janus->name);
+			/* Let's create a Janus session now: we'll get a response asynchronously */
+			JAMRTC_LOG(LOG_INFO, "[%s] Creating a new Janus session\n", janus->name);
+			JsonObject *create = json_object_new();
+			json_object_set_string_member(create, "janus", "create");
+			jamrtc_janus_send(janus, create, NULL);
+			return 0;
+		}
+		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR: {
+			JAMRTC_LOG(LOG_ERR, "[%s] Error connecting to Janus\n", janus ? janus->name : "??");
+			if(janus != NULL && !g_atomic_int_get(&stopping))
+				janus->cb->disconnected(janus, "Error connecting to backend", janus->user_data);
+			return 1;
+		}
+		case LWS_CALLBACK_CLIENT_RECEIVE: {
+			/* Incoming data */
+			if(janus == NULL) {
+				JAMRTC_LOG(LOG_ERR, "Invalid WebSocket client instance...\n");
+				return 1;
+			}
+			/* Is this a new message, or part of a fragmented one? */
+			const size_t remaining = lws_remaining_packet_payload(wsi);
+			if(janus->incoming == NULL) {
+				JAMRTC_LOG(LOG_HUGE, "First fragment: %zu bytes, %zu remaining\n",
+					len, remaining);
+				janus->incoming = g_malloc(len+1);
+				memcpy(janus->incoming, in, len);
+				janus->incoming[len] = '\0';
+				JAMRTC_LOG(LOG_HUGE, "%s\n", janus->incoming);
+			} else {
+				size_t offset = strlen(janus->incoming);
+				JAMRTC_LOG(LOG_HUGE, "Appending fragment: offset %zu, %zu bytes, %zu remaining\n",
+					offset, len, remaining);
+				janus->incoming = g_realloc(janus->incoming, offset+len+1);
+				memcpy(janus->incoming+offset, in, len);
+				janus->incoming[offset+len] = '\0';
+				JAMRTC_LOG(LOG_HUGE, "%s\n", janus->incoming+offset);
+			}
+			if(remaining > 0 || !lws_is_final_fragment(wsi)) {
+				/* Still waiting for some more fragments */
+				JAMRTC_LOG(LOG_HUGE, "Waiting for more fragments\n");
+				return 0;
+			}
+			JAMRTC_LOG(LOG_HUGE, "Done, parsing message: %zu bytes\n", strlen(janus->incoming));
+			/* If we got here, the message is complete: process the message */
+			jamrtc_janus_server_message(janus, janus->incoming);
+			g_free(janus->incoming);
+			janus->incoming = NULL;
+			return 0;
+		}
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+		/* On libwebsockets >= 3.x, we use this event to mark connections as writable in the event loop */
+		case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+			jamrtc_mutex_lock(&clients_mutex);
+			GList *temp = clients;
+			while(temp) {
+				jamrtc_janus *client = (jamrtc_janus *)temp->data;
+				if(client->wsi != NULL && g_async_queue_length(client->messages) > 0)
+					lws_callback_on_writable(client->wsi);
+				temp = temp->next;
+			}
+			jamrtc_mutex_unlock(&clients_mutex);
+			return 0;
+		}
+#endif
+		case LWS_CALLBACK_CLIENT_WRITEABLE: {
+			if(janus == NULL || janus->wsi == NULL) {
+				JAMRTC_LOG(LOG_ERR, "Invalid WebSocket client instance...\n");
+				return -1;
+			}
+			if(g_atomic_int_get(&stopping))
+				return 0;
+			jamrtc_mutex_lock(&janus->mutex);
+			/* Check if we have a pending/partial write to complete first */
+			if(janus->buffer && janus->bufpending > 0 && janus->bufoffset > 0) {
+				JAMRTC_LOG(LOG_VERB, "[%s] Completing pending WebSocket write (still need to write last %d bytes)...\n",
+					janus->name, janus->bufpending);
+				int sent = lws_write(wsi, janus->buffer + janus->bufoffset, janus->bufpending, LWS_WRITE_TEXT);
+				JAMRTC_LOG(LOG_VERB, "[%s]  -- Sent %d/%d bytes\n", janus->name, sent, janus->bufpending);
+				if(sent > -1 && sent < janus->bufpending) {
+					/* We still couldn't send everything that was left, we'll try and complete this in the next round */
+					janus->bufpending -= sent;
+					janus->bufoffset += sent;
+				} else {
+					/* Clear the pending/partial write queue */
+					janus->bufpending = 0;
+					janus->bufoffset = 0;
+				}
+				/* Done for this round, check the next response/notification later */
+				lws_callback_on_writable(wsi);
+				jamrtc_mutex_unlock(&janus->mutex);
+				return 0;
+			}
+			/* Shoot the next pending message */
+			char *event = g_async_queue_try_pop(janus->messages);
+			if(event != NULL) {
+				/* Gotcha! */
+				int buflen = LWS_PRE + strlen(event);
+				if(janus->buffer == NULL || buflen > janus->buflen) {
+					/* We need a (larger) shared buffer */
+					JAMRTC_LOG(LOG_VERB, "[%s] Allocating %d bytes (was %d, event is %zu bytes)\n",
+						janus->name, buflen, janus->buflen, strlen(event));
+					janus->buflen = buflen;
+					janus->buffer = g_realloc(janus->buffer, buflen);
+				}
+				memcpy(janus->buffer + LWS_PRE, event, strlen(event));
+				JAMRTC_LOG(LOG_VERB, "[%s] Sending WebSocket message (%zu bytes)...\n", janus->name, strlen(event));
+				int sent = lws_write(wsi, janus->buffer + LWS_PRE, strlen(event), LWS_WRITE_TEXT);
+				JAMRTC_LOG(LOG_VERB, "[%s]  -- Sent %d/%zu bytes\n", janus->name, sent, strlen(event));
+				if(sent > -1 && sent < (int)strlen(event)) {
+					/* We couldn't send everything in a single write, we'll complete this in the next round */
+					janus->bufpending = strlen(event) - sent;
+					janus->bufoffset = LWS_PRE + sent;
+					JAMRTC_LOG(LOG_VERB, "[%s]  -- Couldn't write all bytes (%d missing), setting offset %d\n",
+						janus->name, janus->bufpending, janus->bufoffset);
+				}
+				/* We can get rid of the message */
+				g_free(event);
+				/* Done for this round, check the next response/notification later */
+				lws_callback_on_writable(wsi);
+			}
+			jamrtc_mutex_unlock(&janus->mutex);
+			return 0;
+		}
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+		case LWS_CALLBACK_CLIENT_CLOSED: {
+#else
+		case LWS_CALLBACK_CLOSED: {
+#endif
+			if(janus == NULL)
+				return 0;
+			JAMRTC_LOG(LOG_INFO, "[%s] Janus connection closed\n", janus->name);
+			jamrtc_mutex_lock(&janus->mutex);
+			janus->wsi = NULL;
+			/* Free the shared buffers */
+			g_free(janus->buffer);
+			janus->buffer = NULL;
+			janus->buflen = 0;
+			janus->bufpending = 0;
+			janus->bufoffset = 0;
+			jamrtc_mutex_unlock(&janus->mutex);
+			if(!g_atomic_int_get(&stopping))
+				janus->cb->disconnected(janus, "Janus connection closed", janus->user_data);
+			return 0;
+		}
+		default:
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_JANUS_H
+#define JAMRTC_JANUS_H
+
+/* GLib */
+#include <glib.h>
+
+/* JSON */
+#include <json-glib/json-glib.h>
+
+
+/* A Janus API client: a WebSocket connection to Janus, and the Janus
+ * session we create on it. All clients share the same libwebsockets
+ * context, and the same thread to serve it, so the same process can
+ * drive as many as it needs (e.g., the load generator) */
+typedef struct jamrtc_janus jamrtc_janus;
+
+/* Callbacks (all invoked on the WebSockets thread) */
+typedef struct jamrtc_janus_callbacks {
+	/* We have a Janus session we can attach handles to */
+	void (* const session_created)(jamrtc_janus *janus, guint64 session_id, gpointer user_data);
+	/* A message from Janus (acks are filtered out): if it's a response to
+	 * a request we sent with an opaque pointer, we pass that along too */
+	void (* const message)(jamrtc_janus *janus, JsonObject *object, const char *response,
+		gpointer opaque, gpointer user_data);
+	/* The connection failed or was closed, or we couldn't create a session
+	 * (not invoked when we're the ones tearing things down) */
+	void (* const disconnected)(jamrtc_janus *janus, const char *reason, gpointer user_data);
+} jamrtc_janus_callbacks;
+
+/* Parse the address of the Janus WebSockets backend, and start the thread
+ * serving the libwebsockets context all clients will share */
+int jamrtc_janus_init(const char *server_url);
+/* Stop the WebSockets thread and close all connections: clients are not
+ * notified, and must be freed after this, not before */
+void jamrtc_janus_cleanup(void);
+
+/* Create a new client and connect it to Janus: the session is created
+ * automatically as soon as we're connected. If opaque_unref is not NULL,
+ * it's invoked on the opaque pointers of tracked requests when done */
+jamrtc_janus *jamrtc_janus_connect(const char *name, const jamrtc_janus_callbacks *callbacks,
+	gpointer user_data, GDestroyNotify opaque_unref);
+/* Get rid of a client (see jamrtc_janus_cleanup) */
+void jamrtc_janus_free(jamrtc_janus *janus);
+/* Get the ID of the Janus session of a client (0 if we don't have one yet) */
+guint64 jamrtc_janus_session_id(jamrtc_janus *janus);
+
+/* Send a Janus API request (takes ownership of msg): a transaction and the
+ * session ID are added automatically, and if opaque is not NULL we track
+ * the transaction, passing opaque back when the response arrives (in which
+ * case the client takes ownership of a reference to it) */
+void jamrtc_janus_send(jamrtc_janus *janus, JsonObject *msg, gpointer opaque);
+/* Attach a new handle to a plugin: the handle ID is in the response */
+void jamrtc_janus_attach(jamrtc_janus *janus, const char *plugin, gpointer opaque);
+/* Send a message (and optionally a JSEP) to the plugin a handle is
+ * attached to (takes ownership of body and jsep) */
+void jamrtc_janus_message(jamrtc_janus *janus, guint64 handle_id,
+	JsonObject *body, JsonObject *jsep, gpointer opaque);
+/* Trickle a candidate on a handle */
+void jamrtc_janus_trickle(jamrtc_janus *janus, guint64 handle_id, guint mlineindex, const char *candidate);
+/* Detach a handle */
+void jamrtc_janus_detach(jamrtc_janus *janus, guint64 handle_id);
+/* Keep the session alive (does nothing if we don't have one yet) */
+void jamrtc_janus_keepalive(jamrtc_janus *janus);
+/* Destroy the session (does nothing if we don't have one yet) */
+void jamrtc_janus_destroy(jamrtc_janus *janus);
+
+/* Stop tracking all the transactions associated with an opaque pointer,
+ * e.g., because what it refers to is going away */
+void jamrtc_janus_forget(jamrtc_janus *janus, gpointer opaque);
+/* Get how many transactions we're still waiting a response for */
+guint jamrtc_janus_pending(jamrtc_janus *janus);
+
+/* Helper method to serialize a JsonObject to a string */
+char *jamrtc_janus_json_to_string(JsonObject *object);
+
+
+#endif
@@ -0,0 +1,798 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Synthetic participant load generator: spawns a configurable number of
+ * participants in the same process, each with its own Janus API client (see
+ * janus.c, the same JamRTC uses) and so its own WebSocket connection and
+ * Janus session, publishing audiotestsrc (and optionally videotestsrc)
+ * streams to the VideoRoom, and optionally subscribing to each other. It
+ * reports how long it took each participant to join, and how much CPU and
+ * memory the process needed as participants were added */
+
+/* Generic includes */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* GStreamer includes */
+#include <gst/gst.h>
+#include <gst/sdp/sdp.h>
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+
+/* WebSockets and JSON includes */
+#include <libwebsockets.h>
+#include <json-glib/json-glib.h>
+#include <glib-unix.h>
+
+/* Local includes */
+#include "janus.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Logging */
+int jamrtc_log_level = LOG_INFO;
+gboolean jamrtc_log_timestamps = FALSE;
+gboolean jamrtc_log_colors = TRUE;
+int lock_debug = 0;
+int lock_profile = 0;
+
+/* Command line options */
+static const char *server_url = NULL;
+static guint64 room_id = 0;
+static guint participants_num = 0, ramp = 0, report_interval = 0;
+static gint duration = -1;
+static gboolean subscribe = FALSE, video = FALSE, no_decode = FALSE;
+static const char *prefix = NULL, *stun_server = NULL;
+
+static GOptionEntry opt_entries[] = {
+	{ "ws", 'w', 0, G_OPTION_ARG_STRING, &server_url, "Address of the Janus WebSockets backend (e.g., ws://localhost:8188; required)", NULL },
+	{ "room", 'r', 0, G_OPTION_ARG_INT, &room_id, "Room to join (e.g., 1234; required)", NULL },
+	{ "participants", 'n', 0, G_OPTION_ARG_INT, &participants_num, "Number of synthetic participants to spawn (default: 4)", NULL },
+	{ "ramp", 'p', 0, G_OPTION_ARG_INT, &ramp, "How long to wait before spawning the next participant, in milliseconds (default: 1000)", NULL },
+	{ "duration", 'd', 0, G_OPTION_ARG_INT, &duration, "How long to keep all participants in the room once spawned, in seconds (default: 60, 0=until interrupted)", NULL },
+	{ "subscribe", 's', 0, G_OPTION_ARG_NONE, &subscribe, "Have synthetic participants subscribe to all the streams in the room (default: publish only)", NULL },
+	{ "video", 'V', 0, G_OPTION_ARG_NONE, &video, "Publish a videotestsrc stream too, besides audio (default: audio only)", NULL },
+	{ "no-decode", 'D', 0, G_OPTION_ARG_NONE, &no_decode, "Don't decode the streams we subscribe to, just drop the RTP packets (default: decode)", NULL },
+	{ "prefix", 'P', 0, G_OPTION_ARG_STRING, &prefix, "Prefix for the display names of synthetic participants (default: Synth)", NULL },
+	{ "stun-server", 'S', 0, G_OPTION_ARG_STRING, &stun_server, "STUN server to use, if any (hostname:port)", NULL },
+	{ "report-interval", 't', 0, G_OPTION_ARG_INT, &report_interval, "How often to log CPU and memory usage, in seconds (default: 5)", NULL },
+	{ "log-level", 'l', 0, G_OPTION_ARG_INT, &jamrtc_log_level, "Logging level (0=disable logging, 7=maximum log level; default: 4)", NULL },
+	{ NULL },
+};
+
+static GMainLoop *loop = NULL;
+
+/* Janus API callbacks */
+static void jamrtc_loadgen_session_created(jamrtc_janus *janus, guint64 session_id, gpointer user_data);
+static void jamrtc_loadgen_server_message(jamrtc_janus *janus, JsonObject *object, const char *response,
+	gpointer opaque, gpointer user_data);
+static void jamrtc_loadgen_disconnected(jamrtc_janus *janus, const char *reason, gpointer user_data);
+static const jamrtc_janus_callbacks janus_callbacks =
+	{
+		.session_created = jamrtc_loadgen_session_created,
+		.message = jamrtc_loadgen_server_message,
+		.disconnected = jamrtc_loadgen_disconnected,
+	};
+
+/* A PeerConnection of a synthetic participant, publisher or subscriber */
+typedef struct jamrtc_loadgen_participant jamrtc_loadgen_participant;
+typedef struct jamrtc_loadgen_pc {
+	jamrtc_loadgen_participant *participant;	/* Who this PeerConnection belongs to */
+	gboolean remote;			/* Whether this is a subscription */
+	guint64 handle_id;			/* Janus handle ID */
+	guint64 feed;				/* Publisher we're subscribed to, if remote */
+	GstElement *pipeline;		/* GStreamer pipeline */
+	GstElement *peerconnection;	/* webrtcbin element */
+	gint64 started;				/* When we started setting this PeerConnection up */
+	gint64 up;					/* When Janus told us this PeerConnection was up */
+} jamrtc_loadgen_pc;
+
+/* A synthetic participant */
+struct jamrtc_loadgen_participant {
+	guint index;				/* Index of this participant */
+	char *uuid;					/* Unique ID of this participant */
+	char *display;				/* Display name of this participant */
+	jamrtc_janus *janus;		/* Janus API client (WebSocket connection and session) */
+	guint64 user_id;			/* Our publisher ID in the VideoRoom */
+	guint64 private_id;			/* Our private ID in the VideoRoom */
+	jamrtc_loadgen_pc *publisher;	/* Our publisher PeerConnection */
+	GHashTable *subscriptions;	/* Our subscriptions, indexed by handle ID */
+	GHashTable *feeds;			/* Publishers we subscribed to already */
+	gint64 started;				/* When we started connecting */
+	gint64 joined;				/* When the VideoRoom told us we were in */
+	gint64 cpu_up, rss_up;		/* Process CPU time and resident memory when our publisher was up */
+	jamrtc_mutex mutex;			/* Mutex to lock/unlock this instance */
+};
+static GPtrArray *participants = NULL;
+static jamrtc_mutex participants_mutex = JAMRTC_MUTEX_INITIALIZER;
+static guint spawned = 0;
+
+/* Process CPU and memory since the previous report */
+static gint64 last_report_time = 0, last_report_cpu = 0;
+/* Process CPU and memory before the first participant was spawned */
+static gint64 ramp_cpu_start = 0, ramp_rss_start = 0;
+
+
+/* SIGINT/SIGTERM handler (dispatched on the main loop, so we can log safely) */
+static gboolean jamrtc_loadgen_handle_signal(gpointer user_data) {
+	JAMRTC_LOG(LOG_INFO, "Stopping the load generator...\n");
+	if(loop != NULL)
+		g_main_loop_quit(loop);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helper method to get the CPU time (user+system) consumed by the process so far, in microseconds */
+static gint64 jamrtc_loadgen_cpu_time(void) {
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0;
+	return (gint64)usage.ru_utime.tv_sec*G_USEC_PER_SEC + usage.ru_utime.tv_usec +
+		(gint64)usage.ru_stime.tv_sec*G_USEC_PER_SEC + usage.ru_stime.tv_usec;
+}
+
+/* Helper method to get the resident memory of the process, in KB */
+static gint64 jamrtc_loadgen_rss(void) {
+	FILE *file = fopen("/proc/self/statm", "r");
+	if(file == NULL)
+		return 0;
+	long size = 0, resident = 0;
+	if(fscanf(file, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(file);
+	return (gint64)resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Helper to duplicate a 64-bit integer, e.g., to use it as a hashtable key */
+static guint64 *jamrtc_uint64_dup(guint64 num) {
+	guint64 *numdup = g_malloc(sizeof(guint64));
+	*numdup = num;
+	return numdup;
+}
+
+/* Helper to attach a new handle to the VideoRoom plugin */
+static void jamrtc_loadgen_attach(jamrtc_loadgen_pc *pc) {
+	pc->started = g_get_monotonic_time();
+	jamrtc_janus_attach(pc->participant->janus, "janus.plugin.videoroom", pc);
+}
+
+/* Helper to create a new PeerConnection instance */
+static jamrtc_loadgen_pc *jamrtc_loadgen_pc_create(jamrtc_loadgen_participant *p, gboolean remote, guint64 feed) {
+	jamrtc_loadgen_pc *pc = g_malloc0(sizeof(jamrtc_loadgen_pc));
+	pc->participant = p;
+	pc->remote = remote;
+	pc->feed = feed;
+	return pc;
+}
+
+/* Helper to get rid of a PeerConnection instance */
+static void jamrtc_loadgen_pc_free(jamrtc_loadgen_pc *pc) {
+	if(pc == NULL)
+		return;
+	if(pc->pipeline != NULL) {
+		gst_element_set_state(pc->pipeline, GST_STATE_NULL);
+		if(pc->peerconnection != NULL)
+			gst_object_unref(pc->peerconnection);
+		gst_object_unref(pc->pipeline);
+	}
+	g_free(pc);
+}
+
+/* Callback invoked when we have an SDP offer or answer ready to be sent */
+static void jamrtc_loadgen_sdp_available(GstPromise *promise, gpointer user_data) {
+	jamrtc_loadgen_pc *pc = (jamrtc_loadgen_pc *)user_data;
+	jamrtc_loadgen_participant *p = pc->participant;
+	if(gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED)
+		return;
+	const char *type = pc->remote ? "answer" : "offer";
+	const GstStructure *reply = gst_promise_get_reply(promise);
+	GstWebRTCSessionDescription *offeranswer = NULL;
+	gst_structure_get(reply, type, GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offeranswer, NULL);
+	gst_promise_unref(promise);
+	if(offeranswer == NULL) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Error creating SDP %s\n", p->display, type);
+		return;
+	}
+
+	/* Set the local description locally */
+	promise = gst_promise_new();
+	g_signal_emit_by_name(pc->peerconnection, "set-local-description", offeranswer, promise);
+	gst_promise_interrupt(promise);
+	gst_promise_unref(promise);
+
+	/* Convert the SDP object to a string */
+	char *text = gst_sdp_message_as_text(offeranswer->sdp);
+	gst_webrtc_session_description_free(offeranswer);
+	/* Fix the SDP, as with max-bundle GStreamer will set 0 in m-line ports */
+	const char *old_string = "m=audio 0";
+	const char *new_string = "m=audio 9";
+	char *pos = strstr(text, old_string);
+	while(pos) {
+		memcpy(pos, new_string, strlen(new_string));
+		pos = strstr(pos + strlen(old_string), old_string);
+	}
+	JAMRTC_LOG(LOG_VERB, "[%s] Sending SDP %s\n", p->display, type);
+	JsonObject *sdp = json_object_new();
+	json_object_set_string_member(sdp, "type", type);
+	json_object_set_string_member(sdp, "sdp", text);
+	g_free(text);
+
+	/* Send the SDP to Janus */
+	JsonObject *req = json_object_new();
+	if(!pc->remote) {
+		/* We use the same stringified JSON display JamRTC uses */
+		JsonObject *info = json_object_new();
+		json_object_set_string_member(info, "uuid", p->uuid);
+		json_object_set_string_member(info, "display", p->display);
+		if(!video)
+			json_object_set_string_member(info, "instrument", "synthetic");
+		char *participant = jamrtc_janus_json_to_string(info);
+		json_object_unref(info);
+		/* Join and publish at the same time */
+		json_object_set_string_member(req, "request", "joinandconfigure");
+		json_object_set_string_member(req, "ptype", "publisher");
+		json_object_set_int_member(req, "room", room_id);
+		json_object_set_string_member(req, "display", participant);
+		json_object_set_boolean_member(req, "audio", TRUE);
+		json_object_set_boolean_member(req, "video", video);
+		g_free(participant);
+	} else {
+		json_object_set_string_member(req, "request", "start");
+	}
+	jamrtc_janus_message(p->janus, pc->handle_id, req, sdp, NULL);
+}
+
+/* Callback invoked when webrtcbin wants us to negotiate */
+static void jamrtc_loadgen_negotiation_needed(GstElement *element, gpointer user_data) {
+	jamrtc_loadgen_pc *pc = (jamrtc_loadgen_pc *)user_data;
+	GstPromise *promise = gst_promise_new_with_change_func(jamrtc_loadgen_sdp_available, pc, NULL);
+	g_signal_emit_by_name(pc->peerconnection, "create-offer", NULL, promise);
+}
+
+/* Callback invoked when a candidate to trickle becomes available */
+static void jamrtc_loadgen_trickle_candidate(GstElement *webrtc,
+		guint mlineindex, char *candidate, gpointer user_data) {
+	jamrtc_loadgen_pc *pc = (jamrtc_loadgen_pc *)user_data;
+	if(mlineindex != 0)
+		return;
+	jamrtc_janus_trickle(pc->participant->janus, pc->handle_id, mlineindex, candidate);
+}
+
+/* Callback invoked when a subscription has a new incoming stream */
+static void jamrtc_loadgen_incoming_stream(GstElement *webrtc, GstPad *pad, gpointer user_data) {
+	jamrtc_loadgen_pc *pc = (jamrtc_loadgen_pc *)user_data;
+	if(GST_PAD_DIRECTION(pad) != GST_PAD_SRC)
+		return;
+	/* We never render anything: we either decode and drop, or just drop */
+	GstElement *sink = NULL;
+	if(no_decode) {
+		sink = gst_element_factory_make("fakesink", NULL);
+		g_object_set(sink, "sync", FALSE, "async", FALSE, NULL);
+	} else {
+		GError *error = NULL;
+		sink = gst_parse_bin_from_description("decodebin ! fakesink sync=false async=false", TRUE, &error);
+		if(error != NULL) {
+			JAMRTC_LOG(LOG_ERR, "[%s] Error creating decoding bin: %s\n",
+				pc->participant->display, error->message);
+			g_error_free(error);
+			return;
+		}
+	}
+	gst_bin_add(GST_BIN(pc->pipeline), sink);
+	gst_element_sync_state_with_parent(sink);
+	GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+	if(gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Error linking incoming stream from feed %"SCNu64"\n",
+			pc->participant->display, pc->feed);
+	}
+	gst_object_unref(sinkpad);
+}
+
+/* Helper to create the pipeline for a PeerConnection */
+static gboolean jamrtc_loadgen_prepare_pipeline(jamrtc_loadgen_pc *pc) {
+	jamrtc_loadgen_participant *p = pc->participant;
+	if(!pc->remote) {
+		/* Publisher: we use test sources instead of JACK and v4l2 */
+		char stun[255], vsrc[512], gst_pipeline[2048];
+		stun[0] = '\0';
+		vsrc[0] = '\0';
+		if(stun_server != NULL)
+			g_snprintf(stun, sizeof(stun), "stun-server=stun://%s", stun_server);
+		if(video) {
+			g_snprintf(vsrc, sizeof(vsrc), "videotestsrc is-live=true pattern=ball ! "
+				"video/x-raw,width=320,height=180,framerate=15/1 ! videoconvert ! "
+				"queue ! vp8enc deadline=1 cpu-used=10 target-bitrate=128000 ! "
+				"rtpvp8pay pt=96 ! queue ! application/x-rtp,media=video,encoding-name=VP8,payload=96 ! pc.");
+		}
+		/* Each participant plays a different note, to tell them apart when listening */
+		g_snprintf(gst_pipeline, sizeof(gst_pipeline), "webrtcbin name=pc bundle-policy=%d %s %s "
+			"audiotestsrc is-live=true freq=%u ! audio/x-raw,channels=1 ! "
+			"audioconvert ! audioresample ! audio/x-raw,channels=1,rate=48000 ! "
+			"queue ! opusenc bitrate=20000 ! "
+			"rtpopuspay pt=111 ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111 ! pc.",
+			video ? 3 : 0, stun, vsrc, 220 + 55*(p->index % 16));
+		JAMRTC_LOG(LOG_VERB, "[%s] Initializing the GStreamer pipeline:\n  -- %s\n", p->display, gst_pipeline);
+		GError *error = NULL;
+		pc->pipeline = gst_parse_launch(gst_pipeline, &error);
+		if(error != NULL) {
+			JAMRTC_LOG(LOG_ERR, "[%s] Failed to parse/launch the pipeline: %s\n", p->display, error->message);
+			g_error_free(error);
+			return FALSE;
+		}
+		pc->peerconnection = gst_bin_get_by_name(GST_BIN(pc->pipeline), "pc");
+		g_signal_connect(pc->peerconnection, "on-negotiation-needed", G_CALLBACK(jamrtc_loadgen_negotiation_needed), pc);
+	} else {
+		/* Subscription: we just create the webrtcbin element for the moment */
+		pc->pipeline = gst_pipeline_new(NULL);
+		pc->peerconnection = gst_element_factory_make("webrtcbin", NULL);
+		g_object_set(pc->peerconnection, "bundle-policy", 3, NULL);
+		if(stun_server != NULL) {
+			char stun[255];
+			g_snprintf(stun, sizeof(stun), "stun://%s", stun_server);
+			g_object_set(pc->peerconnection, "stun-server", stun, NULL);
+		}
+		gst_bin_add(GST_BIN(pc->pipeline), gst_object_ref(pc->peerconnection));
+		g_signal_connect(pc->peerconnection, "pad-added", G_CALLBACK(jamrtc_loadgen_incoming_stream), pc);
+	}
+	g_signal_connect(pc->peerconnection, "on-ice-candidate", G_CALLBACK(jamrtc_loadgen_trickle_candidate), pc);
+	/* Start the pipeline */
+	gst_element_set_state(pc->pipeline, GST_STATE_READY);
+	gst_element_set_state(pc->pipeline, GST_STATE_PLAYING);
+	return TRUE;
+}
+
+/* Helper to subscribe to all the publishers in a list we're not subscribed to yet */
+static void jamrtc_loadgen_subscribe(jamrtc_loadgen_participant *p, JsonArray *publishers) {
+	if(!subscribe || publishers == NULL)
+		return;
+	guint i = 0;
+	for(i=0; i<json_array_get_length(publishers); i++) {
+		JsonObject *publisher = json_array_get_object_element(publishers, i);
+		guint64 feed = json_object_get_int_member(publisher, "id");
+		if(feed == 0 || feed == p->user_id)
+			continue;
+		jamrtc_mutex_lock(&p->mutex);
+		if(g_hash_table_contains(p->feeds, &feed)) {
+			jamrtc_mutex_unlock(&p->mutex);
+			continue;
+		}
+		g_hash_table_add(p->feeds, jamrtc_uint64_dup(feed));
+		jamrtc_mutex_unlock(&p->mutex);
+		JAMRTC_LOG(LOG_VERB, "[%s] Subscribing to feed %"SCNu64"\n", p->display, feed);
+		jamrtc_loadgen_attach(jamrtc_loadgen_pc_create(p, TRUE, feed));
+	}
+}
+
+/* Helper to find the PeerConnection a Janus event is about */
+static jamrtc_loadgen_pc *jamrtc_loadgen_find_pc(jamrtc_loadgen_participant *p, guint64 sender) {
+	if(p->publisher != NULL && p->publisher->handle_id == sender)
+		return p->publisher;
+	jamrtc_mutex_lock(&p->mutex);
+	jamrtc_loadgen_pc *pc = g_hash_table_lookup(p->subscriptions, &sender);
+	jamrtc_mutex_unlock(&p->mutex);
+	return pc;
+}
+
+/* Helper to handle a JSEP offer or answer from Janus */
+static void jamrtc_loadgen_handle_jsep(jamrtc_loadgen_pc *pc, JsonObject *jsep) {
+	const char *sdptype = json_object_get_string_member(jsep, "type");
+	const char *text = json_object_get_string_member(jsep, "sdp");
+	if(sdptype == NULL || text == NULL || pc->peerconnection == NULL)
+		return;
+	gboolean offer = !strcasecmp(sdptype, "offer");
+	GstSDPMessage *sdp = NULL;
+	gst_sdp_message_new(&sdp);
+	if(gst_sdp_message_parse_buffer((guint8 *)text, strlen(text), sdp) != GST_SDP_OK) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Error parsing SDP %s\n", pc->participant->display, sdptype);
+		gst_sdp_message_free(sdp);
+		return;
+	}
+	GstWebRTCSessionDescription *gst_sdp = gst_webrtc_session_description_new(
+		offer ? GST_WEBRTC_SDP_TYPE_OFFER : GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+	GstPromise *promise = gst_promise_new();
+	g_signal_emit_by_name(pc->peerconnection, "set-remote-description", gst_sdp, promise);
+	gst_promise_interrupt(promise);
+	gst_promise_unref(promise);
+	gst_webrtc_session_description_free(gst_sdp);
+	if(offer && pc->remote) {
+		/* We need to prepare an SDP answer */
+		promise = gst_promise_new_with_change_func(jamrtc_loadgen_sdp_available, pc, NULL);
+		g_signal_emit_by_name(pc->peerconnection, "create-answer", NULL, promise);
+	}
+}
+
+/* Callback invoked when the Janus session of a participant has been created */
+static void jamrtc_loadgen_session_created(jamrtc_janus *janus, guint64 session_id, gpointer user_data) {
+	jamrtc_loadgen_participant *p = (jamrtc_loadgen_participant *)user_data;
+	JAMRTC_LOG(LOG_VERB, "[%s] Session created: %"SCNu64"\n", p->display, session_id);
+	/* Attach the publisher handle */
+	p->publisher = jamrtc_loadgen_pc_create(p, FALSE, 0);
+	jamrtc_loadgen_attach(p->publisher);
+}
+
+/* Callback invoked when a participant lost its connection to Janus, or couldn't create a session */
+static void jamrtc_loadgen_disconnected(jamrtc_janus *janus, const char *reason, gpointer user_data) {
+	jamrtc_loadgen_participant *p = (jamrtc_loadgen_participant *)user_data;
+	JAMRTC_LOG(LOG_ERR, "[%s] %s\n", p->display, reason);
+}
+
+/* Handler for messages coming from Janus for a participant: if it's a
+ * response to one of our "attach" requests, we get the PeerConnection too */
+static void jamrtc_loadgen_server_message(jamrtc_janus *janus, JsonObject *object, const char *response,
+		gpointer opaque, gpointer user_data) {
+	jamrtc_loadgen_participant *p = (jamrtc_loadgen_participant *)user_data;
+	jamrtc_loadgen_pc *pc = (jamrtc_loadgen_pc *)opaque;
+	if(!strcasecmp(response, "error")) {
+		JsonObject *err = json_object_get_object_member(object, "error");
+		JAMRTC_LOG(LOG_ERR, "[%s] Got a Janus API error: %"SCNi64" (%s)\n", p->display,
+			json_object_get_int_member(err, "code"), json_object_get_string_member(err, "reason"));
+	} else if(!strcasecmp(response, "success") && pc != NULL && pc->handle_id == 0) {
+		/* Response to one of our "attach" requests */
+		JsonObject *data = json_object_get_object_member(object, "data");
+		pc->handle_id = json_object_get_int_member(data, "id");
+		if(!pc->remote) {
+			/* Prepare the pipeline: we'll join when the offer is ready */
+			jamrtc_loadgen_prepare_pipeline(pc);
+		} else {
+			jamrtc_mutex_lock(&p->mutex);
+			g_hash_table_insert(p->subscriptions, jamrtc_uint64_dup(pc->handle_id), pc);
+			jamrtc_mutex_unlock(&p->mutex);
+			if(jamrtc_loadgen_prepare_pipeline(pc)) {
+				JsonObject *req = json_object_new();
+				json_object_set_string_member(req, "request", "join");
+				json_object_set_string_member(req, "ptype", "subscriber");
+				json_object_set_int_member(req, "room", room_id);
+				json_object_set_int_member(req, "feed", pc->feed);
+				json_object_set_int_member(req, "private_id", p->private_id);
+				jamrtc_janus_message(janus, pc->handle_id, req, NULL, NULL);
+			}
+		}
+	} else if(json_object_has_member(object, "sender")) {
+		/* Event related to one of our handles */
+		guint64 sender = json_object_get_int_member(object, "sender");
+		pc = jamrtc_loadgen_find_pc(p, sender);
+		if(pc == NULL)
+			return;
+		if(!strcasecmp(response, "event")) {
+			JsonObject *plugindata = json_object_get_object_member(object, "plugindata");
+			JsonObject *data = plugindata ? json_object_get_object_member(plugindata, "data") : NULL;
+			if(data != NULL && json_object_has_member(data, "error")) {
+				JAMRTC_LOG(LOG_ERR, "[%s] Got a VideoRoom error: %"SCNi64" (%s)\n", p->display,
+					json_object_get_int_member(data, "error_code"), json_object_get_string_member(data, "error"));
+			} else if(data != NULL && pc == p->publisher) {
+				const char *event = json_object_get_string_member(data, "videoroom");
+				if(event != NULL && !strcasecmp(event, "joined")) {
+					p->user_id = json_object_get_int_member(data, "id");
+					p->private_id = json_object_get_int_member(data, "private_id");
+					p->joined = g_get_monotonic_time();
+					JAMRTC_LOG(LOG_INFO, "[%s] Joined the room in %"SCNi64"ms\n",
+						p->display, (p->joined - p->started)/1000);
+				}
+				if(json_object_has_member(data, "publishers"))
+					jamrtc_loadgen_subscribe(p, json_object_get_array_member(data, "publishers"));
+			}
+			if(json_object_has_member(object, "jsep"))
+				jamrtc_loadgen_handle_jsep(pc, json_object_get_object_member(object, "jsep"));
+		} else if(!strcasecmp(response, "trickle")) {
+			JsonObject *candidate = json_object_get_object_member(object, "candidate");
+			if(candidate != NULL && json_object_has_member(candidate, "candidate")) {
+				g_signal_emit_by_name(pc->peerconnection, "add-ice-candidate",
+					(guint)json_object_get_int_member(candidate, "sdpMLineIndex"),
+					json_object_get_string_member(candidate, "candidate"));
+			}
+		} else if(!strcasecmp(response, "webrtcup")) {
+			pc->up = g_get_monotonic_time();
+			if(pc == p->publisher) {
+				p->cpu_up = jamrtc_loadgen_cpu_time();
+				p->rss_up = jamrtc_loadgen_rss();
+				JAMRTC_LOG(LOG_INFO, "[%s] Publishing after %"SCNi64"ms\n",
+					p->display, (pc->up - p->started)/1000);
+			} else {
+				JAMRTC_LOG(LOG_VERB, "[%s] Subscribed to feed %"SCNu64" in %"SCNi64"ms\n",
+					p->display, pc->feed, (pc->up - pc->started)/1000);
+			}
+		} else if(!strcasecmp(response, "hangup")) {
+			JAMRTC_LOG(LOG_WARN, "[%s] PeerConnection %s down (%s)\n", p->display,
+				pc->remote ? "subscription" : "publisher", json_object_get_string_member(object, "reason"));
+		}
+	}
+}
+
+/* Helper to create a new synthetic participant */
+static jamrtc_loadgen_participant *jamrtc_loadgen_participant_create(guint index) {
+	jamrtc_loadgen_participant *p = g_malloc0(sizeof(jamrtc_loadgen_participant));
+	p->index = index;
+	p->uuid = g_uuid_string_random();
+	p->display = g_strdup_printf("%s%u", prefix, index);
+	p->subscriptions = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_loadgen_pc_free);
+	p->feeds = g_hash_table_new_full(g_int64_hash, g_int64_equal, (GDestroyNotify)g_free, NULL);
+	jamrtc_mutex_init(&p->mutex);
+	return p;
+}
+
+/* Helper to get rid of a synthetic participant */
+static void jamrtc_loadgen_participant_free(jamrtc_loadgen_participant *p) {
+	if(p == NULL)
+		return;
+	jamrtc_janus_free(p->janus);
+	jamrtc_loadgen_pc_free(p->publisher);
+	g_hash_table_destroy(p->subscriptions);
+	g_hash_table_destroy(p->feeds);
+	g_free(p->uuid);
+	g_free(p->display);
+	g_free(p);
+}
+
+/* Timer callback to keep all Janus sessions alive */
+static gboolean jamrtc_loadgen_keepalive(gpointer user_data) {
+	jamrtc_mutex_lock(&participants_mutex);
+	guint i = 0;
+	for(i=0; i<participants->len; i++) {
+		jamrtc_loadgen_participant *p = g_ptr_array_index(participants, i);
+		jamrtc_janus_keepalive(p->janus);
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Timer callback to log the process CPU and memory usage so far */
+static gboolean jamrtc_loadgen_report(gpointer user_data) {
+	gint64 now = g_get_monotonic_time(), cpu = jamrtc_loadgen_cpu_time();
+	double usage = last_report_time ? 100.0 * (cpu - last_report_cpu) / (now - last_report_time) : 0.0;
+	last_report_time = now;
+	last_report_cpu = cpu;
+	guint up = 0, subs = 0, subs_up = 0, i = 0;
+	jamrtc_mutex_lock(&participants_mutex);
+	for(i=0; i<participants->len; i++) {
+		jamrtc_loadgen_participant *p = g_ptr_array_index(participants, i);
+		if(p->publisher != NULL && p->publisher->up > 0)
+			up++;
+		jamrtc_mutex_lock(&p->mutex);
+		GHashTableIter iter;
+		gpointer value = NULL;
+		g_hash_table_iter_init(&iter, p->subscriptions);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			subs++;
+			if(((jamrtc_loadgen_pc *)value)->up > 0)
+				subs_up++;
+		}
+		jamrtc_mutex_unlock(&p->mutex);
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	gint64 rss = jamrtc_loadgen_rss();
+	JAMRTC_LOG(LOG_INFO, "%u/%u participants publishing, %u/%u subscriptions up, CPU %.1f%% (%.1f%%/participant), RSS %"SCNi64"KB (%"SCNi64"KB/participant)\n",
+		up, spawned, subs_up, subs, usage, up ? usage/up : 0.0, rss, up ? rss/up : 0);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helper to sort participants by when their publisher came up */
+static gint jamrtc_loadgen_ramp_compare(gconstpointer a, gconstpointer b) {
+	jamrtc_loadgen_participant *pa = *(jamrtc_loadgen_participant **)a;
+	jamrtc_loadgen_participant *pb = *(jamrtc_loadgen_participant **)b;
+	if(pa->publisher->up < pb->publisher->up)
+		return -1;
+	return pa->publisher->up > pb->publisher->up ? 1 : 0;
+}
+
+/* Helper to log the per-participant summary at the end of the test */
+static void jamrtc_loadgen_summary(void) {
+	JAMRTC_LOG(LOG_INFO, "Per-participant summary:\n");
+	JAMRTC_LOG(LOG_INFO, "  %-12s %8s %8s %10s %12s\n",
+		"participant", "join", "publish", "subs", "sub setup");
+	guint i = 0, joined = 0, published = 0;
+	gint64 join_total = 0, publish_total = 0;
+	GPtrArray *ramp = g_ptr_array_new();
+	for(i=0; i<participants->len; i++) {
+		jamrtc_loadgen_participant *p = g_ptr_array_index(participants, i);
+		char join[20], publish[20], subs[20], setup[20];
+		g_snprintf(join, sizeof(join), "-");
+		g_snprintf(publish, sizeof(publish), "-");
+		g_snprintf(setup, sizeof(setup), "-");
+		if(p->joined > 0) {
+			joined++;
+			join_total += p->joined - p->started;
+			g_snprintf(join, sizeof(join), "%"SCNi64"ms", (p->joined - p->started)/1000);
+		}
+		if(p->publisher != NULL && p->publisher->up > 0) {
+			published++;
+			publish_total += p->publisher->up - p->started;
+			g_snprintf(publish, sizeof(publish), "%"SCNi64"ms", (p->publisher->up - p->started)/1000);
+			g_ptr_array_add(ramp, p);
+		}
+		guint num = 0, num_up = 0;
+		gint64 setup_total = 0;
+		GHashTableIter iter;
+		gpointer value = NULL;
+		jamrtc_mutex_lock(&p->mutex);
+		g_hash_table_iter_init(&iter, p->subscriptions);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			jamrtc_loadgen_pc *pc = (jamrtc_loadgen_pc *)value;
+			num++;
+			if(pc->up > 0) {
+				num_up++;
+				setup_total += pc->up - pc->started;
+			}
+		}
+		jamrtc_mutex_unlock(&p->mutex);
+		g_snprintf(subs, sizeof(subs), "%u/%u", num_up, num);
+		if(num_up > 0)
+			g_snprintf(setup, sizeof(setup), "%"SCNi64"ms", setup_total/num_up/1000);
+		JAMRTC_LOG(LOG_INFO, "  %-12s %8s %8s %10s %12s\n",
+			p->display, join, publish, subs, setup);
+	}
+	if(joined > 0) {
+		JAMRTC_LOG(LOG_INFO, "Average join time: %"SCNi64"ms (%u/%u participants joined)\n",
+			join_total/joined/1000, joined, participants->len);
+	}
+	if(published > 0) {
+		JAMRTC_LOG(LOG_INFO, "Average time to publish: %"SCNi64"ms (%u/%u participants published)\n",
+			publish_total/published/1000, published, participants->len);
+	}
+	/* CPU and memory are only known for the process as a whole, so rather
+	 * than per participant, we report them for each step of the ramp, i.e.,
+	 * when going from N-1 to N publishers, in the order they came up */
+	if(ramp->len == 0) {
+		g_ptr_array_free(ramp, TRUE);
+		return;
+	}
+	g_ptr_array_sort(ramp, jamrtc_loadgen_ramp_compare);
+	JAMRTC_LOG(LOG_INFO, "Process-wide cost per ramp step:\n");
+	JAMRTC_LOG(LOG_INFO, "  %-12s %10s %10s %12s %10s\n",
+		"publishing", "CPU", "CPU step", "RSS", "RSS step");
+	gint64 prev_cpu = ramp_cpu_start, prev_rss = ramp_rss_start;
+	for(i=0; i<ramp->len; i++) {
+		jamrtc_loadgen_participant *p = g_ptr_array_index(ramp, i);
+		char step[20], cpu[20], cpu_step[20], rss[20], rss_step[20];
+		g_snprintf(step, sizeof(step), "%u", i+1);
+		g_snprintf(cpu, sizeof(cpu), "%"SCNi64"ms", (p->cpu_up - ramp_cpu_start)/1000);
+		g_snprintf(cpu_step, sizeof(cpu_step), "+%"SCNi64"ms", (p->cpu_up - prev_cpu)/1000);
+		g_snprintf(rss, sizeof(rss), "%"SCNi64"KB", p->rss_up);
+		g_snprintf(rss_step, sizeof(rss_step), "%+"SCNi64"KB", p->rss_up - prev_rss);
+		JAMRTC_LOG(LOG_INFO, "  %-12s %10s %10s %12s %10s\n",
+			step, cpu, cpu_step, rss, rss_step);
+		prev_cpu = p->cpu_up;
+		prev_rss = p->rss_up;
+	}
+	g_ptr_array_free(ramp, TRUE);
+}
+
+/* Timer callback to stop the test */
+static gboolean jamrtc_loadgen_done(gpointer user_data) {
+	JAMRTC_LOG(LOG_INFO, "Test completed\n");
+	g_main_loop_quit(loop);
+	return G_SOURCE_REMOVE;
+}
+
+/* Timer callback to spawn the next participant */
+static gboolean jamrtc_loadgen_spawn(gpointer user_data) {
+	jamrtc_loadgen_participant *p = jamrtc_loadgen_participant_create(spawned+1);
+	jamrtc_mutex_lock(&participants_mutex);
+	g_ptr_array_add(participants, p);
+	spawned++;
+	/* The WebSockets thread will take care of the connection */
+	p->started = g_get_monotonic_time();
+	if(spawned == 1) {
+		ramp_cpu_start = jamrtc_loadgen_cpu_time();
+		ramp_rss_start = jamrtc_loadgen_rss();
+	}
+	p->janus = jamrtc_janus_connect(p->display, &janus_callbacks, p, NULL);
+	jamrtc_mutex_unlock(&participants_mutex);
+	if(spawned < participants_num)
+		return G_SOURCE_CONTINUE;
+	/* We're done spawning participants */
+	JAMRTC_LOG(LOG_INFO, "All %u participants spawned\n", spawned);
+	if(duration > 0)
+		g_timeout_add_seconds(duration, jamrtc_loadgen_done, NULL);
+	return G_SOURCE_REMOVE;
+}
+
+/* Main application */
+int main(int argc, char *argv[]) {
+
+	/* Parse the command-line arguments */
+	GError *error = NULL;
+	GOptionContext *opts = g_option_context_new("-- Synthetic participants for JamRTC load testing");
+	g_option_context_set_help_enabled(opts, TRUE);
+	g_option_context_add_main_entries(opts, opt_entries, NULL);
+	if(!g_option_context_parse(opts, &argc, &argv, &error)) {
+		g_error_free(error);
+		exit(1);
+	}
+	/* If some arguments are missing, fail */
+	if(server_url == NULL || room_id == 0) {
+		char *help = g_option_context_get_help(opts, TRUE, NULL);
+		g_print("%s", help);
+		g_free(help);
+		g_option_context_free(opts);
+		exit(1);
+	}
+	/* Assign some defaults */
+	if(participants_num == 0)
+		participants_num = 4;
+	if(ramp == 0)
+		ramp = 1000;
+	if(report_interval == 0)
+		report_interval = 5;
+	if(prefix == NULL)
+		prefix = "Synth";
+	if(duration < 0)
+		duration = 60;
+	/* Logging level: default is info and no timestamps */
+	if(jamrtc_log_level == 0)
+		jamrtc_log_level = LOG_INFO;
+	if(jamrtc_log_level < LOG_NONE)
+		jamrtc_log_level = 0;
+	else if(jamrtc_log_level > LOG_MAX)
+		jamrtc_log_level = LOG_MAX;
+
+	JAMRTC_LOG(LOG_INFO, "\n----------------------------------\n");
+	JAMRTC_LOG(LOG_INFO, "JamRTC synthetic load generator\n");
+	JAMRTC_LOG(LOG_INFO, "----------------------------------\n\n");
+	JAMRTC_LOG(LOG_INFO, "Janus backend: %s (room %"SCNu64")\n", server_url, room_id);
+	JAMRTC_LOG(LOG_INFO, "Participants:  %u (one every %ums, %s)\n", participants_num, ramp,
+		video ? "audio+video" : "audio only");
+	JAMRTC_LOG(LOG_INFO, "Subscribing:   %s\n", subscribe ? (no_decode ? "yes (no decoding)" : "yes") : "no");
+	if(duration > 0)
+		JAMRTC_LOG(LOG_INFO, "Duration:      %ds\n\n", duration);
+	else
+		JAMRTC_LOG(LOG_INFO, "Duration:      until interrupted\n\n");
+
+	/* Handle SIGINT (CTRL-C), SIGTERM (from service managers) */
+	g_unix_signal_add(SIGINT, jamrtc_loadgen_handle_signal, NULL);
+	g_unix_signal_add(SIGTERM, jamrtc_loadgen_handle_signal, NULL);
+
+	/* Initialize GStreamer */
+	gst_init(NULL, NULL);
+	lws_set_log_level(0, NULL);
+
+	/* Start the WebSockets stack all participants will share */
+	if(jamrtc_janus_init(server_url) < 0) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+	participants = g_ptr_array_new();
+
+	/* Spawn the first participant right away, and the others later */
+	loop = g_main_loop_new(NULL, FALSE);
+	if(jamrtc_loadgen_spawn(NULL))
+		g_timeout_add(ramp, jamrtc_loadgen_spawn, NULL);
+	g_timeout_add_seconds(15, jamrtc_loadgen_keepalive, NULL);
+	jamrtc_loadgen_report(NULL);
+	g_timeout_add_seconds(report_interval, jamrtc_loadgen_report, NULL);
+	g_main_loop_run(loop);
+
+	/* We're done: log the summary and destroy all sessions */
+	jamrtc_loadgen_report(NULL);
+	jamrtc_mutex_lock(&participants_mutex);
+	jamrtc_loadgen_summary();
+	guint i = 0;
+	for(i=0; i<participants->len; i++) {
+		jamrtc_loadgen_participant *p = g_ptr_array_index(participants, i);
+		jamrtc_janus_destroy(p->janus);
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	/* Give the WebSockets thread a moment to send the requests */
+	g_usleep(500000);
+	jamrtc_janus_cleanup();
+	/* Now we can get rid of all pipelines and participants */
+	g_ptr_array_foreach(participants, (GFunc)jamrtc_loadgen_participant_free, NULL);
+	g_ptr_array_free(participants, TRUE);
+	g_main_loop_unref(loop);
+	g_option_context_free(opts);
+	gst_deinit();
+
+	JAMRTC_LOG(LOG_INFO, "\nBye!\n");
+	exit(0);
+}
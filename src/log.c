@@ -0,0 +1,257 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Local includes */
+#include "log.h"
+#include "debug.h"
+
+
+/* Asynchronous logger: each thread that logs something gets its own ring
+ * buffer of records, that only that thread writes to and only the logger
+ * thread reads from, so no lock is ever needed. The calling thread only
+ * formats the message itself (the arguments may not be around later):
+ * timestamps, prefixes and actually writing the line to the console are
+ * done by the logger thread, which merges the rings in the order records
+ * were queued (they get their sequence number once formatted, right before
+ * being published). When a ring is full, records are dropped and counted */
+#define JAMRTC_LOG_RECORDS		128
+#define JAMRTC_LOG_LINE			512
+#define JAMRTC_LOG_INTERVAL		5000	/* How often the logger thread checks the rings (us) */
+typedef struct jamrtc_log_record {
+	guint seq;
+	int level;
+	gint64 when;
+	/* These are all string literals, so they're safe to read later */
+	const char *file, *function;
+	int line;
+	char text[JAMRTC_LOG_LINE];
+} jamrtc_log_record;
+typedef struct jamrtc_log_ring {
+	jamrtc_log_record records[JAMRTC_LOG_RECORDS];
+	/* The head is only written by the owner thread, the tail by the logger thread */
+	volatile guint head, tail;
+	volatile gint dropped, orphan;
+	guint reported;
+	char thread[32];
+	struct jamrtc_log_ring *next;
+} jamrtc_log_ring;
+
+/* All the rings, and the ring of the current thread */
+static jamrtc_log_ring *volatile rings = NULL;
+static void jamrtc_log_ring_orphan(gpointer data);
+static GPrivate log_ring = G_PRIVATE_INIT(jamrtc_log_ring_orphan);
+static volatile guint sequence = 0;
+/* How many threads are queueing a record right now */
+static volatile gint writers = 0;
+
+/* Logger thread */
+volatile gint jamrtc_log_async = 0;
+static GThread *logger = NULL;
+static volatile gint logger_running = 0;
+static guint64 dropped_total = 0;
+
+
+/* When a thread goes away, its ring is freed by the logger thread, once drained */
+static void jamrtc_log_ring_orphan(gpointer data) {
+	jamrtc_log_ring *ring = (jamrtc_log_ring *)data;
+	if(ring != NULL)
+		g_atomic_int_set(&ring->orphan, 1);
+}
+
+/* Helper to write a record, adding what JAMRTC_LOG would have added */
+static void jamrtc_log_format(GString *out, jamrtc_log_record *record) {
+	if(jamrtc_log_timestamps) {
+		char ts[64];
+		struct tm tmresult;
+		time_t ltime = record->when / G_USEC_PER_SEC;
+		localtime_r(&ltime, &tmresult);
+		strftime(ts, sizeof(ts), "[%a %b %e %T %Y] ", &tmresult);
+		g_string_append(out, ts);
+	}
+	g_string_append(out, jamrtc_log_prefix[record->level | ((int)jamrtc_log_colors << 3)]);
+	if(record->level == LOG_FATAL || record->level == LOG_ERR || record->level == LOG_DBG)
+		g_string_append_printf(out, "[%s:%s:%d] ", record->file, record->function, record->line);
+	g_string_append(out, record->text);
+}
+
+/* Queue a log line */
+void jamrtc_log_write(int level, const char *file, const char *function, int line,
+		const char *format, ...) {
+	/* Let jamrtc_log_cleanup know we're here before checking if the logger is still there */
+	g_atomic_int_inc(&writers);
+	jamrtc_log_ring *ring = NULL;
+	jamrtc_log_record local, *record = &local;
+	guint head = 0;
+	if(g_atomic_int_get(&jamrtc_log_async)) {
+		ring = g_private_get(&log_ring);
+		if(ring == NULL) {
+			/* First time this thread logs something, create a ring and add it to the list */
+			ring = g_malloc0(sizeof(jamrtc_log_ring));
+			pthread_getname_np(pthread_self(), ring->thread, sizeof(ring->thread));
+			do {
+				ring->next = g_atomic_pointer_get(&rings);
+			} while(!g_atomic_pointer_compare_and_exchange(&rings, ring->next, ring));
+			g_private_set(&log_ring, ring);
+		}
+		head = ring->head;
+		if(head - g_atomic_int_get(&ring->tail) >= JAMRTC_LOG_RECORDS) {
+			/* Full, the logger thread can't keep up */
+			g_atomic_int_inc(&ring->dropped);
+			g_atomic_int_add(&writers, -1);
+			return;
+		}
+		record = &ring->records[head % JAMRTC_LOG_RECORDS];
+	}
+	record->level = level;
+	record->file = file;
+	record->function = function;
+	record->line = line;
+	va_list args;
+	va_start(args, format);
+	int len = g_vsnprintf(record->text, sizeof(record->text), format, args);
+	va_end(args);
+	if(len >= JAMRTC_LOG_LINE) {
+		/* Truncated, make sure we still end with a newline */
+		memcpy(record->text + JAMRTC_LOG_LINE - 5, "...\n", 5);
+	}
+	if(ring == NULL) {
+		/* The logger was stopped in the meanwhile, write the line ourselves */
+		g_atomic_int_add(&writers, -1);
+		record->when = g_get_real_time();
+		GString *out = g_string_sized_new(JAMRTC_LOG_LINE);
+		jamrtc_log_format(out, record);
+		g_print("%s", out->str);
+		g_string_free(out, TRUE);
+		return;
+	}
+	/* Only take our place in the order now that the record is ready, so that
+	 * a slow formatting doesn't hold back records queued after it started */
+	record->seq = g_atomic_int_add(&sequence, 1);
+	record->when = g_get_real_time();
+	/* Make the record visible to the logger thread */
+	g_atomic_int_set(&ring->head, head + 1);
+	g_atomic_int_add(&writers, -1);
+}
+
+/* Helper to drain all the rings, oldest record first: returns how many records were written */
+static guint jamrtc_log_flush(GString *out) {
+	guint written = 0;
+	g_string_set_size(out, 0);
+	while(TRUE) {
+		/* Find the ring with the oldest record */
+		jamrtc_log_ring *ring = g_atomic_pointer_get(&rings), *oldest = NULL;
+		guint oldest_seq = 0;
+		for(; ring != NULL; ring = ring->next) {
+			guint tail = ring->tail;
+			if(tail == g_atomic_int_get(&ring->head))
+				continue;
+			guint seq = ring->records[tail % JAMRTC_LOG_RECORDS].seq;
+			if(oldest == NULL || (gint)(seq - oldest_seq) < 0) {
+				oldest = ring;
+				oldest_seq = seq;
+			}
+		}
+		if(oldest == NULL)
+			break;
+		jamrtc_log_format(out, &oldest->records[oldest->tail % JAMRTC_LOG_RECORDS]);
+		g_atomic_int_set(&oldest->tail, oldest->tail + 1);
+		written++;
+	}
+	/* Report drops, and get rid of the rings of threads that are gone */
+	jamrtc_log_ring *ring = g_atomic_pointer_get(&rings), *prev = NULL;
+	while(ring != NULL) {
+		jamrtc_log_ring *next = ring->next;
+		guint dropped = g_atomic_int_get(&ring->dropped);
+		if(dropped != ring->reported) {
+			g_string_append_printf(out, "%sLogger overloaded, dropped %u lines from thread '%s'\n",
+				jamrtc_log_prefix[LOG_WARN | ((int)jamrtc_log_colors << 3)], dropped - ring->reported, ring->thread);
+			dropped_total += dropped - ring->reported;
+			ring->reported = dropped;
+		}
+		if(g_atomic_int_get(&ring->orphan) && ring->tail == g_atomic_int_get(&ring->head)) {
+			/* Unlink it: other threads only ever push new rings at the head */
+			if(prev == NULL && g_atomic_pointer_compare_and_exchange(&rings, ring, next)) {
+				g_free(ring);
+				ring = next;
+				continue;
+			} else if(prev == NULL) {
+				/* New rings were added in the meanwhile, find who's before us now */
+				prev = g_atomic_pointer_get(&rings);
+				while(prev->next != ring)
+					prev = prev->next;
+			}
+			prev->next = next;
+			g_free(ring);
+			ring = next;
+			continue;
+		}
+		prev = ring;
+		ring = next;
+	}
+	if(out->len > 0) {
+		fwrite(out->str, 1, out->len, stdout);
+		fflush(stdout);
+	}
+	return written;
+}
+
+/* Logger thread */
+static gpointer jamrtc_log_thread(gpointer data) {
+	GString *out = g_string_sized_new(JAMRTC_LOG_LINE * 4);
+	while(g_atomic_int_get(&logger_running)) {
+		if(jamrtc_log_flush(out) == 0)
+			g_usleep(JAMRTC_LOG_INTERVAL);
+	}
+	/* Write whatever is left */
+	jamrtc_log_flush(out);
+	g_string_free(out, TRUE);
+	return NULL;
+}
+
+/* Start the asynchronous logger */
+int jamrtc_log_init(void) {
+	if(logger != NULL)
+		return 0;
+	g_atomic_int_set(&logger_running, 1);
+	GError *error = NULL;
+	logger = g_thread_try_new("jamrtc log", jamrtc_log_thread, NULL, &error);
+	if(error != NULL) {
+		g_atomic_int_set(&logger_running, 0);
+		JAMRTC_LOG(LOG_ERR, "Got error %d (%s) trying to launch the logger thread...\n",
+			error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		return -1;
+	}
+	g_atomic_int_set(&jamrtc_log_async, 1);
+	return 0;
+}
+
+/* Stop the asynchronous logger */
+void jamrtc_log_cleanup(void) {
+	if(logger == NULL)
+		return;
+	/* Go back to synchronous logging, and wait for the threads that were still
+	 * queueing records when we did that, so that the last flush sees them too */
+	g_atomic_int_set(&jamrtc_log_async, 0);
+	while(g_atomic_int_get(&writers) > 0)
+		g_usleep(100);
+	g_atomic_int_set(&logger_running, 0);
+	g_thread_join(logger);
+	logger = NULL;
+	if(dropped_total > 0)
+		JAMRTC_LOG(LOG_WARN, "The logger dropped %"SCNu64" lines in total\n", dropped_total);
+	/* Rings of threads still alive stay around, in case we're started again */
+}
@@ -0,0 +1,34 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_LOG_H
+#define JAMRTC_LOG_H
+
+/* GLib */
+#include <glib.h>
+
+
+/* Whether the asynchronous logger is running (JAMRTC_LOG checks this) */
+extern volatile gint jamrtc_log_async;
+
+/* Start the asynchronous logger: from now on, JAMRTC_LOG only copies the
+ * message to a per-thread ring buffer, and a background thread takes care
+ * of timestamps, prefixes and actually writing the lines */
+int jamrtc_log_init(void);
+/* Stop the asynchronous logger, flushing whatever is still queued
+ * (logging goes back to being synchronous after this) */
+void jamrtc_log_cleanup(void);
+
+/* Queue a log line: not to be used directly, use JAMRTC_LOG instead */
+void jamrtc_log_write(int level, const char *file, const char *function, int line,
+	const char *format, ...) G_GNUC_PRINTF(5, 6);
+
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <stdio.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/* Local includes */
+#include "memory.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Memory accounting: we count our own participant and PeerConnection
+ * instances as they're created and freed, and the pipelines and webrtcbin
+ * elements until GStreamer actually finalizes them (a reference we forgot
+ * somewhere keeps them, and all they contain, alive). The WebRTC stack adds
+ * the footprint of each participant (how many elements their pipelines
+ * have, and how much is queued in them) and the pending transactions, and
+ * we add the resident set size of the process. In soak mode, we also take a
+ * sample each time a participant leaves: once the first samples are out of
+ * the way (GLib, GStreamer and the allocator all warm up their caches), the
+ * trend of each value over the join/leave cycles should be flat */
+static const char *object_names[JAMRTC_MEMORY_OBJECTS] = {
+	"participants", "PeerConnections", "pipelines", "webrtcbins"
+};
+static volatile gint live[JAMRTC_MEMORY_OBJECTS];
+
+/* Soak test samples */
+#define JAMRTC_MEMORY_SOAK_MIN_SAMPLES		40		/* Samples we need for a verdict */
+#define JAMRTC_MEMORY_SOAK_MAX_RSS_GROWTH	4096	/* Bytes per cycle we tolerate as noise */
+#define JAMRTC_MEMORY_SOAK_MAX_LEAKS		0.02	/* Objects per cycle we tolerate as noise */
+typedef struct jamrtc_memory_sample {
+	guint64 rss;
+	gint live[JAMRTC_MEMORY_OBJECTS];
+	guint transactions;
+} jamrtc_memory_sample;
+static gboolean soak = FALSE;
+static GArray *samples = NULL;
+static jamrtc_mutex samples_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+
+/* Count an object as created or freed */
+void jamrtc_memory_count(jamrtc_memory_object type, gint delta) {
+	if(type >= JAMRTC_MEMORY_OBJECTS)
+		return;
+	g_atomic_int_add(&live[type], delta);
+}
+
+/* Count a GObject as created now, and as freed when it's finalized */
+static void jamrtc_memory_finalized(gpointer data, GObject *object) {
+	jamrtc_memory_count(GPOINTER_TO_UINT(data), -1);
+}
+void jamrtc_memory_watch(GObject *object, jamrtc_memory_object type) {
+	if(object == NULL || type >= JAMRTC_MEMORY_OBJECTS)
+		return;
+	jamrtc_memory_count(type, 1);
+	g_object_weak_ref(object, jamrtc_memory_finalized, GUINT_TO_POINTER(type));
+}
+
+/* Get how many objects of a type are alive right now */
+gint jamrtc_memory_live(jamrtc_memory_object type) {
+	if(type >= JAMRTC_MEMORY_OBJECTS)
+		return 0;
+	return g_atomic_int_get(&live[type]);
+}
+
+/* Get the resident set size of the process */
+guint64 jamrtc_memory_rss(void) {
+	FILE *file = fopen("/proc/self/statm", "r");
+	if(file == NULL)
+		return 0;
+	unsigned long size = 0, resident = 0;
+	int res = fscanf(file, "%lu %lu", &size, &resident);
+	fclose(file);
+	if(res != 2)
+		return 0;
+	return (guint64)resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Update the accounting */
+void jamrtc_memory_account(jamrtc_stats_memory *memory) {
+	if(memory == NULL)
+		return;
+	memory->rss = jamrtc_memory_rss();
+	memory->participants = MAX(0, jamrtc_memory_live(JAMRTC_MEMORY_PARTICIPANT));
+	memory->peerconnections = MAX(0, jamrtc_memory_live(JAMRTC_MEMORY_PEERCONNECTION));
+	memory->pipelines = MAX(0, jamrtc_memory_live(JAMRTC_MEMORY_PIPELINE));
+	memory->webrtcbins = MAX(0, jamrtc_memory_live(JAMRTC_MEMORY_WEBRTCBIN));
+	JAMRTC_LOG(LOG_VERB, "Memory: %"SCNu64" KB resident, %u participants, %u PeerConnections, "
+		"%u pipelines, %u webrtcbins, %u transactions\n", memory->rss / 1024,
+		memory->participants, memory->peerconnections, memory->pipelines, memory->webrtcbins,
+		memory->transactions);
+	GList *temp = memory->footprints;
+	while(temp) {
+		jamrtc_stats_footprint *f = (jamrtc_stats_footprint *)temp->data;
+		JAMRTC_LOG(LOG_VERB, "  -- %s: %u PeerConnections, %u elements, %"SCNu64" bytes queued\n",
+			f->participant, f->peerconnections, f->elements, f->queued);
+		temp = temp->next;
+	}
+	jamrtc_stats_update_memory(memory);
+}
+
+/* Soak testing */
+void jamrtc_memory_soak_enable(void) {
+	soak = TRUE;
+	samples = g_array_new(FALSE, TRUE, sizeof(jamrtc_memory_sample));
+	JAMRTC_LOG(LOG_INFO, "Soak test: sampling memory each time a participant leaves\n");
+}
+void jamrtc_memory_soak_sample(guint transactions) {
+	if(!soak)
+		return;
+#ifdef __GLIBC__
+	/* Give back what the allocator is keeping around, so that we measure what's in use */
+	malloc_trim(0);
+#endif
+	jamrtc_memory_sample sample = { 0 };
+	sample.rss = jamrtc_memory_rss();
+	guint i = 0;
+	for(i=0; i<JAMRTC_MEMORY_OBJECTS; i++)
+		sample.live[i] = jamrtc_memory_live(i);
+	sample.transactions = transactions;
+	jamrtc_mutex_lock(&samples_mutex);
+	g_array_append_val(samples, sample);
+	jamrtc_mutex_unlock(&samples_mutex);
+}
+
+/* Helper to compute the slope of the least squares line through some values (per sample) */
+static gdouble jamrtc_memory_slope(const gdouble *values, guint num) {
+	if(num < 2)
+		return 0;
+	gdouble mean_x = (gdouble)(num - 1) / 2, mean_y = 0;
+	guint i = 0;
+	for(i=0; i<num; i++)
+		mean_y += values[i];
+	mean_y /= num;
+	gdouble num_sum = 0, den_sum = 0;
+	for(i=0; i<num; i++) {
+		num_sum += (i - mean_x) * (values[i] - mean_y);
+		den_sum += (i - mean_x) * (i - mean_x);
+	}
+	return den_sum > 0 ? num_sum / den_sum : 0;
+}
+
+/* Log what the soak test found */
+int jamrtc_memory_soak_report(void) {
+	if(!soak)
+		return 0;
+	jamrtc_mutex_lock(&samples_mutex);
+	guint total = samples->len;
+	if(total < JAMRTC_MEMORY_SOAK_MIN_SAMPLES) {
+		jamrtc_mutex_unlock(&samples_mutex);
+		JAMRTC_LOG(LOG_WARN, "Soak test: only %u participants left, at least %u needed for a verdict\n",
+			total, JAMRTC_MEMORY_SOAK_MIN_SAMPLES);
+		return 0;
+	}
+	/* Skip the first quarter of the samples, while things warm up */
+	guint skip = total / 4, num = total - skip, i = 0, j = 0;
+	jamrtc_memory_sample *first = &g_array_index(samples, jamrtc_memory_sample, skip);
+	jamrtc_memory_sample *last = &g_array_index(samples, jamrtc_memory_sample, total - 1);
+	gdouble *values = g_malloc(num * sizeof(gdouble));
+	int res = 0;
+	for(i=0; i<num; i++)
+		values[i] = g_array_index(samples, jamrtc_memory_sample, skip + i).rss;
+	gdouble slope = jamrtc_memory_slope(values, num);
+	gboolean flat = (slope <= JAMRTC_MEMORY_SOAK_MAX_RSS_GROWTH);
+	int log_level = flat ? LOG_INFO : LOG_ERR;
+	JAMRTC_LOG(log_level, "Soak test: %u cycles, resident memory %"SCNu64" KB -> %"SCNu64" KB "
+		"after warm-up (%+.1f KB per cycle)%s\n", total, first->rss / 1024, last->rss / 1024,
+		slope / 1024, flat ? "" : ": GROWING");
+	if(!flat)
+		res = -1;
+	for(j=0; j<=JAMRTC_MEMORY_OBJECTS; j++) {
+		for(i=0; i<num; i++) {
+			jamrtc_memory_sample *sample = &g_array_index(samples, jamrtc_memory_sample, skip + i);
+			values[i] = (j < JAMRTC_MEMORY_OBJECTS ? sample->live[j] : sample->transactions);
+		}
+		slope = jamrtc_memory_slope(values, num);
+		flat = (slope <= JAMRTC_MEMORY_SOAK_MAX_LEAKS);
+		log_level = flat ? LOG_INFO : LOG_ERR;
+		JAMRTC_LOG(log_level, "Soak test: %s alive %d -> %d after warm-up (%+.3f per cycle)%s\n",
+			j < JAMRTC_MEMORY_OBJECTS ? object_names[j] : "transactions",
+			j < JAMRTC_MEMORY_OBJECTS ? first->live[j] : (gint)first->transactions,
+			j < JAMRTC_MEMORY_OBJECTS ? last->live[j] : (gint)last->transactions,
+			slope, flat ? "" : ": LEAKING");
+		if(!flat)
+			res = -1;
+	}
+	g_free(values);
+	g_array_free(samples, TRUE);
+	samples = NULL;
+	soak = FALSE;
+	jamrtc_mutex_unlock(&samples_mutex);
+	log_level = (res == 0 ? LOG_INFO : LOG_ERR);
+	JAMRTC_LOG(log_level, "Soak test %s\n", res == 0 ? "passed" : "FAILED");
+	return res;
+}
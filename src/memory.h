@@ -0,0 +1,58 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_MEMORY_H
+#define JAMRTC_MEMORY_H
+
+/* GLib */
+#include <glib-object.h>
+
+/* Local includes */
+#include "stats.h"
+
+
+/* Objects we keep count of */
+typedef enum jamrtc_memory_object {
+	/* Participants (including the ones that left, as long as anything still references them) */
+	JAMRTC_MEMORY_PARTICIPANT = 0,
+	/* PeerConnections (our instances, same as above) */
+	JAMRTC_MEMORY_PEERCONNECTION,
+	/* GStreamer pipelines of PeerConnections, until they're actually finalized */
+	JAMRTC_MEMORY_PIPELINE,
+	/* webrtcbin elements, until they're actually finalized */
+	JAMRTC_MEMORY_WEBRTCBIN,
+	JAMRTC_MEMORY_OBJECTS
+} jamrtc_memory_object;
+
+/* Count an object as created (delta=1) or freed (delta=-1) */
+void jamrtc_memory_count(jamrtc_memory_object type, gint delta);
+/* Count a GObject as created now, and as freed when it's finalized */
+void jamrtc_memory_watch(GObject *object, jamrtc_memory_object type);
+/* Get how many objects of a type are alive right now */
+gint jamrtc_memory_live(jamrtc_memory_object type);
+/* Get the resident set size of the process, in bytes (0 if unknown) */
+guint64 jamrtc_memory_rss(void);
+
+/* Update the accounting: the caller fills in the per-participant
+ * footprints and the pending transactions, and we add the rest before
+ * passing it to the metrics endpoint (the list is owned by the caller) */
+void jamrtc_memory_account(jamrtc_stats_memory *memory);
+
+/* Soak testing: when enabled, memory is sampled every time a participant
+ * leaves, and the report at exit checks that it didn't grow with churn */
+void jamrtc_memory_soak_enable(void);
+/* Take a sample (to call after a participant left): transactions is the
+ * number of Janus transactions we're still waiting a response for */
+void jamrtc_memory_soak_sample(guint transactions);
+/* Log what the soak test found: returns 0 if memory use was flat, -1 if it grew */
+int jamrtc_memory_soak_report(void);
+
+
+#endif
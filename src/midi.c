@@ -0,0 +1,401 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+
+/* JACK includes */
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+
+/* Local includes */
+#include "midi.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* MIDI instruments: rather than encoding audio, we capture the events from
+ * a JACK MIDI input port and send them, timestamped, on a data channel on
+ * the instrument PeerConnection. Events from remote participants are queued
+ * and written to a JACK MIDI output port for each of them, so that a local
+ * synth can render them. Nothing on the JACK process thread ever blocks:
+ * captured events are handed to a sender thread, and received events are
+ * handed to the process thread, via lock-free JACK ringbuffers.
+ *
+ * On the wire, a message is a sequence of events, each made of the capture
+ * time (microseconds, 32 bits, network order), the size and the MIDI bytes */
+#define JAMRTC_MIDI_MAX_EVENT		16		/* Larger events (e.g., SysEx) are dropped */
+#define JAMRTC_MIDI_MAX_PORTS		8
+#define JAMRTC_MIDI_QUEUE			256		/* Events per ringbuffer */
+#define JAMRTC_MIDI_SEND_INTERVAL	1000	/* How often the sender checks for events (us) */
+#define JAMRTC_MIDI_MAX_LATE		50000	/* How late events can be before we resync (us) */
+#define JAMRTC_MIDI_MAX_AHEAD		500000	/* How early events can be before we resync (us) */
+typedef struct jamrtc_midi_event {
+	/* Capture time (JACK time, us) when sending, playout time when receiving */
+	guint64 time;
+	guint8 size;
+	guint8 data[JAMRTC_MIDI_MAX_EVENT];
+} jamrtc_midi_event;
+
+/* JACK client, and the port we capture our instrument from, if any */
+static jack_client_t *client = NULL;
+static jack_port_t *input = NULL;
+static jack_ringbuffer_t *capture_queue = NULL;
+static volatile gint captured = 0, capture_dropped = 0;
+
+/* Data channel we send our events on, and the thread doing that */
+static GstWebRTCDataChannel *channel = NULL;
+static jamrtc_mutex channel_mutex = JAMRTC_MUTEX_INITIALIZER;
+static GThread *sender = NULL;
+static volatile gint running = 0;
+static guint64 sent = 0, send_dropped = 0;
+
+/* Output ports for remote participants */
+struct jamrtc_midi_port {
+	char *name;
+	jack_port_t *port;
+	jack_ringbuffer_t *queue;
+	/* Playout delay (us) */
+	gint64 delay;
+	/* Mapping of the sender's timestamps to our JACK time: only
+	 * accessed by the thread receiving data channel messages */
+	gboolean synced;
+	guint32 last_ts;
+	gint64 remote_time, offset;
+	guint64 received, late, resyncs, dropped;
+};
+static jamrtc_midi_port *ports[JAMRTC_MIDI_MAX_PORTS];
+static jamrtc_mutex ports_mutex = JAMRTC_MUTEX_INITIALIZER;
+/* Process cycles counter, to know when a port isn't used anymore: ports
+ * we removed when JACK wasn't running cycles are only freed at cleanup */
+static volatile gint cycles = 0;
+static GList *retired = NULL;
+
+
+/* JACK process callback: this is a realtime thread, so no locks and no allocations */
+static int jamrtc_midi_process(jack_nframes_t nframes, void *arg) {
+	jack_nframes_t cycle_start = jack_last_frame_time(client);
+	jack_time_t start_time = jack_frames_to_time(client, cycle_start);
+	jack_time_t end_time = jack_frames_to_time(client, cycle_start + nframes);
+	jamrtc_midi_event event;
+	/* Queue what we captured for the sender thread */
+	if(input != NULL) {
+		void *buffer = jack_port_get_buffer(input, nframes);
+		uint32_t count = jack_midi_get_event_count(buffer), i = 0;
+		jack_midi_event_t in;
+		for(i=0; i<count; i++) {
+			if(jack_midi_event_get(&in, buffer, i) != 0)
+				continue;
+			if(in.size == 0 || in.size > JAMRTC_MIDI_MAX_EVENT ||
+					jack_ringbuffer_write_space(capture_queue) < sizeof(event)) {
+				g_atomic_int_inc(&capture_dropped);
+				continue;
+			}
+			event.time = jack_frames_to_time(client, cycle_start + in.time);
+			event.size = in.size;
+			memcpy(event.data, in.buffer, in.size);
+			jack_ringbuffer_write(capture_queue, (const char *)&event, sizeof(event));
+			g_atomic_int_inc(&captured);
+		}
+	}
+	/* Play what we received, at the right offset within this cycle */
+	int i = 0;
+	for(i=0; i<JAMRTC_MIDI_MAX_PORTS; i++) {
+		jamrtc_midi_port *port = g_atomic_pointer_get(&ports[i]);
+		if(port == NULL)
+			continue;
+		void *buffer = jack_port_get_buffer(port->port, nframes);
+		jack_midi_clear_buffer(buffer);
+		jack_nframes_t last = 0, offset = 0;
+		while(jack_ringbuffer_peek(port->queue, (char *)&event, sizeof(event)) == sizeof(event)) {
+			if(event.time >= end_time)
+				break;	/* Not yet */
+			offset = 0;
+			if(event.time > start_time)
+				offset = jack_time_to_frames(client, event.time) - cycle_start;
+			if(offset >= nframes)
+				offset = nframes-1;
+			if(offset < last)
+				offset = last;
+			jack_midi_event_write(buffer, offset, event.data, event.size);
+			last = offset;
+			jack_ringbuffer_read_advance(port->queue, sizeof(event));
+		}
+	}
+	g_atomic_int_inc(&cycles);
+	return 0;
+}
+
+/* Thread sending the events we captured on the data channel */
+static gpointer jamrtc_midi_sender(gpointer data) {
+	JAMRTC_LOG(LOG_INFO, "Joining MIDI sender thread\n");
+	GByteArray *message = g_byte_array_new();
+	jamrtc_midi_event event;
+	guint8 header[5];
+	while(g_atomic_int_get(&running)) {
+		/* Batch all the events that are waiting in a single message */
+		guint events = 0;
+		g_byte_array_set_size(message, 0);
+		while(jack_ringbuffer_read_space(capture_queue) >= sizeof(event)) {
+			jack_ringbuffer_read(capture_queue, (char *)&event, sizeof(event));
+			guint32 ts = (guint32)event.time;
+			header[0] = ts >> 24;
+			header[1] = ts >> 16;
+			header[2] = ts >> 8;
+			header[3] = ts;
+			header[4] = event.size;
+			g_byte_array_append(message, header, sizeof(header));
+			g_byte_array_append(message, event.data, event.size);
+			events++;
+		}
+		if(events == 0) {
+			g_usleep(JAMRTC_MIDI_SEND_INTERVAL);
+			continue;
+		}
+		jamrtc_mutex_lock(&channel_mutex);
+		GstWebRTCDataChannelState state = GST_WEBRTC_DATA_CHANNEL_STATE_CLOSED;
+		if(channel != NULL)
+			g_object_get(channel, "ready-state", &state, NULL);
+		if(state == GST_WEBRTC_DATA_CHANNEL_STATE_OPEN) {
+			GBytes *bytes = g_bytes_new(message->data, message->len);
+			g_signal_emit_by_name(channel, "send-data", bytes);
+			g_bytes_unref(bytes);
+			sent += events;
+		} else {
+			/* Nobody to send this to (yet?) */
+			send_dropped += events;
+		}
+		jamrtc_mutex_unlock(&channel_mutex);
+	}
+	g_byte_array_free(message, TRUE);
+	JAMRTC_LOG(LOG_INFO, "Leaving MIDI sender thread\n");
+	return NULL;
+}
+
+/* MIDI initialization */
+int jamrtc_midi_init(gboolean capture) {
+	jack_status_t status = 0;
+	client = jack_client_open("JamRTC MIDI", JackNoStartServer, &status);
+	if(client == NULL) {
+		JAMRTC_LOG(LOG_ERR, "Couldn't open the JACK MIDI client (0x%x), is JACK running?\n", status);
+		return -1;
+	}
+	jack_set_process_callback(client, jamrtc_midi_process, NULL);
+	if(capture) {
+		input = jack_port_register(client, "capture", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+		capture_queue = jack_ringbuffer_create(JAMRTC_MIDI_QUEUE * sizeof(jamrtc_midi_event));
+		if(input == NULL || capture_queue == NULL) {
+			JAMRTC_LOG(LOG_ERR, "Couldn't create the JACK MIDI capture port\n");
+			jamrtc_midi_cleanup();
+			return -1;
+		}
+	}
+	if(jack_activate(client) != 0) {
+		JAMRTC_LOG(LOG_ERR, "Couldn't activate the JACK MIDI client\n");
+		jamrtc_midi_cleanup();
+		return -1;
+	}
+	if(capture) {
+		g_atomic_int_set(&running, 1);
+		GError *error = NULL;
+		sender = g_thread_try_new("jamrtc midi", jamrtc_midi_sender, NULL, &error);
+		if(error != NULL) {
+			JAMRTC_LOG(LOG_ERR, "Got error %d (%s) trying to launch the MIDI sender thread...\n",
+				error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			jamrtc_midi_cleanup();
+			return -1;
+		}
+	}
+	JAMRTC_LOG(LOG_INFO, "JACK MIDI client ready (%u Hz, %u frames per cycle)\n",
+		jack_get_sample_rate(client), jack_get_buffer_size(client));
+	return 0;
+}
+
+/* Helper to get rid of a port: must be called when the process thread can't see it anymore */
+static void jamrtc_midi_port_free(jamrtc_midi_port *port) {
+	JAMRTC_LOG(LOG_INFO, "[%s] MIDI events received: %"SCNu64" (%"SCNu64" late, %"SCNu64" dropped, %"SCNu64" resyncs)\n",
+		port->name, port->received, port->late, port->dropped, port->resyncs);
+	if(client != NULL && port->port != NULL)
+		jack_port_unregister(client, port->port);
+	if(port->queue != NULL)
+		jack_ringbuffer_free(port->queue);
+	g_free(port->name);
+	g_free(port);
+}
+
+/* MIDI cleanup */
+void jamrtc_midi_cleanup(void) {
+	if(sender != NULL) {
+		g_atomic_int_set(&running, 0);
+		g_thread_join(sender);
+		sender = NULL;
+	}
+	if(client != NULL)
+		jack_deactivate(client);
+	int i = 0;
+	jamrtc_mutex_lock(&ports_mutex);
+	for(i=0; i<JAMRTC_MIDI_MAX_PORTS; i++) {
+		if(ports[i] != NULL) {
+			jamrtc_midi_port_free(ports[i]);
+			ports[i] = NULL;
+		}
+	}
+	/* The process thread is gone, so we can free the ports we couldn't free before */
+	g_list_free_full(retired, (GDestroyNotify)jamrtc_midi_port_free);
+	retired = NULL;
+	jamrtc_mutex_unlock(&ports_mutex);
+	if(input != NULL) {
+		JAMRTC_LOG(LOG_INFO, "MIDI events captured: %d (%"SCNu64" sent, %d+%"SCNu64" dropped)\n",
+			g_atomic_int_get(&captured), sent, g_atomic_int_get(&capture_dropped), send_dropped);
+	}
+	if(client != NULL) {
+		jack_client_close(client);
+		client = NULL;
+	}
+	input = NULL;
+	if(capture_queue != NULL) {
+		jack_ringbuffer_free(capture_queue);
+		capture_queue = NULL;
+	}
+	jamrtc_midi_set_channel(NULL);
+}
+
+/* Whether we can play (and capture) MIDI */
+gboolean jamrtc_midi_is_enabled(void) {
+	return client != NULL;
+}
+
+/* Set the data channel to send the MIDI events we capture on */
+void jamrtc_midi_set_channel(GstWebRTCDataChannel *dc) {
+	jamrtc_mutex_lock(&channel_mutex);
+	if(channel != NULL)
+		gst_object_unref(channel);
+	channel = dc ? gst_object_ref(dc) : NULL;
+	jamrtc_mutex_unlock(&channel_mutex);
+}
+
+/* Create a JACK MIDI output port for a participant's instrument */
+jamrtc_midi_port *jamrtc_midi_add_output(const char *participant, const char *instrument, guint delay) {
+	if(client == NULL || participant == NULL)
+		return NULL;
+	jamrtc_midi_port *port = g_malloc0(sizeof(jamrtc_midi_port));
+	port->name = g_strdup_printf("%s's %s", participant, instrument ? instrument : "MIDI");
+	/* Colons are not allowed in JACK port names */
+	g_strdelimit(port->name, ":", '_');
+	port->delay = (gint64)delay * 1000;
+	port->queue = jack_ringbuffer_create(JAMRTC_MIDI_QUEUE * sizeof(jamrtc_midi_event));
+	port->port = jack_port_register(client, port->name, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+	if(port->queue == NULL || port->port == NULL) {
+		JAMRTC_LOG(LOG_ERR, "[%s] Couldn't create the JACK MIDI output port\n", port->name);
+		jamrtc_midi_port_free(port);
+		return NULL;
+	}
+	/* Let the process thread know about it */
+	int i = 0;
+	jamrtc_mutex_lock(&ports_mutex);
+	for(i=0; i<JAMRTC_MIDI_MAX_PORTS; i++) {
+		if(ports[i] == NULL) {
+			g_atomic_pointer_set(&ports[i], port);
+			break;
+		}
+	}
+	jamrtc_mutex_unlock(&ports_mutex);
+	if(i == JAMRTC_MIDI_MAX_PORTS) {
+		JAMRTC_LOG(LOG_WARN, "[%s] Too many MIDI output ports\n", port->name);
+		jamrtc_midi_port_free(port);
+		return NULL;
+	}
+	JAMRTC_LOG(LOG_INFO, "[%s] Created JACK MIDI output port\n", port->name);
+	return port;
+}
+
+/* Queue the MIDI events we received on a data channel for playout */
+void jamrtc_midi_receive(jamrtc_midi_port *port, GBytes *data) {
+	if(port == NULL || data == NULL || client == NULL)
+		return;
+	gsize len = 0;
+	const guint8 *buffer = g_bytes_get_data(data, &len);
+	gint64 now = jack_get_time();
+	jamrtc_midi_event event;
+	while(len >= 5) {
+		guint32 ts = ((guint32)buffer[0] << 24) | ((guint32)buffer[1] << 16) |
+			((guint32)buffer[2] << 8) | buffer[3];
+		event.size = buffer[4];
+		if(event.size == 0 || event.size > JAMRTC_MIDI_MAX_EVENT || len < 5 + (gsize)event.size) {
+			JAMRTC_LOG(LOG_WARN, "[%s] Invalid MIDI message, ignoring\n", port->name);
+			break;
+		}
+		memcpy(event.data, buffer + 5, event.size);
+		buffer += 5 + event.size;
+		len -= 5 + event.size;
+		port->received++;
+		/* Map the sender's time to ours, keeping the spacing between events */
+		if(port->synced)
+			port->remote_time += (gint32)(ts - port->last_ts);
+		else
+			port->remote_time = ts;
+		port->last_ts = ts;
+		gint64 when = port->remote_time + port->offset;
+		if(!port->synced || when < now - JAMRTC_MIDI_MAX_LATE || when > now + port->delay + JAMRTC_MIDI_MAX_AHEAD) {
+			/* First event, or the clocks drifted too much: (re)sync */
+			if(port->synced)
+				port->resyncs++;
+			port->synced = TRUE;
+			port->offset = now + port->delay - port->remote_time;
+			when = now + port->delay;
+		} else if(when < now) {
+			/* Late, it will be played as soon as possible */
+			port->late++;
+		}
+		event.time = when;
+		if(jack_ringbuffer_write_space(port->queue) < sizeof(event)) {
+			port->dropped++;
+			continue;
+		}
+		jack_ringbuffer_write(port->queue, (const char *)&event, sizeof(event));
+	}
+}
+
+/* Get rid of a JACK MIDI output port */
+void jamrtc_midi_remove_output(jamrtc_midi_port *port) {
+	if(port == NULL)
+		return;
+	int i = 0;
+	gboolean found = FALSE;
+	jamrtc_mutex_lock(&ports_mutex);
+	for(i=0; i<JAMRTC_MIDI_MAX_PORTS; i++) {
+		if(ports[i] == port) {
+			g_atomic_pointer_set(&ports[i], NULL);
+			found = TRUE;
+			break;
+		}
+	}
+	jamrtc_mutex_unlock(&ports_mutex);
+	if(!found)
+		return;
+	/* Make sure the process thread is done with it, before freeing it: a cycle
+	 * that started before we removed it may still be using it, the next won't */
+	gint start = g_atomic_int_get(&cycles), waited = 0;
+	while(g_atomic_int_get(&cycles) - start < 2 && waited < 100) {
+		g_usleep(1000);
+		waited++;
+	}
+	if(g_atomic_int_get(&cycles) - start < 2) {
+		/* JACK isn't running cycles, so we can't know: leave it to the cleanup */
+		JAMRTC_LOG(LOG_WARN, "[%s] JACK is not processing, freeing the MIDI output port at shutdown\n", port->name);
+		jamrtc_mutex_lock(&ports_mutex);
+		retired = g_list_prepend(retired, port);
+		jamrtc_mutex_unlock(&ports_mutex);
+		return;
+	}
+	jamrtc_midi_port_free(port);
+}
@@ -0,0 +1,48 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_MIDI_H
+#define JAMRTC_MIDI_H
+
+/* GLib */
+#include <glib.h>
+
+/* GStreamer */
+#include <gst/webrtc/webrtc.h>
+
+
+/* Label of the data channel MIDI events are exchanged on */
+#define JAMRTC_MIDI_CHANNEL	"jamrtc-midi"
+
+/* A JACK MIDI output port for a remote participant (opaque) */
+typedef struct jamrtc_midi_port jamrtc_midi_port;
+
+/* MIDI initialization: opens a JACK client, with an input port to capture
+ * our own MIDI instrument from, if needed */
+int jamrtc_midi_init(gboolean capture);
+/* MIDI cleanup (closes the JACK client and all ports) */
+void jamrtc_midi_cleanup(void);
+/* Whether we can play (and capture) MIDI */
+gboolean jamrtc_midi_is_enabled(void);
+
+/* Set the data channel to send the MIDI events we capture on (NULL to stop
+ * sending): events captured when there's no open data channel are dropped */
+void jamrtc_midi_set_channel(GstWebRTCDataChannel *channel);
+
+/* Create a JACK MIDI output port for a participant's instrument: events are
+ * played out with the same spacing they were captured with, after a delay */
+jamrtc_midi_port *jamrtc_midi_add_output(const char *participant, const char *instrument, guint delay);
+/* Queue the MIDI events we received on a data channel for playout */
+void jamrtc_midi_receive(jamrtc_midi_port *port, GBytes *data);
+/* Get rid of a JACK MIDI output port */
+void jamrtc_midi_remove_output(jamrtc_midi_port *port);
+
+
+#endif
@@ -0,0 +1,1197 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Local stand-in for a Janus instance with the VideoRoom plugin: it speaks
+ * the subset of the Janus API JamRTC uses over WebSockets (create, attach,
+ * keepalive, trickle, detach, destroy, and the join, joinandconfigure,
+ * configure, start, unpublish and leave VideoRoom requests), notifies
+ * publishers and leaving participants, and can delay responses and events
+ * as scripted. No media is ever exchanged: SDP answers and offers are
+ * crafted so that webrtcbin accepts them, and webrtcup events are faked.
+ *
+ * In benchmark mode, it injects fake publishers in the room at a fixed
+ * rate, which makes connected JamRTC instances subscribe and unsubscribe
+ * as fast as they can, and measures signalling throughput and latency.
+ * With many short-lived publishers it doubles as a churn soak test: once
+ * they all left, subscriber handles still attached to any of them are leaks */
+
+/* Generic includes */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* GLib, WebSockets and JSON includes */
+#include <glib.h>
+#include <glib-unix.h>
+#include <libwebsockets.h>
+#include <json-glib/json-glib.h>
+
+/* Local includes */
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Logging */
+int jamrtc_log_level = LOG_INFO;
+gboolean jamrtc_log_timestamps = FALSE;
+gboolean jamrtc_log_colors = TRUE;
+int lock_debug = 0;
+int lock_profile = 0;
+
+/* Command line options */
+static guint ws_port = 0, jitter = 0;
+static const char *delays_text = NULL;
+static gboolean no_webrtcup = FALSE;
+static guint bench_num = 0, bench_rate = 0, bench_lifetime = 0;
+static guint64 bench_room = 0;
+
+static GOptionEntry opt_entries[] = {
+	{ "port", 'p', 0, G_OPTION_ARG_INT, &ws_port, "Port to listen on for WebSocket connections, on localhost (default: 8188)", NULL },
+	{ "delays", 'd', 0, G_OPTION_ARG_STRING, &delays_text, "Scripted delays in milliseconds, as a comma separated list of type=ms, where type can be create, attach, join, configure, start, event, webrtcup or detach (e.g., join=50,webrtcup=200; default: webrtcup=50)", NULL },
+	{ "jitter", 'j', 0, G_OPTION_ARG_INT, &jitter, "Random jitter to add to all delays, in milliseconds (default: 0)", NULL },
+	{ "no-webrtcup", 'W', 0, G_OPTION_ARG_NONE, &no_webrtcup, "Never send fake webrtcup events (default: send them after start/configure)", NULL },
+	{ "bench", 'b', 0, G_OPTION_ARG_INT, &bench_num, "Benchmark mode: inject this many fake publishers once someone joins, log a report and exit, with exit code 1 if subscriptions to them were never detached (default: 0, disabled)", NULL },
+	{ "bench-rate", 'R', 0, G_OPTION_ARG_INT, &bench_rate, "How many fake publishers to inject per second (default: 10)", NULL },
+	{ "bench-lifetime", 'L', 0, G_OPTION_ARG_INT, &bench_lifetime, "How long fake publishers stay in the room, in milliseconds (default: 2000)", NULL },
+	{ "bench-room", 'r', 0, G_OPTION_ARG_INT64, &bench_room, "Room to inject fake publishers in (default: the first room someone joins)", NULL },
+	{ "log-level", 'l', 0, G_OPTION_ARG_INT, &jamrtc_log_level, "Logging level (0=disable logging, 7=maximum log level; default: 4)", NULL },
+	{ NULL },
+};
+
+/* Scripted delays, per type of response */
+typedef enum jamrtc_mock_delay {
+	JAMRTC_MOCK_DELAY_CREATE = 0,
+	JAMRTC_MOCK_DELAY_ATTACH,
+	JAMRTC_MOCK_DELAY_JOIN,
+	JAMRTC_MOCK_DELAY_CONFIGURE,
+	JAMRTC_MOCK_DELAY_START,
+	JAMRTC_MOCK_DELAY_EVENT,
+	JAMRTC_MOCK_DELAY_WEBRTCUP,
+	JAMRTC_MOCK_DELAY_DETACH,
+	JAMRTC_MOCK_DELAY_NUM,
+	/* Acks and errors are always sent right away */
+	JAMRTC_MOCK_DELAY_NONE
+} jamrtc_mock_delay;
+static const char *delay_names[JAMRTC_MOCK_DELAY_NUM] = {
+	"create", "attach", "join", "configure", "start", "event", "webrtcup", "detach"
+};
+static guint delays[JAMRTC_MOCK_DELAY_NUM] = { 0, 0, 0, 0, 0, 0, 50, 0 };
+
+/* A WebSocket client */
+typedef struct jamrtc_mock_client {
+	guint64 id;				/* Unique ID of this client, to find it when sending delayed messages */
+	struct lws *wsi;		/* The libwebsockets client instance */
+	char *incoming;			/* Buffer containing incoming data until it's complete */
+	unsigned char *buffer;	/* Buffer containing the message to send */
+	int buflen;				/* Length of the buffer (may be resized after re-allocations) */
+	int bufpending;			/* Data an interrupted previous write couldn't send */
+	int bufoffset;			/* Offset from where the interrupted previous write should resume */
+	GAsyncQueue *messages;	/* Queue of outgoing messages to push */
+	GList *sessions;		/* Janus sessions created on this connection */
+} jamrtc_mock_client;
+
+/* A Janus session */
+typedef struct jamrtc_mock_session {
+	guint64 id;				/* Session ID */
+	guint64 client_id;		/* Client that created the session */
+	GHashTable *handles;	/* Handles attached in this session */
+	gint64 created;			/* When the session was created */
+	gint64 joined;			/* When the first publisher handle of this session joined */
+	gint64 published;		/* When the first publisher handle of this session sent an offer */
+} jamrtc_mock_session;
+
+/* A VideoRoom handle (or a fake publisher, if there's no session) */
+typedef struct jamrtc_mock_handle {
+	guint64 id;				/* Handle ID */
+	jamrtc_mock_session *session;	/* Session this handle belongs to (NULL for fake publishers) */
+	guint64 room;			/* Room this handle is in, if any */
+	gboolean publisher;		/* Whether this is a publisher */
+	guint64 user_id;		/* Publisher ID, if a publisher */
+	char *display;			/* Display of the publisher, if any */
+	gboolean audio, video;	/* What the publisher is sending, if published */
+	gboolean published;		/* Whether this publisher is publishing */
+	JsonArray *streams;		/* Streams of the publisher (m-lines), as the multistream VideoRoom lists them */
+	guint64 feed;			/* Feed this handle is subscribed to, if a subscriber */
+	gint64 announced;		/* When this fake publisher was announced */
+} jamrtc_mock_handle;
+
+/* A VideoRoom room: rooms are created automatically the first time someone joins */
+typedef struct jamrtc_mock_room {
+	guint64 id;				/* Room ID */
+	GHashTable *participants;	/* Participants in the room, indexed by publisher ID */
+} jamrtc_mock_room;
+
+/* Global state: sessions, handles and rooms are protected by the same mutex,
+ * while clients have their own, since messages are queued with the other held */
+static GHashTable *clients = NULL, *sessions = NULL, *rooms = NULL;
+static jamrtc_mutex mutex = JAMRTC_MUTEX_INITIALIZER, clients_mutex = JAMRTC_MUTEX_INITIALIZER;
+static guint64 client_ids = 0;
+static char fingerprint[128];
+
+/* Counters */
+static volatile gint messages_in = 0, messages_out = 0;
+static gint64 started = 0;
+
+/* Benchmark state */
+static jamrtc_mock_room *bench_target = NULL;
+static guint bench_injected = 0, bench_left = 0;
+static gint64 bench_started = 0;
+static GArray *bench_join_latencies = NULL, *bench_start_latencies = NULL;
+static guint bench_timer = 0, bench_leaked = 0;
+/* How long we wait for subscribers to detach once all fake publishers left (ms) */
+#define JAMRTC_MOCK_BENCH_GRACE	3000
+
+/* WebSocket server */
+static struct lws_context *context = NULL;
+static GThread *ws_thread = NULL;
+static volatile gint stopping = 0;
+static GMainLoop *loop = NULL;
+
+static int jamrtc_mock_ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+static struct lws_protocols protocols[] = {
+	{ "janus-protocol", jamrtc_mock_ws_callback, sizeof(jamrtc_mock_client), 0 },
+	{ NULL, NULL, 0, 0 }
+};
+
+
+/* SIGINT/SIGTERM handler (dispatched on the main loop, so we can log safely) */
+static gboolean jamrtc_mock_handle_signal(gpointer user_data) {
+	JAMRTC_LOG(LOG_INFO, "Stopping the mock server...\n");
+	if(loop != NULL)
+		g_main_loop_quit(loop);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helper to parse the scripted delays */
+static gboolean jamrtc_mock_parse_delays(const char *text) {
+	if(text == NULL)
+		return TRUE;
+	gboolean ok = TRUE;
+	gchar **items = g_strsplit(text, ",", -1);
+	int i = 0, j = 0;
+	for(i=0; items[i] != NULL && ok; i++) {
+		gchar **kv = g_strsplit(g_strstrip(items[i]), "=", 2);
+		ok = FALSE;
+		if(kv[0] != NULL && kv[1] != NULL) {
+			for(j=0; j<JAMRTC_MOCK_DELAY_NUM; j++) {
+				if(!strcasecmp(kv[0], delay_names[j])) {
+					delays[j] = atoi(kv[1]);
+					ok = TRUE;
+					break;
+				}
+			}
+		}
+		if(!ok)
+			JAMRTC_LOG(LOG_FATAL, "Invalid scripted delay '%s'\n", items[i]);
+		g_strfreev(kv);
+	}
+	g_strfreev(items);
+	return ok;
+}
+
+/* Helper to generate random IDs */
+static guint64 jamrtc_mock_random_id(void) {
+	/* Keep them in the range JavaScript (and json-glib) can handle safely */
+	return ((guint64)g_random_int() << 21) ^ g_random_int();
+}
+
+/* Helper method to serialize a JsonObject to a string */
+static char *jamrtc_mock_json_to_string(JsonObject *object) {
+	/* Make it the root node */
+	JsonNode *root = json_node_init_object(json_node_alloc(), object);
+	JsonGenerator *generator = json_generator_new();
+	json_generator_set_root(generator, root);
+	char *text = json_generator_to_data(generator, NULL);
+
+	/* Release everything */
+	g_object_unref(generator);
+	json_node_free(root);
+	return text;
+}
+
+/* Helper to queue a message on a client connection: the client may be gone already */
+static void jamrtc_mock_deliver(guint64 client_id, char *text) {
+	jamrtc_mutex_lock(&clients_mutex);
+	jamrtc_mock_client *client = g_hash_table_lookup(clients, &client_id);
+	if(client == NULL) {
+		jamrtc_mutex_unlock(&clients_mutex);
+		g_free(text);
+		return;
+	}
+	JAMRTC_LOG(LOG_VERB, "[%"SCNu64"] Sending message: %s\n", client_id, text);
+	g_async_queue_push(client->messages, text);
+	g_atomic_int_inc(&messages_out);
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+	jamrtc_mutex_unlock(&clients_mutex);
+	lws_cancel_service(context);
+#else
+	/* On libwebsockets < 3.x we use lws_callback_on_writable */
+	if(client->wsi != NULL)
+		lws_callback_on_writable(client->wsi);
+	jamrtc_mutex_unlock(&clients_mutex);
+#endif
+}
+
+/* A message waiting for its scripted delay to expire */
+typedef struct jamrtc_mock_delayed {
+	guint64 client_id;
+	char *text;
+} jamrtc_mock_delayed;
+static gboolean jamrtc_mock_deliver_delayed(gpointer user_data) {
+	jamrtc_mock_delayed *delayed = (jamrtc_mock_delayed *)user_data;
+	jamrtc_mock_deliver(delayed->client_id, delayed->text);
+	g_free(delayed);
+	return G_SOURCE_REMOVE;
+}
+
+/* Helper to send a message to a client, after the scripted delay for its type */
+static void jamrtc_mock_send(guint64 client_id, JsonObject *msg, jamrtc_mock_delay type) {
+	char *text = jamrtc_mock_json_to_string(msg);
+	json_object_unref(msg);
+	guint delay = 0;
+	if(type < JAMRTC_MOCK_DELAY_NUM)
+		delay = delays[type] + (jitter ? g_random_int_range(0, jitter+1) : 0);
+	if(delay == 0) {
+		jamrtc_mock_deliver(client_id, text);
+		return;
+	}
+	jamrtc_mock_delayed *delayed = g_malloc(sizeof(jamrtc_mock_delayed));
+	delayed->client_id = client_id;
+	delayed->text = text;
+	g_timeout_add(delay, jamrtc_mock_deliver_delayed, delayed);
+}
+
+/* Helpers to prepare Janus API responses and events */
+static JsonObject *jamrtc_mock_response(const char *janus, guint64 session_id, const char *transaction) {
+	JsonObject *msg = json_object_new();
+	json_object_set_string_member(msg, "janus", janus);
+	if(session_id > 0)
+		json_object_set_int_member(msg, "session_id", session_id);
+	if(transaction != NULL)
+		json_object_set_string_member(msg, "transaction", transaction);
+	return msg;
+}
+static void jamrtc_mock_send_error(guint64 client_id, guint64 session_id, const char *transaction,
+		int code, const char *reason) {
+	JsonObject *msg = jamrtc_mock_response("error", session_id, transaction);
+	JsonObject *error = json_object_new();
+	json_object_set_int_member(error, "code", code);
+	json_object_set_string_member(error, "reason", reason);
+	json_object_set_object_member(msg, "error", error);
+	jamrtc_mock_send(client_id, msg, JAMRTC_MOCK_DELAY_NONE);
+}
+static void jamrtc_mock_send_event(jamrtc_mock_handle *handle, const char *transaction,
+		JsonObject *data, JsonObject *jsep, jamrtc_mock_delay type) {
+	if(handle->session == NULL) {
+		json_object_unref(data);
+		if(jsep)
+			json_object_unref(jsep);
+		return;
+	}
+	JsonObject *msg = jamrtc_mock_response("event", handle->session->id, transaction);
+	json_object_set_int_member(msg, "sender", handle->id);
+	JsonObject *plugindata = json_object_new();
+	json_object_set_string_member(plugindata, "plugin", "janus.plugin.videoroom");
+	json_object_set_object_member(plugindata, "data", data);
+	json_object_set_object_member(msg, "plugindata", plugindata);
+	if(jsep != NULL)
+		json_object_set_object_member(msg, "jsep", jsep);
+	jamrtc_mock_send(handle->session->client_id, msg, type);
+}
+static void jamrtc_mock_send_webrtcup(jamrtc_mock_handle *handle) {
+	if(no_webrtcup || handle->session == NULL)
+		return;
+	JsonObject *msg = jamrtc_mock_response("webrtcup", handle->session->id, NULL);
+	json_object_set_int_member(msg, "sender", handle->id);
+	jamrtc_mock_send(handle->session->client_id, msg, JAMRTC_MOCK_DELAY_WEBRTCUP);
+}
+
+/* Helper to craft an SDP answer webrtcbin will accept out of an offer: we
+ * keep the m-lines and codecs, but replace the transport info with ours */
+static char *jamrtc_mock_sdp_answer(const char *offer) {
+	gchar **lines = g_strsplit(offer, "\r\n", -1);
+	GString *answer = g_string_new(NULL);
+	int i = 0;
+	for(i=0; lines[i] != NULL; i++) {
+		const char *line = lines[i];
+		if(*line == '\0' || strstr(line, "a=candidate") == line || strstr(line, "a=end-of-candidates") == line ||
+				strstr(line, "a=ssrc") == line || strstr(line, "a=rid") == line ||
+				strstr(line, "a=simulcast") == line || strstr(line, "a=msid") == line)
+			continue;
+		if(strstr(line, "o=") == line)
+			g_string_append_printf(answer, "o=- %"SCNu32" 2 IN IP4 127.0.0.1", g_random_int());
+		else if(strstr(line, "a=ice-ufrag:") == line)
+			g_string_append(answer, "a=ice-ufrag:mock");
+		else if(strstr(line, "a=ice-pwd:") == line)
+			g_string_append(answer, "a=ice-pwd:mockmockmockmockmockmock");
+		else if(strstr(line, "a=fingerprint:") == line)
+			g_string_append(answer, fingerprint);
+		else if(strstr(line, "a=setup:") == line)
+			g_string_append(answer, "a=setup:active");
+		else if(!strcmp(line, "a=sendonly") || !strcmp(line, "a=sendrecv"))
+			g_string_append(answer, "a=recvonly");
+		else
+			g_string_append(answer, line);
+		g_string_append(answer, "\r\n");
+	}
+	g_strfreev(lines);
+	return g_string_free(answer, FALSE);
+}
+
+/* Helper to craft an SDP offer for a subscription: the m-lines are in the
+ * provided order, where 'a' is an audio m-line and 'v' is a video one */
+static char *jamrtc_mock_sdp_offer(guint64 feed, const char *mlines) {
+	GString *offer = g_string_new(NULL);
+	g_string_append_printf(offer, "v=0\r\no=- %"SCNu32" 2 IN IP4 127.0.0.1\r\ns=VideoRoom %"SCNu64"\r\nt=0 0\r\n",
+		g_random_int(), feed);
+	g_string_append(offer, "a=group:BUNDLE");
+	int mid = 0;
+	for(mid=0; mlines[mid] != '\0'; mid++)
+		g_string_append_printf(offer, " %d", mid);
+	g_string_append(offer, "\r\na=msid-semantic: WMS janus\r\n");
+	for(mid=0; mlines[mid] != '\0'; mid++) {
+		if(mlines[mid] == 'a') {
+			g_string_append_printf(offer, "m=audio 9 UDP/TLS/RTP/SAVPF 111\r\nc=IN IP4 127.0.0.1\r\n"
+				"a=sendonly\r\na=mid:%d\r\na=rtcp-mux\r\na=ice-ufrag:mock\r\na=ice-pwd:mockmockmockmockmockmock\r\n"
+				"a=ice-options:trickle\r\n%s\r\na=setup:actpass\r\na=rtpmap:111 opus/48000/2\r\n"
+				"a=ssrc:%"SCNu32" cname:janus\r\n", mid, fingerprint, g_random_int());
+		} else {
+			g_string_append_printf(offer, "m=video 9 UDP/TLS/RTP/SAVPF 96\r\nc=IN IP4 127.0.0.1\r\n"
+				"a=sendonly\r\na=mid:%d\r\na=rtcp-mux\r\na=ice-ufrag:mock\r\na=ice-pwd:mockmockmockmockmockmock\r\n"
+				"a=ice-options:trickle\r\n%s\r\na=setup:actpass\r\na=rtpmap:96 VP8/90000\r\n"
+				"a=rtcp-fb:96 nack\r\na=rtcp-fb:96 nack pli\r\na=rtcp-fb:96 ccm fir\r\n"
+				"a=ssrc:%"SCNu32" cname:janus\r\n", mid, fingerprint, g_random_int());
+		}
+	}
+	return g_string_free(offer, FALSE);
+}
+static JsonObject *jamrtc_mock_jsep(const char *type, char *sdp) {
+	JsonObject *jsep = json_object_new();
+	json_object_set_string_member(jsep, "type", type);
+	json_object_set_string_member(jsep, "sdp", sdp);
+	g_free(sdp);
+	return jsep;
+}
+
+/* Helper to describe a publisher the way the VideoRoom does */
+static JsonObject *jamrtc_mock_publisher(jamrtc_mock_handle *publisher) {
+	JsonObject *p = json_object_new();
+	json_object_set_int_member(p, "id", publisher->user_id);
+	if(publisher->display != NULL)
+		json_object_set_string_member(p, "display", publisher->display);
+	if(publisher->audio)
+		json_object_set_string_member(p, "audio_codec", "opus");
+	if(publisher->video)
+		json_object_set_string_member(p, "video_codec", "vp8");
+	if(publisher->streams != NULL)
+		json_object_set_array_member(p, "streams", json_array_ref(publisher->streams));
+	return p;
+}
+
+/* Helper to notify all real publishers in a room about something */
+static void jamrtc_mock_notify(jamrtc_mock_room *room, jamrtc_mock_handle *except, JsonObject *data) {
+	GHashTableIter iter;
+	gpointer value = NULL;
+	g_hash_table_iter_init(&iter, room->participants);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		jamrtc_mock_handle *h = (jamrtc_mock_handle *)value;
+		if(h == except || h->session == NULL)
+			continue;
+		JsonObject *event = json_object_new();
+		json_object_set_string_member(event, "videoroom", "event");
+		json_object_set_int_member(event, "room", room->id);
+		GList *members = json_object_get_members(data), *m = members;
+		while(m) {
+			json_object_set_member(event, m->data, json_node_copy(json_object_get_member(data, m->data)));
+			m = m->next;
+		}
+		g_list_free(members);
+		jamrtc_mock_send_event(h, NULL, event, NULL, JAMRTC_MOCK_DELAY_EVENT);
+	}
+	json_object_unref(data);
+}
+static void jamrtc_mock_notify_publisher(jamrtc_mock_room *room, jamrtc_mock_handle *publisher) {
+	JsonObject *data = json_object_new();
+	JsonArray *list = json_array_new();
+	json_array_add_object_element(list, jamrtc_mock_publisher(publisher));
+	json_object_set_array_member(data, "publishers", list);
+	jamrtc_mock_notify(room, publisher, data);
+}
+static void jamrtc_mock_notify_leaving(jamrtc_mock_room *room, jamrtc_mock_handle *publisher) {
+	JsonObject *data = json_object_new();
+	json_object_set_int_member(data, "leaving", publisher->user_id);
+	jamrtc_mock_notify(room, publisher, data);
+}
+
+/* Helper to remove a publisher from its room, notifying the others */
+static void jamrtc_mock_leave(jamrtc_mock_handle *handle) {
+	if(!handle->publisher || handle->room == 0)
+		return;
+	jamrtc_mock_room *room = g_hash_table_lookup(rooms, &handle->room);
+	if(room == NULL)
+		return;
+	if(g_hash_table_lookup(room->participants, &handle->user_id) == handle) {
+		g_hash_table_steal(room->participants, &handle->user_id);
+		jamrtc_mock_notify_leaving(room, handle);
+	}
+	handle->room = 0;
+}
+
+/* Helpers to get rid of handles and sessions */
+static void jamrtc_mock_handle_free(jamrtc_mock_handle *handle) {
+	g_free(handle->display);
+	if(handle->streams != NULL)
+		json_array_unref(handle->streams);
+	g_free(handle);
+}
+static void jamrtc_mock_session_destroy(jamrtc_mock_session *session) {
+	GHashTableIter iter;
+	gpointer value = NULL;
+	g_hash_table_iter_init(&iter, session->handles);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+		jamrtc_mock_leave((jamrtc_mock_handle *)value);
+	g_hash_table_destroy(session->handles);
+	g_hash_table_remove(sessions, &session->id);
+	g_free(session);
+}
+
+/* Helper to add a handle to a room as a publisher */
+static jamrtc_mock_room *jamrtc_mock_join(jamrtc_mock_handle *handle, guint64 room_id, const char *display) {
+	jamrtc_mock_room *room = g_hash_table_lookup(rooms, &room_id);
+	if(room == NULL) {
+		JAMRTC_LOG(LOG_INFO, "Creating room %"SCNu64"\n", room_id);
+		room = g_malloc0(sizeof(jamrtc_mock_room));
+		room->id = room_id;
+		room->participants = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, NULL);
+		g_hash_table_insert(rooms, &room->id, room);
+	}
+	handle->publisher = TRUE;
+	handle->room = room_id;
+	handle->user_id = jamrtc_mock_random_id();
+	handle->display = g_strdup(display);
+	g_hash_table_insert(room->participants, &handle->user_id, handle);
+	if(handle->session->joined == 0)
+		handle->session->joined = g_get_monotonic_time();
+	/* If we're benchmarking and waiting for a room, this is it */
+	if(bench_num > 0 && bench_target == NULL && (bench_room == 0 || bench_room == room_id))
+		bench_target = room;
+	return room;
+}
+
+/* Helper to handle an SDP offer from a publisher */
+static JsonObject *jamrtc_mock_publish(jamrtc_mock_handle *handle, JsonObject *jsep) {
+	const char *sdp = json_object_get_string_member(jsep, "sdp");
+	if(sdp == NULL)
+		return NULL;
+	handle->audio = strstr(sdp, "m=audio") != NULL;
+	handle->video = strstr(sdp, "m=video") != NULL;
+	handle->published = TRUE;
+	/* Take note of all the m-lines, as the multistream VideoRoom does */
+	if(handle->streams != NULL)
+		json_array_unref(handle->streams);
+	handle->streams = json_array_new();
+	gchar **lines = g_strsplit(sdp, "\r\n", -1);
+	JsonObject *stream = NULL;
+	int i = 0, mindex = 0;
+	for(i=0; lines[i] != NULL; i++) {
+		if(g_str_has_prefix(lines[i], "m=audio") || g_str_has_prefix(lines[i], "m=video")) {
+			stream = json_object_new();
+			json_object_set_string_member(stream, "type", g_str_has_prefix(lines[i], "m=audio") ? "audio" : "video");
+			json_object_set_int_member(stream, "mindex", mindex);
+			json_object_set_string_member(stream, "codec", g_str_has_prefix(lines[i], "m=audio") ? "opus" : "vp8");
+			json_array_add_object_element(handle->streams, stream);
+			mindex++;
+		} else if(g_str_has_prefix(lines[i], "m=")) {
+			stream = NULL;
+			mindex++;
+		} else if(stream != NULL && g_str_has_prefix(lines[i], "a=mid:")) {
+			json_object_set_string_member(stream, "mid", lines[i] + strlen("a=mid:"));
+		}
+	}
+	g_strfreev(lines);
+	if(handle->session->published == 0)
+		handle->session->published = g_get_monotonic_time();
+	return jamrtc_mock_jsep("answer", jamrtc_mock_sdp_answer(sdp));
+}
+
+/* Helper to apply the stream descriptions a publisher provided */
+static void jamrtc_mock_describe(jamrtc_mock_handle *handle, JsonObject *body) {
+	if(handle->streams == NULL || !json_object_has_member(body, "descriptions"))
+		return;
+	JsonArray *descriptions = json_object_get_array_member(body, "descriptions");
+	guint i = 0, j = 0;
+	for(i=0; i<json_array_get_length(descriptions); i++) {
+		JsonObject *d = json_array_get_object_element(descriptions, i);
+		if(d == NULL || !json_object_has_member(d, "mid") || !json_object_has_member(d, "description"))
+			continue;
+		const char *mid = json_object_get_string_member(d, "mid");
+		for(j=0; j<json_array_get_length(handle->streams); j++) {
+			JsonObject *stream = json_array_get_object_element(handle->streams, j);
+			if(json_object_has_member(stream, "mid") && !strcmp(json_object_get_string_member(stream, "mid"), mid))
+				json_object_set_string_member(stream, "description", json_object_get_string_member(d, "description"));
+		}
+	}
+}
+
+/* Helper to figure out the m-lines of a subscription, e.g., "av" for audio
+ * and video: if specific streams are requested, they're in that order */
+static char *jamrtc_mock_subscription(jamrtc_mock_handle *publisher, JsonArray *requested) {
+	GString *mlines = g_string_new(NULL);
+	if(requested == NULL || publisher->streams == NULL) {
+		if(publisher->audio)
+			g_string_append_c(mlines, 'a');
+		if(publisher->video)
+			g_string_append_c(mlines, 'v');
+		return g_string_free(mlines, FALSE);
+	}
+	guint i = 0, j = 0;
+	for(i=0; i<json_array_get_length(requested); i++) {
+		JsonObject *r = json_array_get_object_element(requested, i);
+		if(r == NULL || !json_object_has_member(r, "mid"))
+			continue;
+		const char *mid = json_object_get_string_member(r, "mid");
+		for(j=0; j<json_array_get_length(publisher->streams); j++) {
+			JsonObject *stream = json_array_get_object_element(publisher->streams, j);
+			if(json_object_has_member(stream, "mid") && !strcmp(json_object_get_string_member(stream, "mid"), mid)) {
+				g_string_append_c(mlines, strcmp(json_object_get_string_member(stream, "type"), "video") ? 'a' : 'v');
+				break;
+			}
+		}
+	}
+	return g_string_free(mlines, FALSE);
+}
+
+/* Handler for VideoRoom requests */
+static void jamrtc_mock_videoroom(jamrtc_mock_handle *handle, const char *transaction,
+		JsonObject *body, JsonObject *jsep) {
+	guint64 client_id = handle->session->client_id;
+	const char *request = json_object_has_member(body, "request") ?
+		json_object_get_string_member(body, "request") : NULL;
+	if(request == NULL) {
+		jamrtc_mock_send_error(client_id, handle->session->id, transaction, 456, "Missing element (request)");
+		return;
+	}
+	JsonObject *data = json_object_new();
+	if(!strcasecmp(request, "join") || !strcasecmp(request, "joinandconfigure")) {
+		const char *ptype = json_object_has_member(body, "ptype") ? json_object_get_string_member(body, "ptype") : NULL;
+		guint64 room_id = json_object_has_member(body, "room") ? json_object_get_int_member(body, "room") : 0;
+		if(ptype == NULL || room_id == 0 || handle->room != 0) {
+			json_object_set_string_member(data, "videoroom", "event");
+			json_object_set_int_member(data, "error_code", 425);
+			json_object_set_string_member(data, "error", "Invalid join request");
+			jamrtc_mock_send_event(handle, transaction, data, NULL, JAMRTC_MOCK_DELAY_JOIN);
+			return;
+		}
+		if(!strcasecmp(ptype, "publisher")) {
+			const char *display = json_object_has_member(body, "display") ?
+				json_object_get_string_member(body, "display") : NULL;
+			jamrtc_mock_room *room = jamrtc_mock_join(handle, room_id, display);
+			JsonObject *answer = NULL;
+			if(jsep != NULL && !strcasecmp(request, "joinandconfigure")) {
+				answer = jamrtc_mock_publish(handle, jsep);
+				jamrtc_mock_describe(handle, body);
+			}
+			/* Send the list of publishers that are already in */
+			json_object_set_string_member(data, "videoroom", "joined");
+			json_object_set_int_member(data, "room", room_id);
+			json_object_set_int_member(data, "id", handle->user_id);
+			json_object_set_int_member(data, "private_id", jamrtc_mock_random_id());
+			JsonArray *list = json_array_new();
+			GHashTableIter iter;
+			gpointer value = NULL;
+			g_hash_table_iter_init(&iter, room->participants);
+			while(g_hash_table_iter_next(&iter, NULL, &value)) {
+				jamrtc_mock_handle *p = (jamrtc_mock_handle *)value;
+				if(p != handle && p->published)
+					json_array_add_object_element(list, jamrtc_mock_publisher(p));
+			}
+			json_object_set_array_member(data, "publishers", list);
+			jamrtc_mock_send_event(handle, transaction, data, answer,
+				answer ? JAMRTC_MOCK_DELAY_CONFIGURE : JAMRTC_MOCK_DELAY_JOIN);
+			if(answer != NULL) {
+				jamrtc_mock_notify_publisher(room, handle);
+				jamrtc_mock_send_webrtcup(handle);
+			}
+		} else {
+			/* Subscriber: either to a feed, or to specific streams of a feed */
+			guint64 feed = json_object_has_member(body, "feed") ? json_object_get_int_member(body, "feed") : 0;
+			JsonArray *requested = json_object_has_member(body, "streams") ? json_object_get_array_member(body, "streams") : NULL;
+			if(feed == 0 && requested != NULL && json_array_get_length(requested) > 0) {
+				JsonObject *r = json_array_get_object_element(requested, 0);
+				if(r != NULL && json_object_has_member(r, "feed"))
+					feed = json_object_get_int_member(r, "feed");
+			}
+			jamrtc_mock_room *room = g_hash_table_lookup(rooms, &room_id);
+			jamrtc_mock_handle *publisher = room ? g_hash_table_lookup(room->participants, &feed) : NULL;
+			if(publisher == NULL || !publisher->published) {
+				json_object_set_string_member(data, "videoroom", "event");
+				json_object_set_int_member(data, "error_code", 428);
+				json_object_set_string_member(data, "error", "No such feed");
+				jamrtc_mock_send_event(handle, transaction, data, NULL, JAMRTC_MOCK_DELAY_JOIN);
+				return;
+			}
+			handle->room = room_id;
+			handle->feed = feed;
+			if(publisher->announced > 0 && bench_join_latencies != NULL) {
+				gint64 latency = g_get_monotonic_time() - publisher->announced;
+				g_array_append_val(bench_join_latencies, latency);
+			}
+			json_object_set_string_member(data, "videoroom", "attached");
+			json_object_set_int_member(data, "room", room_id);
+			json_object_set_int_member(data, "id", feed);
+			if(publisher->display != NULL)
+				json_object_set_string_member(data, "display", publisher->display);
+			char *mlines = jamrtc_mock_subscription(publisher, requested);
+			jamrtc_mock_send_event(handle, transaction, data,
+				jamrtc_mock_jsep("offer", jamrtc_mock_sdp_offer(feed, mlines)),
+				JAMRTC_MOCK_DELAY_JOIN);
+			g_free(mlines);
+		}
+	} else if(!strcasecmp(request, "configure")) {
+		JsonObject *answer = NULL;
+		if(jsep != NULL && handle->publisher) {
+			answer = jamrtc_mock_publish(handle, jsep);
+			jamrtc_mock_describe(handle, body);
+		}
+		if(json_object_has_member(body, "display") && handle->publisher) {
+			/* Display change: let the others know, as the VideoRoom does */
+			g_free(handle->display);
+			handle->display = g_strdup(json_object_get_string_member(body, "display"));
+			jamrtc_mock_room *room = g_hash_table_lookup(rooms, &handle->room);
+			if(room != NULL) {
+				JsonObject *changed = json_object_new();
+				json_object_set_int_member(changed, "id", handle->user_id);
+				json_object_set_string_member(changed, "display", handle->display);
+				jamrtc_mock_notify(room, handle, changed);
+			}
+		}
+		json_object_set_string_member(data, "videoroom", "event");
+		json_object_set_int_member(data, "room", handle->room);
+		json_object_set_string_member(data, "configured", "ok");
+		jamrtc_mock_send_event(handle, transaction, data, answer, JAMRTC_MOCK_DELAY_CONFIGURE);
+		if(answer != NULL) {
+			jamrtc_mock_room *room = g_hash_table_lookup(rooms, &handle->room);
+			if(room != NULL)
+				jamrtc_mock_notify_publisher(room, handle);
+			jamrtc_mock_send_webrtcup(handle);
+		}
+	} else if(!strcasecmp(request, "start")) {
+		json_object_set_string_member(data, "videoroom", "event");
+		json_object_set_int_member(data, "room", handle->room);
+		json_object_set_string_member(data, "started", "ok");
+		jamrtc_mock_send_event(handle, transaction, data, NULL, JAMRTC_MOCK_DELAY_START);
+		jamrtc_mock_send_webrtcup(handle);
+		/* If this is a subscription to a fake publisher, take note of the latency */
+		jamrtc_mock_room *room = g_hash_table_lookup(rooms, &handle->room);
+		jamrtc_mock_handle *publisher = room ? g_hash_table_lookup(room->participants, &handle->feed) : NULL;
+		if(publisher != NULL && publisher->announced > 0 && bench_start_latencies != NULL) {
+			gint64 latency = g_get_monotonic_time() - publisher->announced;
+			g_array_append_val(bench_start_latencies, latency);
+		}
+	} else if(!strcasecmp(request, "unpublish") || !strcasecmp(request, "leave")) {
+		json_object_set_string_member(data, "videoroom", "event");
+		json_object_set_int_member(data, "room", handle->room);
+		if(!strcasecmp(request, "leave")) {
+			json_object_set_string_member(data, "leaving", "ok");
+			jamrtc_mock_leave(handle);
+		} else {
+			json_object_set_string_member(data, "unpublished", "ok");
+			handle->published = FALSE;
+		}
+		jamrtc_mock_send_event(handle, transaction, data, NULL, JAMRTC_MOCK_DELAY_EVENT);
+	} else {
+		json_object_set_string_member(data, "videoroom", "event");
+		json_object_set_int_member(data, "error_code", 423);
+		json_object_set_string_member(data, "error", "Unsupported request");
+		jamrtc_mock_send_event(handle, transaction, data, NULL, JAMRTC_MOCK_DELAY_EVENT);
+	}
+}
+
+/* Handler for Janus API requests: we're called with the mutex locked */
+static void jamrtc_mock_request(jamrtc_mock_client *client, JsonObject *object) {
+	const char *janus = json_object_has_member(object, "janus") ? json_object_get_string_member(object, "janus") : NULL;
+	const char *transaction = json_object_has_member(object, "transaction") ?
+		json_object_get_string_member(object, "transaction") : NULL;
+	if(janus == NULL || transaction == NULL) {
+		jamrtc_mock_send_error(client->id, 0, transaction, 456, "Missing mandatory element (janus or transaction)");
+		return;
+	}
+	if(!strcasecmp(janus, "create")) {
+		jamrtc_mock_session *session = g_malloc0(sizeof(jamrtc_mock_session));
+		session->id = jamrtc_mock_random_id();
+		session->client_id = client->id;
+		session->created = g_get_monotonic_time();
+		session->handles = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)jamrtc_mock_handle_free);
+		g_hash_table_insert(sessions, &session->id, session);
+		client->sessions = g_list_append(client->sessions, session);
+		JsonObject *msg = jamrtc_mock_response("success", 0, transaction);
+		JsonObject *data = json_object_new();
+		json_object_set_int_member(data, "id", session->id);
+		json_object_set_object_member(msg, "data", data);
+		jamrtc_mock_send(client->id, msg, JAMRTC_MOCK_DELAY_CREATE);
+		return;
+	}
+	/* Everything else needs a session */
+	guint64 session_id = json_object_has_member(object, "session_id") ? json_object_get_int_member(object, "session_id") : 0;
+	jamrtc_mock_session *session = g_hash_table_lookup(sessions, &session_id);
+	if(session == NULL || session->client_id != client->id) {
+		jamrtc_mock_send_error(client->id, session_id, transaction, 458, "No such session");
+		return;
+	}
+	if(!strcasecmp(janus, "keepalive")) {
+		jamrtc_mock_send(client->id, jamrtc_mock_response("ack", session_id, transaction), JAMRTC_MOCK_DELAY_NONE);
+	} else if(!strcasecmp(janus, "destroy")) {
+		client->sessions = g_list_remove(client->sessions, session);
+		jamrtc_mock_session_destroy(session);
+		jamrtc_mock_send(client->id, jamrtc_mock_response("success", session_id, transaction), JAMRTC_MOCK_DELAY_DETACH);
+	} else if(!strcasecmp(janus, "attach")) {
+		const char *plugin = json_object_has_member(object, "plugin") ? json_object_get_string_member(object, "plugin") : NULL;
+		if(plugin == NULL || strcasecmp(plugin, "janus.plugin.videoroom")) {
+			jamrtc_mock_send_error(client->id, session_id, transaction, 460, "No such plugin");
+			return;
+		}
+		jamrtc_mock_handle *handle = g_malloc0(sizeof(jamrtc_mock_handle));
+		handle->id = jamrtc_mock_random_id();
+		handle->session = session;
+		g_hash_table_insert(session->handles, &handle->id, handle);
+		JsonObject *msg = jamrtc_mock_response("success", session_id, transaction);
+		JsonObject *data = json_object_new();
+		json_object_set_int_member(data, "id", handle->id);
+		json_object_set_object_member(msg, "data", data);
+		jamrtc_mock_send(client->id, msg, JAMRTC_MOCK_DELAY_ATTACH);
+	} else {
+		/* Everything else needs a handle */
+		guint64 handle_id = json_object_has_member(object, "handle_id") ? json_object_get_int_member(object, "handle_id") : 0;
+		jamrtc_mock_handle *handle = g_hash_table_lookup(session->handles, &handle_id);
+		if(handle == NULL) {
+			jamrtc_mock_send_error(client->id, session_id, transaction, 459, "No such handle");
+			return;
+		}
+		if(!strcasecmp(janus, "trickle")) {
+			/* We don't do ICE, so we just acknowledge candidates */
+			jamrtc_mock_send(client->id, jamrtc_mock_response("ack", session_id, transaction), JAMRTC_MOCK_DELAY_NONE);
+		} else if(!strcasecmp(janus, "detach")) {
+			jamrtc_mock_leave(handle);
+			g_hash_table_remove(session->handles, &handle_id);
+			jamrtc_mock_send(client->id, jamrtc_mock_response("success", session_id, transaction), JAMRTC_MOCK_DELAY_DETACH);
+		} else if(!strcasecmp(janus, "message")) {
+			JsonObject *body = json_object_has_member(object, "body") ? json_object_get_object_member(object, "body") : NULL;
+			if(body == NULL) {
+				jamrtc_mock_send_error(client->id, session_id, transaction, 456, "Missing mandatory element (body)");
+				return;
+			}
+			/* Plugin requests are asynchronous: ack first, and send the event later */
+			jamrtc_mock_send(client->id, jamrtc_mock_response("ack", session_id, transaction), JAMRTC_MOCK_DELAY_NONE);
+			JsonObject *jsep = json_object_has_member(object, "jsep") ? json_object_get_object_member(object, "jsep") : NULL;
+			jamrtc_mock_videoroom(handle, transaction, body, jsep);
+		} else {
+			jamrtc_mock_send_error(client->id, session_id, transaction, 453, "Unknown request");
+		}
+	}
+}
+
+/* Handler for messages coming from clients */
+static void jamrtc_mock_message(jamrtc_mock_client *client, const char *text) {
+	JAMRTC_LOG(LOG_VERB, "[%"SCNu64"] Got message: %s\n", client->id, text);
+	g_atomic_int_inc(&messages_in);
+	JsonParser *parser = json_parser_new();
+	GError *error = NULL;
+	if(!json_parser_load_from_data(parser, text, -1, &error)) {
+		JAMRTC_LOG(LOG_WARN, "[%"SCNu64"] Error parsing message: %s\n", client->id, error->message);
+		g_error_free(error);
+		g_object_unref(parser);
+		return;
+	}
+	JsonNode *root = json_parser_get_root(parser);
+	if(JSON_NODE_HOLDS_OBJECT(root)) {
+		jamrtc_mutex_lock(&mutex);
+		jamrtc_mock_request(client, json_node_get_object(root));
+		jamrtc_mutex_unlock(&mutex);
+	}
+	g_object_unref(parser);
+}
+
+/* Thread to implement the WebSockets loop */
+static gpointer jamrtc_mock_ws_thread(gpointer data) {
+	JAMRTC_LOG(LOG_VERB, "Joining mock server WebSocket thread\n");
+	while(!g_atomic_int_get(&stopping)) {
+		/* Loop until we have to stop */
+		lws_service(context, 50);
+	}
+	JAMRTC_LOG(LOG_VERB, "Leaving mock server WebSocket thread\n");
+	return NULL;
+}
+
+/* Handler for all libwebsockets events */
+static int jamrtc_mock_ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+	jamrtc_mock_client *client = (jamrtc_mock_client *)user;
+	switch(reason) {
+		case LWS_CALLBACK_ESTABLISHED: {
+			memset(client, 0, sizeof(jamrtc_mock_client));
+			client->wsi = wsi;
+			client->messages = g_async_queue_new_full(g_free);
+			jamrtc_mutex_lock(&clients_mutex);
+			client->id = ++client_ids;
+			g_hash_table_insert(clients, &client->id, client);
+			jamrtc_mutex_unlock(&clients_mutex);
+			JAMRTC_LOG(LOG_INFO, "[%"SCNu64"] New client connected\n", client->id);
+			return 0;
+		}
+		case LWS_CALLBACK_RECEIVE: {
+			/* Is this a new message, or part of a fragmented one? */
+			const size_t remaining = lws_remaining_packet_payload(wsi);
+			if(client->incoming == NULL) {
+				client->incoming = g_malloc(len+1);
+				memcpy(client->incoming, in, len);
+				client->incoming[len] = '\0';
+			} else {
+				size_t offset = strlen(client->incoming);
+				client->incoming = g_realloc(client->incoming, offset+len+1);
+				memcpy(client->incoming+offset, in, len);
+				client->incoming[offset+len] = '\0';
+			}
+			if(remaining > 0 || !lws_is_final_fragment(wsi))
+				return 0;
+			jamrtc_mock_message(client, client->incoming);
+			g_free(client->incoming);
+			client->incoming = NULL;
+			return 0;
+		}
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+		/* On libwebsockets >= 3.x, we use this event to mark connections as writable in the event loop */
+		case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+			jamrtc_mutex_lock(&clients_mutex);
+			GHashTableIter iter;
+			gpointer value = NULL;
+			g_hash_table_iter_init(&iter, clients);
+			while(g_hash_table_iter_next(&iter, NULL, &value)) {
+				jamrtc_mock_client *c = (jamrtc_mock_client *)value;
+				if(g_async_queue_length(c->messages) > 0)
+					lws_callback_on_writable(c->wsi);
+			}
+			jamrtc_mutex_unlock(&clients_mutex);
+			return 0;
+		}
+#endif
+		case LWS_CALLBACK_SERVER_WRITEABLE: {
+			if(client == NULL || client->messages == NULL || g_atomic_int_get(&stopping))
+				return 0;
+			/* Check if we have a pending/partial write to complete first */
+			if(client->buffer && client->bufpending > 0 && client->bufoffset > 0) {
+				int sent = lws_write(wsi, client->buffer + client->bufoffset, client->bufpending, LWS_WRITE_TEXT);
+				if(sent > -1 && sent < client->bufpending) {
+					client->bufpending -= sent;
+					client->bufoffset += sent;
+				} else {
+					client->bufpending = 0;
+					client->bufoffset = 0;
+				}
+				lws_callback_on_writable(wsi);
+				return 0;
+			}
+			/* Shoot the next pending message */
+			char *event = g_async_queue_try_pop(client->messages);
+			if(event != NULL) {
+				int buflen = LWS_PRE + strlen(event);
+				if(client->buffer == NULL || buflen > client->buflen) {
+					client->buflen = buflen;
+					client->buffer = g_realloc(client->buffer, buflen);
+				}
+				memcpy(client->buffer + LWS_PRE, event, strlen(event));
+				int sent = lws_write(wsi, client->buffer + LWS_PRE, strlen(event), LWS_WRITE_TEXT);
+				if(sent > -1 && sent < (int)strlen(event)) {
+					/* We couldn't send everything in a single write, we'll complete this in the next round */
+					client->bufpending = strlen(event) - sent;
+					client->bufoffset = LWS_PRE + sent;
+				}
+				g_free(event);
+				lws_callback_on_writable(wsi);
+			}
+			return 0;
+		}
+		case LWS_CALLBACK_CLOSED: {
+			if(client == NULL || client->messages == NULL)
+				return 0;
+			JAMRTC_LOG(LOG_INFO, "[%"SCNu64"] Client disconnected\n", client->id);
+			/* Get rid of all the sessions this client created */
+			jamrtc_mutex_lock(&clients_mutex);
+			g_hash_table_remove(clients, &client->id);
+			jamrtc_mutex_unlock(&clients_mutex);
+			jamrtc_mutex_lock(&mutex);
+			g_list_free_full(client->sessions, (GDestroyNotify)jamrtc_mock_session_destroy);
+			client->sessions = NULL;
+			jamrtc_mutex_unlock(&mutex);
+			g_async_queue_unref(client->messages);
+			client->messages = NULL;
+			g_free(client->incoming);
+			g_free(client->buffer);
+			return 0;
+		}
+		default:
+			break;
+	}
+	return 0;
+}
+
+/* Helper to compare latencies when sorting them */
+static gint jamrtc_mock_compare_latencies(gconstpointer a, gconstpointer b) {
+	gint64 la = *(gint64 *)a, lb = *(gint64 *)b;
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+/* Helper to log a latency distribution */
+static void jamrtc_mock_report_latencies(const char *name, GArray *latencies) {
+	if(latencies == NULL || latencies->len == 0) {
+		JAMRTC_LOG(LOG_INFO, "  -- %s: no samples\n", name);
+		return;
+	}
+	g_array_sort(latencies, jamrtc_mock_compare_latencies);
+	guint n = latencies->len;
+	JAMRTC_LOG(LOG_INFO, "  -- %s: %u samples, min %.1fms, p50 %.1fms, p95 %.1fms, p99 %.1fms, max %.1fms\n",
+		name, n,
+		(double)g_array_index(latencies, gint64, 0)/1000,
+		(double)g_array_index(latencies, gint64, n/2)/1000,
+		(double)g_array_index(latencies, gint64, MIN(n-1, n*95/100))/1000,
+		(double)g_array_index(latencies, gint64, MIN(n-1, n*99/100))/1000,
+		(double)g_array_index(latencies, gint64, n-1)/1000);
+}
+
+/* Helper to count subscriber handles whose publisher is gone (must be called with the mutex) */
+static guint jamrtc_mock_stale_subscriptions(void) {
+	guint stale = 0;
+	GHashTableIter iter, hiter;
+	gpointer value = NULL;
+	g_hash_table_iter_init(&iter, sessions);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		jamrtc_mock_session *session = (jamrtc_mock_session *)value;
+		g_hash_table_iter_init(&hiter, session->handles);
+		while(g_hash_table_iter_next(&hiter, NULL, &value)) {
+			jamrtc_mock_handle *handle = (jamrtc_mock_handle *)value;
+			if(handle->publisher || handle->feed == 0)
+				continue;
+			jamrtc_mock_room *room = g_hash_table_lookup(rooms, &handle->room);
+			if(room == NULL || g_hash_table_lookup(room->participants, &handle->feed) == NULL)
+				stale++;
+		}
+	}
+	return stale;
+}
+
+/* Helper to log what happened so far */
+static void jamrtc_mock_report(void) {
+	gint64 now = g_get_monotonic_time();
+	double elapsed = (double)(now - started)/G_USEC_PER_SEC;
+	JAMRTC_LOG(LOG_INFO, "Signalling report (%.1fs):\n", elapsed);
+	JAMRTC_LOG(LOG_INFO, "  -- Messages: %d in (%.1f/s), %d out (%.1f/s)\n",
+		g_atomic_int_get(&messages_in), elapsed > 0 ? g_atomic_int_get(&messages_in)/elapsed : 0.0,
+		g_atomic_int_get(&messages_out), elapsed > 0 ? g_atomic_int_get(&messages_out)/elapsed : 0.0);
+	jamrtc_mutex_lock(&mutex);
+	GHashTableIter iter;
+	gpointer value = NULL;
+	g_hash_table_iter_init(&iter, sessions);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		jamrtc_mock_session *session = (jamrtc_mock_session *)value;
+		if(session->joined == 0)
+			continue;
+		JAMRTC_LOG(LOG_INFO, "  -- Session %"SCNu64": joined %.1fms after create, published %.1fms after create\n",
+			session->id, (double)(session->joined - session->created)/1000,
+			session->published ? (double)(session->published - session->created)/1000 : 0.0);
+	}
+	if(bench_num > 0) {
+		double bench_elapsed = bench_started ? (double)(now - bench_started)/G_USEC_PER_SEC : 0.0;
+		guint subscriptions = bench_start_latencies ? bench_start_latencies->len : 0;
+		JAMRTC_LOG(LOG_INFO, "  -- Benchmark: %u/%u fake publishers injected, %u subscriptions started (%.1f/s)\n",
+			bench_injected, bench_num, subscriptions, bench_elapsed > 0 ? subscriptions/bench_elapsed : 0.0);
+		jamrtc_mock_report_latencies("Publisher announced to subscriber join", bench_join_latencies);
+		jamrtc_mock_report_latencies("Publisher announced to subscription started", bench_start_latencies);
+		bench_leaked = jamrtc_mock_stale_subscriptions();
+		int log_level = bench_leaked > 0 ? LOG_ERR : LOG_INFO;
+		JAMRTC_LOG(log_level, "  -- Subscriber handles still attached to fake publishers that left: %u\n", bench_leaked);
+	}
+	jamrtc_mutex_unlock(&mutex);
+}
+
+/* Benchmark: timer callback to wrap up, once subscribers had time to detach */
+static gboolean jamrtc_mock_bench_done(gpointer user_data) {
+	JAMRTC_LOG(LOG_INFO, "Benchmark completed\n");
+	g_main_loop_quit(loop);
+	return G_SOURCE_REMOVE;
+}
+
+/* Benchmark: timer callback to remove a fake publisher */
+static gboolean jamrtc_mock_bench_leave(gpointer user_data) {
+	jamrtc_mock_handle *publisher = (jamrtc_mock_handle *)user_data;
+	jamrtc_mutex_lock(&mutex);
+	jamrtc_mock_leave(publisher);
+	jamrtc_mock_handle_free(publisher);
+	bench_left++;
+	gboolean done = (bench_left == bench_num);
+	jamrtc_mutex_unlock(&mutex);
+	if(done) {
+		/* All fake publishers came and went: give subscribers some time to detach */
+		g_timeout_add(JAMRTC_MOCK_BENCH_GRACE, jamrtc_mock_bench_done, NULL);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* Benchmark: timer callback to inject fake publishers at the configured rate */
+static gboolean jamrtc_mock_bench_inject(gpointer user_data) {
+	jamrtc_mutex_lock(&mutex);
+	if(bench_target == NULL) {
+		/* Nobody joined yet */
+		jamrtc_mutex_unlock(&mutex);
+		return G_SOURCE_CONTINUE;
+	}
+	gint64 now = g_get_monotonic_time();
+	if(bench_started == 0) {
+		JAMRTC_LOG(LOG_INFO, "Starting benchmark in room %"SCNu64"\n", bench_target->id);
+		bench_started = now;
+	}
+	/* Inject as many publishers as needed to keep up with the rate */
+	guint expected = 1 + (guint)((now - bench_started) * bench_rate / G_USEC_PER_SEC);
+	while(bench_injected < MIN(expected, bench_num)) {
+		bench_injected++;
+		jamrtc_mock_handle *publisher = g_malloc0(sizeof(jamrtc_mock_handle));
+		publisher->publisher = TRUE;
+		publisher->published = TRUE;
+		publisher->audio = TRUE;
+		publisher->room = bench_target->id;
+		publisher->user_id = jamrtc_mock_random_id();
+		/* Use the same stringified JSON display JamRTC uses */
+		char *uuid = g_uuid_string_random();
+		publisher->display = g_strdup_printf("{\"uuid\":\"%s\",\"display\":\"Bench%u\",\"instrument\":\"bench\"}",
+			uuid, bench_injected);
+		g_free(uuid);
+		publisher->announced = g_get_monotonic_time();
+		g_hash_table_insert(bench_target->participants, &publisher->user_id, publisher);
+		jamrtc_mock_notify_publisher(bench_target, publisher);
+		g_timeout_add(bench_lifetime, jamrtc_mock_bench_leave, publisher);
+	}
+	gboolean done = (bench_injected == bench_num);
+	jamrtc_mutex_unlock(&mutex);
+	if(done) {
+		bench_timer = 0;
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+/* Main application */
+int main(int argc, char *argv[]) {
+
+	/* Parse the command-line arguments */
+	GError *error = NULL;
+	GOptionContext *opts = g_option_context_new("-- Local Janus VideoRoom stand-in for JamRTC");
+	g_option_context_set_help_enabled(opts, TRUE);
+	g_option_context_add_main_entries(opts, opt_entries, NULL);
+	if(!g_option_context_parse(opts, &argc, &argv, &error)) {
+		g_error_free(error);
+		exit(1);
+	}
+	/* Assign some defaults */
+	if(ws_port == 0)
+		ws_port = 8188;
+	if(bench_rate == 0)
+		bench_rate = 10;
+	if(bench_lifetime == 0)
+		bench_lifetime = 2000;
+	if(!jamrtc_mock_parse_delays(delays_text)) {
+		g_option_context_free(opts);
+		exit(1);
+	}
+	/* Logging level: default is info and no timestamps */
+	if(jamrtc_log_level == 0)
+		jamrtc_log_level = LOG_INFO;
+	if(jamrtc_log_level < LOG_NONE)
+		jamrtc_log_level = 0;
+	else if(jamrtc_log_level > LOG_MAX)
+		jamrtc_log_level = LOG_MAX;
+
+	JAMRTC_LOG(LOG_INFO, "\n----------------------------------\n");
+	JAMRTC_LOG(LOG_INFO, "JamRTC mock Janus VideoRoom\n");
+	JAMRTC_LOG(LOG_INFO, "----------------------------------\n\n");
+	JAMRTC_LOG(LOG_INFO, "Listening on: ws://127.0.0.1:%u\n", ws_port);
+	int i = 0;
+	for(i=0; i<JAMRTC_MOCK_DELAY_NUM; i++)
+		JAMRTC_LOG(LOG_INFO, "  -- Delay (%s): %ums\n", delay_names[i], delays[i]);
+	JAMRTC_LOG(LOG_INFO, "Jitter: %ums\n", jitter);
+	if(bench_num > 0) {
+		JAMRTC_LOG(LOG_INFO, "Benchmark: %u fake publishers (%u/s, %ums each)\n",
+			bench_num, bench_rate, bench_lifetime);
+	}
+	JAMRTC_LOG(LOG_INFO, "\n");
+
+	/* Handle SIGINT (CTRL-C), SIGTERM (from service managers) */
+	g_unix_signal_add(SIGINT, jamrtc_mock_handle_signal, NULL);
+	g_unix_signal_add(SIGTERM, jamrtc_mock_handle_signal, NULL);
+
+	/* Generate a fake DTLS fingerprint we'll use in all SDPs */
+	GString *fp = g_string_new("a=fingerprint:sha-256 ");
+	for(i=0; i<32; i++)
+		g_string_append_printf(fp, "%s%02X", i ? ":" : "", g_random_int_range(0, 256));
+	g_strlcpy(fingerprint, fp->str, sizeof(fingerprint));
+	g_string_free(fp, TRUE);
+
+	clients = g_hash_table_new(g_int64_hash, g_int64_equal);
+	sessions = g_hash_table_new(g_int64_hash, g_int64_equal);
+	rooms = g_hash_table_new(g_int64_hash, g_int64_equal);
+	if(bench_num > 0) {
+		bench_join_latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+		bench_start_latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+	}
+
+	/* Create the WebSocket server */
+	lws_set_log_level(0, NULL);
+	struct lws_context_creation_info info = { 0 };
+	info.port = ws_port;
+	info.iface = "127.0.0.1";
+	info.protocols = protocols;
+	info.gid = -1;
+	info.uid = -1;
+	context = lws_create_context(&info);
+	if(context == NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Error creating the WebSocket server on port %u\n", ws_port);
+		g_option_context_free(opts);
+		exit(1);
+	}
+	ws_thread = g_thread_try_new("jamrtc mock ws", jamrtc_mock_ws_thread, NULL, &error);
+	if(error != NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the WebSocket thread...\n",
+			error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		lws_context_destroy(context);
+		g_option_context_free(opts);
+		exit(1);
+	}
+
+	/* Loop until we're told to stop (or the benchmark completes) */
+	started = g_get_monotonic_time();
+	loop = g_main_loop_new(NULL, FALSE);
+	if(bench_num > 0)
+		bench_timer = g_timeout_add(MAX(1, 1000/bench_rate), jamrtc_mock_bench_inject, NULL);
+	g_main_loop_run(loop);
+	jamrtc_mock_report();
+
+	/* Done */
+	if(bench_timer > 0)
+		g_source_remove(bench_timer);
+	g_atomic_int_set(&stopping, 1);
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+	lws_cancel_service(context);
+#endif
+	g_thread_join(ws_thread);
+	lws_context_destroy(context);
+	g_main_loop_unref(loop);
+	g_option_context_free(opts);
+
+	JAMRTC_LOG(LOG_INFO, "\nBye!\n");
+	exit(bench_leaked > 0 ? 1 : 0);
+}
@@ -0,0 +1,217 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <stdlib.h>
+#include <time.h>
+
+/* Local includes */
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Contention profiler: when enabled, jamrtc_mutex_lock first tries to get
+ * the mutex without blocking, and only if that fails measures how long it
+ * had to wait; the time the mutex is then held is measured on unlock. Each
+ * thread keeps a small stack of the mutexes it's holding, and where they
+ * were locked from, so that hold times are accounted to the lock call site.
+ * Waiting on a condition releases the mutex, so that time is not held time:
+ * we pause the hold sample before the wait, and resume it after it returns.
+ * Everything is accounted with atomic operations on the static call site
+ * structs themselves, so profiling never adds locks of its own */
+#define JAMRTC_MUTEX_HELD	16
+typedef struct jamrtc_mutex_held {
+	void *mutex;
+	jamrtc_mutex_site *site;
+	/* When we (re)acquired it, and how long we held it before waiting on a condition */
+	gint64 locked, held;
+} jamrtc_mutex_held;
+typedef struct jamrtc_mutex_stack {
+	guint count;
+	jamrtc_mutex_held held[JAMRTC_MUTEX_HELD];
+} jamrtc_mutex_stack;
+static GPrivate mutex_stack = G_PRIVATE_INIT(g_free);
+
+/* All the call sites we've seen so far */
+static jamrtc_mutex_site *volatile sites = NULL;
+
+
+/* Helper to get a monotonic time in nanoseconds */
+static gint64 jamrtc_mutex_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Helper to account a wait or hold time in a call site */
+static void jamrtc_mutex_account(volatile guint *hist, volatile gsize *total, volatile guint *max, gint64 ns) {
+	if(ns < 0)
+		ns = 0;
+	/* Bucket 0 is anything below 256ns, bucket N is up to 256ns << N */
+	guint bucket = ns < 256 ? 0 : g_bit_storage((gulong)(ns >> 8));
+	if(bucket >= JAMRTC_MUTEX_BUCKETS)
+		bucket = JAMRTC_MUTEX_BUCKETS - 1;
+	g_atomic_int_inc(&hist[bucket]);
+	g_atomic_pointer_add(total, ns);
+	guint value = ns > G_MAXUINT ? G_MAXUINT : (guint)ns, current;
+	do {
+		current = g_atomic_int_get(max);
+		if(value <= current)
+			break;
+	} while(!g_atomic_int_compare_and_exchange((volatile gint *)max, (gint)current, (gint)value));
+}
+
+/* Mutex lock with profiling */
+void jamrtc_mutex_lock_profile(void *mutex, jamrtc_mutex_site *site) {
+	if(!g_atomic_int_get(&site->registered) && g_atomic_int_compare_and_exchange(&site->registered, 0, 1)) {
+		/* First time we lock from here, add the call site to the list */
+		do {
+			site->next = g_atomic_pointer_get(&sites);
+		} while(!g_atomic_pointer_compare_and_exchange(&sites, site->next, site));
+	}
+	g_atomic_int_inc(&site->locks);
+	gint64 locked = 0;
+	if(jamrtc_mutex_trylock((jamrtc_mutex *)mutex)) {
+		/* No contention */
+		locked = jamrtc_mutex_now();
+		g_atomic_int_inc(&site->wait_hist[0]);
+	} else {
+		/* Someone else is holding the mutex, check how long we wait */
+		gint64 before = jamrtc_mutex_now();
+		jamrtc_mutex_lock_nodebug((jamrtc_mutex *)mutex);
+		locked = jamrtc_mutex_now();
+		g_atomic_int_inc(&site->contended);
+		jamrtc_mutex_account(site->wait_hist, &site->wait_total, &site->wait_max, locked - before);
+	}
+	/* Keep track of when we got it */
+	jamrtc_mutex_stack *stack = g_private_get(&mutex_stack);
+	if(stack == NULL) {
+		stack = g_malloc0(sizeof(jamrtc_mutex_stack));
+		g_private_set(&mutex_stack, stack);
+	}
+	if(stack->count < JAMRTC_MUTEX_HELD) {
+		stack->held[stack->count].mutex = mutex;
+		stack->held[stack->count].site = site;
+		stack->held[stack->count].locked = locked;
+		stack->held[stack->count].held = 0;
+		stack->count++;
+	}
+}
+
+/* Mutex unlock with profiling */
+void jamrtc_mutex_unlock_profile(void *mutex) {
+	jamrtc_mutex_stack *stack = g_private_get(&mutex_stack);
+	if(stack != NULL) {
+		/* Mutexes are usually released in reverse order, so start from the top */
+		int i = 0;
+		for(i = (int)stack->count - 1; i >= 0; i--) {
+			if(stack->held[i].mutex != mutex)
+				continue;
+			jamrtc_mutex_site *site = stack->held[i].site;
+			jamrtc_mutex_account(site->hold_hist, &site->hold_total, &site->hold_max,
+				stack->held[i].held + jamrtc_mutex_now() - stack->held[i].locked);
+			stack->count--;
+			for(; (guint)i < stack->count; i++)
+				stack->held[i] = stack->held[i+1];
+			break;
+		}
+	}
+	jamrtc_mutex_unlock_nodebug((jamrtc_mutex *)mutex);
+}
+
+/* Pause and resume the hold sample of a mutex around a condition wait */
+static jamrtc_mutex_held *jamrtc_mutex_find_held(void *mutex) {
+	jamrtc_mutex_stack *stack = g_private_get(&mutex_stack);
+	if(stack == NULL)
+		return NULL;
+	int i = 0;
+	for(i = (int)stack->count - 1; i >= 0; i--) {
+		if(stack->held[i].mutex == mutex)
+			return &stack->held[i];
+	}
+	return NULL;
+}
+void jamrtc_mutex_wait_begin(void *mutex) {
+	jamrtc_mutex_held *held = jamrtc_mutex_find_held(mutex);
+	if(held != NULL)
+		held->held += jamrtc_mutex_now() - held->locked;
+}
+void jamrtc_mutex_wait_end(void *mutex) {
+	jamrtc_mutex_held *held = jamrtc_mutex_find_held(mutex);
+	if(held != NULL)
+		held->locked = jamrtc_mutex_now();
+}
+
+/* Helper to get a percentile out of a histogram, as the upper bound of its bucket (in us) */
+static double jamrtc_mutex_percentile(volatile guint *hist, guint count, double percentile) {
+	if(count == 0)
+		return 0;
+	guint target = (guint)(count * percentile), sum = 0, i = 0;
+	for(i = 0; i < JAMRTC_MUTEX_BUCKETS; i++) {
+		sum += g_atomic_int_get(&hist[i]);
+		if(sum > target)
+			break;
+	}
+	if(i >= JAMRTC_MUTEX_BUCKETS)
+		i = JAMRTC_MUTEX_BUCKETS - 1;
+	return (double)((gint64)256 << i) / 1000;
+}
+
+/* Helper to sort call sites by total wait time first, and total hold time then */
+static int jamrtc_mutex_site_compare(const void *a, const void *b) {
+	jamrtc_mutex_site *sa = *(jamrtc_mutex_site **)a, *sb = *(jamrtc_mutex_site **)b;
+	gsize wa = g_atomic_pointer_get(&sa->wait_total), wb = g_atomic_pointer_get(&sb->wait_total);
+	if(wa != wb)
+		return wa > wb ? -1 : 1;
+	gsize ha = g_atomic_pointer_get(&sa->hold_total), hb = g_atomic_pointer_get(&sb->hold_total);
+	if(ha != hb)
+		return ha > hb ? -1 : 1;
+	return 0;
+}
+
+/* Log the worst offenders */
+void jamrtc_mutex_profile_report(guint top) {
+	if(!lock_profile)
+		return;
+	GPtrArray *list = g_ptr_array_new();
+	jamrtc_mutex_site *site = g_atomic_pointer_get(&sites);
+	for(; site != NULL; site = site->next)
+		g_ptr_array_add(list, site);
+	if(list->len == 0) {
+		JAMRTC_LOG(LOG_INFO, "No mutex was locked so far\n");
+		g_ptr_array_free(list, TRUE);
+		return;
+	}
+	qsort(list->pdata, list->len, sizeof(gpointer), jamrtc_mutex_site_compare);
+	JAMRTC_LOG(LOG_INFO, "Mutex contention, worst %u of %u call sites (times in us, percentiles are upper bounds):\n",
+		MIN(top, list->len), list->len);
+	JAMRTC_LOG(LOG_INFO, "  %-40s %9s %7s | %10s %8s %8s %8s | %10s %8s %8s %8s\n",
+		"call site", "locks", "waited",
+		"wait-total", "wait-p50", "wait-p99", "wait-max",
+		"hold-total", "hold-p50", "hold-p99", "hold-max");
+	guint i = 0;
+	for(i = 0; i < list->len && i < top; i++) {
+		site = list->pdata[i];
+		guint locks = g_atomic_int_get(&site->locks), contended = g_atomic_int_get(&site->contended);
+		char where[128];
+		g_snprintf(where, sizeof(where), "%s:%d (%s)", site->file, site->line, site->function);
+		JAMRTC_LOG(LOG_INFO, "  %-40s %9u %6.2f%% | %10.1f %8.1f %8.1f %8.1f | %10.1f %8.1f %8.1f %8.1f\n",
+			where, locks, locks ? (double)contended * 100 / locks : 0,
+			(double)g_atomic_pointer_get(&site->wait_total) / 1000,
+			jamrtc_mutex_percentile(site->wait_hist, locks, 0.5),
+			jamrtc_mutex_percentile(site->wait_hist, locks, 0.99),
+			(double)g_atomic_int_get(&site->wait_max) / 1000,
+			(double)g_atomic_pointer_get(&site->hold_total) / 1000,
+			jamrtc_mutex_percentile(site->hold_hist, locks, 0.5),
+			jamrtc_mutex_percentile(site->hold_hist, locks, 0.99),
+			(double)g_atomic_int_get(&site->hold_max) / 1000);
+	}
+	g_ptr_array_free(list, TRUE);
+}
@@ -17,6 +17,38 @@
 #include "debug.h"
 
 extern int lock_debug;
+extern int lock_profile;
+
+/*! Jamus mutex call site, for contention profiling: each place we lock
+ * a mutex from gets its own static instance, so there's no lookup */
+#define JAMRTC_MUTEX_BUCKETS	24
+typedef struct jamrtc_mutex_site {
+	const char *file, *function;
+	int line;
+	volatile gint registered;
+	/* How many times we locked here, and how many times we had to wait */
+	volatile guint locks, contended;
+	/* Log2 histograms (in 256ns units) of wait and hold times */
+	volatile guint wait_hist[JAMRTC_MUTEX_BUCKETS], hold_hist[JAMRTC_MUTEX_BUCKETS];
+	/* Totals and maximum values (in ns) */
+	volatile gsize wait_total, hold_total;
+	volatile guint wait_max, hold_max;
+	struct jamrtc_mutex_site *next;
+} jamrtc_mutex_site;
+/*! Jamus mutex call site initializer */
+#define JAMRTC_MUTEX_SITE_INITIALIZER { .file = __FILE__, .function = __FUNCTION__, .line = __LINE__ }
+/*! Jamus mutex lock with profiling (measures how long we waited for the mutex, and starts
+ * measuring how long we hold it): not to be used directly, use jamrtc_mutex_lock instead */
+void jamrtc_mutex_lock_profile(void *mutex, jamrtc_mutex_site *site);
+/*! Jamus mutex unlock with profiling (measures how long we held the mutex): not to
+ * be used directly, use jamrtc_mutex_unlock instead */
+void jamrtc_mutex_unlock_profile(void *mutex);
+/*! Jamus mutex hold time pause/resume around condition waits, which release the
+ * mutex in the meanwhile: not to be used directly, use jamrtc_condition_wait instead */
+void jamrtc_mutex_wait_begin(void *mutex);
+void jamrtc_mutex_wait_end(void *mutex);
+/*! Log the call sites that waited (or held mutexes) the most */
+void jamrtc_mutex_profile_report(guint top);
 
 #ifdef USE_PTHREAD_MUTEX
 
@@ -28,18 +60,20 @@ typedef pthread_mutex_t jamrtc_mutex;
 #define JAMRTC_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 /*! Jamus mutex destruction */
 #define jamrtc_mutex_destroy(a) pthread_mutex_destroy(a)
+/*! Jamus mutex trylock (TRUE if we got the lock) */
+#define jamrtc_mutex_trylock(a) (pthread_mutex_trylock(a) == 0)
 /*! Jamus mutex lock without debug */
 #define jamrtc_mutex_lock_nodebug(a) pthread_mutex_lock(a);
 /*! Jamus mutex lock with debug (prints the line that locked a mutex) */
 #define jamrtc_mutex_lock_debug(a) { JAMRTC_PRINT("[%s:%s:%d:lock] %p\n", __FILE__, __FUNCTION__, __LINE__, a); pthread_mutex_lock(a); };
-/*! Jamus mutex lock wrapper (selective locking debug) */
-#define jamrtc_mutex_lock(a) { if(!lock_debug) { jamrtc_mutex_lock_nodebug(a); } else { jamrtc_mutex_lock_debug(a); } };
+/*! Jamus mutex lock wrapper (selective locking debug or profiling) */
+#define jamrtc_mutex_lock(a) { if(lock_profile) { static jamrtc_mutex_site jamrtc_mutex_site_ = JAMRTC_MUTEX_SITE_INITIALIZER; jamrtc_mutex_lock_profile(a, &jamrtc_mutex_site_); } else if(!lock_debug) { jamrtc_mutex_lock_nodebug(a); } else { jamrtc_mutex_lock_debug(a); } };
 /*! Jamus mutex unlock without debug */
 #define jamrtc_mutex_unlock_nodebug(a) pthread_mutex_unlock(a);
 /*! Jamus mutex unlock with debug (prints the line that unlocked a mutex) */
 #define jamrtc_mutex_unlock_debug(a) { JAMRTC_PRINT("[%s:%s:%d:unlock] %p\n", __FILE__, __FUNCTION__, __LINE__, a); pthread_mutex_unlock(a); };
-/*! Jamus mutex unlock wrapper (selective locking debug) */
-#define jamrtc_mutex_unlock(a) { if(!lock_debug) { jamrtc_mutex_unlock_nodebug(a); } else { jamrtc_mutex_unlock_debug(a); } };
+/*! Jamus mutex unlock wrapper (selective locking debug or profiling) */
+#define jamrtc_mutex_unlock(a) { if(lock_profile) { jamrtc_mutex_unlock_profile(a); } else if(!lock_debug) { jamrtc_mutex_unlock_nodebug(a); } else { jamrtc_mutex_unlock_debug(a); } };
 
 /*! Jamus condition implementation */
 typedef pthread_cond_t jamrtc_condition;
@@ -47,10 +81,10 @@ typedef pthread_cond_t jamrtc_condition;
 #define jamrtc_condition_init(a) pthread_cond_init(a,NULL)
 /*! Jamus condition destruction */
 #define jamrtc_condition_destroy(a) pthread_cond_destroy(a)
-/*! Jamus condition wait */
-#define jamrtc_condition_wait(a, b) pthread_cond_wait(a, b);
-/*! Jamus condition timed wait */
-#define jamrtc_condition_timedwait(a, b, c) pthread_cond_timedwait(a, b, c);
+/*! Jamus condition wait (the mutex is not held while waiting, so we pause its hold time sample if profiling) */
+#define jamrtc_condition_wait(a, b) { if(lock_profile) jamrtc_mutex_wait_begin(b); pthread_cond_wait(a, b); if(lock_profile) jamrtc_mutex_wait_end(b); };
+/*! Jamus condition timed wait (see above) */
+#define jamrtc_condition_timedwait(a, b, c) { if(lock_profile) jamrtc_mutex_wait_begin(b); pthread_cond_timedwait(a, b, c); if(lock_profile) jamrtc_mutex_wait_end(b); };
 /*! Jamus condition signal */
 #define jamrtc_condition_signal(a) pthread_cond_signal(a);
 /*! Jamus condition broadcast */
@@ -66,18 +100,20 @@ typedef GMutex jamrtc_mutex;
 #define JAMRTC_MUTEX_INITIALIZER {0}
 /*! Jamus mutex destruction */
 #define jamrtc_mutex_destroy(a) g_mutex_clear(a)
+/*! Jamus mutex trylock (TRUE if we got the lock) */
+#define jamrtc_mutex_trylock(a) g_mutex_trylock(a)
 /*! Jamus mutex lock without debug */
 #define jamrtc_mutex_lock_nodebug(a) g_mutex_lock(a);
 /*! Jamus mutex lock with debug (prints the line that locked a mutex) */
 #define jamrtc_mutex_lock_debug(a) { JAMRTC_PRINT("[%s:%s:%d:lock] %p\n", __FILE__, __FUNCTION__, __LINE__, a); g_mutex_lock(a); };
-/*! Jamus mutex lock wrapper (selective locking debug) */
-#define jamrtc_mutex_lock(a) { if(!lock_debug) { jamrtc_mutex_lock_nodebug(a); } else { jamrtc_mutex_lock_debug(a); } };
+/*! Jamus mutex lock wrapper (selective locking debug or profiling) */
+#define jamrtc_mutex_lock(a) { if(lock_profile) { static jamrtc_mutex_site jamrtc_mutex_site_ = JAMRTC_MUTEX_SITE_INITIALIZER; jamrtc_mutex_lock_profile(a, &jamrtc_mutex_site_); } else if(!lock_debug) { jamrtc_mutex_lock_nodebug(a); } else { jamrtc_mutex_lock_debug(a); } };
 /*! Jamus mutex unlock without debug */
 #define jamrtc_mutex_unlock_nodebug(a) g_mutex_unlock(a);
 /*! Jamus mutex unlock with debug (prints the line that unlocked a mutex) */
 #define jamrtc_mutex_unlock_debug(a) { JAMRTC_PRINT("[%s:%s:%d:unlock] %p\n", __FILE__, __FUNCTION__, __LINE__, a); g_mutex_unlock(a); };
-/*! Jamus mutex unlock wrapper (selective locking debug) */
-#define jamrtc_mutex_unlock(a) { if(!lock_debug) { jamrtc_mutex_unlock_nodebug(a); } else { jamrtc_mutex_unlock_debug(a); } };
+/*! Jamus mutex unlock wrapper (selective locking debug or profiling) */
+#define jamrtc_mutex_unlock(a) { if(lock_profile) { jamrtc_mutex_unlock_profile(a); } else if(!lock_debug) { jamrtc_mutex_unlock_nodebug(a); } else { jamrtc_mutex_unlock_debug(a); } };
 
 /*! Jamus condition implementation */
 typedef GCond jamrtc_condition;
@@ -85,10 +121,10 @@ typedef GCond jamrtc_condition;
 #define jamrtc_condition_init(a) g_cond_init(a)
 /*! Jamus condition destruction */
 #define jamrtc_condition_destroy(a) g_cond_clear(a)
-/*! Jamus condition wait */
-#define jamrtc_condition_wait(a, b) g_cond_wait(a, b);
-/*! Jamus condition wait until */
-#define jamrtc_condition_wait_until(a, b, c) g_cond_wait_until(a, b, c);
+/*! Jamus condition wait (the mutex is not held while waiting, so we pause its hold time sample if profiling) */
+#define jamrtc_condition_wait(a, b) { if(lock_profile) jamrtc_mutex_wait_begin(b); g_cond_wait(a, b); if(lock_profile) jamrtc_mutex_wait_end(b); };
+/*! Jamus condition wait until (see above) */
+#define jamrtc_condition_wait_until(a, b, c) { if(lock_profile) jamrtc_mutex_wait_begin(b); g_cond_wait_until(a, b, c); if(lock_profile) jamrtc_mutex_wait_end(b); };
 /*! Jamus condition signal */
 #define jamrtc_condition_signal(a) g_cond_signal(a);
 /*! Jamus condition broadcast */
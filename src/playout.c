@@ -0,0 +1,784 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* GStreamer includes */
+#include <gst/rtp/gstrtpbuffer.h>
+
+/* Local includes */
+#include "playout.h"
+#include "debug.h"
+
+
+/* Playout stage, loosely inspired by NetEQ: with little or no jitter buffer,
+ * a network spike either makes playout run dry (a glitch), or leaves us with
+ * a burst of audio queued in the sink, i.e., latency we'd carry forever. We
+ * keep track of how late packets arrive (compared to the earliest ones over
+ * the last couple of seconds) in a histogram that slowly forgets, and target
+ * a playout latency that covers most of that lateness; the actual latency is
+ * how much audio we wrote to the sink minus what its clock says was played.
+ * When the latency is above the target we accelerate playout, by dropping a
+ * pitch period, and when it's below we decelerate it, by repeating one, in
+ * both cases crossfading two similar periods, so that it's not noticeable.
+ * If there's no period similar enough we wait, unless we waited too much.
+ * When the sender is silent (DTX) we're told we stopped decoding it, so that
+ * the sink running dry in the meanwhile isn't mistaken for an underrun */
+static gboolean stretch = TRUE;
+static char *traces = NULL;
+static guint traces_num = 0;
+#define JAMRTC_PLAYOUT_MIN_TARGET	5		/* ms */
+#define JAMRTC_PLAYOUT_MAX_TARGET	500		/* ms */
+#define JAMRTC_PLAYOUT_MARGIN		3		/* How far from the target we tolerate the latency to be (ms) */
+#define JAMRTC_PLAYOUT_QUANTILE		0.95	/* Fraction of packets the target latency should cover */
+#define JAMRTC_PLAYOUT_FORGET		0.9993	/* Forgetting factor of the lateness histogram (~30s at 50pps) */
+#define JAMRTC_PLAYOUT_BUCKET		1000	/* Lateness is relative to the earliest packet in the last 1-2 buckets (ms) */
+#define JAMRTC_PLAYOUT_RESET		1000	/* Anything later than this is a jump, not lateness (ms) */
+#define JAMRTC_PLAYOUT_MIN_PITCH	2500	/* Shortest period we drop or repeat (us) */
+#define JAMRTC_PLAYOUT_MAX_PITCH	15000	/* Longest period we drop or repeat (us) */
+#define JAMRTC_PLAYOUT_SIMILARITY	0.81	/* Squared normalized correlation two periods need to be crossfaded */
+#define JAMRTC_PLAYOUT_SILENCE		1e-7	/* Mean square below which anything goes (~-70dBFS) */
+#define JAMRTC_PLAYOUT_PATIENCE		5		/* How many buffers we wait for a good period before forcing it */
+#define JAMRTC_PLAYOUT_UNDERRUN		2		/* How far below zero the latency must go to be an underrun (ms) */
+
+struct jamrtc_playout {
+	/* Who and what we're playing */
+	char *participant, *stream;
+	/* Packet arrivals (only touched by the RTP streaming thread) */
+	guint clock_rate, jitter_buffer;
+	gboolean arrived;
+	guint32 last_ts;
+	gint64 ext_ts;
+	gint64 bucket_start, cur_min, prev_min;
+	gdouble lateness[JAMRTC_PLAYOUT_MAX_TARGET+1];
+	FILE *trace;
+	gint64 trace_start;
+	/* Time-stretching (only touched by the playout streaming thread) */
+	gboolean stretch, quiet;
+	guint min_target, rate, channels;
+	gdouble filtered;
+	gboolean filtered_set;
+	guint waited;
+	gint adjusting;
+	float *mix, *scratch;
+	guint mix_size, scratch_size;
+	guint64 accelerated, decelerated;
+	gint64 offset;
+	/* Sink we play on, its clock, and how much we wrote to it */
+	GstElement *sink;
+	GstClock *clock;
+	gint64 clock_check;
+	gboolean based;
+	GstClockTime clock_base, written;
+	/* What we expose in the statistics */
+	volatile gint target, latency, accelerated_ms, decelerated_ms, underruns;
+	/* Whether we skipped decoding a silent stretch since the last buffer */
+	volatile gint silence;
+};
+
+
+/* Playout initialization */
+int jamrtc_playout_init(gboolean enabled, const char *folder) {
+	stretch = enabled;
+	if(folder != NULL) {
+		if(g_mkdir_with_parents(folder, 0755) < 0) {
+			JAMRTC_LOG(LOG_FATAL, "Couldn't create the jitter traces folder '%s'\n", folder);
+			return -1;
+		}
+		traces = g_strdup(folder);
+	}
+	return 0;
+}
+
+/* Playout cleanup */
+void jamrtc_playout_cleanup(void) {
+	g_free(traces);
+	traces = NULL;
+}
+
+/* Helper to turn names in something we can safely use in a filename */
+static char *jamrtc_playout_sanitize(const char *name) {
+	char *res = g_strdup(name ? name : "unknown");
+	char *c = res;
+	for(c = res; *c; c++) {
+		if(!g_ascii_isalnum(*c) && *c != '-' && *c != '_')
+			*c = '_';
+	}
+	return res;
+}
+
+/* Helper to create a playout stage, with no GStreamer involved */
+static jamrtc_playout *jamrtc_playout_alloc(const char *participant, const char *stream,
+		guint clock_rate, guint jitter_buffer) {
+	jamrtc_playout *playout = g_malloc0(sizeof(jamrtc_playout));
+	playout->participant = g_strdup(participant);
+	playout->stream = g_strdup(stream ? stream : "chat");
+	playout->clock_rate = clock_rate > 0 ? clock_rate : 48000;
+	playout->jitter_buffer = jitter_buffer;
+	playout->stretch = stretch;
+	playout->min_target = JAMRTC_PLAYOUT_MIN_TARGET;
+	playout->target = JAMRTC_PLAYOUT_MIN_TARGET;
+	return playout;
+}
+
+/* Helper to take note of when a packet arrived (times in us), and update the target */
+static void jamrtc_playout_arrival(jamrtc_playout *playout, gint64 now, guint32 ts) {
+	if(!playout->arrived) {
+		playout->arrived = TRUE;
+		playout->ext_ts = ts;
+	} else {
+		playout->ext_ts += (gint32)(ts - playout->last_ts);
+	}
+	playout->last_ts = ts;
+	/* How late this packet is, compared to the earliest one we saw recently */
+	gint64 offset = now - playout->ext_ts * G_USEC_PER_SEC / playout->clock_rate;
+	if(playout->bucket_start == 0 || now - playout->bucket_start >= JAMRTC_PLAYOUT_BUCKET*1000) {
+		playout->prev_min = playout->bucket_start > 0 ? playout->cur_min : offset;
+		playout->cur_min = offset;
+		playout->bucket_start = now;
+	} else if(offset < playout->cur_min) {
+		playout->cur_min = offset;
+	}
+	gint64 lateness = offset - MIN(playout->prev_min, playout->cur_min);
+	if(lateness > JAMRTC_PLAYOUT_RESET*1000) {
+		/* The sender jumped (e.g., it restarted), start over */
+		playout->prev_min = offset;
+		playout->cur_min = offset;
+		lateness = 0;
+	}
+	/* Update the histogram, and find the lateness most packets are within */
+	guint bin = MIN(lateness / 1000, JAMRTC_PLAYOUT_MAX_TARGET), i = 0;
+	gdouble total = 0;
+	for(i=0; i<=JAMRTC_PLAYOUT_MAX_TARGET; i++) {
+		playout->lateness[i] *= JAMRTC_PLAYOUT_FORGET;
+		total += playout->lateness[i];
+	}
+	playout->lateness[bin] += 1 - JAMRTC_PLAYOUT_FORGET;
+	total += 1 - JAMRTC_PLAYOUT_FORGET;
+	gdouble sum = 0;
+	for(i=0; i<JAMRTC_PLAYOUT_MAX_TARGET; i++) {
+		sum += playout->lateness[i];
+		if(sum >= total * JAMRTC_PLAYOUT_QUANTILE)
+			break;
+	}
+	/* Whatever the jitter buffer absorbs is not our problem */
+	gint target = (gint)(i + 1) - (gint)playout->jitter_buffer;
+	g_atomic_int_set(&playout->target, MAX(target, (gint)playout->min_target));
+}
+
+/* Helper to compute how similar a period is to the next one, as a squared
+ * normalized correlation (negative if the correlation is negative) */
+static gdouble jamrtc_playout_similarity(const float *mix, guint period, guint step) {
+	gdouble xy = 0, xx = 0, yy = 0;
+	guint i = 0;
+	for(i=0; i<period; i+=step) {
+		xy += mix[i] * mix[i+period];
+		xx += mix[i] * mix[i];
+		yy += mix[i+period] * mix[i+period];
+	}
+	if(xx <= 0 || yy <= 0)
+		return 0;
+	return (xy > 0 ? xy * xy : -xy * xy) / (xx * yy);
+}
+
+/* Helper to find the pitch period to drop or repeat (frames, up to the
+ * provided maximum): returns FALSE if no period is similar enough */
+static gboolean jamrtc_playout_pitch(jamrtc_playout *playout, const float *in, guint frames, guint max, guint *period) {
+	guint channels = playout->channels, rate = playout->rate;
+	guint tmin = rate * JAMRTC_PLAYOUT_MIN_PITCH / G_USEC_PER_SEC;
+	guint tmax = MIN(rate * JAMRTC_PLAYOUT_MAX_PITCH / G_USEC_PER_SEC, frames / 2);
+	tmax = MIN(tmax, MAX(max, tmin));
+	if(tmin == 0 || tmax < tmin)
+		return FALSE;
+	/* Downmix to mono first */
+	if(playout->mix_size < frames) {
+		playout->mix = g_realloc(playout->mix, frames * sizeof(float));
+		playout->mix_size = frames;
+	}
+	float *mix = playout->mix;
+	gdouble energy = 0;
+	guint i = 0, c = 0;
+	for(i=0; i<frames; i++) {
+		float s = 0;
+		for(c=0; c<channels; c++)
+			s += in[i*channels + c];
+		mix[i] = s / channels;
+		energy += mix[i] * mix[i];
+	}
+	if(energy / frames < JAMRTC_PLAYOUT_SILENCE) {
+		/* Silence, we can drop or repeat as much as we want */
+		*period = tmax;
+		return TRUE;
+	}
+	/* Coarse search at ~8kHz, and then a finer one around the best candidate */
+	guint step = MAX(1, rate / 8000), t = 0, best = tmin;
+	gdouble best_similarity = -1;
+	for(t=tmin; t<=tmax; t+=step) {
+		gdouble similarity = jamrtc_playout_similarity(mix, t, step);
+		if(similarity > best_similarity) {
+			best_similarity = similarity;
+			best = t;
+		}
+	}
+	guint from = best > tmin + step ? best - step : tmin, to = MIN(best + step, tmax);
+	best_similarity = -1;
+	for(t=from; t<=to; t++) {
+		gdouble similarity = jamrtc_playout_similarity(mix, t, 1);
+		if(similarity > best_similarity) {
+			best_similarity = similarity;
+			best = t;
+		}
+	}
+	*period = best;
+	return best_similarity >= JAMRTC_PLAYOUT_SIMILARITY;
+}
+
+/* Helper to decide whether a buffer (interleaved floats) should be stretched,
+ * given the current latency (ms): returns how many frames we wrote to out
+ * (which must have room for the frames plus the longest period), or 0 if
+ * the buffer should be played as it is */
+static guint jamrtc_playout_process(jamrtc_playout *playout, const float *in, guint frames, float *out, gdouble latency) {
+	if(!playout->filtered_set) {
+		playout->filtered = latency;
+		playout->filtered_set = TRUE;
+	} else {
+		playout->filtered += (latency - playout->filtered) / 8;
+	}
+	if(!playout->stretch || playout->channels == 0 || playout->rate == 0)
+		return 0;
+	gdouble target = g_atomic_int_get(&playout->target);
+	gdouble margin = MAX(target / 4, JAMRTC_PLAYOUT_MARGIN);
+	gint adjusting = 0;
+	if(playout->filtered > target + margin)
+		adjusting = 1;
+	else if(playout->filtered < target - margin)
+		adjusting = -1;
+	if(adjusting != playout->adjusting) {
+		if(playout->quiet) {
+			/* Benchmarking, don't log anything */
+		} else if(adjusting != 0) {
+			JAMRTC_LOG(LOG_VERB, "[%s][%s] Playout latency at %.1fms (target %.0fms), %s\n",
+				playout->participant, playout->stream, playout->filtered, target,
+				adjusting > 0 ? "accelerating" : "decelerating");
+		} else {
+			JAMRTC_LOG(LOG_VERB, "[%s][%s] Playout latency back at %.1fms (target %.0fms)\n",
+				playout->participant, playout->stream, playout->filtered, target);
+		}
+		playout->adjusting = adjusting;
+		playout->waited = 0;
+	}
+	if(adjusting == 0)
+		return 0;
+	/* Don't drop or repeat more than it takes to get back to the target */
+	gdouble distance = adjusting > 0 ? playout->filtered - target : target - playout->filtered;
+	guint max = (guint)(distance * playout->rate / 1000), period = 0;
+	if(!jamrtc_playout_pitch(playout, in, frames, max, &period)) {
+		/* Nothing similar enough: wait, unless we've been waiting for a while */
+		if(period == 0 || ++playout->waited < JAMRTC_PLAYOUT_PATIENCE)
+			return 0;
+	}
+	playout->waited = 0;
+	guint channels = playout->channels, i = 0, c = 0;
+	if(adjusting > 0) {
+		/* Accelerate: crossfade a period into the next one, and skip it */
+		for(i=0; i<period; i++) {
+			float w = (i + 0.5f) / period;
+			for(c=0; c<channels; c++)
+				out[i*channels + c] = in[i*channels + c] * (1 - w) + in[(i+period)*channels + c] * w;
+		}
+		memcpy(out + period*channels, in + 2*period*channels, (frames - 2*period) * channels * sizeof(float));
+		playout->accelerated += period;
+		g_atomic_int_set(&playout->accelerated_ms, (gint)(playout->accelerated * 1000 / playout->rate));
+		playout->filtered -= (gdouble)period * 1000 / playout->rate;
+		return frames - period;
+	}
+	/* Decelerate: after the first two periods, crossfade the second one back
+	 * into the first, so that the second one is played twice */
+	memcpy(out, in, period * channels * sizeof(float));
+	for(i=0; i<period; i++) {
+		float w = (i + 0.5f) / period;
+		for(c=0; c<channels; c++)
+			out[(period+i)*channels + c] = in[(period+i)*channels + c] * (1 - w) + in[i*channels + c] * w;
+	}
+	memcpy(out + 2*period*channels, in + period*channels, (frames - period) * channels * sizeof(float));
+	playout->decelerated += period;
+	g_atomic_int_set(&playout->decelerated_ms, (gint)(playout->decelerated * 1000 / playout->rate));
+	playout->filtered += (gdouble)period * 1000 / playout->rate;
+	return frames + period;
+}
+
+/* Pad probe on the RTP packets of the stream, to keep track of arrivals */
+static GstPadProbeReturn jamrtc_playout_rtp(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_playout *playout = (jamrtc_playout *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+	if(buffer == NULL || !gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+		return GST_PAD_PROBE_OK;
+	guint32 ts = gst_rtp_buffer_get_timestamp(&rtp);
+	gst_rtp_buffer_unmap(&rtp);
+	gint64 now = g_get_monotonic_time();
+	jamrtc_playout_arrival(playout, now, ts);
+	if(playout->trace != NULL) {
+		if(playout->trace_start == 0)
+			playout->trace_start = now;
+		fprintf(playout->trace, "%"SCNi64" %"SCNu32"\n", now - playout->trace_start, ts);
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+/* Create a playout stage for an audio stream */
+jamrtc_playout *jamrtc_playout_new(const char *participant, const char *stream,
+		guint clock_rate, guint jitter_buffer) {
+	jamrtc_playout *playout = jamrtc_playout_alloc(participant, stream, clock_rate, jitter_buffer);
+	if(traces != NULL) {
+		/* Save the packet arrival times, so that they can be replayed later */
+		char *p = jamrtc_playout_sanitize(playout->participant), *s = jamrtc_playout_sanitize(playout->stream);
+		char name[256];
+		g_snprintf(name, sizeof(name), "%02u-%s-%s.trace", g_atomic_int_add(&traces_num, 1) + 1, p, s);
+		g_free(p);
+		g_free(s);
+		char *filename = g_build_filename(traces, name, NULL);
+		playout->trace = fopen(filename, "w");
+		if(playout->trace == NULL) {
+			JAMRTC_LOG(LOG_WARN, "[%s][%s] Couldn't create the jitter trace '%s'\n",
+				playout->participant, playout->stream, filename);
+		} else {
+			fprintf(playout->trace, "# clock-rate %u\n", playout->clock_rate);
+		}
+		g_free(filename);
+	}
+	return playout;
+}
+
+/* Watch the RTP packets of the stream */
+void jamrtc_playout_watch(jamrtc_playout *playout, GstPad *rtp_pad) {
+	if(playout == NULL || rtp_pad == NULL)
+		return;
+	gst_pad_add_probe(rtp_pad, GST_PAD_PROBE_TYPE_BUFFER, jamrtc_playout_rtp, playout, NULL);
+}
+
+/* Pad probe after the decoder, that time-stretches what it gets, if needed */
+static GstPadProbeReturn jamrtc_playout_stretch(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_playout *playout = (jamrtc_playout *)user_data;
+	if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if(GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+			GstCaps *caps = NULL;
+			gst_event_parse_caps(event, &caps);
+			gint rate = 0, channels = 0;
+			gst_structure_get_int(gst_caps_get_structure(caps, 0), "rate", &rate);
+			gst_structure_get_int(gst_caps_get_structure(caps, 0), "channels", &channels);
+			playout->rate = rate > 0 ? rate : 0;
+			playout->channels = channels > 0 ? channels : 0;
+		}
+		return GST_PAD_PROBE_OK;
+	}
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(!playout->based || playout->channels == 0 || playout->rate == 0)
+		return GST_PAD_PROBE_OK;
+	/* How much audio is queued in the sink, i.e., what we wrote minus what it played */
+	gint64 played = gst_clock_get_time(playout->clock) - playout->clock_base;
+	gint64 latency = (gint64)playout->written - played;
+	gboolean silence = g_atomic_int_get(&playout->silence) &&
+		g_atomic_int_compare_and_exchange(&playout->silence, 1, 0);
+	if(latency < -(gint64)(JAMRTC_PLAYOUT_UNDERRUN * GST_MSECOND)) {
+		/* The sink ran dry and played silence: start counting from here, and
+		 * unless that's because the sender was silent, count it as an underrun */
+		if(!silence)
+			g_atomic_int_inc(&playout->underruns);
+		playout->written = played;
+		latency = 0;
+	}
+	latency = MAX(latency, 0);
+	g_atomic_int_set(&playout->latency, (gint)(latency / GST_USECOND));
+	GstMapInfo map;
+	if(!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return GST_PAD_PROBE_OK;
+	guint frames = map.size / (sizeof(float) * playout->channels);
+	guint size = (frames + playout->rate * JAMRTC_PLAYOUT_MAX_PITCH / G_USEC_PER_SEC) * playout->channels;
+	if(playout->scratch_size < size) {
+		playout->scratch = g_realloc(playout->scratch, size * sizeof(float));
+		playout->scratch_size = size;
+	}
+	guint written = jamrtc_playout_process(playout, (const float *)map.data, frames,
+		playout->scratch, (gdouble)latency / GST_MSECOND);
+	gst_buffer_unmap(buffer, &map);
+	if(written == 0) {
+		if(playout->offset != 0 && GST_BUFFER_PTS_IS_VALID(buffer)) {
+			/* Keep the timestamps continuous after what we stretched */
+			buffer = gst_buffer_make_writable(buffer);
+			GST_BUFFER_PTS(buffer) += playout->offset;
+			GST_PAD_PROBE_INFO_DATA(info) = buffer;
+		}
+		return GST_PAD_PROBE_OK;
+	}
+	/* Replace the buffer with the stretched one */
+	GstBuffer *stretched = gst_buffer_new_allocate(NULL, written * playout->channels * sizeof(float), NULL);
+	gst_buffer_fill(stretched, 0, playout->scratch, written * playout->channels * sizeof(float));
+	gst_buffer_copy_into(stretched, buffer, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+	if(GST_BUFFER_PTS_IS_VALID(stretched))
+		GST_BUFFER_PTS(stretched) += playout->offset;
+	GST_BUFFER_DURATION(stretched) = gst_util_uint64_scale_int(written, GST_SECOND, playout->rate);
+	playout->offset += ((gint64)written - (gint64)frames) * GST_SECOND / playout->rate;
+	gst_buffer_unref(buffer);
+	GST_PAD_PROBE_INFO_DATA(info) = stretched;
+	return GST_PAD_PROBE_OK;
+}
+
+/* Let the playout stage know we stopped decoding a silent stream */
+void jamrtc_playout_silence(jamrtc_playout *playout) {
+	if(playout == NULL)
+		return;
+	g_atomic_int_set(&playout->silence, 1);
+}
+
+/* Pad probe in front of the sink, to keep track of how much we wrote to it */
+static GstPadProbeReturn jamrtc_playout_written(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_playout *playout = (jamrtc_playout *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(playout->clock == NULL) {
+		/* The sink only provides its clock once it's up and running */
+		gint64 now = g_get_monotonic_time();
+		if(now - playout->clock_check < G_USEC_PER_SEC)
+			return GST_PAD_PROBE_OK;
+		playout->clock_check = now;
+		playout->clock = gst_element_provide_clock(playout->sink);
+		if(playout->clock == NULL)
+			return GST_PAD_PROBE_OK;
+	}
+	if(!playout->based) {
+		playout->based = TRUE;
+		playout->clock_base = gst_clock_get_time(playout->clock);
+		playout->written = 0;
+	}
+	if(buffer != NULL && GST_BUFFER_DURATION_IS_VALID(buffer))
+		playout->written += GST_BUFFER_DURATION(buffer);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Create the element that time-stretches decoded audio */
+GstElement *jamrtc_playout_element(jamrtc_playout *playout, GstElement *sink) {
+	if(playout == NULL || sink == NULL)
+		return NULL;
+	/* We need interleaved floats to work on */
+	GstElement *filter = gst_element_factory_make("capsfilter", NULL);
+	GstCaps *caps = gst_caps_from_string("audio/x-raw,format=F32LE,layout=interleaved");
+	g_object_set(filter, "caps", caps, NULL);
+	gst_caps_unref(caps);
+	if(playout->sink != NULL)
+		gst_object_unref(playout->sink);
+	playout->sink = gst_object_ref(sink);
+	GstPad *pad = gst_element_get_static_pad(filter, "src");
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+		jamrtc_playout_stretch, playout, NULL);
+	gst_object_unref(pad);
+	pad = gst_element_get_static_pad(sink, "sink");
+	if(pad != NULL) {
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, jamrtc_playout_written, playout, NULL);
+		gst_object_unref(pad);
+	}
+	return filter;
+}
+
+/* Get the current playout statistics */
+void jamrtc_playout_stats(jamrtc_playout *playout, guint *latency, guint *target,
+		guint *accelerated, guint *decelerated, guint *underruns) {
+	if(playout == NULL)
+		return;
+	if(latency)
+		*latency = g_atomic_int_get(&playout->latency) / 1000;
+	if(target)
+		*target = g_atomic_int_get(&playout->target);
+	if(accelerated)
+		*accelerated = g_atomic_int_get(&playout->accelerated_ms);
+	if(decelerated)
+		*decelerated = g_atomic_int_get(&playout->decelerated_ms);
+	if(underruns)
+		*underruns = g_atomic_int_get(&playout->underruns);
+}
+
+/* Get rid of a playout stage */
+void jamrtc_playout_free(jamrtc_playout *playout) {
+	if(playout == NULL)
+		return;
+	if(playout->trace != NULL)
+		fclose(playout->trace);
+	if(playout->clock != NULL)
+		gst_object_unref(playout->clock);
+	if(playout->sink != NULL)
+		gst_object_unref(playout->sink);
+	g_free(playout->participant);
+	g_free(playout->stream);
+	g_free(playout->mix);
+	g_free(playout->scratch);
+	g_free(playout);
+}
+
+
+/* Benchmark: packets in a trace (arrival time in us, RTP timestamp) */
+typedef struct jamrtc_playout_packet {
+	gint64 arrival;
+	guint32 ts;
+} jamrtc_playout_packet;
+/* Results of replaying a trace */
+typedef struct jamrtc_playout_result {
+	gdouble latency_avg, latency_p95, latency_max;
+	guint underruns, clicks, late;
+	gdouble underrun_ms, accelerated_ms, decelerated_ms, duration_ms;
+} jamrtc_playout_result;
+
+/* Helper to compute a sine with no libm, good enough for a test signal */
+static gdouble jamrtc_playout_sin(gdouble cycles) {
+	gdouble x = cycles - (gint64)cycles;
+	if(x < 0)
+		x += 1;
+	/* Bring it to [-pi/2, pi/2] */
+	x = x * 2 * G_PI;
+	if(x > G_PI / 2 && x <= 3 * G_PI / 2)
+		x = G_PI - x;
+	else if(x > 3 * G_PI / 2)
+		x = x - 2 * G_PI;
+	gdouble x2 = x * x;
+	return x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42 * (1 - x2 / 72))));
+}
+/* Helper to synthesize what we pretend the participant is playing: a plucked
+ * note every half a second, with some harmonics, and a pause every 4 seconds */
+static float jamrtc_playout_synth(gint64 n, guint rate) {
+	static const int notes[8] = { 0, 3, 5, 7, 10, 7, 5, -1 };
+	if(n < 0)
+		return 0;
+	gint64 note_len = rate / 2;
+	int note = notes[(n / note_len) % 8];
+	if(note < 0)
+		return 0;
+	gdouble t = (gdouble)(n % note_len) / rate;
+	gdouble freq = 110, envelope = (1 - t * 2) * (1 - t * 2);
+	int i = 0;
+	for(i=0; i<note; i++)
+		freq *= 1.0594630943592953;
+	gdouble sample = 0.5 * jamrtc_playout_sin(freq * t) + 0.25 * jamrtc_playout_sin(2 * freq * t) +
+		0.12 * jamrtc_playout_sin(3 * freq * t) + 0.06 * jamrtc_playout_sin(4 * freq * t);
+	return (float)(sample * envelope * 0.5);
+}
+
+/* Helper to sort latency samples */
+static int jamrtc_playout_compare(const void *a, const void *b) {
+	float fa = *(const float *)a, fb = *(const float *)b;
+	return fa < fb ? -1 : (fa > fb ? 1 : 0);
+}
+static int jamrtc_playout_compare_uint(const void *a, const void *b) {
+	guint ua = *(const guint *)a, ub = *(const guint *)b;
+	return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/* Helper to replay a trace: packets are decoded (i.e., synthesized) as soon
+ * as they arrive, and a JACK-like consumer takes a period every so often */
+static void jamrtc_playout_replay(jamrtc_playout_packet *packets, guint count, guint rate, guint frame,
+		gboolean stretching, guint target, float threshold, jamrtc_playout_result *result) {
+	memset(result, 0, sizeof(*result));
+	jamrtc_playout *playout = jamrtc_playout_alloc("bench", stretching ? "stretch" : "none", rate, 0);
+	playout->stretch = stretching;
+	playout->quiet = TRUE;
+	playout->min_target = target;
+	playout->target = target;
+	playout->rate = rate;
+	playout->channels = 1;
+	guint period = 128, maxpitch = rate * JAMRTC_PLAYOUT_MAX_PITCH / G_USEC_PER_SEC;
+	float *in = g_malloc(frame * sizeof(float)), *out = g_malloc((frame + maxpitch) * sizeof(float));
+	/* Queue of what's waiting to be played */
+	guint size = rate, start = 0, len = 0;
+	float *queue = g_malloc(size * sizeof(float));
+	GArray *latencies = g_array_new(FALSE, FALSE, sizeof(float));
+	gint64 first = packets[0].arrival, ext = packets[0].ts, expected = ext, base = ext;
+	guint32 last_ts = packets[0].ts;
+	guint i = 0;
+	guint64 n = 0;
+	gboolean playing = FALSE, dry = FALSE;
+	float previous = 0;
+	while(i < count || len > 0) {
+		gint64 now = first + (gint64)(n * period * G_USEC_PER_SEC / rate);
+		/* Decode whatever arrived by now */
+		while(i < count && packets[i].arrival <= now) {
+			ext += (gint32)(packets[i].ts - last_ts);
+			last_ts = packets[i].ts;
+			jamrtc_playout_arrival(playout, packets[i].arrival, packets[i].ts);
+			i++;
+			if(ext < expected) {
+				/* Too late (or a duplicate), it would be dropped */
+				result->late++;
+				continue;
+			}
+			expected = ext + frame;
+			guint j = 0;
+			for(j=0; j<frame; j++)
+				in[j] = jamrtc_playout_synth(ext - base + j, rate);
+			guint written = jamrtc_playout_process(playout, in, frame, out, (gdouble)len * 1000 / rate);
+			const float *samples = written > 0 ? out : in;
+			if(written == 0)
+				written = frame;
+			if(start + len + written > size) {
+				/* Make room */
+				memmove(queue, queue + start, len * sizeof(float));
+				start = 0;
+				while(len + written > size)
+					size *= 2;
+				queue = g_realloc(queue, size * sizeof(float));
+			}
+			memcpy(queue + start + len, samples, written * sizeof(float));
+			len += written;
+		}
+		if(!playing && (len * 1000 >= target * rate || i == count))
+			playing = TRUE;
+		if(playing) {
+			/* Play a period, and check if it's not continuous */
+			float latency = (float)len * 1000 / rate;
+			g_array_append_val(latencies, latency);
+			guint j = 0;
+			for(j=0; j<period; j++) {
+				float sample = 0;
+				if(len > 0) {
+					sample = queue[start];
+					start++;
+					len--;
+				} else if(i < count) {
+					result->underrun_ms += 1000.0 / rate;
+					if(!dry)
+						result->underruns++;
+					dry = TRUE;
+				}
+				if(len > 0)
+					dry = FALSE;
+				float diff = sample - previous;
+				if(diff > threshold || diff < -threshold)
+					result->clicks++;
+				previous = sample;
+			}
+			result->duration_ms += (gdouble)period * 1000 / rate;
+		}
+		n++;
+	}
+	if(latencies->len > 0) {
+		float *l = (float *)latencies->data;
+		gdouble sum = 0;
+		for(i=0; i<latencies->len; i++)
+			sum += l[i];
+		result->latency_avg = sum / latencies->len;
+		qsort(l, latencies->len, sizeof(float), jamrtc_playout_compare);
+		result->latency_p95 = l[(guint)(latencies->len * 0.95)];
+		result->latency_max = l[latencies->len - 1];
+	}
+	result->accelerated_ms = (gdouble)playout->accelerated * 1000 / rate;
+	result->decelerated_ms = (gdouble)playout->decelerated * 1000 / rate;
+	g_array_free(latencies, TRUE);
+	g_free(queue);
+	g_free(in);
+	g_free(out);
+	jamrtc_playout_free(playout);
+}
+
+/* Helper to load and replay a single trace */
+static int jamrtc_playout_bench_trace(const char *filename) {
+	char *contents = NULL;
+	GError *error = NULL;
+	if(!g_file_get_contents(filename, &contents, NULL, &error)) {
+		JAMRTC_LOG(LOG_ERR, "Couldn't read trace '%s': %s\n", filename, error ? error->message : "??");
+		g_clear_error(&error);
+		return -1;
+	}
+	guint rate = 48000, count = 0;
+	GArray *packets = g_array_new(FALSE, FALSE, sizeof(jamrtc_playout_packet));
+	char **lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	char **line = lines;
+	for(line = lines; *line; line++) {
+		if(**line == '#') {
+			sscanf(*line, "# clock-rate %u", &rate);
+			continue;
+		}
+		jamrtc_playout_packet packet;
+		if(sscanf(*line, "%"SCNi64" %"SCNu32, &packet.arrival, &packet.ts) == 2)
+			g_array_append_val(packets, packet);
+	}
+	g_strfreev(lines);
+	count = packets->len;
+	if(count < 100 || rate == 0) {
+		JAMRTC_LOG(LOG_ERR, "Not enough packets in trace '%s' (%u)\n", filename, count);
+		g_array_free(packets, TRUE);
+		return -1;
+	}
+	jamrtc_playout_packet *p = (jamrtc_playout_packet *)packets->data;
+	/* Find out the packetization, as the most common timestamp step */
+	guint *steps = g_malloc((count - 1) * sizeof(guint)), num = 0, i = 0;
+	for(i=1; i<count; i++) {
+		gint32 step = (gint32)(p[i].ts - p[i-1].ts);
+		if(step > 0 && step < (gint32)rate)
+			steps[num++] = step;
+	}
+	guint frame = rate / 50;
+	if(num > 0) {
+		qsort(steps, num, sizeof(guint), jamrtc_playout_compare_uint);
+		frame = steps[num / 2];
+	}
+	g_free(steps);
+	/* Anything larger than this between two samples is a click (twice the
+	 * largest difference there is in the signal we synthesize) */
+	float threshold = 0, previous = 0;
+	for(i=0; i<rate*4; i++) {
+		float sample = jamrtc_playout_synth(i, rate), diff = sample - previous;
+		if(diff < 0)
+			diff = -diff;
+		threshold = MAX(threshold, diff);
+		previous = sample;
+	}
+	threshold *= 2;
+	JAMRTC_LOG(LOG_INFO, "Trace %s: %u packets, %.1fs, %uHz, %.1fms packets\n", filename, count,
+		(gdouble)(p[count-1].arrival - p[0].arrival) / G_USEC_PER_SEC, rate, (gdouble)frame * 1000 / rate);
+	JAMRTC_LOG(LOG_INFO, "  %-8s %6s | %8s %8s %8s | %9s %11s %7s %6s | %8s %8s\n",
+		"mode", "target", "lat-avg", "lat-p95", "lat-max", "underruns", "underrun-ms", "clicks", "late",
+		"accel-%", "decel-%");
+	static const guint targets[] = { 5, 10, 20, 40 };
+	for(i=0; i<G_N_ELEMENTS(targets); i++) {
+		int mode = 0;
+		for(mode=0; mode<2; mode++) {
+			jamrtc_playout_result result;
+			jamrtc_playout_replay(p, count, rate, frame, mode == 1, targets[i], threshold, &result);
+			gdouble duration = result.duration_ms > 0 ? result.duration_ms : 1;
+			JAMRTC_LOG(LOG_INFO, "  %-8s %4ums | %6.1fms %6.1fms %6.1fms | %9u %9.0fms %7u %6u | %7.2f%% %7.2f%%\n",
+				mode ? "stretch" : "none", targets[i],
+				result.latency_avg, result.latency_p95, result.latency_max,
+				result.underruns, result.underrun_ms, result.clicks, result.late,
+				result.accelerated_ms * 100 / duration, result.decelerated_ms * 100 / duration);
+		}
+	}
+	g_array_free(packets, TRUE);
+	return 0;
+}
+
+/* Benchmark */
+int jamrtc_playout_bench(const char *list) {
+	if(list == NULL)
+		return -1;
+	JAMRTC_LOG(LOG_INFO, "Replaying jitter traces, with and without time-stretching:\n");
+	JAMRTC_LOG(LOG_INFO, "  (latency is what's queued for playout, clicks are discontinuities in what's played)\n");
+	int res = 0;
+	char **files = g_strsplit(list, ",", -1);
+	char **file = files;
+	for(file = files; *file; file++) {
+		if(**file == '\0')
+			continue;
+		if(jamrtc_playout_bench_trace(*file) < 0)
+			res = -1;
+	}
+	g_strfreev(files);
+	return res;
+}
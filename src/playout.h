@@ -0,0 +1,58 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_PLAYOUT_H
+#define JAMRTC_PLAYOUT_H
+
+/* GLib */
+#include <glib.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+
+/* Playout stage of a stream we receive (opaque) */
+typedef struct jamrtc_playout jamrtc_playout;
+
+/* Playout initialization: if stretch is FALSE, we only measure the playout
+ * latency, without ever accelerating or decelerating playout; if a folder
+ * is provided, the packet arrival times of all streams are saved there */
+int jamrtc_playout_init(gboolean stretch, const char *traces);
+/* Playout cleanup */
+void jamrtc_playout_cleanup(void);
+
+/* Create a playout stage for an audio stream: the latency we target
+ * considers how much the jitter buffer already absorbs (ms) */
+jamrtc_playout *jamrtc_playout_new(const char *participant, const char *stream,
+	guint clock_rate, guint jitter_buffer);
+/* Watch the RTP packets of the stream flowing through a pad, to figure
+ * out how late they arrive, and so the latency we should target */
+void jamrtc_playout_watch(jamrtc_playout *playout, GstPad *rtp_pad);
+/* Create the element that time-stretches decoded audio, to add to the
+ * pipeline right before the resampler that feeds the sink: we look at the
+ * clock of the sink to know how much audio is queued for playout */
+GstElement *jamrtc_playout_element(jamrtc_playout *playout, GstElement *sink);
+/* Let the playout stage know we stopped decoding the stream, as the sender
+ * is silent: the sink running dry until it's back is not an underrun */
+void jamrtc_playout_silence(jamrtc_playout *playout);
+/* Get the current playout latency and target (ms), how much audio we
+ * dropped and added so far to keep it there (ms), and the underruns */
+void jamrtc_playout_stats(jamrtc_playout *playout, guint *latency, guint *target,
+	guint *accelerated, guint *decelerated, guint *underruns);
+/* Get rid of a playout stage (the pipeline must be gone already) */
+void jamrtc_playout_free(jamrtc_playout *playout);
+
+/* Benchmark: replay the jitter traces in the comma separated list of files
+ * (as saved by the playout stage), and compare latency and quality with and
+ * without time-stretching, for different targets. Returns 0 if successful */
+int jamrtc_playout_bench(const char *traces);
+
+
+#endif
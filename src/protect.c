@@ -0,0 +1,248 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+
+/* Local includes */
+#include "protect.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Audio protection controller: our webcam and the videos we receive share
+ * the uplink and downlink with the instruments, and when the path gets
+ * congested it's the instruments that suffer first, since there's little
+ * to no buffering for them. Every time statistics are collected, we look at
+ * how the instruments are doing: loss and jitter for what we receive, and
+ * loss, jitter and round-trip time (as reported via RTCP) for what we send.
+ * Round-trip times are compared to the lowest we've seen on the same stream,
+ * since a growing RTT means packets are queueing somewhere. When any of them
+ * looks bad, we throttle video first, and pause it altogether if that's not
+ * enough; when all of them have been clean for a while, we go back one level
+ * at a time. As in degrade.c, if we have to protect audio again soon after a
+ * recovery, we wait twice as long before the next one, so that we don't flap */
+#define JAMRTC_PROTECT_BAD_LOSS			0.02	/* Packet loss that hurts (ratio) */
+#define JAMRTC_PROTECT_CLEAN_LOSS		0.005	/* Packet loss we're fine with (ratio) */
+#define JAMRTC_PROTECT_BAD_JITTER		0.030	/* Jitter that hurts (s) */
+#define JAMRTC_PROTECT_CLEAN_JITTER		0.010	/* Jitter we're fine with (s) */
+#define JAMRTC_PROTECT_BAD_QUEUEING		0.100	/* RTT above the lowest one that hurts (s) */
+#define JAMRTC_PROTECT_CLEAN_QUEUEING	0.030	/* RTT above the lowest one we're fine with (s) */
+#define JAMRTC_PROTECT_ESCALATE			10		/* Seconds to give throttling before pausing */
+#define JAMRTC_PROTECT_RECOVERY			20		/* Seconds clean before recovering, at first */
+#define JAMRTC_PROTECT_MAX_RECOVERY		300		/* Seconds clean before recovering, at most */
+#define JAMRTC_PROTECT_STALE			60		/* Seconds after which we forget about a stream */
+static gboolean enabled = FALSE;
+
+/* What we know about each instrument stream */
+typedef struct jamrtc_protect_stream {
+	/* Counters from the previous sample (inbound only) */
+	guint64 packets;
+	gint64 lost;
+	/* Lowest RTT we've seen (outbound only, s; negative if unknown) */
+	gdouble min_rtt;
+	/* When we got the last sample */
+	gint64 last_seen;
+} jamrtc_protect_stream;
+static GHashTable *streams = NULL;
+/* Worst values since the last update, and which stream they belong to */
+static gdouble worst_loss = 0, worst_jitter = 0, worst_queueing = 0;
+static char *worst_stream = NULL;
+static jamrtc_mutex streams_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+/* State of the controller (only accessed by the thread calling the update) */
+static jamrtc_protect_level level = JAMRTC_PROTECT_NONE;
+static gint64 entered = 0, clean_since = 0, last_recovery = 0;
+static guint recovery = JAMRTC_PROTECT_RECOVERY;
+static gint64 spent[JAMRTC_PROTECT_MAX+1];
+
+
+/* Audio protection controller initialization */
+void jamrtc_protect_init(gboolean enable) {
+	enabled = enable;
+	if(!enabled)
+		return;
+	streams = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	entered = g_get_monotonic_time();
+	memset(spent, 0, sizeof(spent));
+	JAMRTC_LOG(LOG_INFO, "Throttling or pausing video when the instruments suffer on the network\n");
+}
+
+/* Audio protection controller cleanup */
+void jamrtc_protect_cleanup(void) {
+	if(!enabled)
+		return;
+	enabled = FALSE;
+	spent[level] += g_get_monotonic_time() - entered;
+	JAMRTC_LOG(LOG_INFO, "Audio protection: %"SCNi64"s %s, %"SCNi64"s %s, %"SCNi64"s %s\n",
+		spent[JAMRTC_PROTECT_NONE] / G_USEC_PER_SEC, jamrtc_protect_level_str(JAMRTC_PROTECT_NONE),
+		spent[JAMRTC_PROTECT_THROTTLE] / G_USEC_PER_SEC, jamrtc_protect_level_str(JAMRTC_PROTECT_THROTTLE),
+		spent[JAMRTC_PROTECT_PAUSE] / G_USEC_PER_SEC, jamrtc_protect_level_str(JAMRTC_PROTECT_PAUSE));
+	jamrtc_mutex_lock(&streams_mutex);
+	g_hash_table_destroy(streams);
+	streams = NULL;
+	g_free(worst_stream);
+	worst_stream = NULL;
+	jamrtc_mutex_unlock(&streams_mutex);
+}
+
+/* Whether the audio protection controller is enabled */
+gboolean jamrtc_protect_is_enabled(void) {
+	return enabled;
+}
+
+/* Helper to keep track of the worst value of something: must be called with the mutex locked */
+static void jamrtc_protect_worst(gdouble *worst, gdouble value, gdouble bad, const char *name) {
+	if(value <= *worst)
+		return;
+	/* We name the first stream that made things look bad */
+	if(value >= bad && worst_stream == NULL)
+		worst_stream = g_strdup(name);
+	*worst = value;
+}
+
+/* Feed the controller with the latest statistics of an instrument stream */
+void jamrtc_protect_sample(const char *participant, const char *instrument, const jamrtc_stats_stream *stream) {
+	if(!enabled || stream == NULL || stream->video)
+		return;
+	/* For what we send, we need a report from the other side */
+	if(!stream->inbound && stream->rtt < 0)
+		return;
+	char name[256];
+	g_snprintf(name, sizeof(name), "%s/%s (%s)", participant ? participant : "??",
+		instrument ? instrument : "??", stream->inbound ? "inbound" : "outbound");
+	char key[300];
+	g_snprintf(key, sizeof(key), "%s/%"SCNu32, name, stream->ssrc);
+	jamrtc_mutex_lock(&streams_mutex);
+	if(streams == NULL) {
+		jamrtc_mutex_unlock(&streams_mutex);
+		return;
+	}
+	jamrtc_protect_stream *ps = g_hash_table_lookup(streams, key);
+	if(ps == NULL) {
+		ps = g_malloc0(sizeof(jamrtc_protect_stream));
+		ps->min_rtt = -1;
+		ps->packets = stream->packets;
+		ps->lost = stream->packets_lost;
+		g_hash_table_insert(streams, g_strdup(key), ps);
+	}
+	ps->last_seen = g_get_monotonic_time();
+	gdouble loss = 0, queueing = 0;
+	if(stream->inbound) {
+		/* Loss since the previous sample (DTX means fewer packets, not more loss) */
+		gint64 packets = stream->packets > ps->packets ? stream->packets - ps->packets : 0;
+		gint64 lost = MAX(0, stream->packets_lost - ps->lost);
+		if(packets + lost > 0)
+			loss = (gdouble)lost / (packets + lost);
+		ps->packets = stream->packets;
+		ps->lost = stream->packets_lost;
+	} else {
+		/* The receiver tells us about loss, and the RTT tells us about queues */
+		loss = stream->fraction_lost;
+		if(ps->min_rtt < 0 || stream->rtt < ps->min_rtt)
+			ps->min_rtt = stream->rtt;
+		queueing = stream->rtt - ps->min_rtt;
+		/* Let the lowest RTT creep up slowly, in case the route changed for good */
+		ps->min_rtt += 0.001;
+	}
+	jamrtc_protect_worst(&worst_loss, loss, JAMRTC_PROTECT_BAD_LOSS, name);
+	jamrtc_protect_worst(&worst_jitter, stream->jitter, JAMRTC_PROTECT_BAD_JITTER, name);
+	jamrtc_protect_worst(&worst_queueing, queueing, JAMRTC_PROTECT_BAD_QUEUEING, name);
+	jamrtc_mutex_unlock(&streams_mutex);
+}
+
+/* Helper to move to a different level, taking note of how long we spent in the previous one */
+static void jamrtc_protect_change(jamrtc_protect_level new_level, gint64 now, const char *why) {
+	gint64 duration = now - entered;
+	spent[level] += duration;
+	int log_level = (new_level > level ? LOG_WARN : LOG_INFO);
+	JAMRTC_LOG(log_level, "%s: %s (after %"SCNi64"s %s)\n",
+		why, jamrtc_protect_level_str(new_level), duration / G_USEC_PER_SEC, jamrtc_protect_level_str(level));
+	level = new_level;
+	entered = now;
+}
+
+/* Check the samples we got since last time, and figure out the level */
+jamrtc_protect_level jamrtc_protect_update(void) {
+	if(!enabled)
+		return JAMRTC_PROTECT_NONE;
+	gint64 now = g_get_monotonic_time();
+	/* Get the worst of what we saw, and forget about streams that went away */
+	jamrtc_mutex_lock(&streams_mutex);
+	gdouble loss = worst_loss, jitter = worst_jitter, queueing = worst_queueing;
+	char *culprit = worst_stream;
+	worst_loss = 0;
+	worst_jitter = 0;
+	worst_queueing = 0;
+	worst_stream = NULL;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, streams);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		jamrtc_protect_stream *ps = (jamrtc_protect_stream *)value;
+		if(now - ps->last_seen >= JAMRTC_PROTECT_STALE*G_USEC_PER_SEC)
+			g_hash_table_iter_remove(&iter);
+	}
+	jamrtc_mutex_unlock(&streams_mutex);
+	JAMRTC_LOG(LOG_DBG, "Instruments: %.1f%% loss, %.1fms jitter, %.1fms queueing, %s\n",
+		loss * 100, jitter * 1000, queueing * 1000, jamrtc_protect_level_str(level));
+	/* Check how the instruments are doing */
+	char why[512];
+	if(loss >= JAMRTC_PROTECT_BAD_LOSS || jitter >= JAMRTC_PROTECT_BAD_JITTER ||
+			queueing >= JAMRTC_PROTECT_BAD_QUEUEING) {
+		clean_since = 0;
+		/* Throttle right away, but give throttling some time before pausing */
+		if(level < JAMRTC_PROTECT_MAX && (level == JAMRTC_PROTECT_NONE ||
+				now - entered >= JAMRTC_PROTECT_ESCALATE*G_USEC_PER_SEC)) {
+			if(last_recovery > 0 && now - last_recovery < (gint64)recovery * G_USEC_PER_SEC)
+				recovery = MIN(recovery * 2, JAMRTC_PROTECT_MAX_RECOVERY);
+			g_snprintf(why, sizeof(why), "Instrument audio suffering on %s (%.1f%% loss, %.1fms jitter, %.1fms queueing)",
+				culprit ? culprit : "the network", loss * 100, jitter * 1000, queueing * 1000);
+			jamrtc_protect_change(level + 1, now, why);
+		}
+	} else if(loss < JAMRTC_PROTECT_CLEAN_LOSS && jitter < JAMRTC_PROTECT_CLEAN_JITTER &&
+			queueing < JAMRTC_PROTECT_CLEAN_QUEUEING) {
+		if(clean_since == 0)
+			clean_since = now;
+		if(level > JAMRTC_PROTECT_NONE && now - clean_since >= (gint64)recovery * G_USEC_PER_SEC) {
+			/* Clean for a while, go one level up (and wait as long for the next one) */
+			g_snprintf(why, sizeof(why), "Instrument audio clean for %"SCNi64"s",
+				(now - clean_since) / G_USEC_PER_SEC);
+			jamrtc_protect_change(level - 1, now, why);
+			clean_since = now;
+			last_recovery = now;
+		} else if(level == JAMRTC_PROTECT_NONE && last_recovery > 0 &&
+				now - last_recovery >= (gint64)JAMRTC_PROTECT_MAX_RECOVERY * G_USEC_PER_SEC) {
+			/* We've been fine for long enough to forget about past troubles */
+			recovery = JAMRTC_PROTECT_RECOVERY;
+			last_recovery = 0;
+		}
+	} else {
+		/* Not bad, but not clean either: stay where we are */
+		clean_since = 0;
+	}
+	g_free(culprit);
+	return level;
+}
+
+/* Get a string representation of a level */
+const char *jamrtc_protect_level_str(jamrtc_protect_level level) {
+	switch(level) {
+		case JAMRTC_PROTECT_NONE:
+			return "full video";
+		case JAMRTC_PROTECT_THROTTLE:
+			return "video throttled";
+		case JAMRTC_PROTECT_PAUSE:
+			return "video paused";
+		default:
+			break;
+	}
+	return NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_PROTECT_H
+#define JAMRTC_PROTECT_H
+
+/* GLib */
+#include <glib.h>
+
+/* Local includes */
+#include "stats.h"
+
+
+/* Protection levels: what we do to video to leave room to instruments on the network */
+typedef enum jamrtc_protect_level {
+	/* Everything as usual */
+	JAMRTC_PROTECT_NONE = 0,
+	/* Send less video (lower bitrate, or no highest simulcast layer), and ask
+	 * for the lowest substream of who's simulcasting */
+	JAMRTC_PROTECT_THROTTLE,
+	/* Stop sending our webcam, and stop receiving the video of the others */
+	JAMRTC_PROTECT_PAUSE
+} jamrtc_protect_level;
+#define JAMRTC_PROTECT_MAX	JAMRTC_PROTECT_PAUSE
+
+/* Audio protection controller initialization */
+void jamrtc_protect_init(gboolean enabled);
+/* Audio protection controller cleanup: logs how long we spent in each level */
+void jamrtc_protect_cleanup(void);
+/* Whether the audio protection controller is enabled */
+gboolean jamrtc_protect_is_enabled(void);
+/* Feed the controller with the latest statistics of an instrument stream
+ * (we send or receive): can be called from any thread */
+void jamrtc_protect_sample(const char *participant, const char *instrument, const jamrtc_stats_stream *stream);
+/* Check the samples we got since last time, and figure out which level we
+ * should be at now: to call periodically, always from the same thread */
+jamrtc_protect_level jamrtc_protect_update(void);
+/* Get a string representation of a level */
+const char *jamrtc_protect_level_str(jamrtc_protect_level level);
+
+
+#endif
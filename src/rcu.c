@@ -0,0 +1,148 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Local includes */
+#include "rcu.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* This is a simple epoch based scheme: each thread gets a reader slot the
+ * first time it enters a read-side section, where it publishes the global
+ * epoch it saw when entering it. Retiring an object bumps the global epoch,
+ * and tags the object with the previous value: since readers publish their
+ * epoch before reading the shared pointer, a reader that may have seen the
+ * object always has an epoch that's not greater than the tag, so an object
+ * can be freed as soon as all readers are either idle or in a newer epoch.
+ * Slots of threads that went away are reused by new threads */
+typedef struct jamrtc_rcu_reader {
+	volatile gint used;
+	/* Epoch this reader entered its read-side section in (0 when idle) */
+	volatile guint epoch;
+	guint nesting;
+	struct jamrtc_rcu_reader *next;
+} jamrtc_rcu_reader;
+static jamrtc_rcu_reader *volatile readers = NULL;
+static void jamrtc_rcu_reader_release(gpointer data);
+static GPrivate reader_slot = G_PRIVATE_INIT(jamrtc_rcu_reader_release);
+static volatile guint epoch = 1;
+
+/* Objects waiting for readers to move on */
+typedef struct jamrtc_rcu_retired {
+	gpointer data;
+	GDestroyNotify free_func;
+	guint epoch;
+} jamrtc_rcu_retired;
+static GQueue retired = G_QUEUE_INIT;
+static jamrtc_mutex retired_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+
+/* When a thread goes away, its reader slot can be reused */
+static void jamrtc_rcu_reader_release(gpointer data) {
+	jamrtc_rcu_reader *reader = (jamrtc_rcu_reader *)data;
+	if(reader == NULL)
+		return;
+	reader->nesting = 0;
+	g_atomic_int_set(&reader->epoch, 0);
+	g_atomic_int_set(&reader->used, 0);
+}
+
+/* Helper to get the reader slot of the current thread */
+static jamrtc_rcu_reader *jamrtc_rcu_reader_get(void) {
+	jamrtc_rcu_reader *reader = g_private_get(&reader_slot);
+	if(reader != NULL)
+		return reader;
+	/* Check if there's a slot we can reuse first */
+	for(reader = g_atomic_pointer_get(&readers); reader != NULL; reader = reader->next) {
+		if(g_atomic_int_compare_and_exchange(&reader->used, 0, 1))
+			break;
+	}
+	if(reader == NULL) {
+		/* Nope, add a new one */
+		reader = g_malloc0(sizeof(jamrtc_rcu_reader));
+		reader->used = 1;
+		do {
+			reader->next = g_atomic_pointer_get(&readers);
+		} while(!g_atomic_pointer_compare_and_exchange(&readers, reader->next, reader));
+	}
+	g_private_set(&reader_slot, reader);
+	return reader;
+}
+
+/* Enter a read-side section */
+void jamrtc_rcu_read_lock(void) {
+	jamrtc_rcu_reader *reader = jamrtc_rcu_reader_get();
+	if(reader->nesting++ == 0)
+		g_atomic_int_set(&reader->epoch, g_atomic_int_get(&epoch));
+}
+
+/* Leave a read-side section */
+void jamrtc_rcu_read_unlock(void) {
+	jamrtc_rcu_reader *reader = g_private_get(&reader_slot);
+	if(reader == NULL || reader->nesting == 0)
+		return;
+	if(--reader->nesting == 0)
+		g_atomic_int_set(&reader->epoch, 0);
+}
+
+/* Retire an object */
+void jamrtc_rcu_retire(gpointer data, GDestroyNotify free_func) {
+	if(data == NULL || free_func == NULL)
+		return;
+	jamrtc_rcu_retired *item = g_malloc(sizeof(jamrtc_rcu_retired));
+	item->data = data;
+	item->free_func = free_func;
+	jamrtc_mutex_lock(&retired_mutex);
+	item->epoch = g_atomic_int_add(&epoch, 1);
+	g_queue_push_tail(&retired, item);
+	jamrtc_mutex_unlock(&retired_mutex);
+}
+
+/* Free what we can */
+guint jamrtc_rcu_reclaim(void) {
+	/* Objects retired after this point are left alone for now */
+	guint limit = g_atomic_int_get(&epoch);
+	/* Find the oldest epoch readers are still in */
+	guint oldest = limit;
+	jamrtc_rcu_reader *reader = g_atomic_pointer_get(&readers);
+	for(; reader != NULL; reader = reader->next) {
+		guint current = g_atomic_int_get(&reader->epoch);
+		if(current != 0 && current < oldest)
+			oldest = current;
+	}
+	/* Objects are queued in epoch order, so we can stop at the first one that's still visible */
+	GList *freeable = NULL;
+	jamrtc_mutex_lock(&retired_mutex);
+	jamrtc_rcu_retired *item = NULL;
+	while((item = g_queue_peek_head(&retired)) != NULL) {
+		if(item->epoch >= oldest)
+			break;
+		freeable = g_list_prepend(freeable, g_queue_pop_head(&retired));
+	}
+	guint left = g_queue_get_length(&retired);
+	jamrtc_mutex_unlock(&retired_mutex);
+	/* Free them without holding the lock, the free functions may need to retire something too */
+	freeable = g_list_reverse(freeable);
+	GList *temp = freeable;
+	while(temp) {
+		item = (jamrtc_rcu_retired *)temp->data;
+		item->free_func(item->data);
+		g_free(item);
+		temp = temp->next;
+	}
+	g_list_free(freeable);
+	return left;
+}
+
+/* Wait for all readers, and free everything */
+void jamrtc_rcu_synchronize(void) {
+	while(jamrtc_rcu_reclaim() > 0)
+		g_usleep(1000);
+}
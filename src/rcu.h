@@ -0,0 +1,41 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_RCU_H
+#define JAMRTC_RCU_H
+
+/* GLib */
+#include <glib.h>
+
+
+/* Minimal RCU-style reclamation: readers access a shared pointer without
+ * taking any lock, within a read-side section; writers replace it with an
+ * updated copy, and retire the old one, which is only actually freed when
+ * no reader that may have seen it is still around. Writers are expected to
+ * be serialized by the caller */
+
+/* Enter a read-side section (can be nested): it should be short, and
+ * must never wait on anything a writer may be holding */
+void jamrtc_rcu_read_lock(void);
+/* Leave a read-side section */
+void jamrtc_rcu_read_unlock(void);
+
+/* Retire an object that was just unpublished: the free function is
+ * called later on, once no reader can be looking at it anymore */
+void jamrtc_rcu_retire(gpointer data, GDestroyNotify free_func);
+/* Free the retired objects no reader can be looking at anymore: returns
+ * how many retired objects are still waiting for readers */
+guint jamrtc_rcu_reclaim(void);
+/* Wait for all readers, and free all retired objects (not to be called
+ * from within a read-side section) */
+void jamrtc_rcu_synchronize(void);
+
+
+#endif
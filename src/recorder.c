@@ -0,0 +1,469 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+
+/* GStreamer includes */
+#include <gst/rtp/gstrtpbuffer.h>
+
+/* JSON stack (for the session manifest) */
+#include <json-glib/json-glib.h>
+
+/* Local includes */
+#include "recorder.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Multitrack recorder: each stream is saved to its own file as it is,
+ * i.e., the Opus frames we get out of the depayloader (or out of opusenc,
+ * for our own instrument) are just muxed and written, with no decoding or
+ * re-encoding involved. A session manifest (session.json) takes note of
+ * when each track started, so that all tracks can be lined up later when
+ * mixing them, and of when things that may have caused glitches (e.g., JACK
+ * xruns) happened. Where a track starts is the NTP time its first RTP
+ * timestamp maps to, as per the RTCP Sender Reports of its sender (or, for
+ * our own instrument, the clock rtpbin derives our Sender Reports from): the
+ * wallclock time we got the first frame at is only used as a fallback, since
+ * it includes the network and jitter buffer delays of each stream. Each track has a
+ * queue of a couple of seconds, that drops the oldest frames if the disk
+ * can't keep up, rather than stalling the decoder the tee also feeds. The
+ * manifest is only updated in memory when something changes (events may come
+ * from the JACK monitor at any rate), and saved periodically by the WebRTC
+ * loop (see jamrtc_recorder_save) and at exit */
+#define JAMRTC_RECORDER_QUEUE		2		/* How much each track can buffer (seconds) */
+static char *folder = NULL;
+static const char *format = NULL, *muxer = NULL;
+
+/* Recorded tracks */
+struct jamrtc_recorder_track {
+	/* Who and what we're recording */
+	char *participant, *stream;
+	/* Where we're saving the track */
+	char *filename;
+	/* Pad we'll send the EOS to, to finalize the file */
+	GstPad *pad;
+	/* Whether this is our own stream, rather than one we receive */
+	gboolean local;
+	/* SSRC, clock rate and first RTP timestamp we saw, if any */
+	guint32 ssrc, first_rtp_ts;
+	gint clock_rate;
+	gboolean has_rtp_ts;
+	/* RTP timestamp and wallclock time (NTP, converted to microseconds since
+	 * the epoch) from the first Sender Report that we could map it to */
+	guint32 sync_rtp_ts;
+	gint64 sync_time;
+	gboolean synced;
+	/* Wallclock time of the first frame we recorded (0 if none yet) */
+	gint64 start_time;
+	/* Whether this track has been stopped */
+	gboolean stopped;
+	/* How many times the disk couldn't keep up, and we dropped frames */
+	volatile gint dropped;
+};
+static void jamrtc_recorder_track_free(jamrtc_recorder_track *track) {
+	if(track == NULL)
+		return;
+	g_free(track->participant);
+	g_free(track->stream);
+	g_free(track->filename);
+	if(track->pad != NULL)
+		gst_object_unref(track->pad);
+	g_free(track);
+}
+static GList *tracks = NULL;
+static guint tracks_num = 0;
+
+/* Events we took note of (wallclock time and what happened) */
+typedef struct jamrtc_recorder_event {
+	gint64 when;
+	char *what;
+} jamrtc_recorder_event;
+static void jamrtc_recorder_event_free(jamrtc_recorder_event *event) {
+	if(event == NULL)
+		return;
+	g_free(event->what);
+	g_free(event);
+}
+static GList *events = NULL;
+static jamrtc_mutex recorder_mutex = JAMRTC_MUTEX_INITIALIZER;
+/* Whether the manifest changed since we last saved it */
+static gboolean dirty = FALSE;
+
+
+/* Recorder initialization */
+int jamrtc_recorder_init(const char *path, const char *fmt) {
+	if(path == NULL)
+		return -1;
+	if(fmt == NULL || !strcasecmp(fmt, "ogg")) {
+		format = "ogg";
+		muxer = "oggmux";
+	} else if(!strcasecmp(fmt, "mkv")) {
+		format = "mkv";
+		muxer = "matroskamux";
+	} else {
+		JAMRTC_LOG(LOG_FATAL, "Unsupported recording format '%s' (should be ogg or mkv)\n", fmt);
+		return -1;
+	}
+	if(g_mkdir_with_parents(path, 0755) < 0) {
+		JAMRTC_LOG(LOG_FATAL, "Couldn't create the recording folder '%s'\n", path);
+		return -1;
+	}
+	folder = g_strdup(path);
+	return 0;
+}
+
+/* Whether recording is enabled */
+gboolean jamrtc_recorder_is_enabled(void) {
+	return folder != NULL;
+}
+
+/* Helper to figure out when a track started: if we have a Sender Report
+ * for it, it's the time its first RTP timestamp maps to, otherwise it's the
+ * wallclock time of the first frame (must be called with the mutex locked) */
+static gint64 jamrtc_recorder_track_start(jamrtc_recorder_track *track, gboolean *aligned) {
+	if(aligned)
+		*aligned = FALSE;
+	if(track->has_rtp_ts && track->synced && track->clock_rate > 0) {
+		if(aligned)
+			*aligned = TRUE;
+		/* The signed difference takes care of wrap-arounds */
+		gint32 diff = (gint32)(track->first_rtp_ts - track->sync_rtp_ts);
+		return track->sync_time + (gint64)diff * G_USEC_PER_SEC / track->clock_rate;
+	}
+	return track->start_time;
+}
+
+/* Helper to generate the session manifest: must be called with the mutex locked */
+static char *jamrtc_recorder_manifest(void) {
+	/* Tracks are lined up relative to the first one that started */
+	gint64 first = 0;
+	GList *temp = tracks;
+	while(temp) {
+		jamrtc_recorder_track *track = (jamrtc_recorder_track *)temp->data;
+		gint64 start = jamrtc_recorder_track_start(track, NULL);
+		if(start > 0 && (first == 0 || start < first))
+			first = start;
+		temp = temp->next;
+	}
+	JsonObject *session = json_object_new();
+	json_object_set_string_member(session, "format", format);
+	json_object_set_int_member(session, "start_time", first);
+	JsonArray *list = json_array_new();
+	for(temp = g_list_last(tracks); temp != NULL; temp = temp->prev) {
+		jamrtc_recorder_track *track = (jamrtc_recorder_track *)temp->data;
+		JsonObject *t = json_object_new();
+		char *basename = g_path_get_basename(track->filename);
+		json_object_set_string_member(t, "file", basename);
+		g_free(basename);
+		json_object_set_string_member(t, "participant", track->participant);
+		json_object_set_string_member(t, "stream", track->stream);
+		json_object_set_int_member(t, "clock_rate", track->clock_rate);
+		if(track->has_rtp_ts) {
+			json_object_set_int_member(t, "ssrc", track->ssrc);
+			json_object_set_int_member(t, "first_rtp_timestamp", track->first_rtp_ts);
+		}
+		gboolean aligned = FALSE;
+		gint64 start = jamrtc_recorder_track_start(track, &aligned);
+		if(start > 0) {
+			json_object_set_int_member(t, "start_time", start);
+			json_object_set_double_member(t, "offset_ms", (gdouble)(start - first) / 1000);
+			json_object_set_boolean_member(t, "aligned", aligned);
+		}
+		if(g_atomic_int_get(&track->dropped) > 0)
+			json_object_set_int_member(t, "dropped", g_atomic_int_get(&track->dropped));
+		json_array_add_object_element(list, t);
+	}
+	json_object_set_array_member(session, "tracks", list);
+	if(events != NULL) {
+		list = json_array_new();
+		for(temp = g_list_last(events); temp != NULL; temp = temp->prev) {
+			jamrtc_recorder_event *event = (jamrtc_recorder_event *)temp->data;
+			JsonObject *e = json_object_new();
+			json_object_set_string_member(e, "event", event->what);
+			json_object_set_int_member(e, "time", event->when);
+			if(first > 0)
+				json_object_set_double_member(e, "offset_ms", (gdouble)(event->when - first) / 1000);
+			json_array_add_object_element(list, e);
+		}
+		json_object_set_array_member(session, "events", list);
+	}
+	JsonGenerator *generator = json_generator_new();
+	json_generator_set_pretty(generator, TRUE);
+	JsonNode *root = json_node_new(JSON_NODE_OBJECT);
+	json_node_take_object(root, session);
+	json_generator_set_root(generator, root);
+	char *text = json_generator_to_data(generator, NULL);
+	json_node_free(root);
+	g_object_unref(generator);
+	return text;
+}
+
+/* Save the session manifest, if it changed (or if forced to) */
+void jamrtc_recorder_save(gboolean force) {
+	if(!jamrtc_recorder_is_enabled())
+		return;
+	jamrtc_mutex_lock(&recorder_mutex);
+	if(!dirty && !force) {
+		jamrtc_mutex_unlock(&recorder_mutex);
+		return;
+	}
+	dirty = FALSE;
+	char *text = jamrtc_recorder_manifest();
+	jamrtc_mutex_unlock(&recorder_mutex);
+	/* We write the file without holding the lock */
+	char *filename = g_build_filename(folder, "session.json", NULL);
+	GError *error = NULL;
+	if(!g_file_set_contents(filename, text, -1, &error)) {
+		JAMRTC_LOG(LOG_ERR, "Error saving the recording manifest: %s\n",
+			error && error->message ? error->message : "??");
+		g_clear_error(&error);
+	}
+	g_free(filename);
+	g_free(text);
+}
+
+/* One-shot probes to take note of when a track started, and of its first RTP timestamp */
+static GstPadProbeReturn jamrtc_recorder_first_frame(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_recorder_track *track = (jamrtc_recorder_track *)user_data;
+	jamrtc_mutex_lock(&recorder_mutex);
+	track->start_time = g_get_real_time();
+	dirty = TRUE;
+	jamrtc_mutex_unlock(&recorder_mutex);
+	JAMRTC_LOG(LOG_INFO, "[%s][%s] Started recording to %s\n",
+		track->participant, track->stream, track->filename);
+	return GST_PAD_PROBE_REMOVE;
+}
+static GstPadProbeReturn jamrtc_recorder_first_rtp(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_recorder_track *track = (jamrtc_recorder_track *)user_data;
+	GstBuffer *buffer = NULL;
+	if(info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+		buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	} else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		if(gst_buffer_list_length(list) > 0)
+			buffer = gst_buffer_list_get(list, 0);
+	}
+	GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+	if(buffer == NULL || !gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+		return GST_PAD_PROBE_OK;
+	guint32 ssrc = gst_rtp_buffer_get_ssrc(&rtp);
+	guint32 rtp_ts = gst_rtp_buffer_get_timestamp(&rtp);
+	gst_rtp_buffer_unmap(&rtp);
+	gint clock_rate = 0;
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	if(caps != NULL) {
+		gst_structure_get_int(gst_caps_get_structure(caps, 0), "clock-rate", &clock_rate);
+		gst_caps_unref(caps);
+	}
+	/* If this is our own stream, we're the sender: rtpbin maps the running
+	 * time of our packets to the wallclock for our Sender Reports, so we do
+	 * the same here to find out when this first RTP timestamp was captured */
+	gint64 sync_time = 0;
+	GstClockTime pts = GST_BUFFER_PTS(buffer);
+	if(track->local && GST_CLOCK_TIME_IS_VALID(pts)) {
+		GstElement *element = gst_pad_get_parent_element(pad);
+		GstClock *clock = element ? gst_element_get_clock(element) : NULL;
+		GstEvent *event = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+		if(clock != NULL && event != NULL) {
+			const GstSegment *segment = NULL;
+			gst_event_parse_segment(event, &segment);
+			GstClockTime running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, pts);
+			GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(element);
+			gint64 real_now = g_get_real_time();
+			if(GST_CLOCK_TIME_IS_VALID(running_time))
+				sync_time = real_now - GST_CLOCK_DIFF(running_time, now) / GST_USECOND;
+		}
+		if(event != NULL)
+			gst_event_unref(event);
+		if(clock != NULL)
+			gst_object_unref(clock);
+		if(element != NULL)
+			gst_object_unref(element);
+	}
+	jamrtc_mutex_lock(&recorder_mutex);
+	track->ssrc = ssrc;
+	track->first_rtp_ts = rtp_ts;
+	track->has_rtp_ts = TRUE;
+	if(clock_rate > 0)
+		track->clock_rate = clock_rate;
+	if(sync_time > 0) {
+		track->sync_rtp_ts = rtp_ts;
+		track->sync_time = sync_time;
+		track->synced = TRUE;
+	}
+	dirty = TRUE;
+	jamrtc_mutex_unlock(&recorder_mutex);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/* A Sender Report for the SSRC of a track, if it's the first one we get */
+void jamrtc_recorder_sync(jamrtc_recorder_track *track, guint32 ssrc, guint32 rtp_ts, guint64 ntp_time) {
+	if(track == NULL || ntp_time == 0)
+		return;
+	/* NTP timestamps are 32.32 fixed point seconds since 1900 */
+	gint64 sync_time = ((gint64)(ntp_time >> 32) - G_GINT64_CONSTANT(2208988800)) * G_USEC_PER_SEC +
+		(gint64)(((ntp_time & 0xFFFFFFFF) * G_USEC_PER_SEC) >> 32);
+	jamrtc_mutex_lock(&recorder_mutex);
+	if(track->synced || !track->has_rtp_ts || track->ssrc != ssrc) {
+		jamrtc_mutex_unlock(&recorder_mutex);
+		return;
+	}
+	track->sync_rtp_ts = rtp_ts;
+	track->sync_time = sync_time;
+	track->synced = TRUE;
+	dirty = TRUE;
+	jamrtc_mutex_unlock(&recorder_mutex);
+	JAMRTC_LOG(LOG_VERB, "[%s][%s] Aligned the recording to the sender's clock (SSRC %"SCNu32")\n",
+		track->participant, track->stream, ssrc);
+}
+
+/* The queue of a track is full, so it's going to drop the oldest frame */
+static void jamrtc_recorder_overrun(GstElement *queue, gpointer user_data) {
+	jamrtc_recorder_track *track = (jamrtc_recorder_track *)user_data;
+	if(g_atomic_int_add(&track->dropped, 1) == 0) {
+		JAMRTC_LOG(LOG_WARN, "[%s][%s] Writing to disk can't keep up, dropping frames\n",
+			track->participant, track->stream);
+	}
+}
+
+/* Helper to turn names in something we can safely use in a filename */
+static char *jamrtc_recorder_sanitize(const char *name) {
+	char *res = g_strdup(name ? name : "unknown");
+	char *c = res;
+	for(c = res; *c; c++) {
+		if(!g_ascii_isalnum(*c) && *c != '-' && *c != '_')
+			*c = '_';
+	}
+	return res;
+}
+
+/* Start recording a track */
+jamrtc_recorder_track *jamrtc_recorder_add(GstElement *pipeline, GstElement *tee,
+		const char *participant, const char *stream, GstPad *rtp_pad, gboolean local) {
+	if(!jamrtc_recorder_is_enabled() || pipeline == NULL || tee == NULL)
+		return NULL;
+	jamrtc_recorder_track *track = g_malloc0(sizeof(jamrtc_recorder_track));
+	track->participant = g_strdup(participant);
+	track->stream = g_strdup(stream ? stream : "chat");
+	track->local = local;
+	track->clock_rate = 48000;
+	char *p = jamrtc_recorder_sanitize(track->participant), *s = jamrtc_recorder_sanitize(track->stream);
+	char name[256];
+	jamrtc_mutex_lock(&recorder_mutex);
+	tracks_num++;
+	g_snprintf(name, sizeof(name), "%02u-%s-%s.%s", tracks_num, p, s, format);
+	jamrtc_mutex_unlock(&recorder_mutex);
+	g_free(p);
+	g_free(s);
+	track->filename = g_build_filename(folder, name, NULL);
+	/* Create the branch: opusparse takes care of the Opus headers for us */
+	char description[1024];
+	g_snprintf(description, sizeof(description),
+		"queue name=queue leaky=downstream max-size-buffers=0 max-size-bytes=0 max-size-time=%"SCNu64" ! "
+		"opusparse name=parse ! %s ! filesink location=\"%s\" async=false sync=false",
+		(guint64)JAMRTC_RECORDER_QUEUE * GST_SECOND, muxer, track->filename);
+	GError *error = NULL;
+	GstElement *bin = gst_parse_bin_from_description(description, TRUE, &error);
+	if(error != NULL) {
+		JAMRTC_LOG(LOG_ERR, "[%s][%s] Error creating the recording branch: %s\n",
+			track->participant, track->stream, error->message);
+		g_error_free(error);
+		if(bin != NULL)
+			gst_object_unref(bin);
+		jamrtc_recorder_track_free(track);
+		return NULL;
+	}
+	GstElement *parse = gst_bin_get_by_name(GST_BIN(bin), "parse");
+	track->pad = gst_element_get_static_pad(parse, "sink");
+	gst_object_unref(parse);
+	GstElement *queue = gst_bin_get_by_name(GST_BIN(bin), "queue");
+	g_signal_connect(queue, "overrun", G_CALLBACK(jamrtc_recorder_overrun), track);
+	gst_object_unref(queue);
+	gst_bin_add(GST_BIN(pipeline), bin);
+	gst_element_sync_state_with_parent(bin);
+	GstPad *tee_pad = gst_element_get_request_pad(tee, "src_%u");
+	GstPad *bin_pad = gst_element_get_static_pad(bin, "sink");
+	if(gst_pad_link(tee_pad, bin_pad) != GST_PAD_LINK_OK) {
+		JAMRTC_LOG(LOG_ERR, "[%s][%s] Error linking the recording branch\n",
+			track->participant, track->stream);
+	}
+	gst_pad_add_probe(bin_pad, GST_PAD_PROBE_TYPE_BUFFER, jamrtc_recorder_first_frame, track, NULL);
+	gst_object_unref(tee_pad);
+	gst_object_unref(bin_pad);
+	if(rtp_pad != NULL) {
+		gst_pad_add_probe(rtp_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+			jamrtc_recorder_first_rtp, track, NULL);
+	}
+	jamrtc_mutex_lock(&recorder_mutex);
+	tracks = g_list_prepend(tracks, track);
+	jamrtc_mutex_unlock(&recorder_mutex);
+	return track;
+}
+
+/* Stop recording a track */
+void jamrtc_recorder_stop(jamrtc_recorder_track *track) {
+	if(track == NULL)
+		return;
+	jamrtc_mutex_lock(&recorder_mutex);
+	if(track->stopped) {
+		jamrtc_mutex_unlock(&recorder_mutex);
+		return;
+	}
+	track->stopped = TRUE;
+	GstPad *pad = track->pad;
+	track->pad = NULL;
+	jamrtc_mutex_unlock(&recorder_mutex);
+	if(pad != NULL) {
+		/* EOS is serialized, so sending it to the parser right after the queue
+		 * waits for the current buffer, and then the muxer finalizes the file */
+		gst_pad_send_event(pad, gst_event_new_eos());
+		gst_object_unref(pad);
+	}
+	JAMRTC_LOG(LOG_INFO, "[%s][%s] Stopped recording to %s (%d drops)\n",
+		track->participant, track->stream, track->filename, g_atomic_int_get(&track->dropped));
+	jamrtc_mutex_lock(&recorder_mutex);
+	dirty = TRUE;
+	jamrtc_mutex_unlock(&recorder_mutex);
+}
+
+/* Recorder cleanup */
+void jamrtc_recorder_cleanup(void) {
+	if(!jamrtc_recorder_is_enabled())
+		return;
+	jamrtc_mutex_lock(&recorder_mutex);
+	GList *list = g_list_copy(tracks);
+	jamrtc_mutex_unlock(&recorder_mutex);
+	g_list_foreach(list, (GFunc)jamrtc_recorder_stop, NULL);
+	g_list_free(list);
+	jamrtc_recorder_save(TRUE);
+	jamrtc_mutex_lock(&recorder_mutex);
+	g_list_free_full(tracks, (GDestroyNotify)jamrtc_recorder_track_free);
+	tracks = NULL;
+	g_list_free_full(events, (GDestroyNotify)jamrtc_recorder_event_free);
+	events = NULL;
+	jamrtc_mutex_unlock(&recorder_mutex);
+	g_free(folder);
+	folder = NULL;
+}
+
+/* Take note in the session manifest of something that happened */
+void jamrtc_recorder_mark(gint64 when, const char *what) {
+	if(!jamrtc_recorder_is_enabled() || what == NULL)
+		return;
+	jamrtc_recorder_event *event = g_malloc0(sizeof(jamrtc_recorder_event));
+	event->when = when;
+	event->what = g_strdup(what);
+	jamrtc_mutex_lock(&recorder_mutex);
+	events = g_list_prepend(events, event);
+	dirty = TRUE;
+	jamrtc_mutex_unlock(&recorder_mutex);
+}
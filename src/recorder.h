@@ -0,0 +1,59 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_RECORDER_H
+#define JAMRTC_RECORDER_H
+
+/* GLib */
+#include <glib.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+
+/* A track being recorded (opaque) */
+typedef struct jamrtc_recorder_track jamrtc_recorder_track;
+
+/* Recorder initialization: tracks are saved in the provided folder, as
+ * either Ogg/Opus ("ogg") or Matroska ("mkv") files */
+int jamrtc_recorder_init(const char *folder, const char *format);
+/* Recorder cleanup (stops all tracks, and writes the session manifest) */
+void jamrtc_recorder_cleanup(void);
+/* Whether recording is enabled */
+gboolean jamrtc_recorder_is_enabled(void);
+/* Save the session manifest, if anything changed since the last time (or
+ * anyway, if forced to): meant to be called periodically by the WebRTC loop,
+ * rather than from the UI context, since it touches the disk */
+void jamrtc_recorder_save(gboolean force);
+
+/* Start recording a track: the tee must be in the pipeline, and must be
+ * fed with encoded Opus frames (i.e., after opusenc or the depayloader),
+ * since we never decode or re-encode anything. The optional RTP pad is
+ * where the RTP packets of the same stream flow, and is used to take note
+ * of the SSRC and first RTP timestamp, to align tracks later: for tracks
+ * we receive, that needs jamrtc_recorder_sync to be called too, while for
+ * local ones (our own instrument) we can map the timestamp ourselves */
+jamrtc_recorder_track *jamrtc_recorder_add(GstElement *pipeline, GstElement *tee,
+	const char *participant, const char *stream, GstPad *rtp_pad, gboolean local);
+/* Pass the NTP/RTP timestamps pair of an RTCP Sender Report to a track,
+ * so that its first RTP timestamp can be mapped to the sender's wallclock:
+ * only the first Sender Report for the SSRC of the track is used */
+void jamrtc_recorder_sync(jamrtc_recorder_track *track, guint32 ssrc, guint32 rtp_ts, guint64 ntp_time);
+/* Stop recording a track, finalizing the file: must be called before
+ * the pipeline is stopped. The track itself is owned by the recorder */
+void jamrtc_recorder_stop(jamrtc_recorder_track *track);
+/* Take note in the session manifest of something that happened at a
+ * specific (wallclock) time, e.g., a JACK xrun, so that it can be found
+ * in the tracks later: does nothing if we're not recording. This never
+ * touches the disk, the manifest is saved periodically and at cleanup */
+void jamrtc_recorder_mark(gint64 when, const char *what);
+
+
+#endif
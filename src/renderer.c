@@ -0,0 +1,294 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Local includes */
+#include "renderer.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Compositor renderer: rather than having each remote stream and wavescope
+ * render to its own xvimagesink (and X window), all tiles are fed via
+ * intervideosink/intervideosrc pairs to a single compositor, whose output
+ * is then rendered by a single sink embedded in the main window */
+static GstElement *renderer = NULL, *mixer = NULL, *sink = NULL;
+static gboolean window_visible = TRUE;
+
+/* Tiles currently in the layout */
+typedef struct jamrtc_renderer_tile {
+	/* Slot and kind of this tile */
+	guint slot;
+	jamrtc_tile_kind kind;
+	/* The intervideosrc bin in the renderer pipeline */
+	GstElement *source;
+	/* The compositor pad we're feeding */
+	GstPad *pad;
+	/* The valve in the producer pipeline, if any */
+	GstElement *valve;
+	/* Whether this tile should be visible */
+	gboolean visible;
+} jamrtc_renderer_tile;
+static GHashTable *tiles = NULL;
+static jamrtc_mutex tiles_mutex;
+
+/* Helpers to map slots and kinds to channels, keys and positions */
+static const char *jamrtc_renderer_kind_str(jamrtc_tile_kind kind) {
+	switch(kind) {
+		case JAMRTC_TILE_VIDEO:
+			return "video";
+		case JAMRTC_TILE_MIC:
+			return "mic";
+		case JAMRTC_TILE_INSTRUMENT:
+			return "instrument";
+		default:
+			break;
+	}
+	return NULL;
+}
+static void jamrtc_renderer_channel(char *buffer, size_t buflen, guint slot, jamrtc_tile_kind kind) {
+	g_snprintf(buffer, buflen, "jamrtc-%u-%s", slot, jamrtc_renderer_kind_str(kind));
+}
+static gpointer jamrtc_renderer_key(guint slot, jamrtc_tile_kind kind) {
+	return GUINT_TO_POINTER(slot*3 + kind + 1);
+}
+static void jamrtc_renderer_position(guint slot, jamrtc_tile_kind kind, int *x, int *y, int *w, int *h) {
+	*x = (slot-1) * JAMRTC_RENDERER_TILE_WIDTH;
+	*w = JAMRTC_RENDERER_TILE_WIDTH;
+	if(kind == JAMRTC_TILE_VIDEO) {
+		*y = 0;
+		*h = JAMRTC_RENDERER_VIDEO_HEIGHT;
+	} else {
+		*y = JAMRTC_RENDERER_VIDEO_HEIGHT + (kind == JAMRTC_TILE_MIC ? 0 : JAMRTC_RENDERER_AUDIO_HEIGHT);
+		*h = JAMRTC_RENDERER_AUDIO_HEIGHT;
+	}
+}
+
+/* Helper to apply the visibility of a tile: we drop frames at the
+ * source via the valve, and make the tile transparent in the mix */
+static void jamrtc_renderer_tile_update(jamrtc_renderer_tile *tile) {
+	gboolean visible = tile->visible && window_visible;
+	if(tile->valve != NULL)
+		g_object_set(tile->valve, "drop", !visible, NULL);
+	if(tile->pad != NULL)
+		g_object_set(tile->pad, "alpha", visible ? 1.0 : 0.0, NULL);
+}
+
+/* Helper to get rid of a tile */
+static void jamrtc_renderer_tile_free(jamrtc_renderer_tile *tile) {
+	if(tile == NULL)
+		return;
+	if(tile->source != NULL) {
+		gst_element_set_state(tile->source, GST_STATE_NULL);
+		if(tile->pad != NULL) {
+			GstPad *srcpad = gst_element_get_static_pad(tile->source, "src");
+			gst_pad_unlink(srcpad, tile->pad);
+			gst_object_unref(srcpad);
+		}
+		gst_bin_remove(GST_BIN(renderer), tile->source);
+	}
+	if(tile->pad != NULL) {
+		gst_element_release_request_pad(mixer, tile->pad);
+		gst_object_unref(tile->pad);
+	}
+	if(tile->valve != NULL)
+		gst_object_unref(tile->valve);
+	g_free(tile);
+}
+
+/* Compositor renderer initialization */
+int jamrtc_renderer_init(void) {
+	if(renderer != NULL)
+		return 0;
+	/* A black live background drives the output rate even when there are no tiles */
+	char gst_pipeline[1024];
+	g_snprintf(gst_pipeline, sizeof(gst_pipeline),
+		"compositor name=mixer background=black ! videoconvert ! xvimagesink name=renderer sync=false "
+		"videotestsrc pattern=black is-live=true ! video/x-raw,width=%d,height=%d,framerate=30/1 ! mixer.",
+			JAMRTC_RENDERER_WIDTH, JAMRTC_RENDERER_HEIGHT);
+	JAMRTC_LOG(LOG_INFO, "Initializing the compositor renderer:\n  -- %s\n", gst_pipeline);
+	GError *error = NULL;
+	renderer = gst_parse_launch(gst_pipeline, &error);
+	if(error) {
+		JAMRTC_LOG(LOG_ERR, "Failed to parse/launch the renderer pipeline: %s\n", error->message);
+		g_error_free(error);
+		if(renderer != NULL)
+			g_clear_object(&renderer);
+		return -1;
+	}
+	mixer = gst_bin_get_by_name(GST_BIN(renderer), "mixer");
+	sink = gst_bin_get_by_name(GST_BIN(renderer), "renderer");
+	tiles = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)jamrtc_renderer_tile_free);
+	jamrtc_mutex_init(&tiles_mutex);
+	if(gst_element_set_state(renderer, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+		JAMRTC_LOG(LOG_ERR, "Failed to start the renderer pipeline\n");
+		jamrtc_renderer_cleanup();
+		return -1;
+	}
+	return 0;
+}
+
+/* Compositor renderer cleanup */
+void jamrtc_renderer_cleanup(void) {
+	if(renderer == NULL)
+		return;
+	/* Once tiles is NULL, the accessors that got past the renderer check
+	 * before we got here find out under the mutex, and don't touch anything */
+	jamrtc_mutex_lock(&tiles_mutex);
+	gst_element_set_state(renderer, GST_STATE_NULL);
+	g_hash_table_destroy(tiles);
+	tiles = NULL;
+	jamrtc_mutex_unlock(&tiles_mutex);
+	g_clear_object(&mixer);
+	g_clear_object(&sink);
+	g_clear_object(&renderer);
+}
+
+/* Whether the compositor renderer is in use */
+gboolean jamrtc_renderer_is_enabled(void) {
+	return renderer != NULL;
+}
+
+/* Get a reference to the single video sink */
+GstElement *jamrtc_renderer_get_sink(void) {
+	if(sink == NULL)
+		return NULL;
+	return gst_object_ref(sink);
+}
+
+/* Descriptions of a preview branch for gst_parse_launch */
+void jamrtc_renderer_valve_description(char *buffer, size_t buflen, const char *name) {
+	if(renderer == NULL) {
+		buffer[0] = '\0';
+		return;
+	}
+	g_snprintf(buffer, buflen, "valve name=\"%s-valve\" drop=false ! ", name);
+}
+void jamrtc_renderer_sink_description(char *buffer, size_t buflen,
+		const char *name, guint slot, jamrtc_tile_kind kind) {
+	if(renderer == NULL) {
+		g_snprintf(buffer, buflen, "xvimagesink name=\"%s\"", name);
+		return;
+	}
+	char channel[64];
+	jamrtc_renderer_channel(channel, sizeof(channel), slot, kind);
+	g_snprintf(buffer, buflen, "intervideosink name=\"%s\" channel=\"%s\" sync=false", name, channel);
+}
+
+/* Create the elements for a preview branch dynamically */
+GstElement *jamrtc_renderer_sink_new(const char *name, guint slot, jamrtc_tile_kind kind, GstElement **valve) {
+	if(renderer == NULL) {
+		if(valve != NULL)
+			*valve = NULL;
+		return gst_element_factory_make("xvimagesink", name);
+	}
+	char valve_name[100], channel[64];
+	g_snprintf(valve_name, sizeof(valve_name), "%s-valve", name);
+	jamrtc_renderer_channel(channel, sizeof(channel), slot, kind);
+	if(valve != NULL)
+		*valve = gst_element_factory_make("valve", valve_name);
+	GstElement *intersink = gst_element_factory_make("intervideosink", name);
+	g_object_set(intersink, "channel", channel, NULL);
+	return intersink;
+}
+
+/* Add a tile to the layout */
+void jamrtc_renderer_add_tile(guint slot, jamrtc_tile_kind kind, GstElement *valve) {
+	if(renderer == NULL)
+		return;
+	if(slot < 1 || slot > JAMRTC_RENDERER_SLOTS) {
+		/* No room for this tile in the layout, don't bother rendering it */
+		JAMRTC_LOG(LOG_WARN, "Invalid tile slot %u, dropping its frames\n", slot);
+		if(valve != NULL)
+			g_object_set(valve, "drop", TRUE, NULL);
+		return;
+	}
+	char channel[64], description[256];
+	jamrtc_renderer_channel(channel, sizeof(channel), slot, kind);
+	g_snprintf(description, sizeof(description),
+		"intervideosrc channel=\"%s\" ! videoconvert ! queue", channel);
+	GError *error = NULL;
+	GstElement *source = gst_parse_bin_from_description(description, TRUE, &error);
+	if(error) {
+		JAMRTC_LOG(LOG_ERR, "Failed to create source for tile %s: %s\n", channel, error->message);
+		g_error_free(error);
+		if(source != NULL)
+			gst_object_unref(source);
+		return;
+	}
+	jamrtc_mutex_lock(&tiles_mutex);
+	if(tiles == NULL) {
+		/* The renderer went away in the meanwhile */
+		jamrtc_mutex_unlock(&tiles_mutex);
+		gst_object_unref(source);
+		return;
+	}
+	/* If we had a tile in this position already, get rid of it */
+	g_hash_table_remove(tiles, jamrtc_renderer_key(slot, kind));
+	jamrtc_renderer_tile *tile = g_malloc0(sizeof(jamrtc_renderer_tile));
+	tile->slot = slot;
+	tile->kind = kind;
+	tile->source = source;
+	tile->valve = valve ? gst_object_ref(valve) : NULL;
+	tile->visible = TRUE;
+	gst_bin_add(GST_BIN(renderer), source);
+	tile->pad = gst_element_get_request_pad(mixer, "sink_%u");
+	int x = 0, y = 0, w = 0, h = 0;
+	jamrtc_renderer_position(slot, kind, &x, &y, &w, &h);
+	g_object_set(tile->pad, "xpos", x, "ypos", y, "width", w, "height", h, "zorder", 1, NULL);
+	GstPad *srcpad = gst_element_get_static_pad(source, "src");
+	if(gst_pad_link(srcpad, tile->pad) != GST_PAD_LINK_OK)
+		JAMRTC_LOG(LOG_ERR, "Error linking tile %s to the compositor\n", channel);
+	gst_object_unref(srcpad);
+	gst_element_sync_state_with_parent(source);
+	jamrtc_renderer_tile_update(tile);
+	g_hash_table_insert(tiles, jamrtc_renderer_key(slot, kind), tile);
+	jamrtc_mutex_unlock(&tiles_mutex);
+	JAMRTC_LOG(LOG_INFO, "Added tile %s (%dx%d at %d,%d)\n", channel, w, h, x, y);
+}
+
+/* Remove a tile from the layout */
+void jamrtc_renderer_remove_tile(guint slot, jamrtc_tile_kind kind) {
+	if(renderer == NULL)
+		return;
+	jamrtc_mutex_lock(&tiles_mutex);
+	if(tiles != NULL)
+		g_hash_table_remove(tiles, jamrtc_renderer_key(slot, kind));
+	jamrtc_mutex_unlock(&tiles_mutex);
+}
+
+/* Show or hide a specific tile */
+void jamrtc_renderer_set_tile_visible(guint slot, jamrtc_tile_kind kind, gboolean visible) {
+	if(renderer == NULL)
+		return;
+	jamrtc_mutex_lock(&tiles_mutex);
+	jamrtc_renderer_tile *tile = tiles ? g_hash_table_lookup(tiles, jamrtc_renderer_key(slot, kind)) : NULL;
+	if(tile != NULL) {
+		tile->visible = visible;
+		jamrtc_renderer_tile_update(tile);
+	}
+	jamrtc_mutex_unlock(&tiles_mutex);
+}
+
+/* Show or hide all tiles at once */
+void jamrtc_renderer_set_visible(gboolean visible) {
+	if(renderer == NULL)
+		return;
+	jamrtc_mutex_lock(&tiles_mutex);
+	window_visible = visible;
+	GHashTableIter iter;
+	gpointer value;
+	if(tiles != NULL)
+		g_hash_table_iter_init(&iter, tiles);
+	while(tiles != NULL && g_hash_table_iter_next(&iter, NULL, &value)) {
+		jamrtc_renderer_tile *tile = (jamrtc_renderer_tile *)value;
+		jamrtc_renderer_tile_update(tile);
+	}
+	jamrtc_mutex_unlock(&tiles_mutex);
+}
@@ -0,0 +1,69 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_RENDERER_H
+#define JAMRTC_RENDERER_H
+
+/* GLib */
+#include <glib.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+
+/* Tiles in the layout: every slot has a column with one tile of each kind */
+typedef enum jamrtc_tile_kind {
+	JAMRTC_TILE_VIDEO = 0,
+	JAMRTC_TILE_MIC,
+	JAMRTC_TILE_INSTRUMENT
+} jamrtc_tile_kind;
+
+/* Layout of the single compositor output */
+#define JAMRTC_RENDERER_SLOTS			4
+#define JAMRTC_RENDERER_TILE_WIDTH		320
+#define JAMRTC_RENDERER_VIDEO_HEIGHT	180
+#define JAMRTC_RENDERER_AUDIO_HEIGHT	100
+#define JAMRTC_RENDERER_WIDTH			(JAMRTC_RENDERER_SLOTS * JAMRTC_RENDERER_TILE_WIDTH)
+#define JAMRTC_RENDERER_HEIGHT			(JAMRTC_RENDERER_VIDEO_HEIGHT + 2 * JAMRTC_RENDERER_AUDIO_HEIGHT)
+
+
+/* Compositor renderer initialization (creates the shared pipeline) */
+int jamrtc_renderer_init(void);
+/* Compositor renderer cleanup */
+void jamrtc_renderer_cleanup(void);
+/* Whether the compositor renderer is in use */
+gboolean jamrtc_renderer_is_enabled(void);
+/* Get a reference to the single video sink, to embed it in the UI */
+GstElement *jamrtc_renderer_get_sink(void);
+
+/* Fill in the gst_parse_launch descriptions of a preview branch: in
+ * compositor mode the valve (named "<name>-valve") should go as early
+ * in the branch as possible, and the sink is an intervideosink feeding
+ * the tile; otherwise there's no valve, and the sink is a named
+ * xvimagesink as before */
+void jamrtc_renderer_valve_description(char *buffer, size_t buflen, const char *name);
+void jamrtc_renderer_sink_description(char *buffer, size_t buflen,
+	const char *name, guint slot, jamrtc_tile_kind kind);
+/* Create the elements for a preview branch dynamically: the valve and
+ * sink are returned separately, valve is NULL when not in compositor mode */
+GstElement *jamrtc_renderer_sink_new(const char *name, guint slot, jamrtc_tile_kind kind, GstElement **valve);
+
+/* Add a tile to the layout: the valve in the producer pipeline is used
+ * to drop frames at the source when the tile is not visible */
+void jamrtc_renderer_add_tile(guint slot, jamrtc_tile_kind kind, GstElement *valve);
+/* Remove a tile from the layout */
+void jamrtc_renderer_remove_tile(guint slot, jamrtc_tile_kind kind);
+/* Show or hide a specific tile */
+void jamrtc_renderer_set_tile_visible(guint slot, jamrtc_tile_kind kind, gboolean visible);
+/* Show or hide all tiles at once (e.g., when the window is minimised) */
+void jamrtc_renderer_set_visible(gboolean visible);
+
+
+#endif
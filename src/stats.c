@@ -0,0 +1,516 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Generic includes */
+#include <string.h>
+
+/* WebSockets stack (we only use it as an HTTP server here) */
+#include <libwebsockets.h>
+
+/* Local includes */
+#include "stats.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Statistics of all PeerConnections: the collector in the WebRTC stack
+ * updates them periodically, and the HTTP thread only ever renders them
+ * as text, so nothing here ever runs on a streaming (audio) thread */
+typedef struct jamrtc_stats_pc {
+	/* Display name of the participant, and instrument (NULL for the chat) */
+	char *participant, *stream;
+	/* List of jamrtc_stats_stream instances */
+	GList *streams;
+} jamrtc_stats_pc;
+static void jamrtc_stats_pc_free(jamrtc_stats_pc *spc) {
+	if(spc == NULL)
+		return;
+	g_free(spc->participant);
+	g_free(spc->stream);
+	g_list_free_full(spc->streams, (GDestroyNotify)g_free);
+	g_free(spc);
+}
+static GHashTable *pcs = NULL;
+/* Statistics of the local JACK server, if we're monitoring it */
+static jamrtc_stats_jack *jack = NULL;
+/* Memory accounting, if we got any */
+static jamrtc_stats_memory *memory = NULL;
+static void jamrtc_stats_footprint_free(jamrtc_stats_footprint *footprint) {
+	if(footprint == NULL)
+		return;
+	g_free(footprint->participant);
+	g_free(footprint);
+}
+static void jamrtc_stats_memory_free(jamrtc_stats_memory *mem) {
+	if(mem == NULL)
+		return;
+	g_list_free_full(mem->footprints, (GDestroyNotify)jamrtc_stats_footprint_free);
+	g_free(mem);
+}
+static jamrtc_mutex stats_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+/* Metrics we expose */
+typedef enum jamrtc_stats_metric {
+	JAMRTC_METRIC_PACKETS = 0,
+	JAMRTC_METRIC_BYTES,
+	JAMRTC_METRIC_BITRATE,
+	JAMRTC_METRIC_PACKETS_LOST,
+	JAMRTC_METRIC_JITTER,
+	JAMRTC_METRIC_RTT,
+	JAMRTC_METRIC_FRACTION_LOST,
+	JAMRTC_METRIC_JB_LATENCY,
+	JAMRTC_METRIC_JB_PUSHED,
+	JAMRTC_METRIC_JB_LOST,
+	JAMRTC_METRIC_JB_LATE,
+	JAMRTC_METRIC_JB_DUPLICATES,
+	JAMRTC_METRIC_JB_AVG_JITTER,
+	JAMRTC_METRIC_CLOCK_DRIFT,
+	JAMRTC_METRIC_PLAYOUT_LATENCY,
+	JAMRTC_METRIC_PLAYOUT_TARGET,
+	JAMRTC_METRIC_PLAYOUT_ACCELERATED,
+	JAMRTC_METRIC_PLAYOUT_DECELERATED,
+	JAMRTC_METRIC_PLAYOUT_UNDERRUNS,
+	JAMRTC_METRIC_LAST
+} jamrtc_stats_metric;
+static const struct {
+	const char *name, *type, *help;
+} metrics[JAMRTC_METRIC_LAST] = {
+	{ "jamrtc_rtp_packets_total", "counter", "RTP packets received (inbound) or sent (outbound)" },
+	{ "jamrtc_rtp_bytes_total", "counter", "RTP bytes received (inbound) or sent (outbound)" },
+	{ "jamrtc_rtp_bitrate_bps", "gauge", "Bitrate since the previous sample" },
+	{ "jamrtc_rtp_packets_lost_total", "counter", "Packets lost (for outbound streams, as reported by the receiver)" },
+	{ "jamrtc_rtp_jitter_seconds", "gauge", "Interarrival jitter (for outbound streams, as reported by the receiver)" },
+	{ "jamrtc_rtp_round_trip_time_seconds", "gauge", "Round-trip time computed from RTCP" },
+	{ "jamrtc_rtp_fraction_lost", "gauge", "Fraction of packets lost, as reported by the receiver" },
+	{ "jamrtc_jitterbuffer_latency_seconds", "gauge", "Configured jitter buffer size" },
+	{ "jamrtc_jitterbuffer_pushed_total", "counter", "Packets pushed out of the jitter buffer" },
+	{ "jamrtc_jitterbuffer_lost_total", "counter", "Packets considered lost by the jitter buffer" },
+	{ "jamrtc_jitterbuffer_late_total", "counter", "Packets that arrived too late for the jitter buffer" },
+	{ "jamrtc_jitterbuffer_duplicates_total", "counter", "Duplicate packets dropped by the jitter buffer" },
+	{ "jamrtc_jitterbuffer_avg_jitter_seconds", "gauge", "Average jitter measured by the jitter buffer" },
+	{ "jamrtc_clock_drift_ppm", "gauge", "Estimated clock drift of the sender, compared to our audio output" },
+	{ "jamrtc_playout_latency_seconds", "gauge", "Audio queued for playout in the sink" },
+	{ "jamrtc_playout_target_seconds", "gauge", "Playout latency the time-stretching targets" },
+	{ "jamrtc_playout_accelerated_seconds_total", "counter", "Audio dropped by accelerating playout" },
+	{ "jamrtc_playout_decelerated_seconds_total", "counter", "Audio added by decelerating playout" },
+	{ "jamrtc_playout_underruns_total", "counter", "Times the sink ran out of audio to play" },
+};
+/* Helper to get the value of a metric for a stream, if it applies */
+static gboolean jamrtc_stats_metric_value(jamrtc_stats_metric metric, jamrtc_stats_stream *s, gdouble *value) {
+	switch(metric) {
+		case JAMRTC_METRIC_PACKETS:
+			*value = s->packets;
+			return TRUE;
+		case JAMRTC_METRIC_BYTES:
+			*value = s->bytes;
+			return TRUE;
+		case JAMRTC_METRIC_BITRATE:
+			*value = s->bitrate;
+			return TRUE;
+		case JAMRTC_METRIC_PACKETS_LOST:
+			/* The cumulative loss in RTCP can go negative (duplicates), counters can't */
+			*value = MAX(0, s->packets_lost);
+			return TRUE;
+		case JAMRTC_METRIC_JITTER:
+			*value = s->jitter;
+			return TRUE;
+		case JAMRTC_METRIC_RTT:
+			*value = s->rtt;
+			return !s->inbound && s->rtt >= 0;
+		case JAMRTC_METRIC_FRACTION_LOST:
+			*value = s->fraction_lost;
+			return !s->inbound;
+		case JAMRTC_METRIC_JB_LATENCY:
+			*value = (gdouble)s->jb_latency / 1000;
+			return s->jitterbuffer;
+		case JAMRTC_METRIC_JB_PUSHED:
+			*value = s->jb_pushed;
+			return s->jitterbuffer;
+		case JAMRTC_METRIC_JB_LOST:
+			*value = s->jb_lost;
+			return s->jitterbuffer;
+		case JAMRTC_METRIC_JB_LATE:
+			*value = s->jb_late;
+			return s->jitterbuffer;
+		case JAMRTC_METRIC_JB_DUPLICATES:
+			*value = s->jb_duplicates;
+			return s->jitterbuffer;
+		case JAMRTC_METRIC_JB_AVG_JITTER:
+			*value = s->jb_avg_jitter;
+			return s->jitterbuffer;
+		case JAMRTC_METRIC_CLOCK_DRIFT:
+			*value = s->drift_ppm;
+			return s->drift;
+		case JAMRTC_METRIC_PLAYOUT_LATENCY:
+			*value = (gdouble)s->playout_latency / 1000;
+			return s->playout;
+		case JAMRTC_METRIC_PLAYOUT_TARGET:
+			*value = (gdouble)s->playout_target / 1000;
+			return s->playout;
+		case JAMRTC_METRIC_PLAYOUT_ACCELERATED:
+			*value = (gdouble)s->playout_accelerated / 1000;
+			return s->playout;
+		case JAMRTC_METRIC_PLAYOUT_DECELERATED:
+			*value = (gdouble)s->playout_decelerated / 1000;
+			return s->playout;
+		case JAMRTC_METRIC_PLAYOUT_UNDERRUNS:
+			*value = s->playout_underruns;
+			return s->playout;
+		default:
+			break;
+	}
+	return FALSE;
+}
+
+/* Helper to escape label values, as per the Prometheus text format */
+static void jamrtc_stats_append_label(GString *text, const char *name, const char *value) {
+	g_string_append_printf(text, "%s=\"", name);
+	const char *c = value;
+	for(c = value; c && *c; c++) {
+		if(*c == '\\' || *c == '"')
+			g_string_append_c(text, '\\');
+		if(*c == '\n')
+			g_string_append(text, "\\n");
+		else
+			g_string_append_c(text, *c);
+	}
+	g_string_append_c(text, '"');
+}
+
+/* Render all the statistics we have in the Prometheus text format */
+static char *jamrtc_stats_render(size_t *len) {
+	GString *text = g_string_new(NULL);
+	char value[G_ASCII_DTOSTR_BUF_SIZE];
+	jamrtc_mutex_lock(&stats_mutex);
+	int m = 0;
+	for(m=0; m<JAMRTC_METRIC_LAST; m++) {
+		g_string_append_printf(text, "# HELP %s %s\n", metrics[m].name, metrics[m].help);
+		g_string_append_printf(text, "# TYPE %s %s\n", metrics[m].name, metrics[m].type);
+		if(pcs == NULL)
+			continue;
+		GHashTableIter iter;
+		gpointer pc_value;
+		g_hash_table_iter_init(&iter, pcs);
+		while(g_hash_table_iter_next(&iter, NULL, &pc_value)) {
+			jamrtc_stats_pc *spc = (jamrtc_stats_pc *)pc_value;
+			GList *temp = spc->streams;
+			while(temp) {
+				jamrtc_stats_stream *s = (jamrtc_stats_stream *)temp->data;
+				gdouble v = 0;
+				if(jamrtc_stats_metric_value(m, s, &v)) {
+					g_string_append_printf(text, "%s{", metrics[m].name);
+					jamrtc_stats_append_label(text, "participant", spc->participant);
+					g_string_append_c(text, ',');
+					jamrtc_stats_append_label(text, "stream", spc->stream ? spc->stream : "chat");
+					g_string_append_printf(text, ",direction=\"%s\",media=\"%s\",ssrc=\"%"SCNu32"\"} %s\n",
+						s->inbound ? "inbound" : "outbound", s->video ? "video" : "audio", s->ssrc,
+						g_ascii_dtostr(value, sizeof(value), v));
+				}
+				temp = temp->next;
+			}
+		}
+	}
+	/* The JACK metrics are not per stream, so they have no labels */
+	if(jack != NULL) {
+		g_string_append(text, "# HELP jamrtc_jack_xruns_total JACK xruns\n# TYPE jamrtc_jack_xruns_total counter\n");
+		g_string_append_printf(text, "jamrtc_jack_xruns_total %"SCNu64"\n", jack->xruns);
+		g_string_append(text, "# HELP jamrtc_jack_xruns_coinciding_total JACK xruns that happened while our pipelines were busy\n"
+			"# TYPE jamrtc_jack_xruns_coinciding_total counter\n");
+		g_string_append_printf(text, "jamrtc_jack_xruns_coinciding_total %"SCNu64"\n", jack->coinciding);
+		g_string_append(text, "# HELP jamrtc_jack_dsp_load_ratio JACK DSP load\n# TYPE jamrtc_jack_dsp_load_ratio gauge\n");
+		g_string_append_printf(text, "jamrtc_jack_dsp_load_ratio %s\n",
+			g_ascii_dtostr(value, sizeof(value), jack->dsp_load / 100));
+		g_string_append(text, "# HELP jamrtc_jack_buffer_size_frames JACK frames per cycle\n# TYPE jamrtc_jack_buffer_size_frames gauge\n");
+		g_string_append_printf(text, "jamrtc_jack_buffer_size_frames %u\n", jack->buffer_size);
+		g_string_append(text, "# HELP jamrtc_jack_sample_rate_hz JACK sample rate\n# TYPE jamrtc_jack_sample_rate_hz gauge\n");
+		g_string_append_printf(text, "jamrtc_jack_sample_rate_hz %u\n", jack->sample_rate);
+	}
+	/* Memory accounting: process-wide first, and then per participant */
+	if(memory != NULL) {
+		g_string_append(text, "# HELP jamrtc_memory_rss_bytes Resident set size\n# TYPE jamrtc_memory_rss_bytes gauge\n");
+		g_string_append_printf(text, "jamrtc_memory_rss_bytes %"SCNu64"\n", memory->rss);
+		g_string_append(text, "# HELP jamrtc_memory_participants Participant instances alive\n# TYPE jamrtc_memory_participants gauge\n");
+		g_string_append_printf(text, "jamrtc_memory_participants %u\n", memory->participants);
+		g_string_append(text, "# HELP jamrtc_memory_peerconnections PeerConnection instances alive\n# TYPE jamrtc_memory_peerconnections gauge\n");
+		g_string_append_printf(text, "jamrtc_memory_peerconnections %u\n", memory->peerconnections);
+		g_string_append(text, "# HELP jamrtc_memory_pipelines GStreamer pipelines not finalized yet\n# TYPE jamrtc_memory_pipelines gauge\n");
+		g_string_append_printf(text, "jamrtc_memory_pipelines %u\n", memory->pipelines);
+		g_string_append(text, "# HELP jamrtc_memory_webrtcbins webrtcbin elements not finalized yet\n# TYPE jamrtc_memory_webrtcbins gauge\n");
+		g_string_append_printf(text, "jamrtc_memory_webrtcbins %u\n", memory->webrtcbins);
+		g_string_append(text, "# HELP jamrtc_memory_transactions Janus transactions waiting for a response\n# TYPE jamrtc_memory_transactions gauge\n");
+		g_string_append_printf(text, "jamrtc_memory_transactions %u\n", memory->transactions);
+		const char *names[] = { "jamrtc_participant_peerconnections", "jamrtc_participant_elements", "jamrtc_participant_queued_bytes" };
+		const char *helps[] = { "PeerConnections with a pipeline", "GStreamer elements in the pipelines", "Bytes queued in the pipelines" };
+		guint m = 0;
+		for(m=0; m<G_N_ELEMENTS(names); m++) {
+			g_string_append_printf(text, "# HELP %s %s\n# TYPE %s gauge\n", names[m], helps[m], names[m]);
+			GList *temp = memory->footprints;
+			while(temp) {
+				jamrtc_stats_footprint *f = (jamrtc_stats_footprint *)temp->data;
+				g_string_append_printf(text, "%s{", names[m]);
+				jamrtc_stats_append_label(text, "participant", f->participant);
+				g_string_append_printf(text, "} %"SCNu64"\n", m == 0 ? (guint64)f->peerconnections :
+					(m == 1 ? (guint64)f->elements : f->queued));
+				temp = temp->next;
+			}
+		}
+	}
+	jamrtc_mutex_unlock(&stats_mutex);
+	*len = text->len;
+	return g_string_free(text, FALSE);
+}
+
+/* Update the statistics of a PeerConnection */
+void jamrtc_stats_update(guint64 id, const char *participant, const char *stream, GList *streams) {
+	gint64 now = g_get_monotonic_time();
+	jamrtc_mutex_lock(&stats_mutex);
+	if(pcs == NULL) {
+		jamrtc_mutex_unlock(&stats_mutex);
+		g_list_free_full(streams, (GDestroyNotify)g_free);
+		return;
+	}
+	jamrtc_stats_pc *prev = g_hash_table_lookup(pcs, &id);
+	/* Compute the bitrate of each stream using the previous sample, if any */
+	GList *temp = streams;
+	while(temp) {
+		jamrtc_stats_stream *s = (jamrtc_stats_stream *)temp->data;
+		s->when = now;
+		GList *p = prev ? prev->streams : NULL;
+		while(p) {
+			jamrtc_stats_stream *ps = (jamrtc_stats_stream *)p->data;
+			if(ps->ssrc == s->ssrc && ps->inbound == s->inbound) {
+				if(s->bytes >= ps->bytes && s->when > ps->when)
+					s->bitrate = (gdouble)((s->bytes - ps->bytes) * 8) * G_USEC_PER_SEC / (s->when - ps->when);
+				break;
+			}
+			p = p->next;
+		}
+		temp = temp->next;
+	}
+	jamrtc_stats_pc *spc = g_malloc0(sizeof(jamrtc_stats_pc));
+	spc->participant = g_strdup(participant);
+	spc->stream = g_strdup(stream);
+	spc->streams = streams;
+	guint64 *key = g_malloc(sizeof(guint64));
+	*key = id;
+	g_hash_table_insert(pcs, key, spc);
+	jamrtc_mutex_unlock(&stats_mutex);
+}
+
+/* Get rid of the statistics of a PeerConnection */
+void jamrtc_stats_remove(guint64 id) {
+	jamrtc_mutex_lock(&stats_mutex);
+	if(pcs != NULL)
+		g_hash_table_remove(pcs, &id);
+	jamrtc_mutex_unlock(&stats_mutex);
+}
+
+/* Update the statistics of the local JACK server */
+void jamrtc_stats_update_jack(const jamrtc_stats_jack *stats) {
+	if(stats == NULL)
+		return;
+	jamrtc_mutex_lock(&stats_mutex);
+	if(pcs != NULL) {
+		if(jack == NULL)
+			jack = g_malloc0(sizeof(jamrtc_stats_jack));
+		*jack = *stats;
+	}
+	jamrtc_mutex_unlock(&stats_mutex);
+}
+
+/* Update the memory accounting */
+void jamrtc_stats_update_memory(const jamrtc_stats_memory *stats) {
+	if(stats == NULL)
+		return;
+	jamrtc_stats_memory *copy = g_malloc0(sizeof(jamrtc_stats_memory));
+	*copy = *stats;
+	copy->footprints = NULL;
+	GList *temp = stats->footprints;
+	while(temp) {
+		jamrtc_stats_footprint *f = (jamrtc_stats_footprint *)temp->data;
+		jamrtc_stats_footprint *fc = g_malloc(sizeof(jamrtc_stats_footprint));
+		*fc = *f;
+		fc->participant = g_strdup(f->participant);
+		copy->footprints = g_list_prepend(copy->footprints, fc);
+		temp = temp->next;
+	}
+	copy->footprints = g_list_reverse(copy->footprints);
+	jamrtc_mutex_lock(&stats_mutex);
+	if(pcs != NULL) {
+		jamrtc_stats_memory_free(memory);
+		memory = copy;
+		copy = NULL;
+	}
+	jamrtc_mutex_unlock(&stats_mutex);
+	jamrtc_stats_memory_free(copy);
+}
+
+
+/* HTTP server (libwebsockets) */
+static struct lws_context *http_context = NULL;
+static GThread *http_thread = NULL;
+static volatile gint stopping = 0;
+typedef struct jamrtc_stats_http_session {
+	unsigned char *buffer;	/* Response to send (with LWS_PRE bytes in front) */
+	size_t len;				/* Length of the response */
+	size_t offset;			/* How much of the response we sent already */
+} jamrtc_stats_http_session;
+static int jamrtc_stats_http_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+static struct lws_protocols http_protocols[] = {
+	{ "http", jamrtc_stats_http_callback, sizeof(jamrtc_stats_http_session), 0 },
+	{ NULL, NULL, 0, 0 }
+};
+
+/* Handler for all libwebsockets HTTP events */
+static int jamrtc_stats_http_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+	jamrtc_stats_http_session *session = (jamrtc_stats_http_session *)user;
+	switch(reason) {
+		case LWS_CALLBACK_HTTP: {
+			const char *uri = (const char *)in;
+			int status = HTTP_STATUS_OK;
+			size_t body_len = 0;
+			char *body = NULL;
+			if(uri && (!strcmp(uri, "/metrics") || !strcmp(uri, "/"))) {
+				body = jamrtc_stats_render(&body_len);
+			} else {
+				status = HTTP_STATUS_NOT_FOUND;
+				body = g_strdup("Not found\n");
+				body_len = strlen(body);
+			}
+			JAMRTC_LOG(LOG_HUGE, "[stats] %s --> %d (%zu bytes)\n", uri, status, body_len);
+			session->buffer = g_malloc(LWS_PRE + body_len);
+			memcpy(session->buffer + LWS_PRE, body, body_len);
+			session->len = body_len;
+			session->offset = 0;
+			g_free(body);
+			/* Send the headers first */
+			unsigned char headers[LWS_PRE + 512], *p = headers + LWS_PRE, *end = headers + sizeof(headers) - 1;
+			if(lws_add_http_header_status(wsi, status, &p, end) ||
+					lws_add_http_header_by_token(wsi, WSI_TOKEN_HTTP_CONTENT_TYPE,
+						(unsigned char *)"text/plain; version=0.0.4", strlen("text/plain; version=0.0.4"), &p, end) ||
+					lws_add_http_header_content_length(wsi, body_len, &p, end) ||
+					lws_finish_http_header(wsi, &p, end))
+				return 1;
+			if(lws_write(wsi, headers + LWS_PRE, p - (headers + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
+				return 1;
+			/* We'll send the body when we can write */
+			lws_callback_on_writable(wsi);
+			return 0;
+		}
+		case LWS_CALLBACK_HTTP_WRITEABLE: {
+			if(session == NULL || session->buffer == NULL)
+				return -1;
+			size_t chunk = MIN(session->len - session->offset, 4096);
+			gboolean last = (session->offset + chunk == session->len);
+			int sent = lws_write(wsi, session->buffer + LWS_PRE + session->offset, chunk,
+				last ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP);
+			if(sent < 0)
+				return -1;
+			session->offset += sent;
+			if(session->offset < session->len) {
+				lws_callback_on_writable(wsi);
+				return 0;
+			}
+			/* Done */
+			g_free(session->buffer);
+			session->buffer = NULL;
+			if(lws_http_transaction_completed(wsi))
+				return -1;
+			return 0;
+		}
+		case LWS_CALLBACK_CLOSED_HTTP: {
+			if(session != NULL) {
+				g_free(session->buffer);
+				session->buffer = NULL;
+			}
+			return 0;
+		}
+		default:
+			break;
+	}
+	return 0;
+}
+
+/* Thread to implement the HTTP server loop */
+static gpointer jamrtc_stats_thread(gpointer data) {
+	JAMRTC_LOG(LOG_VERB, "Joining stats HTTP server thread\n");
+	while(!g_atomic_int_get(&stopping)) {
+		/* Loop until we have to stop */
+		lws_service(http_context, 50);
+	}
+	JAMRTC_LOG(LOG_VERB, "Leaving stats HTTP server thread\n");
+	return NULL;
+}
+
+/* Start the local HTTP endpoint */
+int jamrtc_stats_init(guint port) {
+	if(port == 0 || port > 65535) {
+		JAMRTC_LOG(LOG_FATAL, "Invalid metrics port %u\n", port);
+		return -1;
+	}
+	jamrtc_mutex_lock(&stats_mutex);
+	pcs = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_stats_pc_free);
+	jamrtc_mutex_unlock(&stats_mutex);
+	/* Only listen on the loopback interface: this is meant for a local scraper */
+	struct lws_context_creation_info info = { 0 };
+	info.port = port;
+	info.iface = "127.0.0.1";
+	info.protocols = http_protocols;
+	info.gid = -1;
+	info.uid = -1;
+	http_context = lws_create_context(&info);
+	if(http_context == NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Error creating the metrics HTTP server on port %u\n", port);
+		jamrtc_stats_cleanup();
+		return -1;
+	}
+	GError *error = NULL;
+	http_thread = g_thread_try_new("jamrtc stats", jamrtc_stats_thread, NULL, &error);
+	if(error != NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the stats HTTP server thread...\n",
+			error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		jamrtc_stats_cleanup();
+		return -1;
+	}
+	JAMRTC_LOG(LOG_INFO, "Metrics available on http://127.0.0.1:%u/metrics\n", port);
+	return 0;
+}
+
+/* Stop the HTTP endpoint */
+void jamrtc_stats_cleanup(void) {
+	g_atomic_int_set(&stopping, 1);
+	if(http_thread != NULL) {
+#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
+		lws_cancel_service(http_context);
+#endif
+		g_thread_join(http_thread);
+		http_thread = NULL;
+	}
+	if(http_context != NULL) {
+		lws_context_destroy(http_context);
+		http_context = NULL;
+	}
+	jamrtc_mutex_lock(&stats_mutex);
+	if(pcs != NULL)
+		g_hash_table_destroy(pcs);
+	pcs = NULL;
+	g_free(jack);
+	jack = NULL;
+	jamrtc_stats_memory_free(memory);
+	memory = NULL;
+	jamrtc_mutex_unlock(&stats_mutex);
+}
+
+/* Whether the statistics endpoint is running */
+gboolean jamrtc_stats_is_enabled(void) {
+	return http_context != NULL;
+}
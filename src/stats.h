@@ -0,0 +1,103 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_STATS_H
+#define JAMRTC_STATS_H
+
+/* GLib */
+#include <glib.h>
+
+
+/* Statistics for a single RTP stream in a PeerConnection, as sampled
+ * from webrtcbin (get-stats) and, for incoming streams, rtpjitterbuffer */
+typedef struct jamrtc_stats_stream {
+	/* SSRC of the stream */
+	guint32 ssrc;
+	/* Whether this is an incoming stream, and whether it's video */
+	gboolean inbound, video;
+	/* Packets and bytes received (inbound) or sent (outbound) */
+	guint64 packets, bytes;
+	/* Packets lost and jitter (seconds): for outbound streams, it's what
+	 * the other end reported to us in RTCP Receiver Reports */
+	gint64 packets_lost;
+	gdouble jitter;
+	/* Outbound only: round-trip time (seconds, negative if unknown) and fraction lost */
+	gdouble rtt, fraction_lost;
+	/* Inbound only: jitter buffer statistics, if we found the jitter buffer */
+	gboolean jitterbuffer;
+	guint64 jb_pushed, jb_lost, jb_late, jb_duplicates;
+	gdouble jb_avg_jitter;	/* seconds */
+	guint jb_latency;		/* ms */
+	/* Inbound audio only: estimated clock drift of the sender, compared to our audio output */
+	gboolean drift;
+	gdouble drift_ppm;
+	/* Inbound instruments only: playout latency and target (ms), how much audio
+	 * was dropped and added to keep it there (ms), and how many underruns */
+	gboolean playout;
+	guint playout_latency, playout_target, playout_accelerated, playout_decelerated, playout_underruns;
+	/* Computed by the stats module itself */
+	gdouble bitrate;		/* bps */
+	gint64 when;			/* monotonic time of the sample */
+} jamrtc_stats_stream;
+
+/* Statistics of the local JACK server, as seen by the JACK monitor */
+typedef struct jamrtc_stats_jack {
+	/* Xruns so far, and how many happened while our pipelines were busy */
+	guint64 xruns, coinciding;
+	/* DSP load (percent) */
+	gdouble dsp_load;
+	/* Frames per cycle, and sample rate */
+	guint buffer_size, sample_rate;
+} jamrtc_stats_jack;
+
+/* Memory footprint of a participant (or ourselves) */
+typedef struct jamrtc_stats_footprint {
+	/* Display name of the participant */
+	char *participant;
+	/* PeerConnections with pipelines, GStreamer elements in those pipelines,
+	 * and bytes queued in their queues right now */
+	guint peerconnections, elements;
+	guint64 queued;
+} jamrtc_stats_footprint;
+
+/* Memory accounting of the whole process */
+typedef struct jamrtc_stats_memory {
+	/* Resident set size (bytes) */
+	guint64 rss;
+	/* Objects that are alive right now */
+	guint participants, peerconnections, pipelines, webrtcbins;
+	/* Janus transactions still waiting for a response */
+	guint transactions;
+	/* List of jamrtc_stats_footprint instances */
+	GList *footprints;
+} jamrtc_stats_memory;
+
+
+/* Start the local HTTP endpoint serving metrics in Prometheus text format
+ * (only listens on the loopback interface) */
+int jamrtc_stats_init(guint port);
+/* Stop the HTTP endpoint and get rid of all statistics */
+void jamrtc_stats_cleanup(void);
+/* Whether the statistics endpoint is running */
+gboolean jamrtc_stats_is_enabled(void);
+
+/* Update the statistics of a PeerConnection: the list of jamrtc_stats_stream
+ * instances is owned by the stats module after this call. The participant is
+ * the display name, the stream is the instrument (or NULL for the chat) */
+void jamrtc_stats_update(guint64 id, const char *participant, const char *stream, GList *streams);
+/* Get rid of the statistics of a PeerConnection */
+void jamrtc_stats_remove(guint64 id);
+/* Update the statistics of the local JACK server */
+void jamrtc_stats_update_jack(const jamrtc_stats_jack *jack);
+/* Update the memory accounting (the footprints are copied) */
+void jamrtc_stats_update_memory(const jamrtc_stats_memory *memory);
+
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+/* Local includes */
+#include "tracing.h"
+#include "mutex.h"
+#include "debug.h"
+
+
+/* Latency tracing: we add a buffer probe to the pads of all elements in
+ * a pipeline, and every time a buffer goes through we check how long ago
+ * it was timestamped, i.e., the difference between the current running
+ * time and the buffer timestamp. Since our sources are live and timestamp
+ * buffers with the running time of their capture (or arrival), the
+ * difference between what we see on the source and sink pads of an
+ * element is the time buffers spent in there (residence time). Probes
+ * only ever update counters atomically, and everything we know about a
+ * pipeline is dropped (after logging a summary) when it's torn down */
+static volatile gint enabled = 0;
+
+/* Accumulated delays (in microseconds): the probes only ever add to the
+ * totals, and the report computes the window since the previous one */
+typedef struct jamrtc_tracing_counter {
+	volatile gsize count;
+	volatile gssize sum;
+	volatile gint max, window_max;
+	/* Totals at the previous report (only touched with the tracing mutex locked) */
+	gsize last_count;
+	gssize last_sum;
+} jamrtc_tracing_counter;
+static void jamrtc_tracing_max(volatile gint *max, gint64 value) {
+	gint current = 0, v = value > G_MAXINT ? G_MAXINT : (gint)value;
+	do {
+		current = g_atomic_int_get(max);
+		if(v <= current)
+			break;
+	} while(!g_atomic_int_compare_and_exchange(max, current, v));
+}
+static void jamrtc_tracing_counter_add(jamrtc_tracing_counter *c, gint64 value) {
+	g_atomic_pointer_add(&c->count, 1);
+	g_atomic_pointer_add(&c->sum, (gssize)value);
+	jamrtc_tracing_max(&c->max, value);
+	jamrtc_tracing_max(&c->window_max, value);
+}
+/* What the report looks at: either the totals, or the window since the previous report */
+typedef struct jamrtc_tracing_values {
+	guint64 count;
+	gint64 sum, max;
+} jamrtc_tracing_values;
+static void jamrtc_tracing_counter_get(jamrtc_tracing_counter *c, gboolean summary, jamrtc_tracing_values *v) {
+	gsize count = g_atomic_pointer_get(&c->count);
+	gssize sum = g_atomic_pointer_get(&c->sum);
+	if(summary) {
+		v->count = count;
+		v->sum = sum;
+		v->max = g_atomic_int_get(&c->max);
+		return;
+	}
+	v->count = count - c->last_count;
+	v->sum = sum - c->last_sum;
+	v->max = g_atomic_int_get(&c->window_max);
+	c->last_count = count;
+	c->last_sum = sum;
+	g_atomic_int_set(&c->window_max, 0);
+}
+static gdouble jamrtc_tracing_avg(jamrtc_tracing_values *v) {
+	return v->count ? (gdouble)v->sum / v->count / 1000 : 0;
+}
+
+/* A stage of a stream, i.e., an element we're tracing */
+typedef struct jamrtc_tracing_stage {
+	/* Name of the element */
+	char *name;
+	/* Delays measured on sink pads (in) and source pads (out) */
+	jamrtc_tracing_counter in, out;
+} jamrtc_tracing_stage;
+static void jamrtc_tracing_stage_free(jamrtc_tracing_stage *stage) {
+	if(stage == NULL)
+		return;
+	g_free(stage->name);
+	g_free(stage);
+}
+
+/* A pad we're tracing */
+typedef struct jamrtc_tracing_point {
+	/* Pad and probe, so that we can remove it when the pipeline goes away */
+	GstPad *pad;
+	gulong probe;
+	/* Pipeline the pad belongs to (the stream holds a reference) */
+	GstElement *pipeline;
+	/* Stage this pad belongs to, and whether it's a source pad */
+	jamrtc_tracing_stage *stage;
+	gboolean src;
+} jamrtc_tracing_point;
+static void jamrtc_tracing_point_free(jamrtc_tracing_point *point) {
+	if(point == NULL)
+		return;
+	gst_pad_remove_probe(point->pad, point->probe);
+	g_object_set_data(G_OBJECT(point->pad), "jamrtc-traced", NULL);
+	gst_object_unref(point->pad);
+	g_free(point);
+}
+
+/* A pipeline we're tracing, with its stages indexed by element name */
+typedef struct jamrtc_tracing_stream {
+	GstElement *pipeline;
+	char *name;
+	GHashTable *stages;
+	GList *points;
+} jamrtc_tracing_stream;
+static void jamrtc_tracing_stream_free(jamrtc_tracing_stream *stream) {
+	if(stream == NULL)
+		return;
+	g_list_free_full(stream->points, (GDestroyNotify)jamrtc_tracing_point_free);
+	g_hash_table_destroy(stream->stages);
+	gst_object_unref(stream->pipeline);
+	g_free(stream->name);
+	g_free(stream);
+}
+
+/* Streams, indexed by pipeline: a new pipeline is a new stream, even
+ * if it's about the same participant (e.g., after a re-subscription) */
+static GHashTable *streams = NULL;
+static jamrtc_mutex tracing_mutex = JAMRTC_MUTEX_INITIALIZER;
+
+
+/* Enable the latency tracing mode */
+void jamrtc_tracing_enable(void) {
+	jamrtc_mutex_lock(&tracing_mutex);
+	if(streams == NULL) {
+		streams = g_hash_table_new_full(NULL, NULL,
+			NULL, (GDestroyNotify)jamrtc_tracing_stream_free);
+	}
+	jamrtc_mutex_unlock(&tracing_mutex);
+	g_atomic_int_set(&enabled, 1);
+}
+
+/* Whether latency tracing is enabled */
+gboolean jamrtc_tracing_is_enabled(void) {
+	return g_atomic_int_get(&enabled);
+}
+
+/* Buffer probe: this is invoked on streaming threads, so keep it short */
+static GstPadProbeReturn jamrtc_tracing_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_tracing_point *point = (jamrtc_tracing_point *)user_data;
+	GstBuffer *buffer = NULL;
+	if(info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+		buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	} else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		if(gst_buffer_list_length(list) > 0)
+			buffer = gst_buffer_list_get(list, 0);
+	}
+	if(buffer == NULL)
+		return GST_PAD_PROBE_OK;
+	/* Incoming RTP packets may only have a DTS (arrival time) */
+	GstClockTime ts = GST_BUFFER_PTS_IS_VALID(buffer) ? GST_BUFFER_PTS(buffer) : GST_BUFFER_DTS(buffer);
+	if(!GST_CLOCK_TIME_IS_VALID(ts))
+		return GST_PAD_PROBE_OK;
+	GstClock *clock = gst_element_get_clock(point->pipeline);
+	if(clock == NULL)
+		return GST_PAD_PROBE_OK;
+	GstClockTime now = gst_clock_get_time(clock);
+	gst_object_unref(clock);
+	GstClockTime base = gst_element_get_base_time(point->pipeline);
+	if(now < base)
+		return GST_PAD_PROBE_OK;
+	gint64 delay = ((gint64)(now - base) - (gint64)ts) / GST_USECOND;
+	jamrtc_tracing_counter_add(point->src ? &point->stage->out : &point->stage->in, delay);
+	return GST_PAD_PROBE_OK;
+}
+
+/* Add buffer probes to all the pads in a pipeline we're not tracing yet */
+void jamrtc_tracing_scan(GstElement *pipeline, const char *name) {
+	if(!jamrtc_tracing_is_enabled() || pipeline == NULL || name == NULL || !GST_IS_BIN(pipeline))
+		return;
+	jamrtc_mutex_lock(&tracing_mutex);
+	jamrtc_tracing_stream *stream = g_hash_table_lookup(streams, pipeline);
+	if(stream == NULL) {
+		stream = g_malloc0(sizeof(jamrtc_tracing_stream));
+		stream->pipeline = gst_object_ref(pipeline);
+		stream->name = g_strdup(name);
+		stream->stages = g_hash_table_new_full(g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify)jamrtc_tracing_stage_free);
+		g_hash_table_insert(streams, pipeline, stream);
+	}
+	guint added = 0;
+	GstIterator *iter = gst_bin_iterate_recurse(GST_BIN(pipeline));
+	GValue item = G_VALUE_INIT;
+	while(gst_iterator_next(iter, &item) == GST_ITERATOR_OK) {
+		GstElement *element = g_value_get_object(&item);
+		/* Bins only have ghost pads, we trace what's inside them instead */
+		if(GST_IS_BIN(element)) {
+			g_value_reset(&item);
+			continue;
+		}
+		GstIterator *pads = gst_element_iterate_pads(element);
+		GValue pad_item = G_VALUE_INIT;
+		while(gst_iterator_next(pads, &pad_item) == GST_ITERATOR_OK) {
+			GstPad *pad = g_value_get_object(&pad_item);
+			if(g_object_get_data(G_OBJECT(pad), "jamrtc-traced") == NULL) {
+				g_object_set_data(G_OBJECT(pad), "jamrtc-traced", GINT_TO_POINTER(1));
+				jamrtc_tracing_stage *stage = g_hash_table_lookup(stream->stages, GST_OBJECT_NAME(element));
+				if(stage == NULL) {
+					stage = g_malloc0(sizeof(jamrtc_tracing_stage));
+					stage->name = g_strdup(GST_OBJECT_NAME(element));
+					g_hash_table_insert(stream->stages, stage->name, stage);
+				}
+				jamrtc_tracing_point *point = g_malloc0(sizeof(jamrtc_tracing_point));
+				point->pad = gst_object_ref(pad);
+				point->pipeline = pipeline;
+				point->stage = stage;
+				point->src = (GST_PAD_DIRECTION(pad) == GST_PAD_SRC);
+				point->probe = gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+					jamrtc_tracing_probe, point, NULL);
+				stream->points = g_list_prepend(stream->points, point);
+				added++;
+			}
+			g_value_reset(&pad_item);
+		}
+		g_value_unset(&pad_item);
+		gst_iterator_free(pads);
+		g_value_reset(&item);
+	}
+	g_value_unset(&item);
+	gst_iterator_free(iter);
+	jamrtc_mutex_unlock(&tracing_mutex);
+	JAMRTC_LOG(LOG_VERB, "[tracing][%s] Tracing %u more pads\n", name, added);
+}
+
+/* Helper to sort stages by the delay they see buffers with, which in
+ * practice sorts them in the order buffers go through them */
+static gdouble jamrtc_tracing_stage_delay(jamrtc_tracing_stage *stage) {
+	jamrtc_tracing_values v;
+	jamrtc_tracing_counter_get(&stage->in, TRUE, &v);
+	if(v.count == 0)
+		jamrtc_tracing_counter_get(&stage->out, TRUE, &v);
+	return jamrtc_tracing_avg(&v);
+}
+static gint jamrtc_tracing_stage_compare(gconstpointer a, gconstpointer b) {
+	gdouble da = jamrtc_tracing_stage_delay((jamrtc_tracing_stage *)a),
+		db = jamrtc_tracing_stage_delay((jamrtc_tracing_stage *)b);
+	return (da < db) ? -1 : (da > db ? 1 : 0);
+}
+
+/* Helper to log the latency breakdown of a stream: must be called with the mutex locked */
+static void jamrtc_tracing_report_stream(jamrtc_tracing_stream *stream, gboolean summary) {
+	JAMRTC_LOG(LOG_INFO, "  %s\n", stream->name);
+	GList *list = g_list_sort(g_hash_table_get_values(stream->stages), jamrtc_tracing_stage_compare);
+	GList *temp = list;
+	gdouble end_to_end = 0;
+	while(temp) {
+		jamrtc_tracing_stage *stage = (jamrtc_tracing_stage *)temp->data;
+		jamrtc_tracing_values in, out;
+		jamrtc_tracing_counter_get(&stage->in, summary, &in);
+		jamrtc_tracing_counter_get(&stage->out, summary, &out);
+		if(in.count > 0 && out.count > 0) {
+			/* We can compute how long buffers stayed in this element */
+			JAMRTC_LOG(LOG_INFO, "    -- %-24s %8.2fms (in %.2fms, out %.2fms, max out %.2fms, %"SCNu64" buffers)\n",
+				stage->name, jamrtc_tracing_avg(&out) - jamrtc_tracing_avg(&in),
+				jamrtc_tracing_avg(&in), jamrtc_tracing_avg(&out),
+				(gdouble)out.max / 1000, out.count);
+		} else if(out.count > 0) {
+			/* Source: how old are buffers when they leave it (e.g., capture period) */
+			JAMRTC_LOG(LOG_INFO, "    -- %-24s %8.2fms (source, max %.2fms, %"SCNu64" buffers)\n",
+				stage->name, jamrtc_tracing_avg(&out), (gdouble)out.max / 1000, out.count);
+		} else if(in.count > 0) {
+			/* Sink: how old are buffers when they get there */
+			JAMRTC_LOG(LOG_INFO, "    -- %-24s %8.2fms (sink, max %.2fms, %"SCNu64" buffers)\n",
+				stage->name, jamrtc_tracing_avg(&in), (gdouble)in.max / 1000, in.count);
+			end_to_end = MAX(end_to_end, jamrtc_tracing_avg(&in));
+		}
+		temp = temp->next;
+	}
+	g_list_free(list);
+	if(end_to_end > 0)
+		JAMRTC_LOG(LOG_INFO, "    == %-24s %8.2fms\n", "slowest sink", end_to_end);
+}
+
+/* Log a per-stream latency breakdown */
+void jamrtc_tracing_report(gboolean summary) {
+	if(!jamrtc_tracing_is_enabled())
+		return;
+	jamrtc_mutex_lock(&tracing_mutex);
+	JAMRTC_LOG(LOG_INFO, "[tracing] Latency breakdown (%s):\n", summary ? "summary" : "since last report");
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, streams);
+	while(g_hash_table_iter_next(&iter, NULL, &value))
+		jamrtc_tracing_report_stream((jamrtc_tracing_stream *)value, summary);
+	jamrtc_mutex_unlock(&tracing_mutex);
+}
+
+/* Stop tracing a pipeline that is being torn down */
+void jamrtc_tracing_forget(GstElement *pipeline) {
+	if(!jamrtc_tracing_is_enabled() || pipeline == NULL)
+		return;
+	jamrtc_mutex_lock(&tracing_mutex);
+	jamrtc_tracing_stream *stream = g_hash_table_lookup(streams, pipeline);
+	if(stream != NULL) {
+		/* We won't be able to include this in the summary at shutdown, log it now */
+		JAMRTC_LOG(LOG_INFO, "[tracing] Latency breakdown (pipeline gone):\n");
+		jamrtc_tracing_report_stream(stream, TRUE);
+		g_hash_table_remove(streams, pipeline);
+	}
+	jamrtc_mutex_unlock(&tracing_mutex);
+}
+
+/* Get rid of all the tracing data */
+void jamrtc_tracing_cleanup(void) {
+	g_atomic_int_set(&enabled, 0);
+	jamrtc_mutex_lock(&tracing_mutex);
+	if(streams != NULL)
+		g_hash_table_destroy(streams);
+	streams = NULL;
+	jamrtc_mutex_unlock(&tracing_mutex);
+}
@@ -0,0 +1,44 @@
+/*
+ * JamRTC -- Jam sessions on Janus!
+ *
+ * Ugly prototype, just to use as a proof of concept
+ *
+ * Developed by Lorenzo Miniero: lorenzo@meetecho.com
+ * License: GPLv3
+ *
+ */
+
+#ifndef JAMRTC_TRACING_H
+#define JAMRTC_TRACING_H
+
+/* GLib */
+#include <glib.h>
+
+/* GStreamer */
+#include <gst/gst.h>
+
+
+/* Enable the latency tracing mode: when not enabled, no probe is ever
+ * added to any pipeline, so there's no overhead at all */
+void jamrtc_tracing_enable(void);
+/* Whether latency tracing is enabled */
+gboolean jamrtc_tracing_is_enabled(void);
+
+/* Add buffer probes to all the pads in a pipeline (recursively) that we're
+ * not tracing yet: can be called multiple times on the same pipeline, e.g.,
+ * when elements are added dynamically. The stream name is used to group
+ * the stages in the report (e.g., "Lorenzo/Guitar (inbound)") */
+void jamrtc_tracing_scan(GstElement *pipeline, const char *stream);
+/* Stop tracing a pipeline, logging a summary of what we saw: must be
+ * called when it's torn down (after it's been set to NULL), since we
+ * hold a reference to it, and its pads, for as long as we trace it */
+void jamrtc_tracing_forget(GstElement *pipeline);
+
+/* Log a per-stream latency breakdown: if summary is TRUE, the averages are
+ * computed since the beginning, otherwise since the previous report */
+void jamrtc_tracing_report(gboolean summary);
+/* Get rid of all the tracing data (pipelines must be stopped already) */
+void jamrtc_tracing_cleanup(void);
+
+
+#endif
@@ -8,6 +8,10 @@
  *
  */
 
+/* Generic includes */
+#include <stdlib.h>
+#include <time.h>
+
 /* GTK/GDK includes */
 #include <gdk/gdk.h>
 #include <gdk/gdkx.h>
@@ -15,17 +19,31 @@
 /* GStreamer includes */
 #include <gst/gst.h>
 #include <gst/sdp/sdp.h>
+#include <gst/rtp/gstrtpbuffer.h>
+#include <gst/audio/audio.h>
 #define GST_USE_UNSTABLE_API
 #include <gst/webrtc/webrtc.h>
 #include <gst/video/videooverlay.h>
 
-/* WebSockets/JSON stack(Janus API) */
-#include <libwebsockets.h>
+/* JSON stack (Janus API) */
 #include <json-glib/json-glib.h>
 
 /* Local includes */
 #include "webrtc.h"
+#include "janus.h"
+#include "renderer.h"
+#include "stats.h"
+#include "tracing.h"
+#include "recorder.h"
+#include "playout.h"
+#include "jackmon.h"
+#include "capture.h"
+#include "degrade.h"
+#include "protect.h"
+#include "midi.h"
+#include "memory.h"
 #include "mutex.h"
+#include "rcu.h"
 #include "refcount.h"
 #include "debug.h"
 
@@ -52,50 +70,198 @@ static const jamrtc_callbacks *cb = NULL;
 /* Global properties */
 static GtkBuilder *builder = NULL;
 static GMainLoop *loop = NULL;
+static GMainContext *loop_context = NULL;
 static const char *stun_server = NULL, *turn_server = NULL,
 	*src_opts = NULL, *video_device = NULL;
 static gboolean no_mic = FALSE,  no_webcam = FALSE, stereo = FALSE, no_jack = FALSE;
 static guint latency = 0;
 
-/* WebSocket properties */
-static const char *server_url = NULL;
-static const char *protocol = NULL, *address = NULL, *path = NULL;
-static int port = 0;
+/* Simulcast ladder for the webcam, if enabled (lowest to highest quality) */
+#define JAMRTC_MAX_SIMULCAST_LAYERS	3
+typedef struct jamrtc_simulcast_layer {
+	guint width, height;
+	guint bitrate;		/* kbps */
+	guint32 ssrc;
+} jamrtc_simulcast_layer;
+static jamrtc_simulcast_layer simulcast_layers[JAMRTC_MAX_SIMULCAST_LAYERS];
+static guint simulcast_num = 0;
+/* Cap on the substream we subscribe to (e.g., under CPU pressure), -1 if none */
+static volatile gint substream_cap = -1;
+/* Bitrate we encode the webcam at, when not simulcasting (bps) */
+#define JAMRTC_WEBCAM_BITRATE	128000
+/* How long to wait after a slow link before trying a higher substream again (seconds) */
+#define JAMRTC_SLOWLINK_RECOVERY	30
+
+/* Statistics collection, if enabled (seconds between samples) */
+static guint stats_interval = 0;
+static GSource *stats_timer = NULL;
+/* Latency tracing reports, if enabled */
+#define JAMRTC_TRACING_INTERVAL	10
+static GSource *tracing_timer = NULL;
+/* Saving of the recording manifest, if we're recording (seconds) */
+#define JAMRTC_RECORDER_SAVE	5
+static GSource *recorder_timer = NULL;
+/* Video degradation under CPU pressure, if enabled (see degrade.c) */
+#define JAMRTC_DEGRADE_INTERVAL	1
+static GSource *degrade_timer = NULL;
+static volatile gint degrade_level = JAMRTC_DEGRADE_NONE;
+/* Video throttling when instruments suffer on the network, if enabled (see protect.c) */
+static volatile gint protect_level = JAMRTC_PROTECT_NONE;
+
+/* Latency probing: RTCP round-trip times are sampled along with the other
+ * statistics, and we keep a rolling window of them for our own uplink (to
+ * Janus) and for each participant. Since RTCP on a subscription only tells
+ * Janus about us, we advertise our uplink RTT in our display, so that each
+ * of us can estimate the whole path to everybody else as ours plus theirs
+ * (or measure it directly, when we're exchanging instruments peer-to-peer) */
+#define JAMRTC_RTT_WINDOW		60
+#define JAMRTC_RTT_ADVERTISE	10
+#define JAMRTC_RTT_THRESHOLD	5
+typedef struct jamrtc_rtt_window {
+	guint samples[JAMRTC_RTT_WINDOW];	/* ms */
+	guint count, next;
+} jamrtc_rtt_window;
+static jamrtc_rtt_window uplink_rtt;
+static gint advertised_rtt = -1;
+static gint64 advertised_rtt_time = 0;
+
+/* Direct peer-to-peer mode for duo jams, if enabled: instruments flow
+ * directly between the two participants, and Janus only relays the SDPs
+ * (with all candidates in them), as part of the display of our mic/webcam
+ * publisher. They're changed on the WebRTC loop, and read when joining */
+static gboolean p2p = FALSE;
+static jamrtc_mutex p2p_mutex = JAMRTC_MUTEX_INITIALIZER;
+static char *p2p_peer = NULL;		/* UUID of the other participant */
+static char *p2p_offer = NULL, *p2p_answer = NULL;	/* Our SDPs, once ready */
+static char *p2p_remote_offer = NULL, *p2p_remote_answer = NULL;	/* Their SDPs, as last seen */
+
+/* Bundle mode, if enabled: mic, webcam and all our instruments are sent as
+ * different m-lines of the same publisher PeerConnection (local_micwebcam),
+ * and we tell subscribers which is which via the VideoRoom descriptions
+ * ("mic", "webcam" and "instrument:<name>"), as multistream Janus allows */
+#define JAMRTC_MAX_INSTRUMENTS	4
+#define JAMRTC_MAX_STREAMS		(JAMRTC_MAX_INSTRUMENTS+2)
+#define JAMRTC_INSTRUMENT_PREFIX	"instrument:"
+typedef struct jamrtc_bundle_instrument {
+	char *name;
+	guint32 ssrc;
+} jamrtc_bundle_instrument;
+static jamrtc_bundle_instrument bundle_instruments[JAMRTC_MAX_INSTRUMENTS];
+static guint bundle_num = 0;
+static gboolean bundle = FALSE;
+static char *bundle_label = NULL;	/* All instrument names, for the UI */
+static guint32 bundle_mic_ssrc = 0;
+
+/* Opus DTX and silence detection, unless disabled: we send DTX and the audio
+ * level extension ourselves, and when a stream we receive is silent (because
+ * of the audio level it advertises, or because it only contains DTX frames)
+ * we stop feeding its decoder, which also stops the visualisation, until
+ * audio comes back. A short hangover avoids chopping pauses within a song */
+static gboolean dtx = TRUE;
+#define JAMRTC_AUDIO_LEVEL_URN		"urn:ietf:params:rtp-hdrext:ssrc-audio-level"
+#define JAMRTC_AUDIO_LEVEL_EXTID	1
+#define JAMRTC_SILENCE_LEVEL		80		/* -dBov, anything at this level or below is silence */
+#define JAMRTC_SILENCE_HANGOVER		500		/* How long a stream must be silent before we skip it (ms) */
+#define JAMRTC_DTX_FRAME_SIZE		3		/* Opus payloads this small are DTX frames (bytes) */
+typedef struct jamrtc_silence {
+	/* PeerConnection and stream this is about (for logging, and the playout stage) */
+	struct jamrtc_webrtc_pc *pc;
+	guint stream;
+	/* ID of the audio level extension, if negotiated */
+	guint8 extid;
+	/* When the stream became quiet (0 if it isn't), whether we're skipping
+	 * it, and whether the next buffer we let through follows a gap */
+	gint64 quiet_since;
+	gboolean silent, resumed;
+	/* How many packets we skipped in the current silence */
+	guint64 skipped;
+	/* Each of the two pad probes holds a reference */
+	jamrtc_refcount ref;
+} jamrtc_silence;
+
+/* Clock drift: the sound card of each remote sender runs at its own pace,
+ * and so does ours, which with no jitter buffer means periodic underruns
+ * (or latency that keeps growing) on the playout chains. We estimate the
+ * rate of both clocks against the monotonic clock, from the lower envelope
+ * of the offsets (RTP timestamps vs. arrival time, JACK sink clock vs. now)
+ * over the last minute, and compensate the difference by resampling the
+ * decoded audio ourselves, right before the audioresample that feeds
+ * jackaudiosink: our resampler has a variable rate, so that we can adjust
+ * the ratio as the estimate changes without renegotiating caps, which would
+ * reset the filter (and click), and the ratio is not limited to integer
+ * rates, since we scale them (at 48kHz, integer rates are ~20ppm apart) */
+static gboolean drift_correction = TRUE;
+#define JAMRTC_DRIFT_BUCKET		1000	/* Each bucket keeps the minimum offset over this long (ms) */
+#define JAMRTC_DRIFT_BUCKETS	60		/* How many buckets we fit the drift on */
+#define JAMRTC_DRIFT_MIN_BUCKETS	10	/* How many buckets we need before trusting the estimate */
+#define JAMRTC_DRIFT_RESET		1000	/* Offset jumps larger than this reset the estimate (ms) */
+#define JAMRTC_DRIFT_MAX		1000	/* Anything larger than this is not drift (ppm) */
+#define JAMRTC_DRIFT_SCALE		1000	/* How much we scale rates by, for the resampler ratio */
+#define JAMRTC_DRIFT_QUALITY	4		/* Quality of the resampler (0-10, the higher the more latency) */
+typedef struct jamrtc_drift_clock {
+	/* Reference times, and the current bucket */
+	gint64 base_local, base_remote;
+	gint64 bucket_start, bucket_time, bucket_min;
+	/* Lower envelope of the offsets (time and offset, in us) */
+	gint64 times[JAMRTC_DRIFT_BUCKETS], offsets[JAMRTC_DRIFT_BUCKETS];
+	guint count, next;
+} jamrtc_drift_clock;
+typedef struct jamrtc_drift {
+	/* PeerConnection the stream belongs to (only used for logging) */
+	struct jamrtc_webrtc_pc *pc;
+	/* Stream name (only used for logging) */
+	char *name;
+	/* SSRC and clock rate of the stream, and the last RTP timestamp we
+	 * saw, unwrapped (only touched by the RTP streaming thread) */
+	volatile gint ssrc;
+	guint clock_rate;
+	guint32 last_ts;
+	gint64 ext_ts;
+	jamrtc_drift_clock sender;
+	/* Estimated rate of the sender, relative to the monotonic clock (ppb) */
+	volatile gint sender_ppb, sender_valid;
+	/* Clock of the sink we play the stream on, and the estimated rate
+	 * of its clock (only touched by the playout streaming thread) */
+	GstElement *sink;
+	GstClock *clock;
+	gint64 clock_check;
+	jamrtc_drift_clock output;
+	gboolean output_valid;
+	gdouble output_ppm;
+	/* Drift between the two (ppb), which is what we expose */
+	volatile gint ppb, valid;
+	/* Format of the decoded audio and the rate it says, whether we can
+	 * resample it, our resampler, the input rate we want it to assume and
+	 * the one it's using (both scaled), and how much we shifted timestamps */
+	GstAudioInfo info;
+	gint nominal;
+	gboolean supported;
+	GstAudioResampler *resampler;
+	gint in_rate, applied;
+	gint64 offset;
+	gdouble logged;
+} jamrtc_drift;
+static void jamrtc_drift_free(jamrtc_drift *drift) {
+	if(drift == NULL)
+		return;
+	if(drift->clock)
+		gst_object_unref(drift->clock);
+	if(drift->sink)
+		gst_object_unref(drift->sink);
+	if(drift->resampler)
+		gst_audio_resampler_free(drift->resampler);
+	g_free(drift->name);
+	g_free(drift);
+}
+
+/* Janus API client (see janus.c) */
+static jamrtc_janus *janus = NULL;
 static jamrtc_state state = 0;
 static GSource *keep_alives = NULL;
-static struct lws_context *context = NULL;
-static struct lws *wsi = NULL;
 static volatile gint stopping = 0;
 
-typedef struct jamrtc_ws_client {
-	struct lws *wsi;		/* The libwebsockets client instance */
-	char *incoming;			/* Buffer containing incoming data until it's complete */
-	unsigned char *buffer;	/* Buffer containing the message to send */
-	int buflen;				/* Length of the buffer (may be resized after re-allocations) */
-	int bufpending;			/* Data an interrupted previous write couldn't send */
-	int bufoffset;			/* Offset from where the interrupted previous write should resume */
-	jamrtc_mutex mutex;		/* Mutex to lock/unlock this instance */
-} jamrtc_ws_client;
-static jamrtc_ws_client *ws_client = NULL;
-static GAsyncQueue *messages = NULL;	/* Queue of outgoing messages to push */
-static jamrtc_mutex writable_mutex;
-static GThread *ws_thread = NULL;
-
-static int jamrtc_ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
-static struct lws_protocols protocols[] = {
-	{ "janus-protocol", jamrtc_ws_callback, sizeof(jamrtc_ws_client), 0 },
-	{ NULL, NULL, 0, 0 }
-};
-static const struct lws_extension exts[] = {
-#ifndef LWS_WITHOUT_EXTENSIONS
-	{ "permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_max_window_bits" },
-	{ "deflate-frame", lws_extension_callback_pm_deflate, "deflate_frame" },
-#endif
-	{ NULL, NULL, NULL }
-};
-
 /* Janus API properties */
-static guint64 session_id = 0, room_id = 0, private_id = 0;
+static guint64 room_id = 0, private_id = 0;
 static char *local_uuid = NULL;
 static const char *display_name = NULL;
 /* Janus API handles management */
@@ -130,6 +296,37 @@ typedef struct jamrtc_webrtc_pc {
 	GstElement *peerconnection;
 	/* Whether there's audio and/or video */
 	gboolean audio, video;
+	/* Whether we asked Janus to stop forwarding video, as it's not visible */
+	gboolean video_paused;
+	/* Valve in front of the video decoder, for subscriptions */
+	GstElement *video_valve;
+	/* Track we're recording this stream to, if any */
+	jamrtc_recorder_track *recording;
+	/* Whether this PeerConnection is with the other participant, rather than with Janus */
+	gboolean p2p;
+	/* Last RTCP round-trip time of what we send (ms, -1 if unknown) */
+	gint rtt;
+	/* JACK xruns we had seen the last time we sampled the statistics */
+	guint xruns;
+	/* Whether this is a MIDI instrument, and the JACK MIDI port we play it on, if remote */
+	gboolean midi;
+	jamrtc_midi_port *midi_port;
+	/* Widths of the simulcast layers the publisher advertised, if any */
+	guint layers[JAMRTC_MAX_SIMULCAST_LAYERS], num_layers;
+	/* Simulcast substream we asked for (-1 if none yet), and the cap we
+	 * put ourselves after a slow link, and when that happened */
+	gint substream, slowlink_cap;
+	gint64 slowlink_time;
+	/* Streams we subscribe to, if the publisher bundles everything in a
+	 * single PeerConnection (their mids), and the instrument names, if any */
+	char *mids[JAMRTC_MAX_STREAMS], *labels[JAMRTC_MAX_STREAMS];
+	guint num_mids;
+	/* Tracks we're recording the other instruments to, if there's more than one */
+	jamrtc_recorder_track *recordings[JAMRTC_MAX_STREAMS];
+	/* Clock drift estimation and compensation of incoming audio streams */
+	jamrtc_drift *drift[JAMRTC_MAX_STREAMS];
+	/* Playout stages (time-stretching) of incoming instruments */
+	jamrtc_playout *playout[JAMRTC_MAX_STREAMS];
 	/*! Atomic flag to check if this instance has been destroyed */
 	volatile gint destroyed;
 	/* Reference count */
@@ -141,20 +338,51 @@ static void jamrtc_webrtc_pc_free(const jamrtc_refcount *pc_ref) {
 	g_free(pc->uuid);
 	g_free(pc->display);
 	g_free(pc->instrument);
+	guint i = 0;
+	for(i=0; i<pc->num_mids; i++) {
+		g_free(pc->mids[i]);
+		g_free(pc->labels[i]);
+	}
+	if(pc->handle_id > 0)
+		jamrtc_stats_remove(pc->handle_id);
+	if(pc->video_valve)
+		gst_object_unref(pc->video_valve);
+	if(pc->peerconnection)
+		gst_object_unref(pc->peerconnection);
 	if(pc->pipeline)
 		gst_object_unref(pc->pipeline);
+	/* Probes were referencing these, so we get rid of them after the pipeline */
+	for(i=0; i<JAMRTC_MAX_STREAMS; i++) {
+		jamrtc_drift_free(pc->drift[i]);
+		jamrtc_playout_free(pc->playout[i]);
+	}
 	g_free(pc);
+	jamrtc_memory_count(JAMRTC_MEMORY_PEERCONNECTION, -1);
 }
+static void jamrtc_detach_handle(jamrtc_webrtc_pc *pc);
 static void jamrtc_webrtc_pc_destroy(jamrtc_webrtc_pc *pc) {
 	if(pc == NULL)
 		return;
 	if(!g_atomic_int_compare_and_exchange(&pc->destroyed, 0, 1))
 		return;
-	/* Send a detach to Janus */
-		/* TODO */
-	/* Quit the PeerConnection loop */
-	if(pc->pipeline)
+	/* Send a detach to Janus, and forget about pending transactions */
+	jamrtc_detach_handle(pc);
+	/* Finalize the recording, if any, before stopping the pipeline */
+	jamrtc_recorder_stop(g_atomic_pointer_get(&pc->recording));
+	guint i = 0;
+	for(i=0; i<JAMRTC_MAX_STREAMS; i++)
+		jamrtc_recorder_stop(g_atomic_pointer_get(&pc->recordings[i]));
+	/* Quit the PeerConnection loop, and stop listening to webrtcbin (the
+	 * pipeline itself is released when the last reference goes away) */
+	if(pc->pipeline) {
 		gst_element_set_state(GST_ELEMENT(pc->pipeline), GST_STATE_NULL);
+		jamrtc_tracing_forget(pc->pipeline);
+	}
+	if(pc->peerconnection)
+		g_signal_handlers_disconnect_by_data(pc->peerconnection, pc);
+	/* Get rid of the MIDI port, if any, now that nothing can be received anymore */
+	jamrtc_midi_remove_output(g_atomic_pointer_get(&pc->midi_port));
+	g_atomic_pointer_set(&pc->midi_port, NULL);
 	/* The PeerConnection will actually be destroyed when the counter gets to 0 */
 	jamrtc_refcount_decrease(&pc->ref);
 }
@@ -173,10 +401,39 @@ static jamrtc_webrtc_pc *jamrtc_webrtc_pc_new(const char *uuid, const char *disp
 	if(instrument != NULL)
 		pc->instrument = g_strdup(instrument);
 	pc->state = JAMRTC_JANUS_SESSION_CREATED;
+	pc->substream = -1;
+	pc->slowlink_cap = JAMRTC_MAX_SIMULCAST_LAYERS-1;
+	pc->rtt = -1;
+	pc->xruns = jamrtc_jackmon_xruns();
 	jamrtc_refcount_init(&pc->ref, jamrtc_webrtc_pc_free);
+	jamrtc_memory_count(JAMRTC_MEMORY_PEERCONNECTION, 1);
 	/* Done */
 	return pc;
 }
+/* Helper to set the streams we'll subscribe to, for bundled publishers
+ * (labels can be NULL, and this must be called with the participants
+ * mutex locked, for PeerConnections that are already in the registry) */
+static void jamrtc_webrtc_pc_set_streams(jamrtc_webrtc_pc *pc, const char **mids, const char **labels, guint num) {
+	guint i = 0;
+	for(i=0; i<pc->num_mids; i++) {
+		g_free(pc->mids[i]);
+		g_free(pc->labels[i]);
+		pc->mids[i] = NULL;
+		pc->labels[i] = NULL;
+	}
+	pc->num_mids = MIN(num, JAMRTC_MAX_STREAMS);
+	for(i=0; i<pc->num_mids; i++) {
+		pc->mids[i] = g_strdup(mids[i]);
+		pc->labels[i] = labels ? g_strdup(labels[i]) : NULL;
+	}
+}
+/* Helper to get the name of a stream of a PeerConnection, e.g., to name
+ * the JACK node it's played on (the index is the m-line of the stream) */
+static const char *jamrtc_webrtc_pc_stream_name(jamrtc_webrtc_pc *pc, guint stream) {
+	if(stream < pc->num_mids && pc->labels[stream] != NULL)
+		return pc->labels[stream];
+	return pc->instrument;
+}
 /* Media we may be publishing ourselves */
 static jamrtc_webrtc_pc *local_micwebcam = NULL;
 static jamrtc_webrtc_pc *local_instrument = NULL;
@@ -195,6 +452,12 @@ typedef struct jamrtc_webrtc_participant {
 	jamrtc_webrtc_pc *micwebcam;
 	/* Instrument PeerConnection of this participant, if any */
 	jamrtc_webrtc_pc *instrument;
+	/* Uplink RTT this participant advertised (ms, -1 if unknown) and the RTT
+	 * we measured directly, if we're peer-to-peer (atomic, as they're written
+	 * both when parsing the participant and on the loop), and the estimates
+	 * so far (only ever touched on the loop) */
+	volatile gint peer_rtt, direct_rtt;
+	jamrtc_rtt_window rtt;
 	/*! Atomic flag to check if this instance has been destroyed */
 	volatile gint destroyed;
 	/* Reference count */
@@ -207,6 +470,7 @@ static void jamrtc_webrtc_participant_free(const jamrtc_refcount *participant_re
 	g_free(participant->uuid);
 	g_free(participant->display);
 	g_free(participant);
+	jamrtc_memory_count(JAMRTC_MEMORY_PARTICIPANT, -1);
 }
 static void jamrtc_webrtc_participant_destroy(jamrtc_webrtc_participant *participant) {
 	if(participant == NULL)
@@ -221,17 +485,116 @@ static void jamrtc_webrtc_participant_unref(jamrtc_webrtc_participant *participa
 		return;
 	jamrtc_refcount_decrease(&participant->ref);
 }
-/* Remote participants and PeerConnections */
-static GHashTable *participants = NULL;
-static GHashTable *participants_byid = NULL;
-static GHashTable *participants_byslot = NULL;
-static GHashTable *peerconnections = NULL;
+/* Remote participants and PeerConnections: the tables are never modified
+ * once published, so that the lookups we do for each incoming message, in
+ * GStreamer callbacks and in timers can be done on a snapshot without any
+ * lock. Writers (which are serialized by participants_mutex, that also
+ * protects the mutable state of participants and PeerConnections) publish
+ * an updated copy instead, and the old one is freed via RCU, when nobody
+ * can be reading from it anymore. Each table holds its own references */
+typedef struct jamrtc_webrtc_registry {
+	GHashTable *participants;
+	GHashTable *participants_byid;
+	GHashTable *participants_byslot;
+	GHashTable *peerconnections;
+} jamrtc_webrtc_registry;
+static jamrtc_webrtc_registry *volatile registry = NULL;
 static jamrtc_mutex participants_mutex;
+/* Registry writes so far, and how long copying and publishing took (us) */
+static volatile gint registry_writes = 0;
+static gint64 registry_write_time = 0, registry_write_max = 0;
+static void jamrtc_webrtc_registry_free(jamrtc_webrtc_registry *reg) {
+	if(reg == NULL)
+		return;
+	g_hash_table_destroy(reg->participants);
+	g_hash_table_destroy(reg->participants_byid);
+	g_hash_table_destroy(reg->participants_byslot);
+	g_hash_table_destroy(reg->peerconnections);
+	g_free(reg);
+}
+/* Create a copy of the registry writers can modify (must be called with participants_mutex) */
+static jamrtc_webrtc_registry *jamrtc_webrtc_registry_copy(jamrtc_webrtc_registry *from) {
+	jamrtc_webrtc_registry *reg = g_malloc0(sizeof(jamrtc_webrtc_registry));
+	reg->participants = g_hash_table_new_full(g_str_hash, g_str_equal,
+		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_webrtc_participant_unref);
+	reg->participants_byid = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_webrtc_participant_unref);
+	reg->participants_byslot = g_hash_table_new_full(NULL, NULL, NULL,
+		(GDestroyNotify)jamrtc_webrtc_participant_unref);
+	reg->peerconnections = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_webrtc_pc_unref);
+	if(from == NULL)
+		return reg;
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, from->participants);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)value;
+		jamrtc_refcount_increase(&participant->ref);
+		g_hash_table_insert(reg->participants, g_strdup((char *)key), participant);
+	}
+	g_hash_table_iter_init(&iter, from->participants_byid);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)value;
+		jamrtc_refcount_increase(&participant->ref);
+		g_hash_table_insert(reg->participants_byid, jamrtc_uint64_dup(*(guint64 *)key), participant);
+	}
+	g_hash_table_iter_init(&iter, from->participants_byslot);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)value;
+		jamrtc_refcount_increase(&participant->ref);
+		g_hash_table_insert(reg->participants_byslot, key, participant);
+	}
+	g_hash_table_iter_init(&iter, from->peerconnections);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)value;
+		jamrtc_refcount_increase(&pc->ref);
+		g_hash_table_insert(reg->peerconnections, jamrtc_uint64_dup(*(guint64 *)key), pc);
+	}
+	return reg;
+}
+/* Helpers to start and commit a change to the registry (must be called with participants_mutex) */
+static jamrtc_webrtc_registry *jamrtc_webrtc_registry_begin(gint64 *start) {
+	*start = g_get_monotonic_time();
+	return jamrtc_webrtc_registry_copy(g_atomic_pointer_get(&registry));
+}
+static void jamrtc_webrtc_registry_commit(jamrtc_webrtc_registry *reg, gint64 start) {
+	jamrtc_webrtc_registry *old = g_atomic_pointer_get(&registry);
+	g_atomic_pointer_set(&registry, reg);
+	jamrtc_rcu_retire(old, (GDestroyNotify)jamrtc_webrtc_registry_free);
+	/* Free the snapshots nobody is looking at anymore */
+	jamrtc_rcu_reclaim();
+	gint64 elapsed = g_get_monotonic_time() - start;
+	registry_write_time += elapsed;
+	if(elapsed > registry_write_max)
+		registry_write_max = elapsed;
+	g_atomic_int_inc(&registry_writes);
+}
+/* Registry benchmark, if enabled */
+static void jamrtc_registry_bench_start(void);
+static void jamrtc_registry_bench_stop(void);
+/* Whether the UI is visible, and whether video tiles have been collapsed */
+static volatile gint window_visible = 1;
+static volatile gint video_collapsed[5] = { 0, 0, 0, 0, 0 };
+/* Width of the video tiles, to pick the right simulcast substream */
+static volatile gint video_width[5] = {
+	JAMRTC_RENDERER_TILE_WIDTH, JAMRTC_RENDERER_TILE_WIDTH, JAMRTC_RENDERER_TILE_WIDTH,
+	JAMRTC_RENDERER_TILE_WIDTH, JAMRTC_RENDERER_TILE_WIDTH
+};
+/* Timer to recover from simulcast substream downgrades after slow links */
+static GSource *substreams_timer = NULL;
 
 /* Signalling methods and callbacks */
-static void jamrtc_connect_websockets(void);
-static void jamrtc_send_message(char *text);
-static gboolean jamrtc_create_session(void);
+static void jamrtc_session_created(jamrtc_janus *client, guint64 session_id, gpointer user_data);
+static void jamrtc_server_message(jamrtc_janus *client, JsonObject *object, const char *response,
+	gpointer opaque, gpointer user_data);
+static void jamrtc_connection_lost(jamrtc_janus *client, const char *reason, gpointer user_data);
+static const jamrtc_janus_callbacks janus_callbacks =
+	{
+		.session_created = jamrtc_session_created,
+		.message = jamrtc_server_message,
+		.disconnected = jamrtc_connection_lost,
+	};
 static gboolean jamrtc_attach_handle(jamrtc_webrtc_pc *pc);
 static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscription, gboolean do_audio, gboolean do_video);
 static void jamrtc_negotiation_needed(GstElement *element, gpointer user_data);
@@ -239,19 +602,57 @@ static void jamrtc_sdp_available(GstPromise *promise, gpointer user_data);
 static void jamrtc_trickle_candidate(GstElement *webrtc,
 	guint mlineindex, char *candidate, gpointer user_data);
 static void jamrtc_incoming_stream(GstElement *webrtc, GstPad *pad, gpointer user_data);
-static void jamrtc_server_message(char *text);
-/* Transactions management */
-static GHashTable *transactions = NULL;
-static jamrtc_mutex transactions_mutex;
+static void jamrtc_recorder_ssrc_active(GstElement *rtpbin, guint session_id, guint ssrc, gpointer user_data);
+static void jamrtc_incoming_data_channel(GstElement *webrtc, GstWebRTCDataChannel *channel, gpointer user_data);
+static void jamrtc_send_request(jamrtc_webrtc_pc *pc, JsonObject *req);
+static gboolean jamrtc_webrtc_check_substreams(gpointer user_data);
+static gboolean jamrtc_webrtc_collect_stats(gpointer user_data);
+static gboolean jamrtc_webrtc_tracing_report(gpointer user_data);
+static gboolean jamrtc_webrtc_recorder_save(gpointer user_data);
+static gboolean jamrtc_webrtc_check_degrade(gpointer user_data);
+static void jamrtc_webrtc_check_protect(void);
+static char *jamrtc_local_display(void);
+static void jamrtc_update_display(void);
+static void jamrtc_set_remote_description(jamrtc_webrtc_pc *pc, const char *text, gboolean offer);
+static void jamrtc_p2p_gathering_state(GstElement *webrtc, GParamSpec *pspec, gpointer user_data);
+static void jamrtc_p2p_connection_state(GstElement *webrtc, GParamSpec *pspec, gpointer user_data);
+static void jamrtc_p2p_start(void);
+static void jamrtc_p2p_check(const char *uuid, const char *display, JsonObject *p2p_object);
+static gboolean jamrtc_p2p_reset(gpointer user_data);
 
 
+/* Helpers to schedule work on the WebRTC/signalling loop, or on the GTK one */
+static void jamrtc_loop_invoke(GSourceFunc func, gpointer user_data) {
+	/* The WebRTC loop runs on its own GMainContext, so that signalling and
+	 * pipeline setup never compete with GTK redraws for the default one */
+	GSource *timeout_source = g_timeout_source_new(0);
+	g_source_set_callback(timeout_source, func, user_data, NULL);
+	g_source_attach(timeout_source, loop_context);
+	g_source_unref(timeout_source);
+}
+static void jamrtc_ui_invoke(GSourceFunc func, gpointer user_data) {
+	/* When running headless there's no UI to update */
+	if(builder == NULL)
+		return;
+	/* We always queue UI work on the default context iterated by gtk_main(),
+	 * rather than using g_main_context_invoke(): that one may run the function
+	 * right away on the calling thread, if it manages to acquire the context */
+	GSource *idle_source = g_idle_source_new();
+	g_source_set_priority(idle_source, G_PRIORITY_DEFAULT);
+	g_source_set_callback(idle_source, func, user_data, NULL);
+	g_source_attach(idle_source, NULL);
+	g_source_unref(idle_source);
+}
+
 /* Video rendering callbacks */
 typedef enum jamrtc_video_message_action {
 	JAMRTC_ACTION_NONE = 0,
+	JAMRTC_ACTION_ADD_RENDERER,
 	JAMRTC_ACTION_ADD_PARTICIPANT,
 	JAMRTC_ACTION_ADD_STREAM,
 	JAMRTC_ACTION_REMOVE_STREAM,
-	JAMRTC_ACTION_REMOVE_PARTICIPANT
+	JAMRTC_ACTION_REMOVE_PARTICIPANT,
+	JAMRTC_ACTION_UPDATE_PARTICIPANT
 } jamrtc_video_message_action;
 typedef struct jamrtc_video_message {
 	jamrtc_video_message_action action;
@@ -261,12 +662,18 @@ typedef struct jamrtc_video_message {
 } jamrtc_video_message;
 static jamrtc_video_message *jamrtc_video_message_create(jamrtc_video_message_action action,
 		gpointer resource, gboolean video, const char *sink) {
+	/* When running headless there's no UI, so no message either */
+	if(builder == NULL)
+		return NULL;
 	jamrtc_video_message *msg = g_malloc(sizeof(jamrtc_video_message));
 	msg->action = action;
 	msg->resource = resource;
 	switch(action) {
+		case JAMRTC_ACTION_ADD_RENDERER:
+			break;
 		case JAMRTC_ACTION_ADD_PARTICIPANT:
-		case JAMRTC_ACTION_REMOVE_PARTICIPANT: {
+		case JAMRTC_ACTION_REMOVE_PARTICIPANT:
+		case JAMRTC_ACTION_UPDATE_PARTICIPANT: {
 			jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)resource;
 			if(participant != NULL)
 				jamrtc_refcount_increase(&participant->ref);
@@ -294,7 +701,8 @@ static void jamrtc_video_message_free(jamrtc_video_message *msg) {
 	g_free(msg->sink);
 	switch(msg->action) {
 		case JAMRTC_ACTION_ADD_PARTICIPANT:
-		case JAMRTC_ACTION_REMOVE_PARTICIPANT: {
+		case JAMRTC_ACTION_REMOVE_PARTICIPANT:
+		case JAMRTC_ACTION_UPDATE_PARTICIPANT: {
 			jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)msg->resource;
 			if(participant != NULL)
 				jamrtc_refcount_decrease(&participant->ref);
@@ -316,7 +724,20 @@ static gboolean jamrtc_video_message_handle(gpointer user_data) {
 	jamrtc_video_message *msg = (jamrtc_video_message *)user_data;
 	if(msg == NULL)
 		return G_SOURCE_REMOVE;
-	if(msg->action == JAMRTC_ACTION_ADD_PARTICIPANT) {
+	if(msg->action == JAMRTC_ACTION_ADD_RENDERER) {
+		/* Embed the single compositor sink in the main window */
+		GtkWidget *widget = GTK_WIDGET(gtk_builder_get_object(builder, "compositor_draw"));
+		gtk_widget_set_size_request(widget, JAMRTC_RENDERER_WIDTH, JAMRTC_RENDERER_HEIGHT);
+		gtk_widget_show(widget);
+		gtk_widget_realize(widget);
+		GdkWindow *window = gtk_widget_get_window(widget);
+		gulong xid = GDK_WINDOW_XID(window);
+		GstElement *sink = jamrtc_renderer_get_sink();
+		if(sink != NULL) {
+			gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), xid);
+			gst_object_unref(sink);
+		}
+	} else if(msg->action == JAMRTC_ACTION_ADD_PARTICIPANT) {
 		/* Initialize the labels in this slot */
 		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)msg->resource;
 		guint slot = participant ? participant->slot : 1;
@@ -334,32 +755,41 @@ static gboolean jamrtc_video_message_handle(gpointer user_data) {
 		/* We have a new stream to render, update the related label too */
 		jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)msg->resource;
 		if(!msg->video) {
-			/* Update the mic/instrument label */
+			/* Update the mic/instrument label (in bundle mode, our instruments
+			 * are in the same PeerConnection as the mic, so check the sink) */
+			gboolean instrument = (pc->instrument != NULL || g_str_has_prefix(msg->sink, "ai"));
 			char audio_label[100];
 			g_snprintf(audio_label, sizeof(audio_label), "user%u_%s", pc->slot,
-				pc->instrument ? "instrument" : "mic");
+				instrument ? "instrument" : "mic");
 			GtkLabel *label = GTK_LABEL(gtk_builder_get_object(builder, audio_label));
-			gtk_label_set_text(label, pc->instrument ? pc->instrument : "Microphone (chat)");
+			gtk_label_set_text(label, instrument ? (pc->instrument ? pc->instrument : bundle_label) : "Microphone (chat)");
 			/* Render the wavescope associated with the audio stream */
 			char draw[100];
 			g_snprintf(draw, sizeof(draw), "user%u_%sdraw", pc->slot,
-				pc->instrument ? "instrument" : "mic");
+				instrument ? "instrument" : "mic");
 			GtkWidget *widget = GTK_WIDGET(gtk_builder_get_object(builder, draw));
 			gtk_widget_set_size_request(widget, 320, 100);
 			GdkWindow *window = gtk_widget_get_window(widget);
 			gulong xid = GDK_WINDOW_XID(window);
-			GstElement *sink = gst_bin_get_by_name(GST_BIN(pc->pipeline), msg->sink);
-			gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), xid);
+			GstElement *sink = pc->pipeline ? gst_bin_get_by_name(GST_BIN(pc->pipeline), msg->sink) : NULL;
+			if(sink != NULL) {
+				gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), xid);
+				gst_object_unref(sink);
+			}
 		} else {
 			/* Render this video stream */
 			char draw[100];
 			g_snprintf(draw, sizeof(draw), "user%u_videodraw", pc->slot);
 			GtkWidget *widget = GTK_WIDGET(gtk_builder_get_object(builder, draw));
-			gtk_widget_set_size_request(widget, 320, 180);
+			gboolean collapsed = (pc->slot <= 4 && g_atomic_int_get(&video_collapsed[pc->slot]));
+			gtk_widget_set_size_request(widget, 320, collapsed ? JAMRTC_COLLAPSED_HEIGHT : 180);
 			GdkWindow *window = gtk_widget_get_window(widget);
 			gulong xid = GDK_WINDOW_XID(window);
-			GstElement *sink = gst_bin_get_by_name(GST_BIN(pc->pipeline), msg->sink);
-			gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), xid);
+			GstElement *sink = pc->pipeline ? gst_bin_get_by_name(GST_BIN(pc->pipeline), msg->sink) : NULL;
+			if(sink != NULL) {
+				gst_video_overlay_set_window_handle(GST_VIDEO_OVERLAY(sink), xid);
+				gst_object_unref(sink);
+			}
 		}
 	} else if(msg->action == JAMRTC_ACTION_REMOVE_STREAM) {
 		/* A stream we were rendering has gone away, update the related label too */
@@ -367,6 +797,10 @@ static gboolean jamrtc_video_message_handle(gpointer user_data) {
 		if(pc->slot < 1 || pc->slot > 4) {
 			JAMRTC_LOG(LOG_WARN, "Invalid stream slot %d, ignoring\n", pc->slot);
 		} else {
+			if(pc->audio)
+				jamrtc_renderer_remove_tile(pc->slot, pc->instrument ? JAMRTC_TILE_INSTRUMENT : JAMRTC_TILE_MIC);
+			if(pc->video)
+				jamrtc_renderer_remove_tile(pc->slot, JAMRTC_TILE_VIDEO);
 			if(pc->audio) {
 				/* Update the mic/instrument label */
 				char audio_label[100];
@@ -389,6 +823,16 @@ static gboolean jamrtc_video_message_handle(gpointer user_data) {
 				gtk_widget_set_size_request(widget, 0, 0);
 			}
 		}
+	} else if(msg->action == JAMRTC_ACTION_UPDATE_PARTICIPANT) {
+		/* Update the label of this slot (the text is in the sink property) */
+		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)msg->resource;
+		if(participant != NULL && participant->slot >= 2 && participant->slot <= 4 &&
+				!g_atomic_int_get(&participant->destroyed)) {
+			char display_label[100];
+			g_snprintf(display_label, sizeof(display_label), "user%u_name", participant->slot);
+			GtkLabel *display = GTK_LABEL(gtk_builder_get_object(builder, display_label));
+			gtk_label_set_text(display, msg->sink);
+		}
 	} else if(msg->action == JAMRTC_ACTION_REMOVE_PARTICIPANT) {
 		/* Reset the labels in this slot */
 		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)msg->resource;
@@ -407,6 +851,9 @@ static gboolean jamrtc_video_message_handle(gpointer user_data) {
 			display = GTK_LABEL(gtk_builder_get_object(builder, display_label));
 			gtk_label_set_text(display, "");
 			/* Get rid of the draw elements too, if any */
+			jamrtc_renderer_remove_tile(slot, JAMRTC_TILE_VIDEO);
+			jamrtc_renderer_remove_tile(slot, JAMRTC_TILE_MIC);
+			jamrtc_renderer_remove_tile(slot, JAMRTC_TILE_INSTRUMENT);
 			char draw[100];
 			g_snprintf(draw, sizeof(draw), "user%u_videodraw", slot);
 			GtkWidget *widget = GTK_WIDGET(gtk_builder_get_object(builder, draw));
@@ -425,25 +872,17 @@ static gboolean jamrtc_video_message_handle(gpointer user_data) {
 
 /* Janus stack initialization */
 int jamrtc_webrtc_init(const jamrtc_callbacks* callbacks, GtkBuilder *gtkbuilder, GMainLoop *mainloop,
-		const char *ws, const char *stun, const char *turn, const char *src, guint jitter, gboolean disable_jack) {
-	/* Validate the input */
-	if(lws_parse_uri((char *)ws, &protocol, &address, &port, &path)) {
-		JAMRTC_LOG(LOG_FATAL, "Invalid Janus WebSocket address\n");
-		return -1;
-	}
-	if((strcasecmp(protocol, "ws") && strcasecmp(protocol, "wss")) || !strlen(address)) {
-		JAMRTC_LOG(LOG_FATAL, "Invalid Janus WebSocket address (only ws:// and wss:// addresses are supported)\n");
-		JAMRTC_LOG(LOG_FATAL, "  -- Protocol: %s\n", protocol);
-		JAMRTC_LOG(LOG_FATAL, "  -- Address:  %s\n", address);
-		JAMRTC_LOG(LOG_FATAL, "  -- Path:     %s\n", path);
+		const char *ws, const char *stun, const char *turn, const char *src, guint jitter, gboolean disable_jack,
+		gboolean compositor) {
+	/* Validate the input, and start the WebSockets stack */
+	if(jamrtc_janus_init(ws) < 0)
 		return -1;
-	}
 
 	/* Take note of the settings */
 	cb = callbacks;
-	server_url = g_strdup(ws);
 	builder = gtkbuilder;
 	loop = mainloop;
+	loop_context = g_main_context_ref(g_main_loop_get_context(mainloop));
 	stun_server = stun;
 	turn_server = turn;
 	src_opts = src;
@@ -451,21 +890,59 @@ int jamrtc_webrtc_init(const jamrtc_callbacks* callbacks, GtkBuilder *gtkbuilder
 	no_jack = disable_jack;
 
 	/* Initialize hashtables and mutexes */
-	participants = g_hash_table_new_full(g_str_hash, g_str_equal,
-		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_webrtc_participant_destroy);
-	participants_byid = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_webrtc_participant_unref);
-	participants_byslot = g_hash_table_new_full(NULL, NULL, NULL,
-		(GDestroyNotify)jamrtc_webrtc_participant_unref);
-	peerconnections = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-		(GDestroyNotify)g_free, (GDestroyNotify)jamrtc_webrtc_pc_unref);
+	g_atomic_pointer_set(&registry, jamrtc_webrtc_registry_copy(NULL));
 	jamrtc_mutex_init(&participants_mutex);
-	transactions = g_hash_table_new_full(g_str_hash, g_str_equal,
-		(GDestroyNotify)g_free, NULL);
-	jamrtc_mutex_init(&transactions_mutex);
+	jamrtc_registry_bench_start();
+
+	/* Periodically check if we can go back to higher simulcast substreams */
+	substreams_timer = g_timeout_source_new_seconds(10);
+	g_source_set_callback(substreams_timer, jamrtc_webrtc_check_substreams, NULL, NULL);
+	g_source_attach(substreams_timer, loop_context);
+
+	/* Periodically sample the statistics of all PeerConnections, for the
+	 * metrics endpoint (if it's up) and for the latency estimates */
+	if(stats_interval > 0) {
+		stats_timer = g_timeout_source_new_seconds(stats_interval);
+		g_source_set_callback(stats_timer, jamrtc_webrtc_collect_stats, NULL, NULL);
+		g_source_attach(stats_timer, loop_context);
+	}
+	/* If latency tracing is enabled, periodically log a breakdown */
+	if(jamrtc_tracing_is_enabled()) {
+		tracing_timer = g_timeout_source_new_seconds(JAMRTC_TRACING_INTERVAL);
+		g_source_set_callback(tracing_timer, jamrtc_webrtc_tracing_report, NULL, NULL);
+		g_source_attach(tracing_timer, loop_context);
+	}
+	/* If we're recording, periodically save the manifest if it changed */
+	if(jamrtc_recorder_is_enabled()) {
+		recorder_timer = g_timeout_source_new_seconds(JAMRTC_RECORDER_SAVE);
+		g_source_set_callback(recorder_timer, jamrtc_webrtc_recorder_save, NULL, NULL);
+		g_source_attach(recorder_timer, loop_context);
+	}
+	/* If we have a CPU budget, periodically check if we need to degrade video */
+	if(jamrtc_degrade_is_enabled()) {
+		degrade_timer = g_timeout_source_new_seconds(JAMRTC_DEGRADE_INTERVAL);
+		g_source_set_callback(degrade_timer, jamrtc_webrtc_check_degrade, NULL, NULL);
+		g_source_attach(degrade_timer, loop_context);
+	}
 
-	/* Connect to Janus */
-	jamrtc_connect_websockets();
+	/* If required, render all video tiles via a single compositor */
+	if(compositor) {
+		if(jamrtc_renderer_init() < 0) {
+			JAMRTC_LOG(LOG_FATAL, "Error initializing the compositor renderer\n");
+			return -1;
+		}
+		jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_RENDERER,
+			NULL, TRUE, NULL);
+		jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+	}
+
+	/* Connect to Janus: each transaction we track holds a reference to the PeerConnection it's about */
+	state = JAMRTC_JANUS_CONNECTING;
+	janus = jamrtc_janus_connect("JamRTC", &janus_callbacks, NULL, (GDestroyNotify)jamrtc_webrtc_pc_unref);
+	if(janus == NULL) {
+		JAMRTC_LOG(LOG_FATAL, "Error connecting to Janus\n");
+		return -1;
+	}
 	return 0;
 }
 
@@ -473,35 +950,78 @@ int jamrtc_webrtc_init(const jamrtc_callbacks* callbacks, GtkBuilder *gtkbuilder
 static gboolean jamrtc_webrtc_cleanup_internal(gpointer user_data) {
 	/* Stop the client */
 	g_atomic_int_set(&stopping, 1);
-	if(ws_thread != NULL) {
-		g_thread_join(ws_thread);
-		ws_thread = NULL;
-	}
-	char *message = NULL;
-	while((message = g_async_queue_try_pop(messages)) != NULL) {
-		g_free(message);
+	jamrtc_janus_cleanup();
+	if(keep_alives != NULL) {
+		g_source_destroy(keep_alives);
+		g_source_unref(keep_alives);
+		keep_alives = NULL;
 	}
-	g_async_queue_unref(messages);
 
 	/* We're done */
-	jamrtc_mutex_lock(&transactions_mutex);
-	g_hash_table_destroy(transactions);
-	transactions = NULL;
-	jamrtc_mutex_unlock(&transactions_mutex);
+	if(substreams_timer != NULL) {
+		g_source_destroy(substreams_timer);
+		g_source_unref(substreams_timer);
+		substreams_timer = NULL;
+	}
+	if(stats_timer != NULL) {
+		g_source_destroy(stats_timer);
+		g_source_unref(stats_timer);
+		stats_timer = NULL;
+	}
+	if(tracing_timer != NULL) {
+		g_source_destroy(tracing_timer);
+		g_source_unref(tracing_timer);
+		tracing_timer = NULL;
+	}
+	if(recorder_timer != NULL) {
+		g_source_destroy(recorder_timer);
+		g_source_unref(recorder_timer);
+		recorder_timer = NULL;
+	}
+	if(degrade_timer != NULL) {
+		g_source_destroy(degrade_timer);
+		g_source_unref(degrade_timer);
+		degrade_timer = NULL;
+	}
+	jamrtc_janus *client = janus;
+	janus = NULL;
+	jamrtc_janus_free(client);
+	jamrtc_registry_bench_stop();
 	jamrtc_mutex_lock(&participants_mutex);
-	g_hash_table_destroy(peerconnections);
-	peerconnections = NULL;
-	g_hash_table_destroy(participants);
-	participants = NULL;
-	g_hash_table_destroy(participants_byid);
-	participants_byid = NULL;
-	g_hash_table_destroy(participants_byslot);
-	participants_byslot = NULL;
+	jamrtc_webrtc_registry *old = g_atomic_pointer_get(&registry);
+	g_atomic_pointer_set(&registry, NULL);
+	if(old != NULL) {
+		/* Participants are gone for good */
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, old->participants);
+		while(g_hash_table_iter_next(&iter, NULL, &value))
+			jamrtc_webrtc_participant_destroy((jamrtc_webrtc_participant *)value);
+		jamrtc_rcu_retire(old, (GDestroyNotify)jamrtc_webrtc_registry_free);
+	}
 	jamrtc_webrtc_pc_destroy(local_micwebcam);
 	local_micwebcam = NULL;
 	jamrtc_webrtc_pc_destroy(local_instrument);
 	local_instrument = NULL;
 	jamrtc_mutex_unlock(&participants_mutex);
+	/* Wait for readers to be done with the snapshots, and free them */
+	jamrtc_rcu_synchronize();
+	JAMRTC_LOG(LOG_VERB, "Participant registry: %d writes, %.1fus on average (max %"SCNi64"us)\n",
+		g_atomic_int_get(&registry_writes),
+		registry_writes ? (double)registry_write_time / registry_writes : 0.0, registry_write_max);
+	jamrtc_mutex_lock(&p2p_mutex);
+	g_clear_pointer(&p2p_peer, g_free);
+	g_clear_pointer(&p2p_offer, g_free);
+	g_clear_pointer(&p2p_answer, g_free);
+	g_clear_pointer(&p2p_remote_offer, g_free);
+	g_clear_pointer(&p2p_remote_answer, g_free);
+	jamrtc_mutex_unlock(&p2p_mutex);
+	guint i = 0;
+	for(i=0; i<bundle_num; i++)
+		g_clear_pointer(&bundle_instruments[i].name, g_free);
+	bundle_num = 0;
+	g_clear_pointer(&bundle_label, g_free);
+	jamrtc_renderer_cleanup();
 
 	/* Quit the main loop: this will eventually exit the application, when done */
 	if(loop) {
@@ -512,12 +1032,161 @@ static gboolean jamrtc_webrtc_cleanup_internal(gpointer user_data) {
 }
 void jamrtc_webrtc_cleanup() {
 	/* Run this on the loop */
-	GSource *timeout_source;
-	timeout_source = g_timeout_source_new(0);
-	g_source_set_callback(timeout_source, jamrtc_webrtc_cleanup_internal, NULL, NULL);
-	g_source_attach(timeout_source, NULL);
-	g_source_unref(timeout_source);
+	jamrtc_loop_invoke(jamrtc_webrtc_cleanup_internal, NULL);
+}
+
+/* Helpers to pause or resume the video of a subscription, depending on
+ * whether it's visible: we ask Janus to stop forwarding video, and also
+ * drop anything that may still be in flight before it reaches the decoder.
+ * Notice that audio is never affected, and that we pause all videos when
+ * the CPU is too busy to decode them, or when the instruments need the
+ * bandwidth. Updates must be performed with the participants mutex locked */
+static gboolean jamrtc_webrtc_video_visible(jamrtc_webrtc_pc *pc) {
+	return builder != NULL && g_atomic_int_get(&window_visible) &&
+		g_atomic_int_get(&degrade_level) < JAMRTC_DEGRADE_REMOTE_VIDEO &&
+		g_atomic_int_get(&protect_level) < JAMRTC_PROTECT_PAUSE &&
+		(pc->slot > 4 || !g_atomic_int_get(&video_collapsed[pc->slot]));
+}
+static gint jamrtc_webrtc_pick_substream(jamrtc_webrtc_pc *pc) {
+	if(pc->num_layers < 2)
+		return -1;
+	/* Pick the largest layer that fits the tile we're rendering it in */
+	guint width = (pc->slot >= 1 && pc->slot <= 4) ?
+		(guint)g_atomic_int_get(&video_width[pc->slot]) : JAMRTC_RENDERER_TILE_WIDTH;
+	gint substream = 0;
+	guint i = 0;
+	for(i=0; i<pc->num_layers; i++) {
+		if(pc->layers[i] <= width)
+			substream = i;
+	}
+	/* Never go above what the link or the CPU can currently cope with */
+	substream = MIN(substream, pc->slowlink_cap);
+	gint cap = g_atomic_int_get(&substream_cap);
+	if(cap >= 0)
+		substream = MIN(substream, cap);
+	return substream;
+}
+static void jamrtc_webrtc_update_video(jamrtc_webrtc_pc *pc) {
+	if(pc == NULL || !pc->remote || !pc->video || pc->instrument != NULL)
+		return;
+	gboolean visible = jamrtc_webrtc_video_visible(pc);
+	GstElement *valve = g_atomic_pointer_get(&pc->video_valve);
+	if(valve != NULL)
+		g_object_set(valve, "drop", !visible, NULL);
+	if(pc->handle_id == 0 || pc->state < JAMRTC_JANUS_STARTED)
+		return;
+	JsonObject *req = NULL;
+	if(visible == pc->video_paused) {
+		pc->video_paused = !visible;
+		JAMRTC_LOG(LOG_INFO, "[%s][%s] Video %s, %s subscription\n",
+			pc->display, pc->instrument ? pc->instrument : "chat",
+			visible ? "visible again" : "not visible anymore", visible ? "resuming" : "pausing");
+		jamrtc_jackmon_activity(pc->display, "chat", visible ? "video resumed" : "video paused");
+		req = json_object_new();
+		json_object_set_string_member(req, "request", "configure");
+		json_object_set_boolean_member(req, "video", visible);
+	}
+	/* If the publisher is simulcasting, check if we need a different substream */
+	gint substream = jamrtc_webrtc_pick_substream(pc);
+	if(visible && substream >= 0 && substream != pc->substream) {
+		JAMRTC_LOG(LOG_INFO, "[%s][%s] Switching to simulcast substream %d (was %d)\n",
+			pc->display, pc->instrument ? pc->instrument : "chat", substream, pc->substream);
+		pc->substream = substream;
+		if(req == NULL) {
+			req = json_object_new();
+			json_object_set_string_member(req, "request", "configure");
+		}
+		json_object_set_int_member(req, "substream", substream);
+	}
+	if(req != NULL)
+		jamrtc_send_request(pc, req);
+}
+static gboolean jamrtc_webrtc_update_videos_internal(gpointer user_data) {
+	/* Writers hold the same mutex, so the registry can't change while we use it */
+	jamrtc_mutex_lock(&participants_mutex);
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	if(reg != NULL) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, reg->participants);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)value;
+			jamrtc_webrtc_update_video(participant->micwebcam);
+		}
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	return G_SOURCE_REMOVE;
+}
+
+/* Notify the stack about whether the UI is visible */
+void jamrtc_webrtc_set_visible(gboolean visible) {
+	jamrtc_renderer_set_visible(visible);
+	if(!g_atomic_int_compare_and_exchange(&window_visible, !visible, visible))
+		return;
+	/* Pause or resume the video subscriptions accordingly */
+	jamrtc_loop_invoke(jamrtc_webrtc_update_videos_internal, NULL);
+}
+
+/* Notify the stack about the width of the video tile in a slot */
+void jamrtc_webrtc_set_video_width(guint slot, guint width) {
+	if(slot < 1 || slot > 4 || width == 0)
+		return;
+	if((guint)g_atomic_int_get(&video_width[slot]) == width)
+		return;
+	g_atomic_int_set(&video_width[slot], width);
+	/* Check if we need a different simulcast substream */
+	jamrtc_loop_invoke(jamrtc_webrtc_update_videos_internal, NULL);
+}
+
+/* Limit the simulcast substream we subscribe to (e.g., under CPU pressure) */
+void jamrtc_webrtc_limit_substream(gint substream) {
+	if(substream >= JAMRTC_MAX_SIMULCAST_LAYERS-1)
+		substream = -1;
+	if(g_atomic_int_get(&substream_cap) == substream)
+		return;
+	g_atomic_int_set(&substream_cap, substream);
+	jamrtc_loop_invoke(jamrtc_webrtc_update_videos_internal, NULL);
 }
+
+/* Timer to relax the substream caps we set after slow links, if things got better */
+static gboolean jamrtc_webrtc_check_substreams(gpointer user_data) {
+	gint64 now = g_get_monotonic_time();
+	jamrtc_mutex_lock(&participants_mutex);
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	if(reg != NULL) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, reg->participants);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)value;
+			jamrtc_webrtc_pc *pc = participant->micwebcam;
+			if(pc == NULL || pc->slowlink_cap >= JAMRTC_MAX_SIMULCAST_LAYERS-1)
+				continue;
+			if(now - pc->slowlink_time < JAMRTC_SLOWLINK_RECOVERY*G_USEC_PER_SEC)
+				continue;
+			/* No slow link in a while, try going one layer up */
+			pc->slowlink_cap++;
+			pc->slowlink_time = now;
+			jamrtc_webrtc_update_video(pc);
+		}
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Collapse or expand the video tile in a slot */
+gboolean jamrtc_webrtc_toggle_video(guint slot) {
+	if(slot < 1 || slot > 4)
+		return FALSE;
+	/* If the tile was collapsed, it's visible now, and vice versa */
+	gboolean visible = g_atomic_int_get(&video_collapsed[slot]) ? TRUE : FALSE;
+	g_atomic_int_set(&video_collapsed[slot], !visible);
+	jamrtc_renderer_set_tile_visible(slot, JAMRTC_TILE_VIDEO, visible);
+	/* Pause or resume the video subscriptions accordingly */
+	jamrtc_loop_invoke(jamrtc_webrtc_update_videos_internal, NULL);
+	return visible;
+}
+
 /* Join the room as a participant (but don't publish anything yet) */
 void jamrtc_join_room(guint64 id, const char *display) {
 	/* Take note of the properties */
@@ -535,10 +1204,761 @@ void jamrtc_join_room(guint64 id, const char *display) {
 	jamrtc_attach_handle(local_micwebcam);
 }
 
+/* Configure simulcast for the webcam (e.g., 160x90@64,320x180@128,640x360@384) */
+int jamrtc_webrtc_set_simulcast(const char *ladder) {
+	simulcast_num = 0;
+	if(ladder == NULL)
+		return 0;
+	gchar **layers = g_strsplit(ladder, ",", -1);
+	int i = 0, res = 0;
+	for(i=0; layers[i] != NULL; i++) {
+		if(simulcast_num == JAMRTC_MAX_SIMULCAST_LAYERS) {
+			JAMRTC_LOG(LOG_ERR, "Too many simulcast layers (max %d)\n", JAMRTC_MAX_SIMULCAST_LAYERS);
+			res = -1;
+			break;
+		}
+		guint width = 0, height = 0, bitrate = 0;
+		if(sscanf(layers[i], "%ux%u@%u", &width, &height, &bitrate) != 3 ||
+				width == 0 || height == 0 || bitrate == 0) {
+			JAMRTC_LOG(LOG_ERR, "Invalid simulcast layer '%s' (should be WIDTHxHEIGHT@KBPS)\n", layers[i]);
+			res = -1;
+			break;
+		}
+		if(simulcast_num > 0 && width <= simulcast_layers[simulcast_num-1].width) {
+			JAMRTC_LOG(LOG_ERR, "Simulcast layers must go from the lowest to the highest resolution\n");
+			res = -1;
+			break;
+		}
+		simulcast_layers[simulcast_num].width = width;
+		simulcast_layers[simulcast_num].height = height;
+		simulcast_layers[simulcast_num].bitrate = bitrate;
+		simulcast_num++;
+	}
+	g_strfreev(layers);
+	if(res == 0 && simulcast_num < 2) {
+		JAMRTC_LOG(LOG_ERR, "Simulcast needs at least two layers\n");
+		res = -1;
+	}
+	if(res < 0)
+		simulcast_num = 0;
+	return res;
+}
+
+/* Get the resolution we capture the webcam at */
+void jamrtc_webrtc_webcam_resolution(guint *width, guint *height) {
+	/* The highest simulcast layer, if we're simulcasting */
+	*width = simulcast_num < 2 ? 320 : simulcast_layers[simulcast_num-1].width;
+	*height = simulcast_num < 2 ? 180 : simulcast_layers[simulcast_num-1].height;
+}
+
+/* Configure how often we should sample statistics (0 disables them) */
+void jamrtc_webrtc_set_stats_interval(guint seconds) {
+	stats_interval = seconds;
+}
+
+/* Enable the direct peer-to-peer mode for instruments */
+void jamrtc_webrtc_set_p2p(gboolean enabled) {
+	p2p = enabled;
+}
+
+/* Enable or disable Opus DTX and silence detection */
+void jamrtc_webrtc_set_dtx(gboolean enabled) {
+	dtx = enabled;
+}
+
+/* Enable or disable the clock drift compensation of incoming audio */
+void jamrtc_webrtc_set_drift_correction(gboolean enabled) {
+	drift_correction = enabled;
+}
+
+/* Enable the bundle mode, with the instruments we'll publish, if any */
+int jamrtc_webrtc_set_bundle(const char *instruments, gboolean capture_stereo) {
+	bundle = TRUE;
+	stereo = capture_stereo;
+	if(instruments == NULL)
+		return 0;
+	gchar **names = g_strsplit(instruments, ",", -1);
+	guint i = 0;
+	for(i=0; names[i] != NULL; i++) {
+		char *name = g_strstrip(names[i]);
+		if(*name == '\0')
+			continue;
+		if(bundle_num == JAMRTC_MAX_INSTRUMENTS) {
+			JAMRTC_LOG(LOG_FATAL, "Too many instruments, at most %d can be bundled\n", JAMRTC_MAX_INSTRUMENTS);
+			g_strfreev(names);
+			return -1;
+		}
+		bundle_instruments[bundle_num].name = g_strdup(name);
+		bundle_num++;
+	}
+	g_strfreev(names);
+	if(bundle_num == 0) {
+		JAMRTC_LOG(LOG_FATAL, "Invalid list of instruments '%s'\n", instruments);
+		return -1;
+	}
+	/* Prepare the label we'll show in our own slot */
+	GString *label = g_string_new(NULL);
+	for(i=0; i<bundle_num; i++)
+		g_string_append_printf(label, "%s%s", i ? " + " : "", bundle_instruments[i].name);
+	bundle_label = g_string_free(label, FALSE);
+	return 0;
+}
+
+/* Registry benchmark: each reader thread keeps on looking up all the
+ * PeerConnections by handle ID, and taking a reference to them, and
+ * measures how long each pass takes, in a log2 histogram (ns) */
+#define JAMRTC_BENCH_BUCKETS	32
+typedef struct jamrtc_registry_bench {
+	GThread *thread;
+	guint64 passes, lookups;
+	guint64 hist[JAMRTC_BENCH_BUCKETS];
+	gint64 max;
+} jamrtc_registry_bench;
+static guint bench_readers = 0;
+static gboolean bench_locked = FALSE;
+static jamrtc_registry_bench *bench = NULL;
+static volatile gint bench_running = 0;
+static gint64 bench_started = 0;
+void jamrtc_webrtc_set_registry_bench(guint readers, gboolean locked) {
+	bench_readers = readers;
+	bench_locked = locked;
+}
+static gint64 jamrtc_bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static gpointer jamrtc_registry_bench_thread(gpointer user_data) {
+	jamrtc_registry_bench *reader = (jamrtc_registry_bench *)user_data;
+	guint64 handle_ids[64];
+	while(g_atomic_int_get(&bench_running)) {
+		gint64 before = jamrtc_bench_now();
+		if(bench_locked)
+			jamrtc_mutex_lock(&participants_mutex);
+		jamrtc_rcu_read_lock();
+		jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+		guint num = 0, i = 0;
+		if(reg != NULL) {
+			/* Get the handle IDs first, and then look them up one by one */
+			GHashTableIter iter;
+			gpointer key;
+			g_hash_table_iter_init(&iter, reg->peerconnections);
+			while(num < G_N_ELEMENTS(handle_ids) && g_hash_table_iter_next(&iter, &key, NULL))
+				handle_ids[num++] = *(guint64 *)key;
+			for(i=0; i<num; i++) {
+				jamrtc_webrtc_pc *pc = g_hash_table_lookup(reg->peerconnections, &handle_ids[i]);
+				if(pc != NULL) {
+					jamrtc_refcount_increase(&pc->ref);
+					jamrtc_webrtc_pc_unref(pc);
+				}
+			}
+		}
+		jamrtc_rcu_read_unlock();
+		if(bench_locked)
+			jamrtc_mutex_unlock(&participants_mutex);
+		gint64 elapsed = jamrtc_bench_now() - before;
+		reader->passes++;
+		reader->lookups += num;
+		reader->hist[MIN(g_bit_storage((gulong)elapsed), JAMRTC_BENCH_BUCKETS-1)]++;
+		if(elapsed > reader->max)
+			reader->max = elapsed;
+		/* Don't starve the writers completely, when using the mutex */
+		if(num == 0 || bench_locked)
+			g_thread_yield();
+	}
+	return NULL;
+}
+static void jamrtc_registry_bench_start(void) {
+	if(bench_readers == 0)
+		return;
+	JAMRTC_LOG(LOG_INFO, "Starting %u registry benchmark readers (%s)\n",
+		bench_readers, bench_locked ? "with the participants mutex" : "lock-free");
+	g_atomic_int_set(&bench_running, 1);
+	bench_started = g_get_monotonic_time();
+	bench = g_malloc0(bench_readers * sizeof(jamrtc_registry_bench));
+	guint i = 0;
+	for(i=0; i<bench_readers; i++) {
+		char name[32];
+		g_snprintf(name, sizeof(name), "jamrtc bench %u", i+1);
+		bench[i].thread = g_thread_new(name, jamrtc_registry_bench_thread, &bench[i]);
+	}
+}
+static double jamrtc_registry_bench_percentile(guint64 *hist, guint64 count, double percentile) {
+	guint64 target = (guint64)(count * percentile), sum = 0;
+	guint i = 0;
+	for(i=0; i<JAMRTC_BENCH_BUCKETS-1; i++) {
+		sum += hist[i];
+		if(sum > target)
+			break;
+	}
+	/* Upper bound of the bucket, in us */
+	return (double)((gint64)1 << i) / 1000;
+}
+static void jamrtc_registry_bench_stop(void) {
+	if(bench == NULL)
+		return;
+	g_atomic_int_set(&bench_running, 0);
+	gint64 elapsed = g_get_monotonic_time() - bench_started;
+	guint64 passes = 0, lookups = 0, hist[JAMRTC_BENCH_BUCKETS] = { 0 };
+	gint64 max = 0;
+	guint i = 0, j = 0;
+	for(i=0; i<bench_readers; i++) {
+		g_thread_join(bench[i].thread);
+		passes += bench[i].passes;
+		lookups += bench[i].lookups;
+		for(j=0; j<JAMRTC_BENCH_BUCKETS; j++)
+			hist[j] += bench[i].hist[j];
+		if(bench[i].max > max)
+			max = bench[i].max;
+	}
+	double seconds = (double)elapsed / G_USEC_PER_SEC;
+	JAMRTC_LOG(LOG_INFO, "Registry benchmark (%u readers, %s, %.1fs):\n", bench_readers,
+		bench_locked ? "with the participants mutex" : "lock-free", seconds);
+	JAMRTC_LOG(LOG_INFO, "  -- %"SCNu64" passes, %"SCNu64" lookups (%.0f lookups/s)\n",
+		passes, lookups, seconds > 0 ? lookups / seconds : 0);
+	if(passes > 0) {
+		JAMRTC_LOG(LOG_INFO, "  -- Pass latency: p50 <%.1fus, p99 <%.1fus, p99.9 <%.1fus, max %.1fus\n",
+			jamrtc_registry_bench_percentile(hist, passes, 0.5),
+			jamrtc_registry_bench_percentile(hist, passes, 0.99),
+			jamrtc_registry_bench_percentile(hist, passes, 0.999),
+			(double)max / 1000);
+	}
+	JAMRTC_LOG(LOG_INFO, "  -- Registry writes: %d, %.1fus on average (max %"SCNi64"us)\n",
+		g_atomic_int_get(&registry_writes),
+		registry_writes ? (double)registry_write_time / registry_writes : 0.0, registry_write_max);
+	g_free(bench);
+	bench = NULL;
+}
+
+/* Helper to read a numeric field from a stats structure, whatever its type */
+static gdouble jamrtc_stats_field(const GstStructure *s, const char *field, gdouble def) {
+	const GValue *value = gst_structure_get_value(s, field);
+	if(value == NULL)
+		return def;
+	GValue number = G_VALUE_INIT;
+	g_value_init(&number, G_TYPE_DOUBLE);
+	gdouble res = def;
+	if(g_value_transform(value, &number))
+		res = g_value_get_double(&number);
+	g_value_unset(&number);
+	return res;
+}
+/* Helper to find a stream in a list of stats by SSRC and direction */
+static jamrtc_stats_stream *jamrtc_stats_find(GList *streams, guint32 ssrc, gboolean inbound) {
+	while(streams) {
+		jamrtc_stats_stream *s = (jamrtc_stats_stream *)streams->data;
+		if(s->ssrc == ssrc && s->inbound == inbound)
+			return s;
+		streams = streams->next;
+	}
+	return NULL;
+}
+/* Helper to add the statistics of the jitter buffers in rtpbin, if any */
+static void jamrtc_stats_jitterbuffers(jamrtc_webrtc_pc *pc, GList *streams) {
+	GstElement *rtpbin = gst_bin_get_by_name(GST_BIN(pc->peerconnection), "rtpbin");
+	if(rtpbin == NULL)
+		return;
+	GstIterator *iter = gst_bin_iterate_recurse(GST_BIN(rtpbin));
+	GValue item = G_VALUE_INIT;
+	while(gst_iterator_next(iter, &item) == GST_ITERATOR_OK) {
+		GstElement *element = g_value_get_object(&item);
+		GstElementFactory *factory = gst_element_get_factory(element);
+		if(factory && !strcmp(GST_OBJECT_NAME(factory), "rtpjitterbuffer")) {
+			/* Find out the SSRC of this jitter buffer from its caps */
+			guint ssrc = 0;
+			GstPad *pad = gst_element_get_static_pad(element, "sink");
+			GstCaps *caps = pad ? gst_pad_get_current_caps(pad) : NULL;
+			if(caps != NULL) {
+				gst_structure_get_uint(gst_caps_get_structure(caps, 0), "ssrc", &ssrc);
+				gst_caps_unref(caps);
+			}
+			if(pad != NULL)
+				gst_object_unref(pad);
+			jamrtc_stats_stream *s = jamrtc_stats_find(streams, ssrc, TRUE);
+			GstStructure *jb = NULL;
+			if(s != NULL) {
+				g_object_get(element, "stats", &jb, "latency", &s->jb_latency, NULL);
+			}
+			if(jb != NULL) {
+				s->jitterbuffer = TRUE;
+				s->jb_pushed = jamrtc_stats_field(jb, "num-pushed", 0);
+				s->jb_lost = jamrtc_stats_field(jb, "num-lost", 0);
+				s->jb_late = jamrtc_stats_field(jb, "num-late", 0);
+				s->jb_duplicates = jamrtc_stats_field(jb, "num-duplicates", 0);
+				s->jb_avg_jitter = jamrtc_stats_field(jb, "avg-jitter", 0) / GST_SECOND;
+				gst_structure_free(jb);
+			}
+		}
+		g_value_reset(&item);
+	}
+	g_value_unset(&item);
+	gst_iterator_free(iter);
+	gst_object_unref(rtpbin);
+}
+/* Helper to add what we know about the playout of incoming audio streams,
+ * i.e., the clock drift we estimated and the playout stage, if any */
+static void jamrtc_stats_playout(jamrtc_webrtc_pc *pc, GList *streams) {
+	guint i = 0;
+	for(i=0; i<JAMRTC_MAX_STREAMS; i++) {
+		jamrtc_drift *drift = g_atomic_pointer_get(&pc->drift[i]);
+		if(drift == NULL)
+			continue;
+		jamrtc_stats_stream *s = jamrtc_stats_find(streams, (guint32)g_atomic_int_get(&drift->ssrc), TRUE);
+		if(s == NULL)
+			continue;
+		if(g_atomic_int_get(&drift->valid)) {
+			s->drift = TRUE;
+			s->drift_ppm = (gdouble)g_atomic_int_get(&drift->ppb) / 1000;
+		}
+		jamrtc_playout *playout = g_atomic_pointer_get(&pc->playout[i]);
+		if(playout != NULL) {
+			s->playout = TRUE;
+			jamrtc_playout_stats(playout, &s->playout_latency, &s->playout_target,
+				&s->playout_accelerated, &s->playout_decelerated, &s->playout_underruns);
+		}
+	}
+}
+
+/* Helpers to keep track of round-trip times in a rolling window */
+static void jamrtc_rtt_add(jamrtc_rtt_window *window, guint rtt) {
+	window->samples[window->next] = rtt;
+	window->next = (window->next + 1) % JAMRTC_RTT_WINDOW;
+	if(window->count < JAMRTC_RTT_WINDOW)
+		window->count++;
+}
+static guint jamrtc_rtt_last(jamrtc_rtt_window *window) {
+	return window->samples[(window->next + JAMRTC_RTT_WINDOW - 1) % JAMRTC_RTT_WINDOW];
+}
+static gint jamrtc_rtt_compare(gconstpointer a, gconstpointer b) {
+	guint first = *(const guint *)a, second = *(const guint *)b;
+	return first < second ? -1 : (first > second ? 1 : 0);
+}
+static void jamrtc_rtt_summary(jamrtc_rtt_window *window, guint *min, guint *avg, guint *p95) {
+	*min = *avg = *p95 = 0;
+	if(window->count == 0)
+		return;
+	guint sorted[JAMRTC_RTT_WINDOW], i = 0, total = 0;
+	memcpy(sorted, window->samples, window->count * sizeof(guint));
+	qsort(sorted, window->count, sizeof(guint), jamrtc_rtt_compare);
+	for(i=0; i<window->count; i++)
+		total += sorted[i];
+	*min = sorted[0];
+	*avg = total / window->count;
+	*p95 = sorted[MIN(window->count-1, (window->count * 95) / 100)];
+}
+
+/* Update the latency estimate for all participants, and advertise our own uplink RTT */
+static void jamrtc_latency_update(void) {
+	gint uplink = uplink_rtt.count > 0 ? (gint)jamrtc_rtt_last(&uplink_rtt) : -1;
+	/* The estimates are only ever updated here, on the loop, so a snapshot is
+	 * enough: the RTTs we derive them from are read atomically, instead */
+	jamrtc_rcu_read_lock();
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	GHashTableIter iter;
+	gpointer value;
+	if(reg != NULL)
+		g_hash_table_iter_init(&iter, reg->participants);
+	while(reg != NULL && g_hash_table_iter_next(&iter, NULL, &value)) {
+		jamrtc_webrtc_participant *participant = (jamrtc_webrtc_participant *)value;
+		/* A direct measurement beats an estimate */
+		gint direct_rtt = g_atomic_int_get(&participant->direct_rtt);
+		gint peer_rtt = g_atomic_int_get(&participant->peer_rtt);
+		gint rtt = direct_rtt;
+		if(rtt < 0 && uplink >= 0 && peer_rtt >= 0)
+			rtt = uplink + peer_rtt;
+		if(rtt < 0)
+			continue;
+		jamrtc_rtt_add(&participant->rtt, rtt);
+		guint min = 0, avg = 0, p95 = 0;
+		jamrtc_rtt_summary(&participant->rtt, &min, &avg, &p95);
+		char text[256];
+		g_snprintf(text, sizeof(text), "%s (RTT %u/%u/%u ms, one-way ~%u ms)",
+			participant->display, min, avg, p95, avg/2);
+		JAMRTC_LOG(LOG_VERB, "[%s] Round-trip time%s: min %ums, avg %ums, p95 %ums\n",
+			participant->display, direct_rtt >= 0 ? "" : " (via Janus)", min, avg, p95);
+		if(participant->slot > 0) {
+			/* Show the estimates in the participant's label */
+			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_UPDATE_PARTICIPANT,
+				participant, FALSE, text);
+			jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+		}
+	}
+	jamrtc_rcu_read_unlock();
+	/* Let the others know about our own uplink, if it changed enough */
+	if(uplink_rtt.count > 0) {
+		guint min = 0, avg = 0, p95 = 0;
+		jamrtc_rtt_summary(&uplink_rtt, &min, &avg, &p95);
+		gint64 now = g_get_monotonic_time();
+		if(now - advertised_rtt_time >= JAMRTC_RTT_ADVERTISE*G_USEC_PER_SEC &&
+				(advertised_rtt < 0 || ABS((gint)avg - advertised_rtt) >= JAMRTC_RTT_THRESHOLD)) {
+			advertised_rtt = avg;
+			advertised_rtt_time = now;
+			jamrtc_update_display();
+		}
+	}
+}
+
+/* Helper to release a PeerConnection reference on the loop: if it's the
+ * last one, we don't want to dispose of webrtcbin from its own thread */
+static gboolean jamrtc_stats_release(gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	if(pc->rtt >= 0 && !pc->remote) {
+		if(pc->p2p) {
+			/* This is the round-trip time to our peer */
+			jamrtc_rcu_read_lock();
+			jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+			jamrtc_webrtc_participant *participant = (reg && p2p_peer) ? g_hash_table_lookup(reg->participants, p2p_peer) : NULL;
+			if(participant != NULL)
+				g_atomic_int_set(&participant->direct_rtt, pc->rtt);
+			jamrtc_rcu_read_unlock();
+		} else {
+			/* This is the round-trip time to Janus */
+			jamrtc_rtt_add(&uplink_rtt, pc->rtt);
+		}
+	}
+	jamrtc_webrtc_pc_unref(pc);
+	return G_SOURCE_REMOVE;
+}
+/* Callback invoked when webrtcbin has the statistics we asked for: this
+ * is called on the webrtcbin thread, and never on a streaming thread */
+static void jamrtc_stats_available(GstPromise *promise, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	if(gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED || g_atomic_int_get(&pc->destroyed)) {
+		gst_promise_unref(promise);
+		jamrtc_loop_invoke(jamrtc_stats_release, pc);
+		return;
+	}
+	const GstStructure *reply = gst_promise_get_reply(promise);
+	/* First of all, check which codecs are video (90khz clock) */
+	GHashTable *video_codecs = g_hash_table_new(g_str_hash, g_str_equal);
+	int i = 0, n = gst_structure_n_fields(reply);
+	for(i=0; i<n; i++) {
+		const GValue *value = gst_structure_get_value(reply, gst_structure_nth_field_name(reply, i));
+		if(!GST_VALUE_HOLDS_STRUCTURE(value))
+			continue;
+		const GstStructure *s = gst_value_get_structure(value);
+		GstWebRTCStatsType type = 0;
+		if(!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL) || type != GST_WEBRTC_STATS_CODEC)
+			continue;
+		if(jamrtc_stats_field(s, "clock-rate", 0) == 90000)
+			g_hash_table_add(video_codecs, (gpointer)gst_structure_get_string(s, "id"));
+	}
+	/* Now let's go through the RTP statistics */
+	GList *streams = NULL;
+	for(i=0; i<n; i++) {
+		const GValue *value = gst_structure_get_value(reply, gst_structure_nth_field_name(reply, i));
+		if(!GST_VALUE_HOLDS_STRUCTURE(value))
+			continue;
+		const GstStructure *s = gst_value_get_structure(value);
+		GstWebRTCStatsType type = 0;
+		guint ssrc = 0;
+		if(!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL) ||
+				!gst_structure_get_uint(s, "ssrc", &ssrc))
+			continue;
+		if(type != GST_WEBRTC_STATS_INBOUND_RTP && type != GST_WEBRTC_STATS_OUTBOUND_RTP &&
+				type != GST_WEBRTC_STATS_REMOTE_INBOUND_RTP)
+			continue;
+		/* Remote inbound statistics are what the peer says about what we send */
+		gboolean inbound = (type == GST_WEBRTC_STATS_INBOUND_RTP);
+		jamrtc_stats_stream *stream = jamrtc_stats_find(streams, ssrc, inbound);
+		if(stream == NULL) {
+			stream = g_malloc0(sizeof(jamrtc_stats_stream));
+			stream->ssrc = ssrc;
+			stream->inbound = inbound;
+			stream->rtt = -1;
+			streams = g_list_append(streams, stream);
+		}
+		const char *codec = gst_structure_get_string(s, "codec-id");
+		if(codec != NULL && g_hash_table_contains(video_codecs, codec))
+			stream->video = TRUE;
+		if(type == GST_WEBRTC_STATS_INBOUND_RTP) {
+			stream->packets = jamrtc_stats_field(s, "packets-received", 0);
+			stream->bytes = jamrtc_stats_field(s, "bytes-received", 0);
+			stream->packets_lost = jamrtc_stats_field(s, "packets-lost", 0);
+			stream->jitter = jamrtc_stats_field(s, "jitter", 0);
+		} else if(type == GST_WEBRTC_STATS_OUTBOUND_RTP) {
+			stream->packets = jamrtc_stats_field(s, "packets-sent", 0);
+			stream->bytes = jamrtc_stats_field(s, "bytes-sent", 0);
+		} else {
+			stream->packets_lost = jamrtc_stats_field(s, "packets-lost", 0);
+			stream->jitter = jamrtc_stats_field(s, "jitter", 0);
+			stream->rtt = jamrtc_stats_field(s, "round-trip-time", -1);
+			stream->fraction_lost = jamrtc_stats_field(s, "fraction-lost", 0);
+		}
+	}
+	g_hash_table_destroy(video_codecs);
+	/* Remote streams only: add what the jitter buffers know */
+	if(pc->remote) {
+		jamrtc_stats_jitterbuffers(pc, streams);
+		jamrtc_stats_playout(pc, streams);
+	}
+	/* Take note of the round-trip time of what we send, if any */
+	gint rtt = -1;
+	GList *temp = streams;
+	while(temp) {
+		jamrtc_stats_stream *stream = (jamrtc_stats_stream *)temp->data;
+		if(!stream->inbound && stream->rtt >= 0)
+			rtt = MAX(rtt, (gint)(stream->rtt * 1000));
+		temp = temp->next;
+	}
+	pc->rtt = rtt;
+	/* Tell the audio protection controller how the instruments are doing: in
+	 * bundle mode, our instruments are all the audio streams but the mic */
+	if(jamrtc_protect_is_enabled() && (pc->instrument != NULL || (pc == local_micwebcam && bundle_num > 0))) {
+		for(temp = streams; temp != NULL; temp = temp->next) {
+			jamrtc_stats_stream *stream = (jamrtc_stats_stream *)temp->data;
+			if(stream->video || (pc->instrument == NULL && stream->ssrc == bundle_mic_ssrc))
+				continue;
+			jamrtc_protect_sample(pc->display, pc->instrument ? pc->instrument : "bundle", stream);
+		}
+	}
+	/* If JACK had xruns since last time, log them with the statistics of our audio
+	 * streams, so that it's easier to tell a local glitch from a network one */
+	guint xruns = jamrtc_jackmon_xruns();
+	if(xruns != pc->xruns) {
+		for(temp = streams; temp != NULL; temp = temp->next) {
+			jamrtc_stats_stream *stream = (jamrtc_stats_stream *)temp->data;
+			if(stream->video || (!stream->inbound && stream->rtt < 0 && stream->packets == 0))
+				continue;
+			if(stream->inbound) {
+				JAMRTC_LOG(LOG_WARN, "[%s][%s] %u JACK xruns in the last %us: %"SCNu64" packets (%"SCNi64" lost), "
+					"jitter buffer %"SCNu64" late/%"SCNu64" lost, playout %ums (%u underruns)\n",
+					pc->display, pc->instrument ? pc->instrument : "chat", xruns - pc->xruns, stats_interval,
+					stream->packets, stream->packets_lost, stream->jb_late, stream->jb_lost,
+					stream->playout_latency, stream->playout_underruns);
+			} else {
+				JAMRTC_LOG(LOG_WARN, "[%s][%s] %u JACK xruns in the last %us: %"SCNu64" packets sent (%.1f%% lost)\n",
+					pc->display, pc->instrument ? pc->instrument : "chat", xruns - pc->xruns, stats_interval,
+					stream->packets, stream->fraction_lost * 100);
+			}
+		}
+		pc->xruns = xruns;
+	}
+	/* Done, pass the statistics to the stats module (there's no handle for peer-to-peer) */
+	if(pc->handle_id > 0)
+		jamrtc_stats_update(pc->handle_id, pc->display, pc->instrument, streams);
+	else
+		g_list_free_full(streams, (GDestroyNotify)g_free);
+	gst_promise_unref(promise);
+	jamrtc_loop_invoke(jamrtc_stats_release, pc);
+}
+/* Helpers to add the memory footprint of a PeerConnection to the one of its participant */
+static void jamrtc_webrtc_footprint_free(jamrtc_stats_footprint *footprint) {
+	g_free(footprint->participant);
+	g_free(footprint);
+}
+static void jamrtc_webrtc_footprint(jamrtc_webrtc_pc *pc, GHashTable *footprints) {
+	jamrtc_stats_footprint *footprint = g_hash_table_lookup(footprints, pc->display);
+	if(footprint == NULL) {
+		footprint = g_malloc0(sizeof(jamrtc_stats_footprint));
+		footprint->participant = g_strdup(pc->display);
+		g_hash_table_insert(footprints, footprint->participant, footprint);
+	}
+	footprint->peerconnections++;
+	GstIterator *iter = gst_bin_iterate_recurse(GST_BIN(pc->pipeline));
+	GValue item = G_VALUE_INIT;
+	while(gst_iterator_next(iter, &item) == GST_ITERATOR_OK) {
+		GstElement *element = g_value_get_object(&item);
+		footprint->elements++;
+		/* Queues are where buffers pile up, if anything downstream is stuck */
+		GParamSpec *level = g_object_class_find_property(G_OBJECT_GET_CLASS(element), "current-level-bytes");
+		if(level != NULL && G_PARAM_SPEC_VALUE_TYPE(level) == G_TYPE_UINT64) {
+			guint64 bytes = 0;
+			g_object_get(element, "current-level-bytes", &bytes, NULL);
+			footprint->queued += bytes;
+		} else if(level != NULL && G_PARAM_SPEC_VALUE_TYPE(level) == G_TYPE_UINT) {
+			guint bytes = 0;
+			g_object_get(element, "current-level-bytes", &bytes, NULL);
+			footprint->queued += bytes;
+		}
+		g_value_reset(&item);
+	}
+	g_value_unset(&item);
+	gst_iterator_free(iter);
+}
+/* Timer to periodically ask all PeerConnections for their statistics */
+static gboolean jamrtc_webrtc_collect_stats(gpointer user_data) {
+	/* Update the latency estimates with what we got last time */
+	jamrtc_latency_update();
+	/* Report what JACK went through in the meanwhile, if we're monitoring it */
+	jamrtc_jackmon_poll();
+	/* Check how the instruments did on the network since last time */
+	jamrtc_webrtc_check_protect();
+	/* Take a reference to all the PeerConnections first */
+	GList *list = NULL;
+	jamrtc_mutex_lock(&participants_mutex);
+	if(local_micwebcam != NULL) {
+		jamrtc_refcount_increase(&local_micwebcam->ref);
+		list = g_list_prepend(list, local_micwebcam);
+	}
+	if(local_instrument != NULL) {
+		jamrtc_refcount_increase(&local_instrument->ref);
+		list = g_list_prepend(list, local_instrument);
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	jamrtc_rcu_read_lock();
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	if(reg != NULL) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, reg->peerconnections);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)value;
+			jamrtc_refcount_increase(&pc->ref);
+			list = g_list_prepend(list, pc);
+		}
+	}
+	jamrtc_rcu_read_unlock();
+	/* Now ask each of them for their statistics: we'll get them asynchronously */
+	GHashTable *footprints = g_hash_table_new(g_str_hash, g_str_equal);
+	GList *temp = list;
+	while(temp) {
+		jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)temp->data;
+		if(!g_atomic_int_get(&pc->destroyed) && pc->pipeline != NULL)
+			jamrtc_webrtc_footprint(pc, footprints);
+		if(!g_atomic_int_get(&pc->destroyed) && (pc->handle_id > 0 || pc->p2p) &&
+				pc->pipeline != NULL && pc->peerconnection != NULL) {
+			/* The promise callback will release the reference */
+			GstPromise *promise = gst_promise_new_with_change_func(jamrtc_stats_available, pc, NULL);
+			g_signal_emit_by_name(pc->peerconnection, "get-stats", NULL, promise);
+		} else {
+			jamrtc_webrtc_pc_unref(pc);
+		}
+		temp = temp->next;
+	}
+	g_list_free(list);
+	/* Update the memory accounting too */
+	jamrtc_stats_memory memory = { 0 };
+	memory.transactions = jamrtc_janus_pending(janus);
+	memory.footprints = g_hash_table_get_values(footprints);
+	jamrtc_memory_account(&memory);
+	g_list_free_full(memory.footprints, (GDestroyNotify)jamrtc_webrtc_footprint_free);
+	g_hash_table_destroy(footprints);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helpers to trace the latency of the stages of a pipeline, if enabled */
+static void jamrtc_webrtc_trace(jamrtc_webrtc_pc *pc) {
+	if(!jamrtc_tracing_is_enabled() || pc == NULL || pc->pipeline == NULL)
+		return;
+	char stream[256];
+	g_snprintf(stream, sizeof(stream), "%s/%s (%s)", pc->display,
+		pc->instrument ? pc->instrument : "chat", pc->remote ? "inbound" : "outbound");
+	jamrtc_tracing_scan(pc->pipeline, stream);
+}
+static gboolean jamrtc_webrtc_tracing_report(gpointer user_data) {
+	jamrtc_tracing_report(FALSE);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Periodic saving of the recording manifest */
+static gboolean jamrtc_webrtc_recorder_save(gpointer user_data) {
+	jamrtc_recorder_save(FALSE);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Helper to apply the current degradation and protection levels to the
+ * webcam we publish: the elements we change are created in jamrtc_prepare_pipeline */
+static void jamrtc_webrtc_limit_webcam(jamrtc_webrtc_pc *pc) {
+	if(pc == NULL || pc->pipeline == NULL || !pc->video)
+		return;
+	jamrtc_degrade_level level = g_atomic_int_get(&degrade_level);
+	jamrtc_protect_level protect = g_atomic_int_get(&protect_level);
+	/* Capture fewer frames */
+	GstElement *element = gst_bin_get_by_name(GST_BIN(pc->pipeline), "vrate");
+	if(element != NULL) {
+		g_object_set(element, "max-rate", level >= JAMRTC_DEGRADE_FPS ?
+			JAMRTC_DEGRADE_LOW_FPS : JAMRTC_DEGRADE_FULL_FPS, NULL);
+		gst_object_unref(element);
+	}
+	/* Encode a smaller video, or stop encoding the highest simulcast layer */
+	element = gst_bin_get_by_name(GST_BIN(pc->pipeline), "vsize");
+	if(element != NULL) {
+		GstCaps *caps = gst_caps_new_simple("video/x-raw",
+			"width", G_TYPE_INT, level >= JAMRTC_DEGRADE_RESOLUTION ? 160 : 320,
+			"height", G_TYPE_INT, level >= JAMRTC_DEGRADE_RESOLUTION ? 90 : 180, NULL);
+		g_object_set(element, "caps", caps, NULL);
+		gst_caps_unref(caps);
+		gst_object_unref(element);
+	}
+	/* Send less, or nothing at all, when the instruments need the bandwidth */
+	element = gst_bin_get_by_name(GST_BIN(pc->pipeline), "venc");
+	if(element != NULL) {
+		g_object_set(element, "target-bitrate", protect >= JAMRTC_PROTECT_THROTTLE ?
+			JAMRTC_WEBCAM_BITRATE/2 : JAMRTC_WEBCAM_BITRATE, NULL);
+		gst_object_unref(element);
+	}
+	element = gst_bin_get_by_name(GST_BIN(pc->pipeline), "vsend");
+	if(element != NULL) {
+		g_object_set(element, "drop", protect >= JAMRTC_PROTECT_PAUSE, NULL);
+		gst_object_unref(element);
+	}
+	guint i = 0;
+	for(i=0; simulcast_num > 1 && i<simulcast_num; i++) {
+		char name[20];
+		g_snprintf(name, sizeof(name), "vlayer%u", i);
+		element = gst_bin_get_by_name(GST_BIN(pc->pipeline), name);
+		if(element != NULL) {
+			gboolean top = (i == simulcast_num-1);
+			g_object_set(element, "drop", protect >= JAMRTC_PROTECT_PAUSE ||
+				(top && (level >= JAMRTC_DEGRADE_RESOLUTION || protect >= JAMRTC_PROTECT_THROTTLE)), NULL);
+			gst_object_unref(element);
+		}
+	}
+	/* Stop rendering our own preview */
+	element = gst_bin_get_by_name(GST_BIN(pc->pipeline), "vpreview-cpu");
+	if(element != NULL) {
+		g_object_set(element, "drop", level >= JAMRTC_DEGRADE_PREVIEW, NULL);
+		gst_object_unref(element);
+	}
+}
+/* Helper to apply the current degradation and protection levels to both
+ * what we send and what we receive: must be called on the loop */
+static void jamrtc_webrtc_limit_video(const char *what) {
+	/* Update what we send */
+	jamrtc_mutex_lock(&participants_mutex);
+	jamrtc_webrtc_pc *pc = local_micwebcam;
+	if(pc != NULL)
+		jamrtc_refcount_increase(&pc->ref);
+	jamrtc_mutex_unlock(&participants_mutex);
+	jamrtc_jackmon_activity(pc ? pc->display : NULL, "chat", what);
+	jamrtc_webrtc_limit_webcam(pc);
+	jamrtc_webrtc_pc_unref(pc);
+	/* Update what we receive: the lowest substream first, and then no video at all */
+	gboolean lowest = g_atomic_int_get(&degrade_level) >= JAMRTC_DEGRADE_RESOLUTION ||
+		g_atomic_int_get(&protect_level) >= JAMRTC_PROTECT_THROTTLE;
+	jamrtc_webrtc_limit_substream(lowest ? 0 : -1);
+	jamrtc_webrtc_update_videos_internal(NULL);
+}
+/* Timer to check whether we should degrade (or recover) video, to keep audio safe */
+static gboolean jamrtc_webrtc_check_degrade(gpointer user_data) {
+	jamrtc_degrade_level level = jamrtc_degrade_update();
+	if(level == (jamrtc_degrade_level)g_atomic_int_get(&degrade_level))
+		return G_SOURCE_CONTINUE;
+	g_atomic_int_set(&degrade_level, level);
+	char what[100];
+	g_snprintf(what, sizeof(what), "video degradation (%s)", jamrtc_degrade_level_str(level));
+	jamrtc_webrtc_limit_video(what);
+	return G_SOURCE_CONTINUE;
+}
+/* Helper to check whether we should throttle (or restore) video, to leave
+ * room to the instruments on the network: called after collecting stats */
+static void jamrtc_webrtc_check_protect(void) {
+	jamrtc_protect_level level = jamrtc_protect_update();
+	if(level == (jamrtc_protect_level)g_atomic_int_get(&protect_level))
+		return;
+	g_atomic_int_set(&protect_level, level);
+	char what[100];
+	g_snprintf(what, sizeof(what), "audio protection (%s)", jamrtc_protect_level_str(level));
+	jamrtc_webrtc_limit_video(what);
+}
+
 /* Publish mic/webcam for the chat part */
 static gboolean jamrtc_webrtc_publish_micwebcam_internal(gpointer user_data) {
 	/* Create a GStreamer pipeline for the sendonly PeerConnection */
 	jamrtc_prepare_pipeline(local_micwebcam, FALSE, !no_mic, !no_webcam);
+	/* If we're already limiting video, start as we mean to go on */
+	jamrtc_webrtc_limit_webcam(local_micwebcam);
 	return G_SOURCE_REMOVE;
 }
 void jamrtc_webrtc_publish_micwebcam(gboolean ignore_mic, gboolean ignore_webcam, const char *device) {
@@ -548,33 +1968,33 @@ void jamrtc_webrtc_publish_micwebcam(gboolean ignore_mic, gboolean ignore_webcam
 	video_device = device;
 
 	/* Run this on the loop */
-	GSource *timeout_source;
-	timeout_source = g_timeout_source_new(0);
-	g_source_set_callback(timeout_source, jamrtc_webrtc_publish_micwebcam_internal, NULL, NULL);
-	g_source_attach(timeout_source, NULL);
-	g_source_unref(timeout_source);
+	jamrtc_loop_invoke(jamrtc_webrtc_publish_micwebcam_internal, NULL);
 }
 
 /* Publish the instrument */
 static gboolean jamrtc_webrtc_publish_instrument_internal(gpointer user_data) {
+	if(p2p) {
+		/* We'll send the instrument directly to the other participant */
+		local_instrument->p2p = TRUE;
+		if(p2p_peer == NULL)
+			JAMRTC_LOG(LOG_INFO, "[%s][%s] Waiting for a peer to play with\n", local_instrument->display, local_instrument->instrument);
+		jamrtc_p2p_start();
+		return G_SOURCE_REMOVE;
+	}
 	/* Attach to the VideoRoom plugin: we'll join once we do that */
 	jamrtc_attach_handle(local_instrument);
 	return G_SOURCE_REMOVE;
 }
-void jamrtc_webrtc_publish_instrument(const char *instrument, gboolean capture_stereo) {
+void jamrtc_webrtc_publish_instrument(const char *instrument, gboolean capture_stereo, gboolean midi) {
 	/* Take note of the properties */
 	stereo = capture_stereo;
 
 	/* Create an instance for our instrument */
 	local_instrument = jamrtc_webrtc_pc_new(local_uuid, display_name, FALSE, instrument);
 	local_instrument->slot = 1;
-	/* Run this on the loop (maybe wait if we're also publishing mic/webcam) */
-	GSource *timeout_source;
-	//~ timeout_source = g_timeout_source_new_seconds((no_mic && no_webcam) ? 0 : 1);
-	timeout_source = g_timeout_source_new(0);
-	g_source_set_callback(timeout_source, jamrtc_webrtc_publish_instrument_internal, NULL, NULL);
-	g_source_attach(timeout_source, NULL);
-	g_source_unref(timeout_source);
+	local_instrument->midi = midi;
+	/* Run this on the loop */
+	jamrtc_loop_invoke(jamrtc_webrtc_publish_instrument_internal, NULL);
 }
 
 /* Subscribe to a remote stream */
@@ -593,9 +2013,11 @@ static gboolean jamrtc_webrtc_subscribe_internal(gpointer user_data) {
 int jamrtc_webrtc_subscribe(const char *uuid, gboolean instrument) {
 	if(uuid == NULL)
 		return -1;
+	/* We need the mutex anyway, since the streams of a participant may change */
 	jamrtc_mutex_lock(&participants_mutex);
 	/* Find the remote participant */
-	jamrtc_webrtc_participant *participant = g_hash_table_lookup(participants, uuid);
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	jamrtc_webrtc_participant *participant = reg ? g_hash_table_lookup(reg->participants, uuid) : NULL;
 	if(participant == NULL) {
 		jamrtc_mutex_unlock(&participants_mutex);
 		JAMRTC_LOG(LOG_ERR, "No such participant %s\n", uuid);
@@ -608,6 +2030,11 @@ int jamrtc_webrtc_subscribe(const char *uuid, gboolean instrument) {
 		JAMRTC_LOG(LOG_ERR, "No such stream from participant %s\n", uuid);
 		return -3;
 	}
+	if(pc->p2p) {
+		/* We're getting this directly from the participant, nothing to do */
+		jamrtc_mutex_unlock(&participants_mutex);
+		return 0;
+	}
 	if(pc->pipeline != NULL) {
 		jamrtc_mutex_unlock(&participants_mutex);
 		JAMRTC_LOG(LOG_ERR, "[%s][%s] PeerConnection already available\n",
@@ -617,14 +2044,77 @@ int jamrtc_webrtc_subscribe(const char *uuid, gboolean instrument) {
 	jamrtc_refcount_increase(&pc->ref);
 	jamrtc_mutex_unlock(&participants_mutex);
 
-	/* Run this on the loop (maybe wait if we're also publishing mic/webcam) */
-	GSource *timeout_source;
-	//~ timeout_source = g_timeout_source_new(pc->instrument ? 1000 : 500);
-	timeout_source = g_timeout_source_new(0);
-	g_source_set_callback(timeout_source, jamrtc_webrtc_subscribe_internal, pc, NULL);
-	g_source_attach(timeout_source, NULL);
-	g_source_unref(timeout_source);
+	/* Run this on the loop */
+	jamrtc_loop_invoke(jamrtc_webrtc_subscribe_internal, pc);
+
+	return 0;
+}
 
+/* Unsubscribe from a remote stream */
+typedef struct jamrtc_webrtc_unsubscription {
+	char *uuid;
+	gboolean instrument;
+} jamrtc_webrtc_unsubscription;
+static gboolean jamrtc_webrtc_unsubscribe_internal(gpointer user_data) {
+	jamrtc_webrtc_unsubscription *unsub = (jamrtc_webrtc_unsubscription *)user_data;
+	if(unsub == NULL)
+		return G_SOURCE_REMOVE;
+	jamrtc_mutex_lock(&participants_mutex);
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	jamrtc_webrtc_participant *participant = reg ? g_hash_table_lookup(reg->participants, unsub->uuid) : NULL;
+	jamrtc_webrtc_pc *oldpc = NULL;
+	if(participant != NULL)
+		oldpc = (unsub->instrument ? participant->instrument : participant->micwebcam);
+	if(oldpc == NULL || oldpc->p2p || oldpc->pipeline == NULL) {
+		/* Nothing to tear down (e.g., the participant left already) */
+		jamrtc_mutex_unlock(&participants_mutex);
+		g_free(unsub->uuid);
+		g_free(unsub);
+		return G_SOURCE_REMOVE;
+	}
+	JAMRTC_LOG(LOG_INFO, "[%s][%s] Unsubscribing\n",
+		oldpc->display, oldpc->instrument ? oldpc->instrument : "chat");
+	/* The stream may be published again: replace the PeerConnection with
+	 * a fresh one we can subscribe with, and get rid of the old one */
+	jamrtc_webrtc_pc *pc = jamrtc_webrtc_pc_new(oldpc->uuid, oldpc->display, TRUE, oldpc->instrument);
+	pc->user_id = oldpc->user_id;
+	pc->slot = oldpc->slot;
+	pc->audio = oldpc->audio;
+	pc->video = oldpc->video;
+	pc->midi = oldpc->midi;
+	memcpy(pc->layers, oldpc->layers, sizeof(pc->layers));
+	pc->num_layers = oldpc->num_layers;
+	jamrtc_webrtc_pc_set_streams(pc, (const char **)oldpc->mids, (const char **)oldpc->labels, oldpc->num_mids);
+	if(unsub->instrument)
+		participant->instrument = pc;
+	else
+		participant->micwebcam = pc;
+	if(oldpc->handle_id != 0) {
+		gint64 start = 0;
+		jamrtc_webrtc_registry *update = jamrtc_webrtc_registry_begin(&start);
+		g_hash_table_remove(update->peerconnections, &oldpc->handle_id);
+		jamrtc_webrtc_registry_commit(update, start);
+	}
+	jamrtc_mutex_unlock(&participants_mutex);
+	/* Update the UI */
+	jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_STREAM,
+		oldpc, FALSE, NULL);
+	jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+	/* Detach the handle and release the pipeline */
+	jamrtc_webrtc_pc_destroy(oldpc);
+	g_free(unsub->uuid);
+	g_free(unsub);
+	return G_SOURCE_REMOVE;
+}
+int jamrtc_webrtc_unsubscribe(const char *uuid, gboolean instrument) {
+	if(uuid == NULL)
+		return -1;
+	/* This may be called while we're handling the event that stopped the
+	 * stream, so we do everything on the loop, later */
+	jamrtc_webrtc_unsubscription *unsub = g_malloc(sizeof(jamrtc_webrtc_unsubscription));
+	unsub->uuid = g_strdup(uuid);
+	unsub->instrument = instrument;
+	jamrtc_loop_invoke(jamrtc_webrtc_unsubscribe_internal, unsub);
 	return 0;
 }
 
@@ -645,23 +2135,54 @@ static gboolean jamrtc_cleanup(const char *msg, enum jamrtc_state state) {
 	return G_SOURCE_REMOVE;
 }
 
-/* Helper method to generate a random transaction string */
-static char *jamrtc_random_transaction(char *transaction, size_t trlen) {
-	g_snprintf(transaction, trlen, "%"SCNu32, g_random_int());
-	return transaction;
+/* Helper method to send a request to the VideoRoom plugin on a handle (takes ownership of req) */
+static void jamrtc_send_request(jamrtc_webrtc_pc *pc, JsonObject *req) {
+	if(pc == NULL || req == NULL || pc->handle_id == 0) {
+		if(req != NULL)
+			json_object_unref(req);
+		return;
+	}
+	/* Send the request to the plugin via WebSockets */
+	JAMRTC_LOG(LOG_VERB, "[%s][%s] Sending request to the VideoRoom plugin\n",
+		pc->display, pc->instrument ? pc->instrument : "chat");
+	jamrtc_janus_message(janus, pc->handle_id, req, NULL, NULL);
 }
 
-/* Helper method to serialize a JsonObject to a string */
-static char *jamrtc_json_to_string(JsonObject *object) {
-	/* Make it the root node */
-	JsonNode *root = json_node_init_object(json_node_alloc(), object);
-	JsonGenerator *generator = json_generator_new();
-	json_generator_set_root(generator, root);
-	char *text = json_generator_to_data(generator, NULL);
-
-	/* Release everything */
-	g_object_unref(generator);
-	json_node_free(root);
+/* Helper method to build the stringified JSON object we use as our display */
+static char *jamrtc_local_display(void) {
+	JsonObject *info = json_object_new();
+	json_object_set_string_member(info, "uuid", local_uuid);
+	json_object_set_string_member(info, "display", display_name);
+	if(!no_webcam && simulcast_num > 1) {
+		/* Let subscribers know about our simulcast layers, so they can pick */
+		JsonArray *layers = json_array_new();
+		guint i = 0;
+		for(i=0; i<simulcast_num; i++)
+			json_array_add_int_element(layers, simulcast_layers[i].width);
+		json_object_set_array_member(info, "layers", layers);
+	}
+	if(advertised_rtt >= 0)
+		json_object_set_int_member(info, "rtt", advertised_rtt);
+	if(p2p) {
+		/* We use the display to exchange SDPs with our peer too */
+		JsonObject *info_p2p = json_object_new();
+		if(local_instrument != NULL) {
+			json_object_set_string_member(info_p2p, "instrument", local_instrument->instrument);
+			if(local_instrument->midi)
+				json_object_set_boolean_member(info_p2p, "midi", TRUE);
+		}
+		jamrtc_mutex_lock(&p2p_mutex);
+		if(p2p_peer != NULL)
+			json_object_set_string_member(info_p2p, "peer", p2p_peer);
+		if(p2p_offer != NULL)
+			json_object_set_string_member(info_p2p, "offer", p2p_offer);
+		if(p2p_answer != NULL)
+			json_object_set_string_member(info_p2p, "answer", p2p_answer);
+		jamrtc_mutex_unlock(&p2p_mutex);
+		json_object_set_object_member(info, "p2p", info_p2p);
+	}
+	char *text = jamrtc_janus_json_to_string(info);
+	json_object_unref(info);
 	return text;
 }
 
@@ -670,35 +2191,34 @@ static gboolean jamrtc_attach_handle(jamrtc_webrtc_pc *pc) {
 	if(pc == NULL)
 		return FALSE;
 	/* Make sure we have a valid Janus session to use as well */
-	if(session_id == 0)
+	if(jamrtc_janus_session_id(janus) == 0)
 		return FALSE;
 
 	JAMRTC_LOG(LOG_INFO, "[%s][%s] Attaching to the VideoRoom plugin\n",
 		pc->display, pc->instrument ? pc->instrument : "chat");
 	pc->state = JAMRTC_JANUS_ATTACHING_PLUGIN;
 
-	/* Prepare the Janus API request */
-	JsonObject *attach = json_object_new();
-	json_object_set_string_member(attach, "janus", "attach");
-	json_object_set_int_member(attach, "session_id", session_id);
-	json_object_set_string_member(attach, "plugin", "janus.plugin.videoroom");
-	char transaction[12];
-	json_object_set_string_member(attach, "transaction", jamrtc_random_transaction(transaction, sizeof(transaction)));
-	char *text = jamrtc_json_to_string(attach);
-	json_object_unref(attach);
-
-	/* Track the task */
-	jamrtc_mutex_lock(&transactions_mutex);
-	g_hash_table_insert(transactions, g_strdup(transaction), pc);
-	jamrtc_mutex_unlock(&transactions_mutex);
-
-	/* Send the request: we'll get a response asynchronously */
-	JAMRTC_LOG(LOG_VERB, "[%s][%s] Sending message: %s\n",
-		pc->display, pc->instrument ? pc->instrument : "chat", text);
-	jamrtc_send_message(text);
+	/* Send the request and track the task: we'll get a response asynchronously */
+	jamrtc_refcount_increase(&pc->ref);
+	jamrtc_janus_attach(janus, "janus.plugin.videoroom", pc);
 	return TRUE;
 }
 
+/* Helper method to detach a handle we don't need anymore, and forget about its transactions */
+static void jamrtc_detach_handle(jamrtc_webrtc_pc *pc) {
+	if(pc == NULL)
+		return;
+	/* Responses to requests we sent on this handle would reference a
+	 * PeerConnection that's going away, so we stop tracking them */
+	jamrtc_janus_forget(janus, pc);
+	/* When we're shutting down, destroying the session takes care of the handles */
+	if(pc->handle_id == 0 || jamrtc_janus_session_id(janus) == 0 || g_atomic_int_get(&stopping))
+		return;
+	JAMRTC_LOG(LOG_INFO, "[%s][%s] Detaching from the VideoRoom plugin\n",
+		pc->display, pc->instrument ? pc->instrument : "chat");
+	jamrtc_janus_detach(janus, pc->handle_id);
+}
+
 /* Callback to be notified about state changes in the pipeline */
 static void jamrtc_pipeline_state_changed(GstBus *bus, GstMessage *msg, gpointer user_data) {
 	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
@@ -710,6 +2230,34 @@ static void jamrtc_pipeline_state_changed(GstBus *bus, GstMessage *msg, gpointer
 	/* TODO Should we use this to refresh the UI? */
 }
 
+/* Helper method to add a preview branch of a pipeline to the compositor layout */
+static void jamrtc_add_tile(jamrtc_webrtc_pc *pc, jamrtc_tile_kind kind, const char *sinkname) {
+	char valve_name[100];
+	g_snprintf(valve_name, sizeof(valve_name), "%s-valve", sinkname);
+	GstElement *valve = gst_bin_get_by_name(GST_BIN(pc->pipeline), valve_name);
+	jamrtc_renderer_add_tile(pc->slot, kind, valve);
+	if(valve != NULL)
+		gst_object_unref(valve);
+}
+
+/* Helper method to prepare the gst_parse_launch description of the preview
+ * branch of something we publish: there's none if we're running headless */
+static void jamrtc_preview_description(char *buffer, size_t buflen, const char *name, jamrtc_tile_kind kind) {
+	*buffer = '\0';
+	if(builder == NULL)
+		return;
+	char valve[100], sink[256];
+	jamrtc_renderer_valve_description(valve, sizeof(valve), name);
+	jamrtc_renderer_sink_description(sink, sizeof(sink), name, 1, kind);
+	if(kind == JAMRTC_TILE_VIDEO) {
+		/* The additional valve is the one we close under CPU pressure */
+		g_snprintf(buffer, buflen, "queue ! valve name=%s-cpu ! %s%s ", name, valve, sink);
+	} else {
+		g_snprintf(buffer, buflen, "queue ! %saudioconvert ! wavescope style=%d ! videoconvert ! %s ",
+			valve, kind == JAMRTC_TILE_MIC ? 1 : 3, sink);
+	}
+}
+
 /* Helper method to setup the webrtcbin pipeline, and trigger the negotiation process */
 static volatile gint pc_index = 0;
 static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscription, gboolean do_audio, gboolean do_video) {
@@ -719,11 +2267,29 @@ static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscript
 	char pc_name[10];
 	g_snprintf(pc_name, sizeof(pc_name), "pc%d", g_atomic_int_get(&pc_index));
 	/* Prepare the pipeline, using the info we got from the command line */
-	char stun[255], turn[255], audio[1024], video[1024], gst_pipeline[2048];
+	char stun[255], turn[255], audio[1024], video[2048], instruments[4096], gst_pipeline[8192];
+	char preview[512];
 	stun[0] = '\0';
 	turn[0] = '\0';
 	audio[0] = '\0';
 	video[0] = '\0';
+	instruments[0] = '\0';
+	/* Unless disabled, we use DTX when encoding audio, and tell subscribers
+	 * the audio level of what we send (RFC 6464), so that they can detect
+	 * silence without decoding anything (the level is computed before the
+	 * encoder, and the payloader adds the extension negotiated in the caps) */
+	char opus[128], opus_caps[128];
+	g_snprintf(opus, sizeof(opus), "%sopusenc bitrate=20000%s",
+		dtx ? "level audio-level-meta=true post-messages=false ! " : "", dtx ? " dtx=true" : "");
+	g_snprintf(opus_caps, sizeof(opus_caps), "%s%s%s",
+		dtx ? ",extmap-"G_STRINGIFY(JAMRTC_AUDIO_LEVEL_EXTID)"=(string)\"" : "",
+		dtx ? JAMRTC_AUDIO_LEVEL_URN : "", dtx ? "\"" : "");
+	/* With more than one m-line, we always bundle them all */
+	guint mlines = (do_audio ? 1 : 0) + (do_video ? 1 : 0);
+	if(!subscription && pc == local_micwebcam)
+		mlines += bundle_num;
+	else if(subscription && pc->num_mids > 0)
+		mlines = pc->num_mids;
 	if(stun_server != NULL)
 		g_snprintf(stun, sizeof(stun), "stun-server=stun://%s", stun_server);
 	if(turn_server != NULL)
@@ -735,62 +2301,124 @@ static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscript
 			/* We're trying to capture mic and/or webcam */
 			if(do_audio) {
 				guint32 audio_ssrc = g_random_int();
+				bundle_mic_ssrc = audio_ssrc;
+				jamrtc_preview_description(preview, sizeof(preview), "ampreview", JAMRTC_TILE_MIC);
 				if(!no_jack) {
 					/* Use jackaudiosrc and name it */
 					g_snprintf(audio, sizeof(audio), "jackaudiosrc %s connect=0 client-name=\"JamRTC mic\" ! audio/x-raw,channels=1 ! "
-						"audioconvert ! audioresample ! audio/x-raw,channels=1,rate=48000 ! tee name=at ! "
-							"queue ! audioconvert ! wavescope style=1 ! videoconvert ! xvimagesink name=\"ampreview\" "
-						"at. ! queue ! opusenc bitrate=20000 ! "
-						"rtpopuspay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111 ! %s.",
-							src_opts, audio_ssrc, pc_name);
+						"audioconvert ! audioresample ! audio/x-raw,channels=1,rate=48000 ! tee name=at ! %s%s"
+						"queue ! %s ! "
+						"rtpopuspay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111%s ! %s.",
+							src_opts, preview, *preview ? "at. ! " : "", opus, audio_ssrc, opus_caps, pc_name);
 				} else {
 					/* Use autoaudiosrc */
 					g_snprintf(audio, sizeof(audio), "autoaudiosrc %s ! audio/x-raw,channels=1 ! "
-						"audioconvert ! audioresample ! audio/x-raw,channels=1,rate=48000 ! tee name=at ! "
-							"queue ! audioconvert ! wavescope style=1 ! videoconvert ! xvimagesink name=\"ampreview\" "
-						"at. ! queue ! opusenc bitrate=20000 ! "
-						"rtpopuspay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111 ! %s.",
-							src_opts, audio_ssrc, pc_name);
+						"audioconvert ! audioresample ! audio/x-raw,channels=1,rate=48000 ! tee name=at ! %s%s"
+						"queue ! %s ! "
+						"rtpopuspay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111%s ! %s.",
+							src_opts, preview, *preview ? "at. ! " : "", opus, audio_ssrc, opus_caps, pc_name);
 				}
 			}
 			if(do_video) {
-				guint32 video_ssrc = g_random_int();
-				g_snprintf(video, sizeof(video), "v4l2src device=%s ! videoconvert ! videoscale ! "
-					"video/x-raw,width=320,height=180 ! tee name=vt ! queue ! xvimagesink name=\"vpreview\" "
-					"vt. ! queue ! vp8enc deadline=1 cpu-used=10 target-bitrate=128000 ! "
-					"rtpvp8pay pt=96 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=video,encoding-name=VP8,payload=96 ! %s.",
-						video_device, video_ssrc, pc_name);
+				jamrtc_preview_description(preview, sizeof(preview), "vpreview", JAMRTC_TILE_VIDEO);
+				/* We ask the webcam for what's closest to what we need, to avoid converting
+				 * and scaling frames ourselves whenever possible (negotiated at startup,
+				 * see jamrtc_capture_prepare) */
+				char capture[1024];
+				/* We also need something to capture fewer frames, or encode a smaller
+				 * video, when the CPU is busy (see jamrtc_webrtc_limit_webcam) */
+				const char *vrate = "videorate name=vrate drop-only=true max-rate="G_STRINGIFY(JAMRTC_DEGRADE_FULL_FPS);
+				if(simulcast_num < 2) {
+					guint32 video_ssrc = g_random_int();
+					jamrtc_capture_describe(video_device, 320, 180, capture, sizeof(capture));
+					g_snprintf(video, sizeof(video), "%s ! %s ! videoscale ! "
+						"capsfilter name=vsize caps=video/x-raw,width=320,height=180 ! tee name=vt ! %s%s"
+						"queue ! valve name=vsend ! vp8enc name=venc deadline=1 cpu-used=10 target-bitrate=%d ! "
+						"rtpvp8pay pt=96 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=video,encoding-name=VP8,payload=96 ! %s.",
+							capture, vrate, preview, *preview ? "vt. ! " : "", JAMRTC_WEBCAM_BITRATE, video_ssrc, pc_name);
+				} else {
+					/* Simulcast: we capture at the resolution of the highest layer, and
+					 * then encode each layer separately, funneling them to webrtcbin as
+					 * different SSRCs of the same m-line (we'll fix the SDP later) */
+					jamrtc_simulcast_layer *top = &simulcast_layers[simulcast_num-1];
+					jamrtc_capture_describe(video_device, top->width, top->height, capture, sizeof(capture));
+					g_snprintf(video, sizeof(video), "%s ! %s ! tee name=vt %s%s "
+						"rtpfunnel name=vf ! application/x-rtp,media=video,encoding-name=VP8,payload=96 ! %s. ",
+							capture, vrate, *preview ? "! " : "", preview, pc_name);
+					guint i = 0;
+					for(i=0; i<simulcast_num; i++) {
+						char layer[256];
+						jamrtc_simulcast_layer *sl = &simulcast_layers[i];
+						sl->ssrc = g_random_int();
+						g_snprintf(layer, sizeof(layer), "vt. ! queue ! valve name=vlayer%u ! videoscale ! video/x-raw,width=%u,height=%u ! "
+							"vp8enc deadline=1 cpu-used=10 target-bitrate=%u ! "
+							"rtpvp8pay pt=96 picture-id-mode=2 ssrc=%"SCNu32" ! queue ! vf. ",
+								i, sl->width, sl->height, sl->bitrate*1000, sl->ssrc);
+						g_strlcat(video, layer, sizeof(video));
+					}
+				}
+			}
+			/* In bundle mode, each instrument is an additional m-line: only the
+			 * first one is previewed, and they're all recorded, if needed */
+			guint i = 0;
+			for(i=0; i<bundle_num; i++) {
+				char branch[1024], tee[20], rec[40];
+				jamrtc_bundle_instrument *bi = &bundle_instruments[i];
+				bi->ssrc = g_random_int();
+				g_snprintf(tee, sizeof(tee), "at%u", i);
+				rec[0] = '\0';
+				if(jamrtc_recorder_is_enabled())
+					g_snprintf(rec, sizeof(rec), "tee name=airec%u ! ", i);
+				if(i == 0)
+					jamrtc_preview_description(preview, sizeof(preview), "aipreview", JAMRTC_TILE_INSTRUMENT);
+				else
+					preview[0] = '\0';
+				char source[512];
+				if(!no_jack)
+					g_snprintf(source, sizeof(source), "jackaudiosrc %s connect=0 client-name=\"JamRTC %s\"", src_opts, bi->name);
+				else
+					g_snprintf(source, sizeof(source), "autoaudiosrc %s", src_opts);
+				g_snprintf(branch, sizeof(branch), "%s ! audio/x-raw,channels=%d ! "
+					"audioconvert ! audioresample ! audio/x-raw,channels=%d,rate=48000 ! tee name=%s ! %s%s%s"
+					"queue ! %s ! %s"
+					"rtpopuspay name=aipay%u pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111%s ! %s. ",
+						source, stereo ? 2 : 1, stereo ? 2 : 1, tee,
+						preview, *preview ? tee : "", *preview ? ". ! " : "", opus, rec, i, bi->ssrc, opus_caps, pc_name);
+				g_strlcat(instruments, branch, sizeof(instruments));
 			}
 		} else if(!subscription && pc == local_instrument) {
 			/* We're trying to capture an instrument */
 			if(do_audio) {
 				guint32 audio_ssrc = g_random_int();
+				/* If we're recording, we tee the encoded frames to the recorder too */
+				const char *rec = jamrtc_recorder_is_enabled() ? "tee name=airec ! " : "";
+				jamrtc_preview_description(preview, sizeof(preview), "aipreview", JAMRTC_TILE_INSTRUMENT);
 				if(!no_jack) {
 					/* Use jackaudiosrc and name it */
 					g_snprintf(audio, sizeof(audio), "jackaudiosrc %s connect=0 client-name=\"JamRTC %s\" ! audio/x-raw,channels=%d ! "
-						"audioconvert ! audioresample ! audio/x-raw,channels=%d,rate=48000 ! tee name=at ! "
-							"queue ! audioconvert ! wavescope style=3 ! videoconvert ! xvimagesink name=\"aipreview\" "
-						"at. ! queue ! opusenc bitrate=20000 ! "
-						"rtpopuspay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111 ! %s.",
-							src_opts, pc->instrument, stereo ? 2 : 1, stereo ? 2 : 1, audio_ssrc, pc_name);
+						"audioconvert ! audioresample ! audio/x-raw,channels=%d,rate=48000 ! tee name=at ! %s%s"
+						"queue ! %s ! %s"
+						"rtpopuspay name=aipay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111%s ! %s.",
+							src_opts, pc->instrument, stereo ? 2 : 1, stereo ? 2 : 1,
+							preview, *preview ? "at. ! " : "", opus, rec, audio_ssrc, opus_caps, pc_name);
 				} else {
 					/* Use autoaudiosrc */
 					g_snprintf(audio, sizeof(audio), "autoaudiosrc %s ! audio/x-raw,channels=%d ! "
-						"audioconvert ! audioresample ! audio/x-raw,channels=%d,rate=48000 ! tee name=at ! "
-							"queue ! audioconvert ! wavescope style=3 ! videoconvert ! xvimagesink name=\"aipreview\" "
-						"at. ! queue ! opusenc bitrate=20000 ! "
-						"rtpopuspay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111 ! %s.",
-							src_opts, stereo ? 2 : 1, stereo ? 2 : 1, audio_ssrc, pc_name);
+						"audioconvert ! audioresample ! audio/x-raw,channels=%d,rate=48000 ! tee name=at ! %s%s"
+						"queue ! %s ! %s"
+						"rtpopuspay name=aipay pt=111 ssrc=%"SCNu32" ! queue ! application/x-rtp,media=audio,encoding-name=OPUS,payload=111%s ! %s.",
+							src_opts, stereo ? 2 : 1, stereo ? 2 : 1,
+							preview, *preview ? "at. ! " : "", opus, rec, audio_ssrc, opus_caps, pc_name);
 				}
 			}
 		}
 		/* Let's build the pipeline out of the elements we crafted above */
-		g_snprintf(gst_pipeline, sizeof(gst_pipeline), "webrtcbin name=%s bundle-policy=%d %s %s %s %s",
-			pc_name, (do_audio && do_video ? 3 : 0), stun, turn, video, audio);
+		g_snprintf(gst_pipeline, sizeof(gst_pipeline), "webrtcbin name=%s bundle-policy=%d %s %s %s %s %s",
+			pc_name, (mlines > 1 ? 3 : 0), stun, turn, video, audio, instruments);
 		JAMRTC_LOG(LOG_INFO, "[%s][%s] Initializing the GStreamer pipeline:\n  -- %s\n",
 			pc->display, pc->instrument ? pc->instrument : "chat", gst_pipeline);
 		GError *error = NULL;
-		pc->pipeline = gst_parse_launch(gst_pipeline, &error);
+		pc->pipeline = gst_parse_launch_full(gst_pipeline, NULL, GST_PARSE_FLAG_PLACE_IN_BIN, &error);
 		if(error) {
 			JAMRTC_LOG(LOG_ERR, "[%s][%s] Failed to parse/launch the pipeline: %s\n",
 				pc->display, pc->instrument ? pc->instrument : "chat", error->message);
@@ -801,26 +2429,75 @@ static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscript
 		pc->peerconnection = gst_bin_get_by_name(GST_BIN(pc->pipeline), pc_name);
 		/* Let's configure the function to be invoked when an SDP offer can be prepared */
 		g_signal_connect(pc->peerconnection, "on-negotiation-needed", G_CALLBACK(jamrtc_negotiation_needed), pc);
+		/* If we're recording, add our own instrument as a track too */
+		GstElement *rec_tee = gst_bin_get_by_name(GST_BIN(pc->pipeline), "airec");
+		if(rec_tee != NULL) {
+			GstElement *pay = gst_bin_get_by_name(GST_BIN(pc->pipeline), "aipay");
+			GstPad *rtp_pad = gst_element_get_static_pad(pay, "src");
+			g_atomic_pointer_set(&pc->recording,
+				jamrtc_recorder_add(pc->pipeline, rec_tee, pc->display, pc->instrument, rtp_pad, TRUE));
+			gst_object_unref(rtp_pad);
+			gst_object_unref(pay);
+			gst_object_unref(rec_tee);
+		}
+		/* In bundle mode, record all the instruments we're sending as separate tracks */
+		guint i = 0;
+		for(i=0; pc == local_micwebcam && i<bundle_num; i++) {
+			char name[20];
+			g_snprintf(name, sizeof(name), "airec%u", i);
+			rec_tee = gst_bin_get_by_name(GST_BIN(pc->pipeline), name);
+			if(rec_tee == NULL)
+				break;
+			g_snprintf(name, sizeof(name), "aipay%u", i);
+			GstElement *pay = gst_bin_get_by_name(GST_BIN(pc->pipeline), name);
+			GstPad *rtp_pad = gst_element_get_static_pad(pay, "src");
+			jamrtc_recorder_track *track = jamrtc_recorder_add(pc->pipeline, rec_tee,
+				pc->display, bundle_instruments[i].name, rtp_pad, TRUE);
+			g_atomic_pointer_set(i == 0 ? &pc->recording : &pc->recordings[i], track);
+			gst_object_unref(rtp_pad);
+			gst_object_unref(pay);
+			gst_object_unref(rec_tee);
+		}
 	} else {
 		/* Since this is a subscription, we just create the webrtcbin element for the moment */
 		char pipe_name[100];
 		g_snprintf(pipe_name, sizeof(pipe_name), "pipe-%s", pc_name);
 		pc->pipeline = gst_pipeline_new(pipe_name);
 		pc->peerconnection = gst_element_factory_make("webrtcbin", pc_name);
-		g_object_set(pc->peerconnection, "bundle-policy", (do_audio && do_video ? 3 : 0), NULL);
+		g_object_set(pc->peerconnection, "bundle-policy", (mlines > 1 ? 3 : 0), NULL);
 		if(stun_server != NULL)
 			g_object_set(pc->peerconnection, "stun-server", stun_server, NULL);
 		if(turn_server != NULL)
 			g_object_set(pc->peerconnection, "turn-server", turn_server, NULL);
 		gst_bin_add_many(GST_BIN(pc->pipeline), pc->peerconnection, NULL);
+		/* Keep a reference of our own, as we do for publishers */
+		gst_object_ref(pc->peerconnection);
 		gst_element_sync_state_with_parent(pc->pipeline);
 		/* We'll handle incoming streams, and how to render them, dynamically */
 		g_signal_connect(pc->peerconnection, "pad-added", G_CALLBACK(jamrtc_incoming_stream), pc);
+		/* If we're recording, we need the Sender Reports to line up the tracks */
+		if(jamrtc_recorder_is_enabled()) {
+			GstElement *rtpbin = gst_bin_get_by_name(GST_BIN(pc->peerconnection), "rtpbin");
+			if(rtpbin != NULL) {
+				g_signal_connect(rtpbin, "on-ssrc-active", G_CALLBACK(jamrtc_recorder_ssrc_active), pc);
+				gst_object_unref(rtpbin);
+			}
+		}
+		if(pc->midi)
+			g_signal_connect(pc->peerconnection, "on-data-channel", G_CALLBACK(jamrtc_incoming_data_channel), pc);
 	}
 	pc->audio = do_audio;
 	pc->video = do_video;
+	/* Keep track of the pipeline and webrtcbin, to spot any we leak */
+	jamrtc_memory_watch(G_OBJECT(pc->pipeline), JAMRTC_MEMORY_PIPELINE);
+	jamrtc_memory_watch(G_OBJECT(pc->peerconnection), JAMRTC_MEMORY_WEBRTCBIN);
 	/* We need a different callback to be notified about candidates to trickle to Janus */
 	g_signal_connect(pc->peerconnection, "on-ice-candidate", G_CALLBACK(jamrtc_trickle_candidate), pc);
+	if(pc->p2p) {
+		/* There's no trickling with our peer, we wait for all candidates instead */
+		g_signal_connect(pc->peerconnection, "notify::ice-gathering-state", G_CALLBACK(jamrtc_p2p_gathering_state), pc);
+		g_signal_connect(pc->peerconnection, "notify::ice-connection-state", G_CALLBACK(jamrtc_p2p_connection_state), pc);
+	}
 
 	/* For instruments, replace the jitter buffer size in rtpbin (it's 200ms by default, we definitely want less) */
 	if(pc->instrument != NULL) {
@@ -839,15 +2516,34 @@ static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscript
 	if(!subscription) {
 		if(do_audio) {
 			const char *sinkname = (pc == local_micwebcam ? "ampreview" : "aipreview");
-			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
-				pc, FALSE, sinkname);
-			g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+			if(jamrtc_renderer_is_enabled()) {
+				jamrtc_add_tile(pc, pc == local_micwebcam ? JAMRTC_TILE_MIC : JAMRTC_TILE_INSTRUMENT, sinkname);
+			} else {
+				jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
+					pc, FALSE, sinkname);
+				jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+			}
 		}
 		if(do_video) {
 			const char *sinkname = "vpreview";
-			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
-				pc, TRUE, sinkname);
-			g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+			if(jamrtc_renderer_is_enabled()) {
+				jamrtc_add_tile(pc, JAMRTC_TILE_VIDEO, sinkname);
+			} else {
+				jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
+					pc, TRUE, sinkname);
+				jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+			}
+		}
+		if(pc == local_micwebcam && bundle_num > 0) {
+			/* Bundled instruments are previewed in the instrument tile */
+			const char *sinkname = "aipreview";
+			if(jamrtc_renderer_is_enabled()) {
+				jamrtc_add_tile(pc, JAMRTC_TILE_INSTRUMENT, sinkname);
+			} else {
+				jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
+					pc, FALSE, sinkname);
+				jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+			}
 		}
 		/* Save updated pipeline to a dot file, in case we're debugging */
 		char dot_name[100];
@@ -860,11 +2556,29 @@ static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscript
 	//~ gst_bus_add_signal_watch(bus);
 	//~ g_signal_connect(G_OBJECT(bus), "message::state-changed", (GCallback)jamrtc_pipeline_state_changed, pc);
 	//~ gst_object_unref(bus);
+	/* Count the frames that are late or dropped, if we're watching the CPU */
+	if(jamrtc_degrade_is_enabled()) {
+		GstBus *bus = gst_element_get_bus(pc->pipeline);
+		gst_bus_set_sync_handler(bus, jamrtc_degrade_bus_handler, NULL, NULL);
+		gst_object_unref(bus);
+	}
 	/* Start the pipeline */
 	gst_element_set_state(pc->pipeline, GST_STATE_READY);
-	gst_object_unref(pc->peerconnection);
+	if(pc == local_instrument && pc->midi) {
+		/* MIDI instruments are sent on a data channel, which will trigger the negotiation */
+		GstWebRTCDataChannel *channel = NULL;
+		g_signal_emit_by_name(pc->peerconnection, "create-data-channel", JAMRTC_MIDI_CHANNEL, NULL, &channel);
+		if(channel == NULL) {
+			JAMRTC_LOG(LOG_ERR, "[%s][%s] Couldn't create the MIDI data channel\n",
+				pc->display, pc->instrument);
+		} else {
+			jamrtc_midi_set_channel(channel);
+			gst_object_unref(channel);
+		}
+	}
 	JAMRTC_LOG(LOG_INFO, "[%s][%s] Starting GStreamer pipeline\n",
 		pc->display, pc->instrument ? pc->instrument : "chat");
+	jamrtc_jackmon_activity(pc->display, pc->instrument ? pc->instrument : "chat", "pipeline starting");
 	GstStateChangeReturn ret = gst_element_set_state(GST_ELEMENT(pc->pipeline), GST_STATE_PLAYING);
 	if(ret == GST_STATE_CHANGE_FAILURE) {
 		JAMRTC_LOG(LOG_ERR, "[%s][%s] Failed to start the pipeline%s\n",
@@ -872,16 +2586,19 @@ static gboolean jamrtc_prepare_pipeline(jamrtc_webrtc_pc *pc, gboolean subscript
 			no_jack ? "" : " (is JACK running?)");
 		goto err;
 	}
+	/* Trace the latency of all stages, if needed (webrtcbin internals are
+	 * only all there once the PeerConnection is up, we'll scan again then) */
+	jamrtc_webrtc_trace(pc);
 
 	/* Done */
 	return TRUE;
 
 err:
 	/* If we got here, something went wrong */
+	if(pc->peerconnection)
+		g_clear_object(&pc->peerconnection);
 	if(pc->pipeline)
 		g_clear_object(&pc->pipeline);
-	if(pc->peerconnection)
-		pc->peerconnection = NULL;
 	return FALSE;
 }
 
@@ -898,6 +2615,120 @@ static void jamrtc_negotiation_needed(GstElement *element, gpointer user_data) {
 	g_signal_emit_by_name(pc->peerconnection, "create-offer", NULL, promise);
 }
 
+/* Helper method to advertise our simulcast SSRCs in the video m-line of an SDP */
+static char *jamrtc_sdp_add_simulcast(char *sdp) {
+	/* Prepare the lines Janus will look for to detect simulcast */
+	GString *ssrcs = g_string_new("a=ssrc-group:SIM");
+	guint i = 0;
+	for(i=0; i<simulcast_num; i++)
+		g_string_append_printf(ssrcs, " %"SCNu32, simulcast_layers[i].ssrc);
+	g_string_append(ssrcs, "\r\n");
+	for(i=0; i<simulcast_num; i++)
+		g_string_append_printf(ssrcs, "a=ssrc:%"SCNu32" cname:jamrtc\r\n", simulcast_layers[i].ssrc);
+	/* Replace whatever ssrc attribute webrtcbin put in the video m-line with ours */
+	gchar **lines = g_strsplit(sdp, "\r\n", -1);
+	GString *fixed = g_string_new(NULL);
+	gboolean video = FALSE, done = FALSE;
+	for(i=0; lines[i] != NULL; i++) {
+		char *line = lines[i];
+		if(*line == '\0')
+			continue;
+		if(g_str_has_prefix(line, "m=")) {
+			if(video && !done) {
+				g_string_append(fixed, ssrcs->str);
+				done = TRUE;
+			}
+			video = g_str_has_prefix(line, "m=video");
+		} else if(video && (g_str_has_prefix(line, "a=ssrc:") || g_str_has_prefix(line, "a=ssrc-group:"))) {
+			continue;
+		}
+		g_string_append_printf(fixed, "%s\r\n", line);
+	}
+	if(video && !done)
+		g_string_append(fixed, ssrcs->str);
+	g_strfreev(lines);
+	g_string_free(ssrcs, TRUE);
+	g_free(sdp);
+	return g_string_free(fixed, FALSE);
+}
+
+/* Helper method to label the m-lines of our bundled PeerConnection, so that
+ * subscribers can tell our mic, webcam and instruments apart: we match the
+ * SSRCs we configured in the payloaders, and if webrtcbin didn't advertise
+ * them we rely on the order, since m-lines follow the order of the sink pads */
+static JsonArray *jamrtc_sdp_descriptions(const char *sdp) {
+	JsonArray *descriptions = json_array_new();
+	gchar **lines = g_strsplit(sdp, "\r\n", -1);
+	const char *mid = NULL;
+	gboolean video = FALSE, audio = FALSE;
+	guint32 ssrc = 0;
+	guint audio_index = 0, i = 0;
+	for(i=0; ; i++) {
+		char *line = lines[i];
+		if(line == NULL || g_str_has_prefix(line, "m=")) {
+			/* We're done with the previous m-line, if any */
+			if(mid != NULL && (audio || video)) {
+				char description[128];
+				description[0] = '\0';
+				if(video) {
+					g_strlcpy(description, "webcam", sizeof(description));
+				} else {
+					guint position = audio_index - 1, j = 0;
+					if(ssrc != 0 && ssrc == bundle_mic_ssrc)
+						g_strlcpy(description, "mic", sizeof(description));
+					for(j=0; *description == '\0' && ssrc != 0 && j<bundle_num; j++) {
+						if(ssrc == bundle_instruments[j].ssrc)
+							g_snprintf(description, sizeof(description), JAMRTC_INSTRUMENT_PREFIX"%s", bundle_instruments[j].name);
+					}
+					if(*description == '\0') {
+						/* No SSRC we know, the mic (if any) comes first */
+						if(!no_mic && position == 0)
+							g_strlcpy(description, "mic", sizeof(description));
+						else if(position - (no_mic ? 0 : 1) < bundle_num)
+							g_snprintf(description, sizeof(description), JAMRTC_INSTRUMENT_PREFIX"%s",
+								bundle_instruments[position - (no_mic ? 0 : 1)].name);
+					}
+				}
+				if(*description != '\0') {
+					JsonObject *d = json_object_new();
+					json_object_set_string_member(d, "mid", mid);
+					json_object_set_string_member(d, "description", description);
+					json_array_add_object_element(descriptions, d);
+				}
+			}
+			if(line == NULL)
+				break;
+			mid = NULL;
+			ssrc = 0;
+			video = g_str_has_prefix(line, "m=video");
+			audio = g_str_has_prefix(line, "m=audio");
+			if(audio)
+				audio_index++;
+		} else if(g_str_has_prefix(line, "a=mid:")) {
+			mid = line + strlen("a=mid:");
+		} else if(ssrc == 0 && g_str_has_prefix(line, "a=ssrc:")) {
+			ssrc = (guint32)g_ascii_strtoull(line + strlen("a=ssrc:"), NULL, 10);
+		}
+	}
+	g_strfreev(lines);
+	return descriptions;
+}
+
+/* Helper method to convert an SDP to a string, fixing the m-line ports:
+ * with max-bundle GStreamer will set 0 there, which Janus won't like */
+static char *jamrtc_sdp_to_string(const GstSDPMessage *sdp) {
+	char *text = gst_sdp_message_as_text(sdp);
+	const char *old_string = "m=audio 0";
+	const char *new_string = "m=audio 9";
+	char *pos = strstr(text, old_string);
+	while(pos) {
+		memcpy(pos, new_string, strlen(new_string));
+		pos += strlen(old_string);
+		pos = strstr(pos, old_string);
+	}
+	return text;
+}
+
 /* Callback invoked when we have an SDP offer or answer ready to be sent */
 static void jamrtc_sdp_available(GstPromise *promise, gpointer user_data) {
 	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
@@ -925,20 +2756,21 @@ static void jamrtc_sdp_available(GstPromise *promise, gpointer user_data) {
 	gst_promise_interrupt(promise);
 	gst_promise_unref(promise);
 
-	/* Convert the SDP object to a string */
-	char *text = gst_sdp_message_as_text(offeranswer->sdp);
-	/* Fix the SDP, as with max-bundle GStreamer will set 0 in m-line ports */
-	const char *old_string = "m=audio 0";
-	const char *new_string = "m=audio 9";
-	char *pos = strstr(text, old_string), *tmp = NULL;
-	int i = 0;
-	while(pos) {
-		i++;
-		memcpy(pos, new_string, strlen(new_string));
-		pos += strlen(old_string);
-		tmp = strstr(pos, old_string);
-		pos = tmp;
+	if(pc->p2p) {
+		/* We'll send the SDP to our peer when all candidates have been gathered */
+		JAMRTC_LOG(LOG_INFO, "[%s][%s] Gathering candidates for the SDP %s\n",
+			pc->display, pc->instrument, pc->remote ? "answer" : "offer");
+		gst_webrtc_session_description_free(offeranswer);
+		return;
 	}
+
+	/* Convert the SDP object to a string */
+	char *text = jamrtc_sdp_to_string(offeranswer->sdp);
+	/* If we're simulcasting, advertise the SSRCs of all layers */
+	if(pc == local_micwebcam && simulcast_num > 1)
+		text = jamrtc_sdp_add_simulcast(text);
+	/* In bundle mode, label all the m-lines we're publishing */
+	JsonArray *descriptions = (pc == local_micwebcam && bundle) ? jamrtc_sdp_descriptions(text) : NULL;
 	JAMRTC_LOG(LOG_INFO, "[%s][%s] Sending SDP %s\n",
 		pc->display, pc->instrument ? pc->instrument : "chat",
 		pc->remote ? "answer" : "offer");
@@ -955,101 +2787,634 @@ static void jamrtc_sdp_available(GstPromise *promise, gpointer user_data) {
 		 * for mic/webcam, and "joinandconfigure" for instruments instead */
 		JsonObject *req = json_object_new();
 		json_object_set_string_member(req, "request", pc == local_micwebcam ? "configure" : "joinandconfigure");
+		if(descriptions != NULL)
+			json_object_set_array_member(req, "descriptions", descriptions);
 		if(pc == local_instrument) {
 			/* For instruments, we also use this request to join the room  */
 			JsonObject *info = json_object_new();
 			json_object_set_string_member(info, "uuid", local_uuid);
 			json_object_set_string_member(info, "display", pc->display);
 			json_object_set_string_member(info, "instrument", pc->instrument);
-			char *participant = jamrtc_json_to_string(info);
+			if(pc->midi)
+				json_object_set_boolean_member(info, "midi", TRUE);
+			char *participant = jamrtc_janus_json_to_string(info);
 			json_object_unref(info);
 			/* Join the room as a participant */
 			json_object_set_string_member(req, "ptype", "publisher");
 			json_object_set_int_member(req, "room", room_id);
 			json_object_set_string_member(req, "display", participant);
-			json_object_set_boolean_member(req, "audio", TRUE);
+			json_object_set_boolean_member(req, "audio", !pc->midi);
 			json_object_set_boolean_member(req, "video", FALSE);
+			json_object_set_boolean_member(req, "data", pc->midi);
 			g_free(participant);
 		}
-		/* Prepare the Janus API request to send the message to the plugin */
-		JsonObject *msg = json_object_new();
-		json_object_set_string_member(msg, "janus", "message");
-		char transaction[12];
-		json_object_set_string_member(msg, "transaction", jamrtc_random_transaction(transaction, sizeof(transaction)));
-		json_object_set_int_member(msg, "session_id", session_id);
-		json_object_set_int_member(msg, "handle_id", pc->handle_id);
-		json_object_set_object_member(msg, "body", req);
-		json_object_set_object_member(msg, "jsep", sdp);
-		text = jamrtc_json_to_string(msg);
-		json_object_unref(msg);
-		/* Send the request via WebSockets */
-		JAMRTC_LOG(LOG_VERB, "Sending message: %s\n", text);
-		jamrtc_send_message(text);
-	} else {
-		/* Prepare the request to the VideoRoom plugin: it's just "start" */
-		JsonObject *req = json_object_new();
-		json_object_set_string_member(req, "request", "start");
-		/* Prepare the Janus API request to send the message to the plugin */
-		JsonObject *msg = json_object_new();
-		json_object_set_string_member(msg, "janus", "message");
-		char transaction[12];
-		json_object_set_string_member(msg, "transaction", jamrtc_random_transaction(transaction, sizeof(transaction)));
-		json_object_set_int_member(msg, "session_id", session_id);
-		json_object_set_int_member(msg, "handle_id", pc->handle_id);
-		json_object_set_object_member(msg, "body", req);
-		json_object_set_object_member(msg, "jsep", sdp);
-		text = jamrtc_json_to_string(msg);
-		json_object_unref(msg);
-		/* Send the request via WebSockets */
-		JAMRTC_LOG(LOG_VERB, "Sending message: %s\n", text);
-		jamrtc_send_message(text);
+		/* Send the request to the plugin via WebSockets */
+		jamrtc_janus_message(janus, pc->handle_id, req, sdp, NULL);
+	} else {
+		/* Prepare the request to the VideoRoom plugin: it's just "start" */
+		JsonObject *req = json_object_new();
+		json_object_set_string_member(req, "request", "start");
+		/* Send the request to the plugin via WebSockets */
+		jamrtc_janus_message(janus, pc->handle_id, req, sdp, NULL);
+	}
+	gst_webrtc_session_description_free(offeranswer);
+}
+
+/* Callback invoked when a candidate to trickle becomes available */
+static void jamrtc_trickle_candidate(GstElement *webrtc,
+		guint mlineindex, char *candidate, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	if(pc == NULL) {
+		JAMRTC_LOG(LOG_ERR, "Invalid PeerConnection object\n");
+		return;
+	}
+	if(mlineindex != 0 || pc->p2p)
+		return;
+	/* Make sure we're in the right state*/
+	if(pc->state < JAMRTC_JANUS_SDP_PREPARED) {
+		JAMRTC_LOG(LOG_WARN, "[%s][%s] Can't trickle, not in a PeerConnection\n",
+			pc->display, pc->instrument ? pc->instrument : "chat");
+		return;
+	}
+
+	/* Send the request via WebSockets */
+	jamrtc_janus_trickle(janus, pc->handle_id, mlineindex, candidate);
+}
+
+/* Helper method to set a remote SDP on a PeerConnection */
+static void jamrtc_set_remote_description(jamrtc_webrtc_pc *pc, const char *text, gboolean offer) {
+	/* Convert the SDP to something webrtcbin can digest */
+	GstSDPMessage *sdp = NULL;
+	int ret = gst_sdp_message_new(&sdp);
+	if(ret != GST_SDP_OK) {
+		/* Something went wrong */
+		JAMRTC_LOG(LOG_ERR, "[%s][%s] Error initializing SDP object (%d)\n",
+			pc->display, pc->instrument ? pc->instrument : "chat", ret);
+	}
+	ret = gst_sdp_message_parse_buffer((guint8 *)text, strlen(text), sdp);
+	if(ret != GST_SDP_OK) {
+		/* Something went wrong */
+		JAMRTC_LOG(LOG_ERR, "[%s][%s] Error parsing SDP buffer (%d)\n",
+			pc->display, pc->instrument ? pc->instrument : "chat", ret);
+	}
+	GstWebRTCSessionDescription *gst_sdp = gst_webrtc_session_description_new(
+		offer ? GST_WEBRTC_SDP_TYPE_OFFER : GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+
+	/* Set remote description on our pipeline */
+	GstPromise *promise = gst_promise_new();
+	g_signal_emit_by_name(pc->peerconnection, "set-remote-description", gst_sdp, promise);
+	gst_promise_interrupt(promise);
+	gst_promise_unref(promise);
+	gst_webrtc_session_description_free(gst_sdp);
+
+	/* Check if there are any candidates in the SDP: we'll need to fake trickles in case */
+	if(strstr(text, "candidate") != NULL) {
+		int mlines = 0, i = 0;
+		gchar **lines = g_strsplit(text, "\r\n", -1);
+		gchar *line = NULL;
+		while(lines[i] != NULL) {
+			line = lines[i];
+			if(strstr(line, "m=") == line) {
+				/* New m-line */
+				mlines++;
+				if(mlines > 1)	/* We only need candidates from the first one */
+					break;
+			} else if(mlines == 1 && strstr(line, "a=candidate") != NULL) {
+				/* Found a candidate, fake a trickle */
+				line += 2;
+				JAMRTC_LOG(LOG_VERB, "[%s][%s]  -- Found candidate: %s\n",
+					pc->display, pc->instrument ? pc->instrument : "chat", line);
+				g_signal_emit_by_name(pc->peerconnection, "add-ice-candidate", 0, line);
+			}
+			i++;
+		}
+		g_clear_pointer(&lines, g_strfreev);
+	}
+}
+
+/* Helper to update our display (e.g., with the current SDPs in peer-to-peer mode) */
+static void jamrtc_update_display(void) {
+	if(local_micwebcam == NULL || local_micwebcam->user_id == 0) {
+		/* We haven't joined yet, the display will be sent when we do */
+		return;
+	}
+	char *participant = jamrtc_local_display();
+	JsonObject *req = json_object_new();
+	json_object_set_string_member(req, "request", "configure");
+	json_object_set_string_member(req, "display", participant);
+	g_free(participant);
+	jamrtc_send_request(local_micwebcam, req);
+}
+
+/* Peer-to-peer mode: SDP ready to be sent to our peer, with all candidates */
+typedef struct jamrtc_p2p_sdp {
+	jamrtc_webrtc_pc *pc;
+	char *sdp;
+} jamrtc_p2p_sdp;
+static gboolean jamrtc_p2p_sdp_ready(gpointer user_data) {
+	jamrtc_p2p_sdp *ready = (jamrtc_p2p_sdp *)user_data;
+	jamrtc_webrtc_pc *pc = ready->pc;
+	if(!g_atomic_int_get(&pc->destroyed)) {
+		JAMRTC_LOG(LOG_INFO, "[%s][%s] Sending SDP %s to our peer\n",
+			pc->display, pc->instrument, pc->remote ? "answer" : "offer");
+		JAMRTC_LOG(LOG_VERB, "%s\n", ready->sdp);
+		jamrtc_mutex_lock(&p2p_mutex);
+		char **target = pc->remote ? &p2p_answer : &p2p_offer;
+		g_free(*target);
+		*target = ready->sdp;
+		ready->sdp = NULL;
+		jamrtc_mutex_unlock(&p2p_mutex);
+		jamrtc_update_display();
+	}
+	jamrtc_webrtc_pc_unref(pc);
+	g_free(ready->sdp);
+	g_free(ready);
+	return G_SOURCE_REMOVE;
+}
+static void jamrtc_p2p_gathering_state(GstElement *webrtc, GParamSpec *pspec, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	GstWebRTCICEGatheringState gathering = GST_WEBRTC_ICE_GATHERING_STATE_NEW;
+	g_object_get(webrtc, "ice-gathering-state", &gathering, NULL);
+	if(gathering != GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE)
+		return;
+	/* The local description now contains all the candidates we gathered */
+	GstWebRTCSessionDescription *local = NULL;
+	g_object_get(webrtc, "local-description", &local, NULL);
+	if(local == NULL)
+		return;
+	jamrtc_p2p_sdp *ready = g_malloc(sizeof(jamrtc_p2p_sdp));
+	jamrtc_refcount_increase(&pc->ref);
+	ready->pc = pc;
+	ready->sdp = jamrtc_sdp_to_string(local->sdp);
+	gst_webrtc_session_description_free(local);
+	jamrtc_loop_invoke(jamrtc_p2p_sdp_ready, ready);
+}
+static void jamrtc_p2p_connection_state(GstElement *webrtc, GParamSpec *pspec, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	GstWebRTCICEConnectionState ice = GST_WEBRTC_ICE_CONNECTION_STATE_NEW;
+	g_object_get(webrtc, "ice-connection-state", &ice, NULL);
+	if(ice == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED) {
+		JAMRTC_LOG(LOG_INFO, "[%s][%s] PeerConnection with our peer established\n",
+			pc->display, pc->instrument);
+		pc->state = JAMRTC_JANUS_STARTED;
+		jamrtc_webrtc_trace(pc);
+	} else if(ice == GST_WEBRTC_ICE_CONNECTION_STATE_FAILED) {
+		JAMRTC_LOG(LOG_WARN, "[%s][%s] PeerConnection with our peer failed (no direct connectivity?)\n",
+			pc->display, pc->instrument);
+	} else if(ice == GST_WEBRTC_ICE_CONNECTION_STATE_DISCONNECTED) {
+		JAMRTC_LOG(LOG_WARN, "[%s][%s] PeerConnection with our peer disconnected\n",
+			pc->display, pc->instrument);
+	}
+}
+
+/* Peer-to-peer mode: start sending our instrument, if we have a peer */
+static void jamrtc_p2p_start(void) {
+	if(local_instrument == NULL || local_instrument->pipeline != NULL || p2p_peer == NULL)
+		return;
+	JAMRTC_LOG(LOG_INFO, "[%s][%s] Sending our instrument directly to %s\n",
+		local_instrument->display, local_instrument->instrument, p2p_peer);
+	/* Negotiation will start automatically, and we'll wait for candidates */
+	jamrtc_prepare_pipeline(local_instrument, FALSE, !local_instrument->midi, FALSE);
+}
+
+/* Peer-to-peer mode: what a participant advertised in their display */
+typedef struct jamrtc_p2p_info {
+	char *uuid, *display, *instrument, *peer, *offer, *answer;
+	gboolean midi;
+} jamrtc_p2p_info;
+static void jamrtc_p2p_info_free(jamrtc_p2p_info *info) {
+	g_free(info->uuid);
+	g_free(info->display);
+	g_free(info->instrument);
+	g_free(info->peer);
+	g_free(info->offer);
+	g_free(info->answer);
+	g_free(info);
+}
+static gboolean jamrtc_p2p_handle(gpointer user_data) {
+	jamrtc_p2p_info *info = (jamrtc_p2p_info *)user_data;
+	if(g_atomic_int_get(&stopping))
+		goto done;
+	/* Is this the participant we're jamming with? */
+	if(p2p_peer == NULL) {
+		JAMRTC_LOG(LOG_INFO, "Jamming peer-to-peer with %s (%s)\n", info->display, info->uuid);
+		jamrtc_mutex_lock(&p2p_mutex);
+		p2p_peer = g_strdup(info->uuid);
+		jamrtc_mutex_unlock(&p2p_mutex);
+		jamrtc_p2p_start();
+	} else if(strcasecmp(p2p_peer, info->uuid)) {
+		JAMRTC_LOG(LOG_WARN, "Ignoring peer-to-peer participant %s, we're already jamming with someone\n",
+			info->display);
+		goto done;
+	}
+	/* Only look at the SDPs meant for us */
+	if(info->peer == NULL || strcasecmp(info->peer, local_uuid))
+		goto done;
+	if(info->offer != NULL && info->instrument != NULL &&
+			(p2p_remote_offer == NULL || strcmp(p2p_remote_offer, info->offer))) {
+		/* New offer for their instrument: create a PeerConnection to receive it */
+		g_free(p2p_remote_offer);
+		p2p_remote_offer = g_strdup(info->offer);
+		jamrtc_mutex_lock(&participants_mutex);
+		jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+		jamrtc_webrtc_participant *participant = reg ? g_hash_table_lookup(reg->participants, info->uuid) : NULL;
+		if(participant == NULL) {
+			jamrtc_mutex_unlock(&participants_mutex);
+			JAMRTC_LOG(LOG_WARN, "No such participant %s\n", info->uuid);
+			goto done;
+		}
+		jamrtc_webrtc_pc *oldpc = participant->instrument;
+		jamrtc_webrtc_pc *pc = jamrtc_webrtc_pc_new(participant->uuid, info->display, TRUE, info->instrument);
+		pc->p2p = TRUE;
+		pc->midi = info->midi;
+		pc->slot = participant->slot;
+		participant->instrument = pc;
+		jamrtc_mutex_unlock(&participants_mutex);
+		if(oldpc != NULL) {
+			/* They started from scratch, get rid of the previous PeerConnection */
+			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_STREAM,
+				oldpc, FALSE, NULL);
+			jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+			jamrtc_webrtc_pc_destroy(oldpc);
+		}
+		JAMRTC_LOG(LOG_INFO, "[%s][%s]  -- Received SDP offer from our peer\n",
+			pc->display, pc->instrument);
+		JAMRTC_LOG(LOG_VERB, "%s\n", info->offer);
+		if(jamrtc_prepare_pipeline(pc, TRUE, !pc->midi, FALSE)) {
+			pc->state = JAMRTC_JANUS_SDP_PREPARED;
+			jamrtc_set_remote_description(pc, info->offer, TRUE);
+			GstPromise *promise = gst_promise_new_with_change_func(jamrtc_sdp_available, pc, NULL);
+			g_signal_emit_by_name(pc->peerconnection, "create-answer", NULL, promise);
+			/* Notify the application */
+			cb->stream_started(pc->uuid, pc->display, pc->instrument, !pc->midi, FALSE);
+		}
+	}
+	if(info->answer != NULL && local_instrument != NULL && local_instrument->pipeline != NULL &&
+			(p2p_remote_answer == NULL || strcmp(p2p_remote_answer, info->answer))) {
+		/* Answer to our instrument offer */
+		g_free(p2p_remote_answer);
+		p2p_remote_answer = g_strdup(info->answer);
+		JAMRTC_LOG(LOG_INFO, "[%s][%s]  -- Received SDP answer from our peer\n",
+			local_instrument->display, local_instrument->instrument);
+		JAMRTC_LOG(LOG_VERB, "%s\n", info->answer);
+		jamrtc_set_remote_description(local_instrument, info->answer, FALSE);
+	}
+
+done:
+	jamrtc_p2p_info_free(info);
+	return G_SOURCE_REMOVE;
+}
+static void jamrtc_p2p_check(const char *uuid, const char *display, JsonObject *p2p_object) {
+	if(!p2p || uuid == NULL || p2p_object == NULL)
+		return;
+	/* Process this on the loop, where all the peer-to-peer state lives */
+	jamrtc_p2p_info *info = g_malloc0(sizeof(jamrtc_p2p_info));
+	info->uuid = g_strdup(uuid);
+	info->display = g_strdup(display);
+	if(json_object_has_member(p2p_object, "instrument"))
+		info->instrument = g_strdup(json_object_get_string_member(p2p_object, "instrument"));
+	if(json_object_has_member(p2p_object, "midi"))
+		info->midi = json_object_get_boolean_member(p2p_object, "midi");
+	if(json_object_has_member(p2p_object, "peer"))
+		info->peer = g_strdup(json_object_get_string_member(p2p_object, "peer"));
+	if(json_object_has_member(p2p_object, "offer"))
+		info->offer = g_strdup(json_object_get_string_member(p2p_object, "offer"));
+	if(json_object_has_member(p2p_object, "answer"))
+		info->answer = g_strdup(json_object_get_string_member(p2p_object, "answer"));
+	jamrtc_loop_invoke(jamrtc_p2p_handle, info);
+}
+
+/* Peer-to-peer mode: our peer left, get ready for a new one */
+static gboolean jamrtc_p2p_reset(gpointer user_data) {
+	char *uuid = (char *)user_data;
+	if(p2p_peer != NULL && !strcasecmp(p2p_peer, uuid)) {
+		JAMRTC_LOG(LOG_INFO, "Our peer-to-peer partner left\n");
+		jamrtc_mutex_lock(&p2p_mutex);
+		g_clear_pointer(&p2p_peer, g_free);
+		g_clear_pointer(&p2p_offer, g_free);
+		g_clear_pointer(&p2p_answer, g_free);
+		g_clear_pointer(&p2p_remote_offer, g_free);
+		g_clear_pointer(&p2p_remote_answer, g_free);
+		jamrtc_mutex_unlock(&p2p_mutex);
+		if(local_instrument != NULL && local_instrument->pipeline != NULL) {
+			/* Stop sending our instrument: we'll offer it again to whoever comes next */
+			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_STREAM,
+				local_instrument, FALSE, NULL);
+			jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+			jamrtc_recorder_stop(g_atomic_pointer_get(&local_instrument->recording));
+			g_atomic_pointer_set(&local_instrument->recording, NULL);
+			gst_element_set_state(GST_ELEMENT(local_instrument->pipeline), GST_STATE_NULL);
+			jamrtc_tracing_forget(local_instrument->pipeline);
+			g_signal_handlers_disconnect_by_data(local_instrument->peerconnection, local_instrument);
+			g_clear_object(&local_instrument->peerconnection);
+			g_clear_object(&local_instrument->pipeline);
+			local_instrument->state = JAMRTC_JANUS_SESSION_CREATED;
+		}
+		jamrtc_update_display();
 	}
-	gst_webrtc_session_description_free(offeranswer);
+	g_free(uuid);
+	return G_SOURCE_REMOVE;
 }
 
-/* Callback invoked when a candidate to trickle becomes available */
-static void jamrtc_trickle_candidate(GstElement *webrtc,
-		guint mlineindex, char *candidate, gpointer user_data) {
-	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
-	if(pc == NULL) {
-		JAMRTC_LOG(LOG_ERR, "Invalid PeerConnection object\n");
-		return;
+/* Helper to add a sample to a clock drift estimator (times in us): returns
+ * TRUE if there's a new estimate of how faster the remote clock is (ppm) */
+static gboolean jamrtc_drift_clock_update(jamrtc_drift_clock *dc, gint64 local, gint64 remote, gdouble *ppm) {
+	if(dc->base_local == 0) {
+		dc->base_local = local;
+		dc->base_remote = remote;
 	}
-	if(mlineindex != 0)
-		return;
-	/* Make sure we're in the right state*/
-	if(pc->state < JAMRTC_JANUS_SDP_PREPARED) {
-		JAMRTC_LOG(LOG_WARN, "[%s][%s] Can't trickle, not in a PeerConnection\n",
-			pc->display, pc->instrument ? pc->instrument : "chat");
-		return;
+	/* How much the remote clock is behind, compared to when we started */
+	gint64 offset = (local - dc->base_local) - (remote - dc->base_remote);
+	gint64 previous = dc->bucket_start > 0 ? dc->bucket_min :
+		(dc->count > 0 ? dc->offsets[(dc->next + JAMRTC_DRIFT_BUCKETS - 1) % JAMRTC_DRIFT_BUCKETS] : offset);
+	if(ABS(offset - previous) > JAMRTC_DRIFT_RESET*1000) {
+		/* Something jumped (e.g., the sender restarted), start from scratch */
+		memset(dc, 0, sizeof(*dc));
+		return FALSE;
 	}
-
-	/* Prepare the Janus API request */
-	JsonObject *trickle = json_object_new();
-	json_object_set_string_member(trickle, "janus", "trickle");
-	json_object_set_int_member(trickle, "session_id", session_id);
-	json_object_set_int_member(trickle, "handle_id", pc->handle_id);
-	char transaction[12];
-	json_object_set_string_member(trickle, "transaction", jamrtc_random_transaction(transaction, sizeof(transaction)));
-	JsonObject *ice = json_object_new();
-	json_object_set_string_member(ice, "candidate", candidate);
-	json_object_set_int_member(ice, "sdpMLineIndex", mlineindex);
-	json_object_set_object_member(trickle, "candidate", ice);
-	char *text = jamrtc_json_to_string(trickle);
-	json_object_unref(trickle);
-
-	/* Send the request via WebSockets */
-	JAMRTC_LOG(LOG_VERB, "[%s][%s] Sending message: %s\n",
-		pc->display, pc->instrument ? pc->instrument : "chat", text);
-	jamrtc_send_message(text);
+	/* Network delays only ever add to the offset, so we keep the minimum */
+	if(dc->bucket_start == 0 || offset < dc->bucket_min) {
+		if(dc->bucket_start == 0)
+			dc->bucket_start = local;
+		dc->bucket_time = local;
+		dc->bucket_min = offset;
+	}
+	if(local - dc->bucket_start < JAMRTC_DRIFT_BUCKET*1000)
+		return FALSE;
+	/* Bucket done, add it to the envelope and fit a line on it */
+	dc->times[dc->next] = dc->bucket_time - dc->base_local;
+	dc->offsets[dc->next] = dc->bucket_min;
+	dc->next = (dc->next + 1) % JAMRTC_DRIFT_BUCKETS;
+	if(dc->count < JAMRTC_DRIFT_BUCKETS)
+		dc->count++;
+	dc->bucket_start = 0;
+	if(dc->count < JAMRTC_DRIFT_MIN_BUCKETS)
+		return FALSE;
+	gdouble mx = 0, my = 0, sxy = 0, sxx = 0;
+	guint i = 0;
+	for(i=0; i<dc->count; i++) {
+		mx += (gdouble)dc->times[i] / G_USEC_PER_SEC;
+		my += dc->offsets[i];
+	}
+	mx /= dc->count;
+	my /= dc->count;
+	for(i=0; i<dc->count; i++) {
+		gdouble dx = (gdouble)dc->times[i] / G_USEC_PER_SEC - mx;
+		sxy += dx * (dc->offsets[i] - my);
+		sxx += dx * dx;
+	}
+	if(sxx <= 0)
+		return FALSE;
+	/* The slope is how many us the remote clock loses per second, so ppm */
+	*ppm = -sxy / sxx;
+	return TRUE;
+}
+/* Pad probe on the RTP packets of an audio stream, to estimate the clock
+ * rate of the sender from the RTP timestamps and when packets arrive */
+static GstPadProbeReturn jamrtc_drift_rtp(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_drift *drift = (jamrtc_drift *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+	if(buffer == NULL || !gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+		return GST_PAD_PROBE_OK;
+	guint32 ssrc = gst_rtp_buffer_get_ssrc(&rtp), ts = gst_rtp_buffer_get_timestamp(&rtp);
+	gst_rtp_buffer_unmap(&rtp);
+	gint64 now = g_get_monotonic_time();
+	if(ssrc != (guint32)g_atomic_int_get(&drift->ssrc)) {
+		/* New sender, start from scratch */
+		g_atomic_int_set(&drift->ssrc, (gint)ssrc);
+		g_atomic_int_set(&drift->sender_valid, 0);
+		memset(&drift->sender, 0, sizeof(drift->sender));
+		drift->ext_ts = ts;
+	} else {
+		drift->ext_ts += (gint32)(ts - drift->last_ts);
+	}
+	drift->last_ts = ts;
+	gdouble ppm = 0;
+	if(jamrtc_drift_clock_update(&drift->sender, now, drift->ext_ts * G_USEC_PER_SEC / drift->clock_rate, &ppm)) {
+		g_atomic_int_set(&drift->sender_ppb, (gint)(ppm * 1000));
+		g_atomic_int_set(&drift->sender_valid, ABS(ppm) <= JAMRTC_DRIFT_MAX);
+	}
+	return GST_PAD_PROBE_OK;
+}
+/* Pad probe in front of the resampler that feeds jackaudiosink: we estimate
+ * the rate of the sink clock, and if needed resample to compensate the drift */
+static GstPadProbeReturn jamrtc_drift_resample(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_drift *drift = (jamrtc_drift *)user_data;
+	if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if(GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
+			return GST_PAD_PROBE_OK;
+		GstCaps *caps = NULL;
+		gst_event_parse_caps(event, &caps);
+		GstAudioInfo audio;
+		if(!gst_audio_info_from_caps(&audio, caps))
+			return GST_PAD_PROBE_OK;
+		if(GST_AUDIO_INFO_FORMAT(&audio) != GST_AUDIO_INFO_FORMAT(&drift->info) ||
+				GST_AUDIO_INFO_CHANNELS(&audio) != GST_AUDIO_INFO_CHANNELS(&drift->info) ||
+				GST_AUDIO_INFO_RATE(&audio) != drift->nominal) {
+			/* New format, start from scratch */
+			if(drift->resampler != NULL)
+				gst_audio_resampler_free(drift->resampler);
+			drift->resampler = NULL;
+			drift->in_rate = 0;
+			drift->applied = 0;
+		}
+		drift->info = audio;
+		drift->nominal = GST_AUDIO_INFO_RATE(&audio);
+		GstAudioFormat format = GST_AUDIO_INFO_FORMAT(&audio);
+		drift->supported = (GST_AUDIO_INFO_LAYOUT(&audio) == GST_AUDIO_LAYOUT_INTERLEAVED &&
+			(format == GST_AUDIO_FORMAT_F32 || format == GST_AUDIO_FORMAT_F64 ||
+			format == GST_AUDIO_FORMAT_S16 || format == GST_AUDIO_FORMAT_S32));
+		if(!drift->supported && drift_correction) {
+			JAMRTC_LOG(LOG_WARN, "[%s][%s] Can't compensate the clock drift of this format, only estimating it\n",
+				drift->pc->display, drift->name ? drift->name : "chat");
+		}
+		return GST_PAD_PROBE_OK;
+	}
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	gint64 now = g_get_monotonic_time();
+	/* The sink only provides its clock once it's up and running */
+	if(drift->clock == NULL && now - drift->clock_check >= JAMRTC_DRIFT_BUCKET*1000) {
+		drift->clock_check = now;
+		drift->clock = gst_element_provide_clock(drift->sink);
+	}
+	if(drift->clock != NULL) {
+		GstClockTime time = gst_clock_get_time(drift->clock);
+		gdouble ppm = 0;
+		if(GST_CLOCK_TIME_IS_VALID(time) &&
+				jamrtc_drift_clock_update(&drift->output, now, time / GST_USECOND, &ppm)) {
+			drift->output_valid = (ABS(ppm) <= JAMRTC_DRIFT_MAX);
+			drift->output_ppm = ppm;
+		}
+	}
+	if(drift->nominal <= 0)
+		return GST_PAD_PROBE_OK;
+	gint out_rate = drift->nominal * JAMRTC_DRIFT_SCALE;
+	if(drift->output_valid && g_atomic_int_get(&drift->sender_valid)) {
+		/* How much faster the sender is than our sink */
+		gdouble sender = (gdouble)g_atomic_int_get(&drift->sender_ppb) / 1000;
+		gdouble ppm = ((1 + sender / 1000000) / (1 + drift->output_ppm / 1000000) - 1) * 1000000;
+		g_atomic_int_set(&drift->ppb, (gint)(ppm * 1000));
+		if(!g_atomic_int_get(&drift->valid) || ABS(ppm - drift->logged) >= 10) {
+			JAMRTC_LOG(LOG_VERB, "[%s][%s] Clock drift: %.1f ppm (sender %+.1f ppm, JACK %+.1f ppm)\n",
+				drift->pc->display, drift->name ? drift->name : "chat", ppm, sender, drift->output_ppm);
+			drift->logged = ppm;
+		}
+		g_atomic_int_set(&drift->valid, 1);
+		/* If the sender is faster, we need to consume its samples faster,
+		 * so we resample as if the input rate was a bit higher */
+		drift->in_rate = (gint)(out_rate * (1 + ppm / 1000000) + 0.5);
+	}
+	if(!drift_correction || !drift->supported)
+		return GST_PAD_PROBE_OK;
+	/* We resample from the start (with the nominal rate until we have an
+	 * estimate), so that the latency of the filter is there from the start
+	 * too, and from then on we only ever update the ratio */
+	if(drift->in_rate <= 0)
+		drift->in_rate = out_rate;
+	if(drift->resampler == NULL) {
+		GstStructure *options = gst_structure_new_empty("jamrtc-drift");
+		gst_audio_resampler_options_set_quality(GST_AUDIO_RESAMPLER_METHOD_KAISER,
+			JAMRTC_DRIFT_QUALITY, drift->in_rate, out_rate, options);
+		gst_structure_set(options, GST_AUDIO_RESAMPLER_OPT_FILTER_MODE, GST_TYPE_AUDIO_RESAMPLER_FILTER_MODE,
+			GST_AUDIO_RESAMPLER_FILTER_MODE_INTERPOLATED, NULL);
+		drift->resampler = gst_audio_resampler_new(GST_AUDIO_RESAMPLER_METHOD_KAISER,
+			GST_AUDIO_RESAMPLER_FLAG_VARIABLE_RATE, GST_AUDIO_INFO_FORMAT(&drift->info),
+			GST_AUDIO_INFO_CHANNELS(&drift->info), drift->in_rate, out_rate, options);
+		gst_structure_free(options);
+		if(drift->resampler == NULL) {
+			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error creating the resampler, only estimating the clock drift\n",
+				drift->pc->display, drift->name ? drift->name : "chat");
+			drift->supported = FALSE;
+			return GST_PAD_PROBE_OK;
+		}
+		drift->applied = drift->in_rate;
+	} else if(drift->in_rate != drift->applied) {
+		/* Variable rate resamplers interpolate the filter, so this is seamless */
+		gst_audio_resampler_update(drift->resampler, drift->in_rate, out_rate, NULL);
+		drift->applied = drift->in_rate;
+	}
+	/* Replace the buffer with the resampled one */
+	GstMapInfo map;
+	if(!gst_buffer_map(buffer, &map, GST_MAP_READ))
+		return GST_PAD_PROBE_OK;
+	gsize bpf = GST_AUDIO_INFO_BPF(&drift->info);
+	gsize in_frames = map.size / bpf;
+	gsize out_frames = gst_audio_resampler_get_out_frames(drift->resampler, in_frames);
+	GstBuffer *resampled = gst_buffer_new_allocate(NULL, out_frames * bpf, NULL);
+	GstMapInfo out_map;
+	gst_buffer_map(resampled, &out_map, GST_MAP_WRITE);
+	gpointer in[1] = { map.data }, out[1] = { out_map.data };
+	gst_audio_resampler_resample(drift->resampler, in, in_frames, out, out_frames);
+	gst_buffer_unmap(resampled, &out_map);
+	gst_buffer_unmap(buffer, &map);
+	if(out_frames == 0) {
+		/* The resampler kept it all as history, nothing to pass along */
+		gst_buffer_unref(resampled);
+		return GST_PAD_PROBE_DROP;
+	}
+	gst_buffer_copy_into(resampled, buffer, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+	/* Keep the timestamps continuous after what we resampled */
+	if(GST_BUFFER_PTS_IS_VALID(resampled))
+		GST_BUFFER_PTS(resampled) += drift->offset;
+	GST_BUFFER_DURATION(resampled) = gst_util_uint64_scale_int(out_frames, GST_SECOND, drift->nominal);
+	drift->offset += ((gint64)out_frames - (gint64)in_frames) * GST_SECOND / drift->nominal;
+	gst_buffer_unref(buffer);
+	GST_PAD_PROBE_INFO_DATA(info) = resampled;
+	return GST_PAD_PROBE_OK;
+}
+/* Helper to compensate the clock drift of a stream we play on jackaudiosink */
+static void jamrtc_drift_attach(jamrtc_webrtc_pc *pc, guint stream, GstElement *resample, GstElement *sink) {
+	jamrtc_drift *drift = stream < JAMRTC_MAX_STREAMS ? g_atomic_pointer_get(&pc->drift[stream]) : NULL;
+	if(drift == NULL || no_jack)
+		return;
+	if(drift->sink)
+		gst_object_unref(drift->sink);
+	drift->sink = gst_object_ref(sink);
+	if(drift->clock)
+		gst_object_unref(drift->clock);
+	drift->clock = NULL;
+	memset(&drift->output, 0, sizeof(drift->output));
+	drift->output_valid = FALSE;
+	/* New chain, so new resampler too (we'll get the caps again) */
+	if(drift->resampler)
+		gst_audio_resampler_free(drift->resampler);
+	drift->resampler = NULL;
+	drift->nominal = 0;
+	drift->in_rate = 0;
+	drift->applied = 0;
+	drift->offset = 0;
+	GstPad *sinkpad = gst_element_get_static_pad(resample, "sink");
+	gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+		jamrtc_drift_resample, drift, NULL);
+	gst_object_unref(sinkpad);
 }
 
-/* Callbacks invoked when we have a stream from an existing subscription */
-static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboolean video) {
+/* Callbacks invoked when we have a stream from an existing subscription
+ * (the stream is the index of the instrument, if there's more than one) */
+static void jamrtc_handle_headless_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboolean video, guint stream) {
+	GstElement *entry = gst_element_factory_make("queue", NULL);
+	GstElement *sink = NULL;
+	if(video) {
+		/* We should never get video when headless, but just in case */
+		sink = gst_element_factory_make("fakesink", NULL);
+		gst_bin_add_many(GST_BIN(pc->pipeline), entry, sink, NULL);
+		gst_element_link(entry, sink);
+	} else {
+		GstElement *conv = gst_element_factory_make("audioconvert", NULL);
+		GstElement *resample = gst_element_factory_make("audioresample", NULL);
+		sink = gst_element_factory_make(no_jack ? "autoaudiosink" : "jackaudiosink", NULL);
+		if(!no_jack) {
+			/* Assign a name to the Jack node */
+			const char *name = jamrtc_webrtc_pc_stream_name(pc, stream);
+			char client_name[100];
+			g_snprintf(client_name, sizeof(client_name), "%s's %s",
+				pc->display, name ? name : "mic");
+			g_object_set(sink, "client-name", client_name, NULL);
+		}
+		/* Instruments are time-stretched before the resampler, if needed */
+		GstElement *stretcher = stream < JAMRTC_MAX_STREAMS ?
+			jamrtc_playout_element(g_atomic_pointer_get(&pc->playout[stream]), sink) : NULL;
+		gst_bin_add_many(GST_BIN(pc->pipeline), entry, conv, resample, sink, NULL);
+		if(stretcher != NULL)
+			gst_bin_add(GST_BIN(pc->pipeline), stretcher);
+		if((stretcher && !gst_element_link_many(entry, conv, stretcher, resample, sink, NULL)) ||
+				(!stretcher && !gst_element_link_many(entry, conv, resample, sink, NULL))) {
+			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error linking audio to sink...\n",
+				pc->display, pc->instrument ? pc->instrument : "chat");
+		}
+		gst_element_sync_state_with_parent(conv);
+		if(stretcher != NULL)
+			gst_element_sync_state_with_parent(stretcher);
+		gst_element_sync_state_with_parent(resample);
+		jamrtc_drift_attach(pc, stream, resample, sink);
+	}
+	g_object_set(sink, "sync", FALSE, NULL);
+	gst_element_sync_state_with_parent(entry);
+	gst_element_sync_state_with_parent(sink);
+	GstPad *entry_pad = gst_element_get_static_pad(entry, "sink");
+	if(gst_pad_link(pad, entry_pad) != GST_PAD_LINK_OK) {
+		JAMRTC_LOG(LOG_ERR, "[%s][%s] Error feeding %s...\n",
+			pc->display, pc->instrument ? pc->instrument : "chat",
+			GST_OBJECT_NAME(gst_element_get_factory(sink)));
+	}
+	gst_object_unref(entry_pad);
+	jamrtc_webrtc_trace(pc);
+}
+static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboolean video, guint stream) {
+	if(builder == NULL || (!video && stream > 0)) {
+		/* We're headless, or this is an additional instrument in a bundle (we
+		 * only have an instrument tile per participant): just play the audio */
+		jamrtc_handle_headless_stream(pc, pad, video, stream);
+		return;
+	}
 	GstElement *entry = gst_element_factory_make(video ? "queue" : "audioconvert", NULL);
 	GstElement *conv = gst_element_factory_make(video ? "videoconvert" : "audioconvert", NULL);
-	GstElement *sink = gst_element_factory_make(video ? "xvimagesink" :
-		(no_jack ? "autoaudiosink" : "jackaudiosink"), NULL);
+	/* Video is rendered via xvimagesink, or fed to the compositor (in which case there's a valve too) */
+	GstElement *valve = NULL;
+	GstElement *sink = video ? jamrtc_renderer_sink_new("video", pc->slot, JAMRTC_TILE_VIDEO, &valve) :
+		gst_element_factory_make(no_jack ? "autoaudiosink" : "jackaudiosink", NULL);
 	if(!video) {
 		/* Create a queue to add after the first audioconvert */
 		GstElement *q = gst_element_factory_make("queue", NULL);
@@ -1057,8 +3422,9 @@ static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboole
 		if(!no_jack) {
 			/* Assign a name to the Jack node */
 			char name[100];
+			const char *stream_name = jamrtc_webrtc_pc_stream_name(pc, stream);
 			g_snprintf(name, sizeof(name), "%s's %s",
-				pc->display, pc->instrument ? pc->instrument : "mic");
+				pc->display, stream_name ? stream_name : "mic");
 			g_object_set(sink, "client-name", name, NULL);
 			//~ g_object_set(sink, "connect", 0, NULL);
 		}
@@ -1070,9 +3436,21 @@ static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboole
 		GstElement *wav = gst_element_factory_make("wavescope", NULL);
 		g_object_set(wav, "style", pc->instrument ? 3 : 1, NULL);
 		GstElement *vconv = gst_element_factory_make("videoconvert", NULL);
-		GstElement *vsink = gst_element_factory_make("xvimagesink", NULL);
-		g_object_set(vsink, "name", pc->instrument ? "aiwave" : "amwave", NULL);
+		GstElement *vsink = jamrtc_renderer_sink_new(pc->instrument ? "aiwave" : "amwave", pc->slot,
+			pc->instrument ? JAMRTC_TILE_INSTRUMENT : JAMRTC_TILE_MIC, &valve);
+		/* Instruments are time-stretched before the resampler, if needed */
+		GstElement *stretcher = stream < JAMRTC_MAX_STREAMS ?
+			jamrtc_playout_element(g_atomic_pointer_get(&pc->playout[stream]), sink) : NULL;
 		gst_bin_add_many(GST_BIN(pc->pipeline), entry, q, conv, resample, tee, qa, sink, qv, wav, vconv, vsink, NULL);
+		if(stretcher != NULL) {
+			gst_bin_add(GST_BIN(pc->pipeline), stretcher);
+			gst_element_sync_state_with_parent(stretcher);
+		}
+		if(valve != NULL) {
+			/* Drop frames before the wavescope, when the tile is not visible */
+			gst_bin_add(GST_BIN(pc->pipeline), valve);
+			gst_element_sync_state_with_parent(valve);
+		}
 		gst_element_sync_state_with_parent(entry);
 		gst_element_sync_state_with_parent(q);
 		gst_element_sync_state_with_parent(conv);
@@ -1088,21 +3466,27 @@ static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboole
 			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error linking audio pad to tee...\n",
 				pc->display, pc->instrument ? pc->instrument : "chat");
 		}
-		if(!gst_element_link_many(qa, conv, resample, sink, NULL)) {
+		if((stretcher && !gst_element_link_many(qa, conv, stretcher, resample, sink, NULL)) ||
+				(!stretcher && !gst_element_link_many(qa, conv, resample, sink, NULL))) {
 			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error linking audio to sink...\n",
 				pc->display, pc->instrument ? pc->instrument : "chat");
 		}
-		if(!gst_element_link_many(qv, wav, vconv, vsink, NULL)) {
+		if((valve && !gst_element_link_many(qv, valve, wav, vconv, vsink, NULL)) ||
+				(!valve && !gst_element_link_many(qv, wav, vconv, vsink, NULL))) {
 			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error linking audio to visualizer...\n",
 				pc->display, pc->instrument ? pc->instrument : "chat");
 		}
+		jamrtc_drift_attach(pc, stream, resample, sink);
 		g_object_set(sink, "sync", FALSE, NULL);
 		g_object_set(vsink, "sync", FALSE, NULL);
-		if(pc->slot != 0) {
+		if(jamrtc_renderer_is_enabled()) {
+			/* Render the wavescope in the compositor */
+			jamrtc_renderer_add_tile(pc->slot, pc->instrument ? JAMRTC_TILE_INSTRUMENT : JAMRTC_TILE_MIC, valve);
+		} else if(pc->slot != 0) {
 			/* Render the video */
 			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
 				pc, FALSE, pc->instrument ? "aiwave" : "amwave");
-			g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+			jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
 		}
 		/* Manually connect the tee pads */
 		GstPad *tee_audio_pad = gst_element_get_request_pad(tee, "src_%u");
@@ -1123,18 +3507,27 @@ static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboole
 			pc->display, pc->instrument ? pc->instrument : "mic");
 		GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(pc->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, dot_name);
 	} else {
-		g_object_set(sink, "name", "video", NULL);
 		gst_bin_add_many(GST_BIN(pc->pipeline), entry, conv, sink, NULL);
 		gst_element_sync_state_with_parent(entry);
 		gst_element_sync_state_with_parent(conv);
 		gst_element_sync_state_with_parent(sink);
-		gst_element_link_many(entry, conv, sink, NULL);
+		if(valve != NULL) {
+			/* Drop frames before converting them, when the tile is not visible */
+			gst_bin_add(GST_BIN(pc->pipeline), valve);
+			gst_element_sync_state_with_parent(valve);
+			gst_element_link_many(entry, valve, conv, sink, NULL);
+		} else {
+			gst_element_link_many(entry, conv, sink, NULL);
+		}
 		g_object_set(sink, "sync", FALSE, NULL);
-		if(pc->slot != 0) {
+		if(jamrtc_renderer_is_enabled()) {
+			/* Render the video in the compositor */
+			jamrtc_renderer_add_tile(pc->slot, JAMRTC_TILE_VIDEO, valve);
+		} else if(pc->slot != 0) {
 			/* Render the video */
 			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_STREAM,
 				pc, TRUE, "video");
-			g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+			jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
 		}
 	}
 	/* Finally, let's connect the webrtcbin pad to our entry queue */
@@ -1147,6 +3540,8 @@ static void jamrtc_handle_media_stream(jamrtc_webrtc_pc *pc, GstPad *pad, gboole
 	}
 	if(!video)
 		GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(pc->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "sink-3");
+	/* Trace the new stages too (depayloader and decoder included), if needed */
+	jamrtc_webrtc_trace(pc);
 }
 static void jamrtc_incoming_decodebin_stream(GstElement *decodebin, GstPad *pad, gpointer user_data) {
 	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
@@ -1162,152 +3557,314 @@ static void jamrtc_incoming_decodebin_stream(GstElement *decodebin, GstPad *pad,
 	}
 	GstCaps *caps = gst_pad_get_current_caps(pad);
 	const char *name = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	guint stream = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(decodebin), "jamrtc-stream"));
 	if(g_str_has_prefix(name, "video")) {
-		jamrtc_handle_media_stream(pc, pad, TRUE);
+		jamrtc_handle_media_stream(pc, pad, TRUE, stream);
 	} else if(g_str_has_prefix(name, "audio")) {
-		jamrtc_handle_media_stream(pc, pad, FALSE);
+		jamrtc_handle_media_stream(pc, pad, FALSE, stream);
 	} else {
 		JAMRTC_LOG(LOG_ERR, "[%s][%s] Unknown pad %s, ignoring",
 			pc->display, pc->instrument ? pc->instrument : "chat", GST_PAD_NAME(pad));
 	}
 }
+/* Callbacks invoked when a remote MIDI instrument sends us something on its data channel */
+static void jamrtc_midi_message(GstWebRTCDataChannel *channel, GBytes *data, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	jamrtc_midi_receive(g_atomic_pointer_get(&pc->midi_port), data);
+}
+static void jamrtc_incoming_data_channel(GstElement *webrtc, GstWebRTCDataChannel *channel, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	char *label = NULL;
+	g_object_get(channel, "label", &label, NULL);
+	if(label == NULL || strcmp(label, JAMRTC_MIDI_CHANNEL)) {
+		JAMRTC_LOG(LOG_WARN, "[%s][%s] Ignoring unknown data channel '%s'\n",
+			pc->display, pc->instrument, label ? label : "");
+		g_free(label);
+		return;
+	}
+	g_free(label);
+	if(!jamrtc_midi_is_enabled()) {
+		JAMRTC_LOG(LOG_WARN, "[%s][%s] MIDI instrument, but no JACK MIDI client: ignoring it\n",
+			pc->display, pc->instrument);
+		return;
+	}
+	if(g_atomic_pointer_get(&pc->midi_port) == NULL)
+		g_atomic_pointer_set(&pc->midi_port, jamrtc_midi_add_output(pc->display, pc->instrument, latency));
+	JAMRTC_LOG(LOG_INFO, "[%s][%s] Receiving MIDI events\n", pc->display, pc->instrument);
+	g_signal_connect(channel, "on-message-data", G_CALLBACK(jamrtc_midi_message), pc);
+}
+/* Helper to find the ID of the audio level extension in the caps of a stream, if any */
+static guint8 jamrtc_audio_level_extid(const GstStructure *s) {
+	guint i = 0, n = gst_structure_n_fields(s);
+	for(i=0; i<n; i++) {
+		const char *field = gst_structure_nth_field_name(s, i);
+		if(!g_str_has_prefix(field, "extmap-"))
+			continue;
+		/* The extension is either just the URI, or an array with direction, URI and attributes */
+		const GValue *value = gst_structure_get_value(s, field);
+		const char *uri = NULL;
+		if(G_VALUE_HOLDS_STRING(value)) {
+			uri = g_value_get_string(value);
+		} else if(GST_VALUE_HOLDS_ARRAY(value) && gst_value_array_get_size(value) >= 2) {
+			const GValue *item = gst_value_array_get_value(value, 1);
+			if(G_VALUE_HOLDS_STRING(item))
+				uri = g_value_get_string(item);
+		}
+		if(uri != NULL && !strcmp(uri, JAMRTC_AUDIO_LEVEL_URN))
+			return (guint8)atoi(field + strlen("extmap-"));
+	}
+	return 0;
+}
+/* The silence detection state is shared by two probes on different pads,
+ * which may go away in any order: each of them releases its reference */
+static void jamrtc_silence_free(const jamrtc_refcount *silence_ref) {
+	jamrtc_silence *silence = jamrtc_refcount_containerof(silence_ref, jamrtc_silence, ref);
+	g_free(silence);
+}
+static void jamrtc_silence_unref(gpointer data) {
+	jamrtc_silence *silence = (jamrtc_silence *)data;
+	if(silence != NULL)
+		jamrtc_refcount_decrease(&silence->ref);
+}
+/* Pad probe on the RTP packets of an audio stream, before they're depayloaded:
+ * we check whether the stream is silent, without decoding anything */
+static GstPadProbeReturn jamrtc_silence_check(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_silence *silence = (jamrtc_silence *)user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+	if(buffer == NULL || !gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+		return GST_PAD_PROBE_OK;
+	gboolean quiet = (gst_rtp_buffer_get_payload_len(&rtp) <= JAMRTC_DTX_FRAME_SIZE);
+	if(!quiet && silence->extid > 0) {
+		gpointer data = NULL;
+		guint size = 0;
+		if(gst_rtp_buffer_get_extension_onebyte_header(&rtp, silence->extid, 0, &data, &size) && size > 0)
+			quiet = ((*(guint8 *)data & 0x7F) >= JAMRTC_SILENCE_LEVEL);
+	}
+	gst_rtp_buffer_unmap(&rtp);
+	jamrtc_webrtc_pc *pc = silence->pc;
+	if(!quiet) {
+		silence->quiet_since = 0;
+		if(silence->silent) {
+			silence->silent = FALSE;
+			silence->resumed = TRUE;
+			JAMRTC_LOG(LOG_VERB, "[%s][%s] Audio is back, decoding again (skipped %"SCNu64" packets)\n",
+				pc->display, pc->instrument ? pc->instrument : "chat", silence->skipped);
+			silence->skipped = 0;
+		}
+	} else if(silence->quiet_since == 0) {
+		silence->quiet_since = g_get_monotonic_time();
+	} else if(!silence->silent && g_get_monotonic_time() - silence->quiet_since >= JAMRTC_SILENCE_HANGOVER*1000) {
+		silence->silent = TRUE;
+		JAMRTC_LOG(LOG_VERB, "[%s][%s] Stream is silent, not decoding it for now\n",
+			pc->display, pc->instrument ? pc->instrument : "chat");
+	}
+	return GST_PAD_PROBE_OK;
+}
+/* Pad probe in front of the decoder, which drops what we found to be silent
+ * (this is in the same streaming thread as the check, so no lock is needed) */
+static GstPadProbeReturn jamrtc_silence_skip(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+	jamrtc_silence *silence = (jamrtc_silence *)user_data;
+	if(silence->silent) {
+		if(silence->skipped == 0 && silence->stream < JAMRTC_MAX_STREAMS) {
+			/* The sink will run dry: let the playout stage know it's not an underrun */
+			jamrtc_playout_silence(g_atomic_pointer_get(&silence->pc->playout[silence->stream]));
+		}
+		silence->skipped++;
+		return GST_PAD_PROBE_DROP;
+	}
+	if(silence->resumed) {
+		/* Let the decoder know there was a gap */
+		silence->resumed = FALSE;
+		GstBuffer *buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+		GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+		GST_PAD_PROBE_INFO_DATA(info) = buffer;
+	}
+	return GST_PAD_PROBE_OK;
+}
+/* We got RTCP from a sender: if it was a Sender Report, pass it to the recorder */
+static void jamrtc_recorder_ssrc_active(GstElement *rtpbin, guint session_id, guint ssrc, gpointer user_data) {
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
+	GObject *session = NULL, *source = NULL;
+	g_signal_emit_by_name(rtpbin, "get-internal-session", session_id, &session);
+	if(session == NULL)
+		return;
+	g_signal_emit_by_name(session, "get-source-by-ssrc", ssrc, &source);
+	g_object_unref(session);
+	if(source == NULL)
+		return;
+	GstStructure *stats = NULL;
+	g_object_get(source, "stats", &stats, NULL);
+	g_object_unref(source);
+	if(stats == NULL)
+		return;
+	gboolean have_sr = FALSE;
+	guint64 ntp_time = 0;
+	guint rtp_ts = 0;
+	if(gst_structure_get_boolean(stats, "have-sr", &have_sr) && have_sr &&
+			gst_structure_get_uint64(stats, "sr-ntptime", &ntp_time) &&
+			gst_structure_get_uint(stats, "sr-rtptime", &rtp_ts)) {
+		/* The recorder ignores it for tracks with a different SSRC */
+		jamrtc_recorder_sync(g_atomic_pointer_get(&pc->recording), ssrc, rtp_ts, ntp_time);
+		guint i = 0;
+		for(i=1; i<JAMRTC_MAX_STREAMS; i++)
+			jamrtc_recorder_sync(g_atomic_pointer_get(&pc->recordings[i]), ssrc, rtp_ts, ntp_time);
+	}
+	gst_structure_free(stats);
+}
+
 static void jamrtc_incoming_stream(GstElement *webrtc, GstPad *pad, gpointer user_data) {
 	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)user_data;
 	if(pc == NULL) {
 		JAMRTC_LOG(LOG_ERR, "Invalid PeerConnection object\n");
 		return;
 	}
+	/* Check if this is video */
+	gboolean video = FALSE, opus = FALSE;
+	guint8 extid = 0;
+	gint clock_rate = 0;
+	GstCaps *caps = gst_pad_query_caps(pad, NULL);
+	if(caps != NULL) {
+		const char *media = gst_structure_get_string(gst_caps_get_structure(caps, 0), "media");
+		video = (media != NULL && !strcasecmp(media, "video"));
+		const char *codec = gst_structure_get_string(gst_caps_get_structure(caps, 0), "encoding-name");
+		opus = (codec != NULL && !strcasecmp(codec, "OPUS"));
+		extid = jamrtc_audio_level_extid(gst_caps_get_structure(caps, 0));
+		gst_structure_get_int(gst_caps_get_structure(caps, 0), "clock-rate", &clock_rate);
+		gst_caps_unref(caps);
+	}
+	if(video && builder == NULL) {
+		/* We're headless, so we don't need the video at all: we asked Janus
+		 * not to send it, and we don't decode whatever may still get here */
+		GstElement *fakesink = gst_element_factory_make("fakesink", NULL);
+		g_object_set(fakesink, "sync", FALSE, "async", FALSE, NULL);
+		gst_bin_add(GST_BIN(pc->pipeline), fakesink);
+		gst_element_sync_state_with_parent(fakesink);
+		GstPad *sinkpad = gst_element_get_static_pad(fakesink, "sink");
+		gst_pad_link(pad, sinkpad);
+		gst_object_unref(sinkpad);
+		return;
+	}
+	/* If the publisher bundles more instruments, check which one this is:
+	 * since we asked for them in order, the m-line index tells us */
+	guint stream = 0;
+	if(pc->instrument != NULL && pc->num_mids > 1) {
+		GstWebRTCRTPTransceiver *transceiver = NULL;
+		g_object_get(pad, "transceiver", &transceiver, NULL);
+		if(transceiver != NULL) {
+			g_object_get(transceiver, "mlineindex", &stream, NULL);
+			gst_object_unref(transceiver);
+		}
+		if(stream >= pc->num_mids)
+			stream = 0;
+	}
 	/* Create an element to decode the stream */
 	JAMRTC_LOG(LOG_INFO, "[%s][%s] Creating decodebin element\n",
 		pc->display, pc->instrument ? pc->instrument : "chat");
+	jamrtc_jackmon_activity(pc->display, pc->instrument ? jamrtc_webrtc_pc_stream_name(pc, stream) : "chat",
+		video ? "video starting" : "audio starting");
 	GstElement *decodebin = gst_element_factory_make("decodebin", NULL);
+	g_object_set_data(G_OBJECT(decodebin), "jamrtc-stream", GUINT_TO_POINTER(stream));
 	g_signal_connect(decodebin, "pad-added", G_CALLBACK(jamrtc_incoming_decodebin_stream), pc);
 	gst_bin_add(GST_BIN(pc->pipeline), decodebin);
 	gst_element_sync_state_with_parent(decodebin);
 	GstPad *sinkpad = gst_element_get_static_pad(decodebin, "sink");
-	gst_pad_link(pad, sinkpad);
+	if(video) {
+		/* For video, we add a valve in front of the decoder, so that we can
+		 * stop decoding (and rendering) when the video is not visible */
+		GstElement *valve = gst_element_factory_make("valve", NULL);
+		gst_bin_add(GST_BIN(pc->pipeline), valve);
+		gst_element_sync_state_with_parent(valve);
+		GstPad *valve_sinkpad = gst_element_get_static_pad(valve, "sink");
+		GstPad *valve_srcpad = gst_element_get_static_pad(valve, "src");
+		gst_pad_link(valve_srcpad, sinkpad);
+		gst_pad_link(pad, valve_sinkpad);
+		gst_object_unref(valve_sinkpad);
+		gst_object_unref(valve_srcpad);
+		g_object_set(valve, "drop", !jamrtc_webrtc_video_visible(pc), NULL);
+		g_atomic_pointer_set(&pc->video_valve, gst_object_ref(valve));
+	} else if(opus && jamrtc_recorder_is_enabled()) {
+		/* We're recording: depayload the audio ourselves, and tee the Opus
+		 * frames to both the decoder and the recorder (no transcoding) */
+		GstElement *depay = gst_element_factory_make("rtpopusdepay", NULL);
+		GstElement *tee = gst_element_factory_make("tee", NULL);
+		gst_bin_add_many(GST_BIN(pc->pipeline), depay, tee, NULL);
+		gst_element_sync_state_with_parent(depay);
+		gst_element_sync_state_with_parent(tee);
+		gst_element_link(depay, tee);
+		GstPad *tee_pad = gst_element_get_request_pad(tee, "src_%u");
+		gst_pad_link(tee_pad, sinkpad);
+		gst_object_unref(tee_pad);
+		jamrtc_recorder_track *track = jamrtc_recorder_add(pc->pipeline, tee,
+			pc->display, jamrtc_webrtc_pc_stream_name(pc, stream), pad, FALSE);
+		g_atomic_pointer_set(stream == 0 ? &pc->recording : &pc->recordings[stream], track);
+		GstPad *depay_sinkpad = gst_element_get_static_pad(depay, "sink");
+		gst_pad_link(pad, depay_sinkpad);
+		gst_object_unref(depay_sinkpad);
+	} else {
+		gst_pad_link(pad, sinkpad);
+	}
+	if(opus && dtx) {
+		/* Stop feeding the decoder when the stream is silent: we check the RTP
+		 * packets here, and drop them (if needed) right before the decoder, so
+		 * that the recorder, if any, still gets everything */
+		jamrtc_silence *silence = g_malloc0(sizeof(jamrtc_silence));
+		silence->pc = pc;
+		silence->stream = stream;
+		silence->extid = extid;
+		jamrtc_refcount_init(&silence->ref, jamrtc_silence_free);
+		jamrtc_refcount_increase(&silence->ref);
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, jamrtc_silence_check, silence, jamrtc_silence_unref);
+		gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, jamrtc_silence_skip, silence, jamrtc_silence_unref);
+	}
+	if(!video && stream < JAMRTC_MAX_STREAMS) {
+		/* Keep track of the clock of the sender, to compensate its drift when we play it */
+		jamrtc_drift *drift = g_atomic_pointer_get(&pc->drift[stream]);
+		if(drift == NULL) {
+			drift = g_malloc0(sizeof(jamrtc_drift));
+			drift->pc = pc;
+			drift->name = g_strdup(jamrtc_webrtc_pc_stream_name(pc, stream));
+			drift->clock_rate = clock_rate > 0 ? clock_rate : 48000;
+			g_atomic_pointer_set(&pc->drift[stream], drift);
+		}
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, jamrtc_drift_rtp, drift, NULL);
+		if(pc->instrument != NULL) {
+			/* Instruments get a playout stage too, that keeps their latency in check */
+			jamrtc_playout *playout = g_atomic_pointer_get(&pc->playout[stream]);
+			if(playout == NULL) {
+				playout = jamrtc_playout_new(pc->display, jamrtc_webrtc_pc_stream_name(pc, stream),
+					drift->clock_rate, latency);
+				g_atomic_pointer_set(&pc->playout[stream], playout);
+			}
+			jamrtc_playout_watch(playout, pad);
+		}
+	}
 	gst_object_unref(sinkpad);
 }
 
 /* Helper method to send a keep-alive */
 static gboolean jamrtc_send_keepalive(gpointer user_data) {
-	if(session_id == 0)
+	if(jamrtc_janus_session_id(janus) == 0)
 		return FALSE;
-
-	/* Prepare the Janus API request */
-	JsonObject *keepalive = json_object_new();
-	json_object_set_string_member(keepalive, "janus", "keepalive");
-	json_object_set_int_member(keepalive, "session_id", session_id);
-	char transaction[12];
-	json_object_set_string_member(keepalive, "transaction", jamrtc_random_transaction(transaction, sizeof(transaction)));
-	char *text = jamrtc_json_to_string(keepalive);
-	json_object_unref(keepalive);
-
-	/* Send the request via WebSockets */
-	JAMRTC_LOG(LOG_VERB, "Sending message: %s\n", text);
-	jamrtc_send_message(text);
-
+	jamrtc_janus_keepalive(janus);
 	return TRUE;
 }
 
-/* Thread to implement the WebSockets loop */
-static gpointer jamrtc_ws_thread(gpointer data) {
-	JAMRTC_LOG(LOG_VERB, "Joining Jamus WebSocket client thread\n");
-	while(!g_atomic_int_get(&stopping)) {
-		/* Loop until we have to stop */
-		lws_service(context, 50);
-	}
-	JAMRTC_LOG(LOG_VERB, "Leaving Jamus WebSocket client thread\n");
-	return NULL;
-}
-/* Helper method to connect to the remote Janus backend via WebSockets */
-static void jamrtc_connect_websockets(void) {
-	/* Connect */
-	JAMRTC_LOG(LOG_INFO, "Connecting to Janus: %s\n", server_url);
-	gboolean secure = !strcasecmp(protocol, "wss");
-	state = JAMRTC_JANUS_CONNECTING;
-
-	struct lws_context_creation_info info = { 0 };
-	info.port = CONTEXT_PORT_NO_LISTEN;
-	info.protocols = protocols;
-	info.gid = -1;
-	info.uid = -1;
-	if(secure)
-		info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-	context = lws_create_context(&info);
-	if(context == NULL) {
-		jamrtc_cleanup("Creating libwebsocket context failed", JAMRTC_JANUS_CONNECTION_ERROR);
-		return;
-	}
-	struct lws_client_connect_info i = { 0 };
-	i.host = address;
-	i.origin = address;
-	i.address = address;
-	i.port = port;
-	char wspath[256];
-	g_snprintf(wspath, sizeof(wspath), "/%s", path);
-	i.path = wspath;
-	i.context = context;
-	if(secure)
-		i.ssl_connection = 1;
-	i.ietf_version_or_minus_one = -1;
-	i.client_exts = exts;
-	i.protocol = protocols[0].name;
-	wsi = lws_client_connect_via_info(&i);
-	if(wsi == NULL) {
-		jamrtc_cleanup("Error initializing WebSocket connection", JAMRTC_JANUS_CONNECTION_ERROR);
-		return;
-	}
-	jamrtc_mutex_init(&writable_mutex);
-
-	/* Initialize the message queue */
-	messages = g_async_queue_new();
-
-	/* Start a thread to handle the WebSockets event loop */
-	GError *error = NULL;
-	ws_thread = g_thread_try_new("jamrtc ws", jamrtc_ws_thread, NULL, &error);
-	if(error != NULL) {
-		JAMRTC_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the Jamus WebSocket client thread...\n",
-			error->code, error->message ? error->message : "??");
-		jamrtc_cleanup("Thread error", JAMRTC_JANUS_CONNECTION_ERROR);
-		g_error_free(error);
-		return;
-	}
-}
-
-/* Helper to send a message via WebSockets */
-void jamrtc_send_message(char *text) {
-	g_async_queue_push(messages, text);
-#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
-	if(context != NULL)
-		lws_cancel_service(context);
-#else
-	/* On libwebsockets < 3.x we use lws_callback_on_writable */
-	jamrtc_mutex_lock(&writable_mutex);
-	if(wsi != NULL)
-		lws_callback_on_writable(wsi);
-	jamrtc_mutex_unlock(&writable_mutex);
-#endif
+/* Callback invoked when our Janus session has been created */
+static void jamrtc_session_created(jamrtc_janus *client, guint64 session_id, gpointer user_data) {
+	state = JAMRTC_JANUS_SESSION_CREATED;
+	/* Start the keep-alive timer */
+	keep_alives = g_timeout_source_new_seconds(15);
+	g_source_set_priority(keep_alives, G_PRIORITY_DEFAULT);
+	g_source_set_callback(keep_alives, jamrtc_send_keepalive, NULL, NULL);
+	g_source_attach(keep_alives, loop_context);
+	/* Notify the application */
+	cb->server_connected();
 }
 
-/* Helper method to create a new Janus session */
-static gboolean jamrtc_create_session(void) {
-	JAMRTC_LOG(LOG_INFO, "Creating a new Janus session\n");
-	state = JAMRTC_JANUS_CREATING_SESSION;
-
-	/* Prepare the Janus API request */
-	JsonObject *create = json_object_new();
-	json_object_set_string_member(create, "janus", "create");
-	char transaction[12];
-	json_object_set_string_member(create, "transaction", jamrtc_random_transaction(transaction, sizeof(transaction)));
-	char *text = jamrtc_json_to_string(create);
-	json_object_unref(create);
-
-	/* Send the request, we'll get a response asynchronously */
-	JAMRTC_LOG(LOG_VERB, "Sending message: %s\n", text);
-	jamrtc_send_message(text);
-
-	return TRUE;
+/* Callback invoked when we lost our connection to Janus, or couldn't create a session */
+static void jamrtc_connection_lost(jamrtc_janus *client, const char *reason, gpointer user_data) {
+	jamrtc_cleanup(reason, JAMRTC_JANUS_DISCONNECTED);
 }
 
 /* Helper method to parse an attendee/publisher, in order to
@@ -1324,6 +3881,10 @@ static void jamrtc_parse_participant(JsonObject *p, gboolean publisher) {
 	/* This display property is actually supposed to be a stringified JSON, parse it */
 	const char *display_json = json_object_get_string_member(p, "display");
 	const char *uuid = NULL, *display = display_json, *instrument = NULL;
+	JsonArray *layers = NULL;
+	JsonObject *p2p_object = NULL;
+	gboolean midi = FALSE;
+	gint peer_rtt = -1;
 	JsonParser *display_parser = json_parser_new();
 	if(json_parser_load_from_data(display_parser, display_json, -1, NULL)) {
 		JsonNode *display_root = json_parser_get_root(display_parser);
@@ -1335,6 +3896,17 @@ static void jamrtc_parse_participant(JsonObject *p, gboolean publisher) {
 				display = json_object_get_string_member(display_object, "display");
 			if(json_object_has_member(display_object, "instrument"))
 				instrument = json_object_get_string_member(display_object, "instrument");
+			JsonNode *layers_node = json_object_get_member(display_object, "layers");
+			if(layers_node != NULL && JSON_NODE_HOLDS_ARRAY(layers_node))
+				layers = json_node_get_array(layers_node);
+			if(json_object_has_member(display_object, "midi"))
+				midi = json_object_get_boolean_member(display_object, "midi");
+			JsonNode *rtt_node = json_object_get_member(display_object, "rtt");
+			if(rtt_node != NULL && JSON_NODE_HOLDS_VALUE(rtt_node) &&
+					json_node_get_value_type(rtt_node) == G_TYPE_INT64)
+				peer_rtt = json_node_get_int(rtt_node);
+			if(json_object_has_member(display_object, "p2p"))
+				p2p_object = json_object_get_object_member(display_object, "p2p");
 		}
 	}
 	if(uuid != NULL && !strcasecmp(uuid, local_uuid)) {
@@ -1345,39 +3917,107 @@ static void jamrtc_parse_participant(JsonObject *p, gboolean publisher) {
 	}
 	gboolean has_audio = json_object_has_member(p, "audio_codec");
 	gboolean has_video = json_object_has_member(p, "video_codec");
+	/* If they bundle everything in a single PeerConnection, the descriptions
+	 * of their streams tell us which are for the chat and which are instruments */
+	const char *chat_mids[JAMRTC_MAX_STREAMS], *instrument_mids[JAMRTC_MAX_STREAMS],
+		*instrument_names[JAMRTC_MAX_STREAMS+1];
+	guint num_chat = 0, num_instruments = 0;
+	gboolean chat_audio = FALSE, chat_video = FALSE;
+	JsonArray *streams = json_object_has_member(p, "streams") ? json_object_get_array_member(p, "streams") : NULL;
+	guint i = 0, num_streams = streams ? json_array_get_length(streams) : 0;
+	for(i=0; i<num_streams; i++) {
+		JsonNode *node = json_array_get_element(streams, i);
+		if(json_node_get_node_type(node) != JSON_NODE_OBJECT)
+			continue;
+		JsonObject *stream = json_node_get_object(node);
+		if(!json_object_has_member(stream, "mid") || !json_object_has_member(stream, "description") ||
+				(json_object_has_member(stream, "disabled") && json_object_get_boolean_member(stream, "disabled")))
+			continue;
+		const char *mid = json_object_get_string_member(stream, "mid");
+		const char *description = json_object_get_string_member(stream, "description");
+		if(mid == NULL || description == NULL)
+			continue;
+		if(g_str_has_prefix(description, JAMRTC_INSTRUMENT_PREFIX) && num_instruments < JAMRTC_MAX_INSTRUMENTS) {
+			instrument_mids[num_instruments] = mid;
+			instrument_names[num_instruments] = description + strlen(JAMRTC_INSTRUMENT_PREFIX);
+			num_instruments++;
+		} else if((!strcmp(description, "mic") || !strcmp(description, "webcam")) && num_chat < 2) {
+			chat_mids[num_chat] = mid;
+			num_chat++;
+			if(!strcmp(description, "mic"))
+				chat_audio = TRUE;
+			else
+				chat_video = TRUE;
+		}
+	}
+	instrument_names[num_instruments] = NULL;
+	gboolean bundled = (num_instruments > 0);
+	char *bundled_label = bundled ? g_strjoinv(" + ", (gchar **)instrument_names) : NULL;
+	if(bundled) {
+		has_audio = chat_audio;
+		has_video = chat_video;
+		instrument = bundled_label;
+	}
 	gboolean new_participant = FALSE;
-	jamrtc_mutex_lock(&participants_mutex);
-	jamrtc_webrtc_participant *participant = uuid ? g_hash_table_lookup(participants, uuid) : NULL;
-	if(participant == NULL)
-		participant = g_hash_table_lookup(participants_byid, &user_id);
+	/* Check if we know this participant already, which doesn't need any lock */
+	jamrtc_rcu_read_lock();
+	jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+	jamrtc_webrtc_participant *participant = (reg && uuid) ? g_hash_table_lookup(reg->participants, uuid) : NULL;
+	if(reg != NULL && participant == NULL)
+		participant = g_hash_table_lookup(reg->participants_byid, &user_id);
+	if(participant != NULL)
+		jamrtc_refcount_increase(&participant->ref);
+	jamrtc_rcu_read_unlock();
+	if(reg == NULL) {
+		/* We're shutting down */
+		g_free(bundled_label);
+		if(display_parser != NULL)
+			g_object_unref(display_parser);
+		return;
+	}
 	if(participant == NULL) {
-		/* Create a new participant instance */
+		/* Create a new participant instance, before taking the lock */
 		new_participant = TRUE;
 		participant = g_malloc0(sizeof(jamrtc_webrtc_participant));
 		participant->uuid = uuid ? g_strdup(uuid) : g_uuid_string_random();
 		participant->display = g_strdup(display);
+		participant->peer_rtt = -1;
+		participant->direct_rtt = -1;
+		/* The first reference is released when the participant leaves,
+		 * the second one is ours until we're done here */
 		jamrtc_refcount_init(&participant->ref, jamrtc_webrtc_participant_free);
-		/* Find a slot for this participant */
+		jamrtc_refcount_increase(&participant->ref);
+		jamrtc_memory_count(JAMRTC_MEMORY_PARTICIPANT, 1);
+	}
+	jamrtc_mutex_lock(&participants_mutex);
+	reg = g_atomic_pointer_get(&registry);
+	if(reg == NULL) {
+		/* We started shutting down in the meanwhile */
+		jamrtc_mutex_unlock(&participants_mutex);
+		if(new_participant)
+			jamrtc_webrtc_participant_destroy(participant);
+		jamrtc_webrtc_participant_unref(participant);
+		g_free(bundled_label);
+		if(display_parser != NULL)
+			g_object_unref(display_parser);
+		return;
+	}
+	jamrtc_webrtc_registry *update = NULL;
+	gint64 start = 0;
+	if(new_participant) {
+		/* Find a slot for this participant, and add it to the registry */
+		update = jamrtc_webrtc_registry_begin(&start);
 		guint slot = 2;
 		for(slot=2; slot <=4; slot++) {
-			if(g_hash_table_lookup(participants_byslot, GUINT_TO_POINTER(slot)) == NULL) {
+			if(g_hash_table_lookup(update->participants_byslot, GUINT_TO_POINTER(slot)) == NULL) {
 				/* Found */
 				participant->slot = slot;
-				g_hash_table_insert(participants_byslot, GUINT_TO_POINTER(slot), participant);
+				g_hash_table_insert(update->participants_byslot, GUINT_TO_POINTER(slot), participant);
 				jamrtc_refcount_increase(&participant->ref);
 				break;
 			}
 		}
-		if(participant->slot == 0) {
-			JAMRTC_LOG(LOG_WARN, "No slot available for this participant, they won't be rendered in the UI\n");
-		} else {
-			/* Update the UI */
-			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_PARTICIPANT,
-				participant, FALSE, NULL);
-			g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
-		}
-		/* Insert into the hashtables */
-		g_hash_table_insert(participants, g_strdup(participant->uuid), participant);
+		g_hash_table_insert(update->participants, g_strdup(participant->uuid), participant);
 		jamrtc_refcount_increase(&participant->ref);
 	}
 	if(instrument != NULL) {
@@ -1386,31 +4026,83 @@ static void jamrtc_parse_participant(JsonObject *p, gboolean publisher) {
 			participant->instrument = jamrtc_webrtc_pc_new(participant->uuid, display, TRUE, instrument);
 		participant->instrument->user_id = participant->instrument_user_id;
 		participant->instrument->slot = participant->slot;
-		if(publisher) {
+		participant->instrument->midi = midi;
+		if(bundled) {
+			/* We'll only subscribe to the instrument m-lines of their PeerConnection */
+			jamrtc_webrtc_pc_set_streams(participant->instrument, instrument_mids, instrument_names, num_instruments);
+			participant->instrument->audio = TRUE;
+			participant->instrument->video = FALSE;
+		} else if(publisher) {
 			participant->instrument->audio = has_audio;
 			participant->instrument->video = has_video;
 		}
-	} else {
+	}
+	if(instrument == NULL || bundled) {
 		participant->user_id = user_id;
-		if(participant->micwebcam == NULL)
+		g_atomic_int_set(&participant->peer_rtt, peer_rtt);
+		if(participant->micwebcam == NULL && (!bundled || num_chat > 0))
 			participant->micwebcam = jamrtc_webrtc_pc_new(participant->uuid, display, TRUE, NULL);
+	}
+	if((instrument == NULL || bundled) && participant->micwebcam != NULL) {
 		participant->micwebcam->user_id = participant->user_id;
 		participant->micwebcam->slot = participant->slot;
+		if(bundled)
+			jamrtc_webrtc_pc_set_streams(participant->micwebcam, chat_mids, NULL, num_chat);
+		if(layers != NULL) {
+			/* This participant is simulcasting their webcam */
+			guint len = json_array_get_length(layers), num = 0;
+			for(i=0; i<len && num<JAMRTC_MAX_SIMULCAST_LAYERS; i++) {
+				/* Skip anything that's not a valid width, it comes from a peer */
+				JsonNode *node = json_array_get_element(layers, i);
+				if(!JSON_NODE_HOLDS_VALUE(node) || json_node_get_value_type(node) != G_TYPE_INT64 ||
+						json_node_get_int(node) <= 0)
+					continue;
+				participant->micwebcam->layers[num] = json_node_get_int(node);
+				num++;
+			}
+			participant->micwebcam->num_layers = num;
+		}
 		if(publisher) {
 			participant->micwebcam->audio = has_audio;
 			participant->micwebcam->video = has_video;
 		}
 	}
-	if(g_hash_table_lookup(participants_byid, &user_id) == NULL) {
+	if(g_hash_table_lookup(update ? update->participants_byid : reg->participants_byid, &user_id) == NULL) {
+		if(update == NULL)
+			update = jamrtc_webrtc_registry_begin(&start);
 		jamrtc_refcount_increase(&participant->ref);
-		g_hash_table_insert(participants_byid, jamrtc_uint64_dup(user_id), participant);
+		g_hash_table_insert(update->participants_byid, jamrtc_uint64_dup(user_id), participant);
 	}
+	if(update != NULL)
+		jamrtc_webrtc_registry_commit(update, start);
 	jamrtc_mutex_unlock(&participants_mutex);
+	if(new_participant) {
+		if(participant->slot == 0) {
+			JAMRTC_LOG(LOG_WARN, "No slot available for this participant, they won't be rendered in the UI\n");
+		} else {
+			/* Update the UI */
+			jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_PARTICIPANT,
+				participant, FALSE, NULL);
+			jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+		}
+	}
 	/* Notify the application, if needed */
-	if(new_participant)
+	if(new_participant) {
+		jamrtc_jackmon_activity(display, NULL, "joined");
 		cb->participant_joined(participant->uuid, display);
-	if(publisher)
+	}
+	if(publisher && bundled) {
+		/* Their chat and their instruments are separate subscriptions for us */
+		if(num_chat > 0)
+			cb->stream_started(participant->uuid, display, NULL, has_audio, has_video);
+		cb->stream_started(participant->uuid, display, instrument, TRUE, FALSE);
+	} else if(publisher) {
 		cb->stream_started(participant->uuid, display, instrument, has_audio, has_video);
+	}
+	/* Check if they want to jam with us directly */
+	jamrtc_p2p_check(participant->uuid, display, p2p_object);
+	jamrtc_webrtc_participant_unref(participant);
+	g_free(bundled_label);
 	if(display_parser != NULL)
 		g_object_unref(display_parser);
 }
@@ -1430,72 +4122,28 @@ static void jamrtc_parse_participants(JsonArray *list, gboolean publishers) {
 }
 
 /* Callback invoked when we receive a message from Janus via WebSockets */
-static void jamrtc_server_message(char *text) {
-	JAMRTC_LOG(LOG_VERB, "Got message: '%s'\n", text);
-
-	/* Prepare to handle the transaction */
-	gboolean remove_transaction = FALSE;
-	const char *transaction = NULL;
-	jamrtc_webrtc_pc *pc = NULL;
-
-	/* Make sure the text we just received is valid JSON */
-	JsonParser *parser = json_parser_new();
-	if(!json_parser_load_from_data(parser, text, -1, NULL)) {
-		JAMRTC_LOG(LOG_ERR, "Not JSON, ignoring... '%s'\n", text);
-		goto done;
-	}
-	JsonNode *root = json_parser_get_root(parser);
-	if(!JSON_NODE_HOLDS_OBJECT(root)) {
-		JAMRTC_LOG(LOG_ERR, "Invalid JSON message, ignoring... '%s'\n", text);
-		goto done;
-	}
-	JsonObject *object = json_node_get_object(root);
-	if(!json_object_has_member(object, "janus")) {
-		JAMRTC_LOG(LOG_ERR, "No 'janus' field in the received message, ignoring...\n");
-		goto done;
-	}
-	const char *response = json_object_get_string_member(object, "janus");
-
-	/* Get the transaction, and check if there's a related object */
-	transaction = NULL;
-	if(json_object_has_member(object, "transaction")) {
-		transaction = json_object_get_string_member(object, "transaction");
-		jamrtc_mutex_lock(&transactions_mutex);
-		pc = g_hash_table_lookup(transactions, transaction);
-		jamrtc_mutex_unlock(&transactions_mutex);
-	}
-	if(pc != NULL) {
-		/* Let's get rid of this transaction when we're done */
-		remove_transaction = TRUE;
-	} else if(json_object_has_member(object, "sender")) {
+static void jamrtc_server_message(jamrtc_janus *client, JsonObject *object, const char *response,
+		gpointer opaque, gpointer user_data) {
+	/* Check if there's a related object: responses to requests we tracked
+	 * come with the PeerConnection they're about (and janus.c holds a
+	 * reference until we're done), for the rest we check the handle ID */
+	jamrtc_webrtc_pc *pc = (jamrtc_webrtc_pc *)opaque;
+	gboolean pc_ref = FALSE;
+	if(pc == NULL && json_object_has_member(object, "sender")) {
 		/* Not a transaction we know or originated ourselves, check the
 		 * handle ID to see if we know who this event is belongs to */
-		jamrtc_mutex_lock(&participants_mutex);
 		guint64 handle_id = json_object_get_int_member(object, "sender");
-		pc = g_hash_table_lookup(peerconnections, &handle_id);
-		jamrtc_mutex_unlock(&participants_mutex);
-	}
-
-	/* We handle the incoming message differently, depending on the context and related state */
-	if(session_id == 0) {
-		/* We don't have a session ID yet, so this must be a response to our "create" */
-		JsonObject *child = json_object_get_object_member(object, "data");
-		if(!json_object_has_member(child, "id")) {
-			jamrtc_cleanup("ERROR: no session ID", JAMRTC_JANUS_API_ERROR);
-			goto done;
+		jamrtc_rcu_read_lock();
+		jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+		pc = reg ? g_hash_table_lookup(reg->peerconnections, &handle_id) : NULL;
+		if(pc != NULL) {
+			/* Keep a reference until we're done, in case it goes away while we handle the event */
+			jamrtc_refcount_increase(&pc->ref);
+			pc_ref = TRUE;
 		}
-		session_id = json_object_get_int_member(child, "id");
-		state = JAMRTC_JANUS_SESSION_CREATED;
-		JAMRTC_LOG(LOG_INFO, "  -- Session created: %"SCNu64"\n", session_id);
-		/* Start the keep-alive timer */
-		keep_alives = g_timeout_source_new_seconds(15);
-		g_source_set_priority(keep_alives, G_PRIORITY_DEFAULT);
-		g_source_set_callback(keep_alives, jamrtc_send_keepalive, NULL, NULL);
-		g_source_attach(keep_alives, NULL);
-		/* Notify the application */
-		cb->server_connected();
-		goto done;
+		jamrtc_rcu_read_unlock();
 	}
+
 	/* Did we receive a response to something we needed? */
 	if(pc == NULL)
 		goto done;
@@ -1514,17 +4162,18 @@ static void jamrtc_server_message(char *text) {
 		JAMRTC_LOG(LOG_INFO, "[%s][%s]  -- Handle attached: %"SCNu64"\n",
 			pc->display, pc->instrument ? pc->instrument : "chat", pc->handle_id);
 		jamrtc_mutex_lock(&participants_mutex);
-		jamrtc_refcount_increase(&pc->ref);
-		g_hash_table_insert(peerconnections, jamrtc_uint64_dup(pc->handle_id), pc);
+		if(g_atomic_pointer_get(&registry) != NULL) {
+			gint64 start = 0;
+			jamrtc_webrtc_registry *update = jamrtc_webrtc_registry_begin(&start);
+			jamrtc_refcount_increase(&pc->ref);
+			g_hash_table_insert(update->peerconnections, jamrtc_uint64_dup(pc->handle_id), pc);
+			jamrtc_webrtc_registry_commit(update, start);
+		}
 		jamrtc_mutex_unlock(&participants_mutex);
 		/* Check if we should automatically do something */
 		if(pc == local_micwebcam) {
 			/* We use a stringified JSON object as our display, to carry more info */
-			JsonObject *info = json_object_new();
-			json_object_set_string_member(info, "uuid", local_uuid);
-			json_object_set_string_member(info, "display", pc->display);
-			char *participant = jamrtc_json_to_string(info);
-			json_object_unref(info);
+			char *participant = jamrtc_local_display();
 			/* Join the room as a participant */
 			JsonObject *req = json_object_new();
 			json_object_set_string_member(req, "request", "join");
@@ -1533,27 +4182,13 @@ static void jamrtc_server_message(char *text) {
 			json_object_set_string_member(req, "display", participant);
 			json_object_set_boolean_member(req, "audio", !no_mic);
 			json_object_set_boolean_member(req, "video", !no_webcam);
-			/* Prepare the Janus API request to send the message to the plugin */
-			JsonObject *msg = json_object_new();
-			json_object_set_string_member(msg, "janus", "message");
-			char tr[12];
-			json_object_set_string_member(msg, "transaction", jamrtc_random_transaction(tr, sizeof(tr)));
-			json_object_set_int_member(msg, "session_id", session_id);
-			json_object_set_int_member(msg, "handle_id", pc->handle_id);
-			json_object_set_object_member(msg, "body", req);
-			char *text = jamrtc_json_to_string(msg);
-			json_object_unref(msg);
 			g_free(participant);
-			/* Track the task */
-			jamrtc_mutex_lock(&transactions_mutex);
-			g_hash_table_insert(transactions, g_strdup(tr), pc);
-			jamrtc_mutex_unlock(&transactions_mutex);
-			/* Send the request via WebSockets */
-			JAMRTC_LOG(LOG_VERB, "Sending message: %s\n", text);
-			jamrtc_send_message(text);
+			/* Send the request via WebSockets, and track the task */
+			jamrtc_refcount_increase(&pc->ref);
+			jamrtc_janus_message(janus, pc->handle_id, req, NULL, pc);
 		} else if(pc == local_instrument) {
 			/* Create a GStreamer pipeline for the sendonly PeerConnection */
-			jamrtc_prepare_pipeline(pc, FALSE, TRUE, FALSE);
+			jamrtc_prepare_pipeline(pc, FALSE, !pc->midi, FALSE);
 		} else {
 			/* Create a GStreamer pipeline for the recvonly subscription */
 			if(jamrtc_prepare_pipeline(pc, TRUE, pc->audio, pc->video)) {
@@ -1562,21 +4197,25 @@ static void jamrtc_server_message(char *text) {
 				json_object_set_string_member(req, "request", "join");
 				json_object_set_string_member(req, "ptype", "subscriber");
 				json_object_set_int_member(req, "room", room_id);
-				json_object_set_int_member(req, "feed", pc->user_id);
+				jamrtc_mutex_lock(&participants_mutex);
+				if(pc->num_mids > 0) {
+					/* The publisher bundles everything, only ask for the streams we need */
+					JsonArray *streams = json_array_new();
+					guint i = 0;
+					for(i=0; i<pc->num_mids; i++) {
+						JsonObject *stream = json_object_new();
+						json_object_set_int_member(stream, "feed", pc->user_id);
+						json_object_set_string_member(stream, "mid", pc->mids[i]);
+						json_array_add_object_element(streams, stream);
+					}
+					json_object_set_array_member(req, "streams", streams);
+				} else {
+					json_object_set_int_member(req, "feed", pc->user_id);
+				}
+				jamrtc_mutex_unlock(&participants_mutex);
 				json_object_set_int_member(req, "private_id", private_id);
-				/* Prepare the Janus API request to send the message to the plugin */
-				JsonObject *msg = json_object_new();
-				json_object_set_string_member(msg, "janus", "message");
-				char tr[12];
-				json_object_set_string_member(msg, "transaction", jamrtc_random_transaction(tr, sizeof(tr)));
-				json_object_set_int_member(msg, "session_id", session_id);
-				json_object_set_int_member(msg, "handle_id", pc->handle_id);
-				json_object_set_object_member(msg, "body", req);
-				char *text = jamrtc_json_to_string(msg);
-				json_object_unref(msg);
 				/* Send the request via WebSockets */
-				JAMRTC_LOG(LOG_VERB, "Sending message: %s\n", text);
-				jamrtc_send_message(text);
+				jamrtc_janus_message(janus, pc->handle_id, req, NULL, NULL);
 			}
 		}
 	} else if(json_object_has_member(object, "jsep")) {
@@ -1595,58 +4234,16 @@ static void jamrtc_server_message(char *text) {
 		JAMRTC_LOG(LOG_INFO, "[%s][%s]  -- Received SDP %s\n",
 			pc->display, pc->instrument ? pc->instrument : "chat", sdptype);
 		JAMRTC_LOG(LOG_VERB, "%s\n", text);
-
-		/* Check if there are any candidates in the SDP: we'll need to fake trickles in case */
-		if(strstr(text, "candidate") != NULL) {
-			int mlines = 0, i = 0;
-			gchar **lines = g_strsplit(text, "\r\n", -1);
-			gchar *line = NULL;
-			while(lines[i] != NULL) {
-				line = lines[i];
-				if(strstr(line, "m=") == line) {
-					/* New m-line */
-					mlines++;
-					if(mlines > 1)	/* We only need candidates from the first one */
-						break;
-				} else if(mlines == 1 && strstr(line, "a=candidate") != NULL) {
-					/* Found a candidate, fake a trickle */
-					line += 2;
-					JAMRTC_LOG(LOG_VERB, "[%s][%s]  -- Found candidate: %s\n",
-						pc->display, pc->instrument ? pc->instrument : "chat", line);
-					g_signal_emit_by_name(pc->peerconnection, "add-ice-candidate", 0, line);
-				}
-				i++;
-			}
-			g_clear_pointer(&lines, g_strfreev);
-		}
-
-		/* Convert the SDP to something webrtcbin can digest */
-		GstSDPMessage *sdp = NULL;
-		int ret = gst_sdp_message_new(&sdp);
-		if(ret != GST_SDP_OK) {
-			/* Something went wrong */
-			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error initializing SDP object (%d)\n",
-				pc->display, pc->instrument ? pc->instrument : "chat", ret);
-		}
-		ret = gst_sdp_message_parse_buffer((guint8 *)text, strlen(text), sdp);
-		if(ret != GST_SDP_OK) {
-			/* Something went wrong */
-			JAMRTC_LOG(LOG_ERR, "[%s][%s] Error parsing SDP buffer (%d)\n",
-				pc->display, pc->instrument ? pc->instrument : "chat", ret);
-		}
-		GstWebRTCSessionDescription *gst_sdp = gst_webrtc_session_description_new(
-			offer ? GST_WEBRTC_SDP_TYPE_OFFER : GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+		if(pc->state == JAMRTC_JANUS_STARTED)
+			jamrtc_jackmon_activity(pc->display, pc->instrument ? pc->instrument : "chat", "renegotiation");
 
 		/* Set remote description on our pipeline */
-		GstPromise *promise = gst_promise_new();
-		g_signal_emit_by_name(pc->peerconnection, "set-remote-description", gst_sdp, promise);
-		gst_promise_interrupt(promise);
-		gst_promise_unref(promise);
+		jamrtc_set_remote_description(pc, text, offer);
 
 		pc->state = offer ? JAMRTC_JANUS_SDP_PREPARED : JAMRTC_JANUS_STARTED;
 		if(offer && pc->remote) {
 			/* We need to prepare an SDP answer */
-			promise = gst_promise_new_with_change_func(jamrtc_sdp_available, pc, NULL);
+			GstPromise *promise = gst_promise_new_with_change_func(jamrtc_sdp_available, pc, NULL);
 			g_signal_emit_by_name(pc->peerconnection, "create-answer", NULL, promise);
 			//~ gst_promise_interrupt(promise);
 			//~ gst_promise_unref(promise);
@@ -1699,7 +4296,7 @@ static void jamrtc_server_message(char *text) {
 					/* Update the UI */
 					jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_ADD_PARTICIPANT,
 						NULL, FALSE, NULL);
-					g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+					jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
 					/* Notify the application layer we're in */
 					cb->joined_room();
 				} else if(pc == local_instrument) {
@@ -1709,6 +4306,11 @@ static void jamrtc_server_message(char *text) {
 			/* Check if there's news on attendees and/or publishers */
 			//~ JAMRTC_LOG(LOG_WARN, "  -- TBD: %s\n", text);
 			if(pc == local_micwebcam) {
+				if(event != NULL && !strcasecmp(event, "event") &&
+						json_object_has_member(data, "id") && json_object_has_member(data, "display")) {
+					/* A participant changed their display (e.g., new SDPs in peer-to-peer mode) */
+					jamrtc_parse_participant(data, FALSE);
+				}
 				if(json_object_has_member(data, "joining")) {
 					/* Parse the new VideoRoom participant */
 					JsonObject *joining = json_object_get_object_member(data, "joining");
@@ -1724,12 +4326,46 @@ static void jamrtc_server_message(char *text) {
 					JsonArray *publishers = json_object_get_array_member(data, "publishers");
 					jamrtc_parse_participants(publishers, TRUE);
 				}
+				if(json_object_has_member(data, "unpublished") &&
+						json_node_get_value_type(json_object_get_member(data, "unpublished")) == G_TYPE_INT64) {
+					/* A VideoRoom participant stopped publishing, but is still here */
+					guint64 user_id = json_object_get_int_member(data, "unpublished");
+					char *uuid = NULL, *display = NULL, *instrument = NULL;
+					gboolean chat = FALSE, instr = FALSE;
+					jamrtc_mutex_lock(&participants_mutex);
+					jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+					jamrtc_webrtc_participant *participant = reg ? g_hash_table_lookup(reg->participants_byid, &user_id) : NULL;
+					if(participant != NULL) {
+						uuid = g_strdup(participant->uuid);
+						display = g_strdup(participant->display);
+						chat = (participant->user_id == user_id && participant->micwebcam != NULL);
+						instr = (participant->instrument_user_id == user_id && participant->instrument != NULL);
+						if(instr)
+							instrument = g_strdup(participant->instrument->instrument);
+					}
+					jamrtc_mutex_unlock(&participants_mutex);
+					/* Notify the application, which will unsubscribe */
+					if(chat)
+						cb->stream_stopped(uuid, display, NULL);
+					if(instr)
+						cb->stream_stopped(uuid, display, instrument);
+					g_free(uuid);
+					g_free(display);
+					g_free(instrument);
+				}
 				if(json_object_has_member(data, "leaving")) {
 					/* A VideoRoom participant left, get rid of the PeerConnection instance */
 					guint64 user_id = json_object_get_int_member(data, "leaving");
 					jamrtc_mutex_lock(&participants_mutex);
-					jamrtc_webrtc_participant *participant = g_hash_table_lookup(participants_byid, &user_id);
+					jamrtc_webrtc_registry *reg = g_atomic_pointer_get(&registry);
+					jamrtc_webrtc_participant *participant = reg ? g_hash_table_lookup(reg->participants_byid, &user_id) : NULL;
+					jamrtc_webrtc_registry *update = NULL;
+					gint64 start = 0;
+					gboolean left = FALSE;
 					if(participant != NULL) {
+						/* Make sure the participant doesn't go away while we update the registry */
+						jamrtc_refcount_increase(&participant->ref);
+						update = jamrtc_webrtc_registry_begin(&start);
 						if(participant->user_id == user_id) {
 							participant->user_id = 0;
 							jamrtc_webrtc_pc *oldpc = participant->micwebcam;
@@ -1737,52 +4373,86 @@ static void jamrtc_server_message(char *text) {
 								/* Update the UI */
 								jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_STREAM,
 									participant->micwebcam, FALSE, NULL);
-								g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+								jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
 								/* Remove the stream */
 								participant->micwebcam = NULL;
 								if(oldpc->handle_id != 0)
-									g_hash_table_remove(peerconnections, &oldpc->handle_id);
+									g_hash_table_remove(update->peerconnections, &oldpc->handle_id);
 								/* Notify the application */
 								cb->stream_stopped(oldpc->uuid, oldpc->display, NULL);
 								jamrtc_webrtc_pc_destroy(oldpc);
 							}
-						} else if(participant->instrument_user_id == user_id) {
+							oldpc = participant->instrument;
+							if(oldpc != NULL && oldpc->p2p) {
+								/* We were getting their instrument directly, get rid of it too */
+								jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_STREAM,
+									oldpc, FALSE, NULL);
+								jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
+								participant->instrument = NULL;
+								cb->stream_stopped(oldpc->uuid, oldpc->display, oldpc->instrument);
+								jamrtc_webrtc_pc_destroy(oldpc);
+							}
+							if(p2p)
+								jamrtc_loop_invoke(jamrtc_p2p_reset, g_strdup(participant->uuid));
+						}
+						if(participant->instrument_user_id == user_id) {
+							/* This is also true for participants that bundle everything */
 							participant->instrument_user_id = 0;
 							jamrtc_webrtc_pc *oldpc = participant->instrument;
 							if(oldpc != NULL) {
 								/* Update the UI */
 								jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_STREAM,
 									participant->instrument, FALSE, NULL);
-								g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+								jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
 								/* Remove the stream */
 								participant->instrument = NULL;
 								if(oldpc->handle_id != 0)
-									g_hash_table_remove(peerconnections, &oldpc->handle_id);
+									g_hash_table_remove(update->peerconnections, &oldpc->handle_id);
 								/* Notify the application */
 								cb->stream_stopped(oldpc->uuid, oldpc->display, oldpc->instrument);
 								jamrtc_webrtc_pc_destroy(oldpc);
 							}
 						}
-						g_hash_table_remove(participants_byid, &user_id);
+						g_hash_table_remove(update->participants_byid, &user_id);
 					}
 					if(participant && participant->user_id == 0 && participant->instrument_user_id == 0) {
 						/* No streams left for this participant */
+						jamrtc_jackmon_activity(participant->display, NULL, "left");
 						cb->participant_left(participant->uuid, participant->display);
 						/* Update the UI */
 						jamrtc_video_message *msg = jamrtc_video_message_create(JAMRTC_ACTION_REMOVE_PARTICIPANT,
 							participant, FALSE, NULL);
-						g_main_context_invoke(NULL, jamrtc_video_message_handle, msg);
+						jamrtc_ui_invoke(jamrtc_video_message_handle, msg);
 						/* Remove the participant */
-						g_hash_table_remove(participants, participant->uuid);
-						g_hash_table_remove(participants_byslot, GUINT_TO_POINTER(participant->slot));
+						if(participant->slot <= 4)
+							g_atomic_int_set(&video_collapsed[participant->slot], 0);
+						g_hash_table_remove(update->participants, participant->uuid);
+						g_hash_table_remove(update->participants_byslot, GUINT_TO_POINTER(participant->slot));
+						jamrtc_webrtc_participant_destroy(participant);
+						left = TRUE;
 					}
+					if(update != NULL)
+						jamrtc_webrtc_registry_commit(update, start);
 					jamrtc_mutex_unlock(&participants_mutex);
+					jamrtc_webrtc_participant_unref(participant);
+					if(left) {
+						/* If we're soak testing, check how much memory we're using now */
+						jamrtc_memory_soak_sample(jamrtc_janus_pending(janus));
+					}
 				}
 			}
 		} else if(!strcasecmp(response, "webrtcup")) {
 			/* PeerConnection is up */
 			JAMRTC_LOG(LOG_INFO, "[%s][%s] PeerConnection with Janus established\n",
 				pc->display, pc->instrument ? pc->instrument : "chat");
+			pc->state = JAMRTC_JANUS_STARTED;
+			jamrtc_webrtc_trace(pc);
+			if(pc->remote) {
+				/* If this video isn't visible right now, pause the subscription */
+				jamrtc_mutex_lock(&participants_mutex);
+				jamrtc_webrtc_update_video(pc);
+				jamrtc_mutex_unlock(&participants_mutex);
+			}
 		} else if(!strcasecmp(response, "media")) {
 			/* Notification about media reception */
 			const char *type = json_object_get_string_member(object, "type");
@@ -1794,6 +4464,20 @@ static void jamrtc_server_message(char *text) {
 				JAMRTC_LOG(LOG_WARN, "[%s][%s] Janus hasn't received %s from us for a while...\n",
 					pc->display, pc->instrument ? pc->instrument : "chat", type);
 			}
+		} else if(!strcasecmp(response, "slowlink")) {
+			/* Janus is having trouble sending or receiving media */
+			gboolean uplink = json_object_get_boolean_member(object, "uplink");
+			JAMRTC_LOG(LOG_WARN, "[%s][%s] Janus reports problems %s us\n",
+				pc->display, pc->instrument ? pc->instrument : "chat", uplink ? "receiving from" : "sending to");
+			if(pc->remote && !uplink && pc->num_layers > 1) {
+				/* Our downlink is struggling, ask for a lower substream for a while */
+				jamrtc_mutex_lock(&participants_mutex);
+				gint current = pc->substream >= 0 ? pc->substream : (gint)pc->num_layers-1;
+				pc->slowlink_cap = MAX(0, current-1);
+				pc->slowlink_time = g_get_monotonic_time();
+				jamrtc_webrtc_update_video(pc);
+				jamrtc_mutex_unlock(&participants_mutex);
+			}
 		} else if(!strcasecmp(response, "hangup")) {
 			/* PeerConnection is down, wrap up */
 			JAMRTC_LOG(LOG_INFO, "[%s][%s] PeerConnection with Janus is down (%s)\n",
@@ -1803,181 +4487,6 @@ static void jamrtc_server_message(char *text) {
 	}
 
 done:
-	g_object_unref(parser);
-	if(pc != NULL && remove_transaction) {
-		jamrtc_mutex_lock(&transactions_mutex);
-		g_hash_table_remove(transactions, transaction);
-		jamrtc_mutex_unlock(&transactions_mutex);
-	}
-}
-
-/* Handler for all libwebsockets events */
-static int jamrtc_ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
-	switch(reason) {
-		case LWS_CALLBACK_CLIENT_ESTABLISHED: {
-			/* Prepare the session */
-			if(ws_client == NULL)
-				ws_client = (jamrtc_ws_client *)user;
-			ws_client->wsi = wsi;
-			ws_client->buffer = NULL;
-			ws_client->buflen = 0;
-			ws_client->bufpending = 0;
-			ws_client->bufoffset = 0;
-			jamrtc_mutex_init(&ws_client->mutex);
-
-			state = JAMRTC_JANUS_CONNECTED;
-			JAMRTC_LOG(LOG_INFO, "  -- Connected to Janus\n");
-			/* Let's create a Janus session now */
-			jamrtc_create_session();
-			return 0;
-		}
-		case LWS_CALLBACK_CLIENT_CONNECTION_ERROR: {
-			state = JAMRTC_JANUS_DISCONNECTED;
-			jamrtc_cleanup("Error connecting to backend", 0);
-			cb->server_disconnected();
-			return 1;
-		}
-		case LWS_CALLBACK_CLIENT_RECEIVE: {
-			/* Incoming data */
-			if(ws_client == NULL) {
-				JAMRTC_LOG(LOG_ERR, "Invalid WebSocket client instance...\n");
-				return 1;
-			}
-			/* Is this a new message, or part of a fragmented one? */
-			const size_t remaining = lws_remaining_packet_payload(wsi);
-			if(ws_client->incoming == NULL) {
-				JAMRTC_LOG(LOG_HUGE, "First fragment: %zu bytes, %zu remaining\n",
-					len, remaining);
-				ws_client->incoming = g_malloc(len+1);
-				memcpy(ws_client->incoming, in, len);
-				ws_client->incoming[len] = '\0';
-				JAMRTC_LOG(LOG_HUGE, "%s\n", ws_client->incoming);
-			} else {
-				size_t offset = strlen(ws_client->incoming);
-				JAMRTC_LOG(LOG_HUGE, "Appending fragment: offset %zu, %zu bytes, %zu remaining\n",
-					offset, len, remaining);
-				ws_client->incoming = g_realloc(ws_client->incoming, offset+len+1);
-				memcpy(ws_client->incoming+offset, in, len);
-				ws_client->incoming[offset+len] = '\0';
-				JAMRTC_LOG(LOG_HUGE, "%s\n", ws_client->incoming+offset);
-			}
-			if(remaining > 0 || !lws_is_final_fragment(wsi)) {
-				/* Still waiting for some more fragments */
-				JAMRTC_LOG(LOG_HUGE, "Waiting for more fragments\n");
-				return 0;
-			}
-			JAMRTC_LOG(LOG_HUGE, "Done, parsing message: %zu bytes\n", strlen(ws_client->incoming));
-			/* If we got here, the message is complete: process the message */
-			jamrtc_server_message(ws_client->incoming);
-			g_free(ws_client->incoming);
-			ws_client->incoming = NULL;
-			return 0;
-		}
-#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
-		/* On libwebsockets >= 3.x, we use this event to mark connections as writable in the event loop */
-		case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
-			if(ws_client != NULL && ws_client->wsi != NULL)
-				lws_callback_on_writable(ws_client->wsi);
-			return 0;
-		}
-#endif
-		case LWS_CALLBACK_CLIENT_WRITEABLE: {
-			if(ws_client == NULL || ws_client->wsi == NULL) {
-				JAMRTC_LOG(LOG_ERR, "Invalid WebSocket client instance...\n");
-				return -1;
-			}
-			if(!g_atomic_int_get(&stopping)) {
-				jamrtc_mutex_lock(&ws_client->mutex);
-				/* Check if we have a pending/partial write to complete first */
-				if(ws_client->buffer && ws_client->bufpending > 0 && ws_client->bufoffset > 0
-						&& !g_atomic_int_get(&stopping)) {
-					JAMRTC_LOG(LOG_VERB, "Completing pending WebSocket write (still need to write last %d bytes)...\n",
-						ws_client->bufpending);
-					int sent = lws_write(wsi, ws_client->buffer + ws_client->bufoffset, ws_client->bufpending, LWS_WRITE_TEXT);
-					JAMRTC_LOG(LOG_VERB, "  -- Sent %d/%d bytes\n", sent, ws_client->bufpending);
-					if(sent > -1 && sent < ws_client->bufpending) {
-						/* We still couldn't send everything that was left, we'll try and complete this in the next round */
-						ws_client->bufpending -= sent;
-						ws_client->bufoffset += sent;
-					} else {
-						/* Clear the pending/partial write queue */
-						ws_client->bufpending = 0;
-						ws_client->bufoffset = 0;
-					}
-					/* Done for this round, check the next response/notification later */
-					lws_callback_on_writable(wsi);
-					jamrtc_mutex_unlock(&ws_client->mutex);
-					return 0;
-				}
-				/* Shoot all the pending messages */
-				char *event = g_async_queue_try_pop(messages);
-				if(event && !g_atomic_int_get(&stopping)) {
-					/* Gotcha! */
-					int buflen = LWS_PRE + strlen(event);
-					if(ws_client->buffer == NULL) {
-						/* Let's allocate a shared buffer */
-						JAMRTC_LOG(LOG_VERB, "Allocating %d bytes (event is %zu bytes)\n", buflen, strlen(event));
-						ws_client->buflen = buflen;
-						ws_client->buffer = g_malloc0(buflen);
-					} else if(buflen > ws_client->buflen) {
-						/* We need a larger shared buffer */
-						JAMRTC_LOG(LOG_VERB, "Re-allocating to %d bytes (was %d, event is %zu bytes)\n",
-							buflen, ws_client->buflen, strlen(event));
-						ws_client->buflen = buflen;
-						ws_client->buffer = g_realloc(ws_client->buffer, buflen);
-					}
-					memcpy(ws_client->buffer + LWS_PRE, event, strlen(event));
-					JAMRTC_LOG(LOG_VERB, "Sending WebSocket message (%zu bytes)...\n", strlen(event));
-					int sent = lws_write(wsi, ws_client->buffer + LWS_PRE, strlen(event), LWS_WRITE_TEXT);
-					JAMRTC_LOG(LOG_VERB, "  -- Sent %d/%zu bytes\n", sent, strlen(event));
-					if(sent > -1 && sent < (int)strlen(event)) {
-						/* We couldn't send everything in a single write, we'll complete this in the next round */
-						ws_client->bufpending = strlen(event) - sent;
-						ws_client->bufoffset = LWS_PRE + sent;
-						JAMRTC_LOG(LOG_VERB, "  -- Couldn't write all bytes (%d missing), setting offset %d\n",
-							ws_client->bufpending, ws_client->bufoffset);
-					}
-					/* We can get rid of the message */
-					g_free(event);
-					/* Done for this round, check the next response/notification later */
-					lws_callback_on_writable(wsi);
-					jamrtc_mutex_unlock(&ws_client->mutex);
-					return 0;
-				}
-				jamrtc_mutex_unlock(&ws_client->mutex);
-			}
-			return 0;
-		}
-#if (LWS_LIBRARY_VERSION_MAJOR >= 3)
-		case LWS_CALLBACK_CLIENT_CLOSED: {
-#else
-		case LWS_CALLBACK_CLOSED: {
-#endif
-			JAMRTC_LOG(LOG_INFO, "Janus connection closed\n");
-			if(ws_client != NULL) {
-				/* Cleanup */
-				jamrtc_mutex_lock(&ws_client->mutex);
-				JAMRTC_LOG(LOG_INFO, "Destroying Janus client\n");
-				ws_client->wsi = NULL;
-				/* Free the shared buffers */
-				g_free(ws_client->buffer);
-				ws_client->buffer = NULL;
-				ws_client->buflen = 0;
-				ws_client->bufpending = 0;
-				ws_client->bufoffset = 0;
-				jamrtc_mutex_unlock(&ws_client->mutex);
-			}
-			ws_client = NULL;
-			wsi = NULL;
-			state = JAMRTC_JANUS_DISCONNECTED;
-			jamrtc_cleanup("Janus connection closed", 0);
-			cb->server_disconnected();
-			return 0;
-		}
-		default:
-			//~ if(wsi)
-				//~ JAMRTC_LOG(LOG_HUGE, "%d (%s)\n", reason, jamrtc_ws_reason_string(reason));
-			break;
-	}
-	return 0;
+	if(pc_ref)
+		jamrtc_webrtc_pc_unref(pc);
 }
@@ -33,18 +33,63 @@ typedef struct jamrtc_callbacks {
 
 /* Janus stack initialization */
 int jamrtc_webrtc_init(const jamrtc_callbacks *callbacks, GtkBuilder *builder, GMainLoop *mainloop,
-	const char *ws, const char *stun, const char *turn, const char *src_opts, guint latency, gboolean no_jack);
+	const char *ws, const char *stun, const char *turn, const char *src_opts, guint latency, gboolean no_jack,
+	gboolean compositor);
 /* Janus stack cleanup */
 void jamrtc_webrtc_cleanup(void);
+/* Notify the stack about whether the UI is visible (e.g., not minimised) */
+void jamrtc_webrtc_set_visible(gboolean visible);
+/* Collapse or expand the video tile in a slot (returns whether it's visible now) */
+gboolean jamrtc_webrtc_toggle_video(guint slot);
+/* Height of a collapsed video tile */
+#define JAMRTC_COLLAPSED_HEIGHT	18
+/* Configure the simulcast layers for our webcam, as a comma separated
+ * list of WIDTHxHEIGHT@KBPS layers from the lowest to the highest */
+int jamrtc_webrtc_set_simulcast(const char *ladder);
+/* Get the resolution we capture the webcam at (the highest simulcast
+ * layer, if we're simulcasting, or 320x180 otherwise) */
+void jamrtc_webrtc_webcam_resolution(guint *width, guint *height);
+/* Notify the stack about the width of the video tile in a slot, to
+ * pick the most appropriate substream if the participant simulcasts */
+void jamrtc_webrtc_set_video_width(guint slot, guint width);
+/* Cap the substream we'll ask for on all subscriptions (-1 means no cap) */
+void jamrtc_webrtc_limit_substream(gint substream);
+/* Configure how often (in seconds) the statistics of all PeerConnections
+ * should be sampled for the metrics endpoint and the latency estimates
+ * (to call before the init) */
+void jamrtc_webrtc_set_stats_interval(guint seconds);
+/* Send instruments directly to the other participant, rather than via
+ * Janus, which is then only used to exchange SDPs (to call before the init) */
+void jamrtc_webrtc_set_p2p(gboolean enabled);
+/* Enable or disable Opus DTX on what we send, and skipping the decoding of
+ * silent streams we receive (enabled by default, to call before the init) */
+void jamrtc_webrtc_set_dtx(gboolean enabled);
+/* Enable or disable compensating the clock drift between remote senders and
+ * our JACK clock by resampling what we play (enabled by default; the drift is
+ * estimated and exposed in the statistics anyway, to call before the init) */
+void jamrtc_webrtc_set_drift_correction(gboolean enabled);
+/* Publish mic, webcam and instruments as separate m-lines of a single
+ * PeerConnection, labelled via the VideoRoom stream descriptions, rather
+ * than using a PeerConnection (and a publisher) for each: instruments is
+ * a comma separated list, or NULL if there's none (to call before the init) */
+int jamrtc_webrtc_set_bundle(const char *instruments, gboolean stereo);
+/* Benchmark the participant registry: spawn threads that keep looking up
+ * PeerConnections the same way we do for incoming messages, either lock-free
+ * or holding the participants mutex, and log lookup rates and latencies at
+ * the end, e.g., while a mock Janus makes participants churn (to call before
+ * the init) */
+void jamrtc_webrtc_set_registry_bench(guint readers, gboolean locked);
 
 /* Join the room as a participant */
 void jamrtc_join_room(guint64 room_id, const char *display);
 /* Publish mic/webcam for the chat part */
 void jamrtc_webrtc_publish_micwebcam(gboolean no_mic, gboolean no_webcam, const char *video_device);
-/* Publish the instrument */
-void jamrtc_webrtc_publish_instrument(const char *instrument, gboolean stereo);
+/* Publish the instrument (MIDI instruments are sent on a data channel) */
+void jamrtc_webrtc_publish_instrument(const char *instrument, gboolean stereo, gboolean midi);
 /* Subscribe to a remote stream */
 int jamrtc_webrtc_subscribe(const char *uuid, gboolean instrument);
+/* Unsubscribe from a remote stream, detaching the handle and releasing the pipeline */
+int jamrtc_webrtc_unsubscribe(const char *uuid, gboolean instrument);
 
 
 #endif